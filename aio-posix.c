@@ -17,18 +17,158 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* With this many handlers, aio_poll() switches from ppoll() to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+/* ...and it goes back to ppoll() below this */
+#define EPOLL_DISABLE_THRESHOLD (EPOLL_ENABLE_THRESHOLD / 2)
+
+/* Maximum number of events dispatched per aio_poll() */
+#define EPOLL_MAX_EVENTS 128
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    trace_aio_epoll_disable(ctx, ctx->nb_handlers);
+    ctx->epoll_enabled = false;
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static bool aio_epoll_add(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event = {
+        .events = epoll_events_from_pfd(node->pfd.events),
+        .data.ptr = node,
+    };
+
+    return epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                     node->pfd.fd, &event) == 0;
+}
+
+/* Keep the epoll set in sync with the handler list */
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    if (!node->pfd.events) {
+        epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, NULL);
+    } else if (!aio_epoll_add(ctx, node, is_new)) {
+        /* Some file descriptors, e.g. regular files, can't be used with
+         * epoll.  ppoll() handles them fine, so stick to that.
+         */
+        aio_epoll_disable(ctx);
+        ctx->epoll_available = false;
+    }
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epollfd == -1) {
+        ctx->epoll_available = false;
+        return false;
+    }
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events &&
+            !aio_epoll_add(ctx, node, true)) {
+            close(ctx->epollfd);
+            ctx->epollfd = -1;
+            ctx->epoll_available = false;
+            return false;
+        }
+    }
+
+    trace_aio_epoll_enable(ctx, ctx->nb_handlers);
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+/* Switch between ppoll() and epoll depending on the number of handlers */
+static bool aio_epoll_check_poll(AioContext *ctx)
+{
+    if (ctx->epoll_enabled) {
+        if (ctx->nb_handlers < EPOLL_DISABLE_THRESHOLD) {
+            aio_epoll_disable(ctx);
+        }
+    } else if (ctx->epoll_available &&
+               ctx->nb_handlers >= EPOLL_ENABLE_THRESHOLD) {
+        aio_epoll_try_enable(ctx);
+    }
+    return ctx->epoll_enabled;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx)
+{
+    return false;
+}
+
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = -1;
+    ctx->epoll_enabled = false;
+    ctx->epoll_available = true;
+#endif
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epoll_enabled) {
+        aio_epoll_disable(ctx);
+    }
+#endif
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -49,6 +189,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
@@ -56,11 +197,19 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
+            ctx->nb_handlers--;
+            if (node->io_poll) {
+                node->io_poll = NULL;
+                ctx->nb_poll_handlers--;
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
                 node->pfd.revents = 0;
+                ctx->deleted_handlers = true;
             } else {
                 /* Otherwise, delete it for real.  We can't just mark it as
                  * deleted because deleted nodes are only cleaned up after
@@ -76,6 +225,8 @@ void aio_set_fd_handler(AioContext *ctx,
             node = g_malloc0(sizeof(AioHandler));
             node->pfd.fd = fd;
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
+            ctx->nb_handlers++;
+            is_new = true;
 
             g_source_add_poll(&ctx->source, &node->pfd);
         }
@@ -87,6 +238,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -100,6 +252,27 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        return;
+    }
+    if (!node->io_poll != !io_poll) {
+        ctx->nb_poll_handlers += io_poll ? 1 : -1;
+    }
+    node->io_poll = io_poll;
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -109,9 +282,11 @@ bool aio_pending(AioContext *ctx)
 
         revents = node->pfd.revents & node->pfd.events;
         if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
+            ctx->revents_pending = true;
             return true;
         }
         if (revents & (G_IO_OUT | G_IO_ERR) && node->io_write) {
+            ctx->revents_pending = true;
             return true;
         }
     }
@@ -119,7 +294,56 @@ bool aio_pending(AioContext *ctx)
     return false;
 }
 
-static bool aio_dispatch(AioContext *ctx)
+/* Invoke the callbacks of a handler for its pending events */
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+{
+    bool progress = false;
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (!node->deleted &&
+        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+
+        /* aio_notify() does not count as progress */
+        if (node->opaque != &ctx->notifier) {
+            ctx->stats.dispatched++;
+            progress = true;
+        }
+    }
+    if (!node->deleted &&
+        (revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+        ctx->stats.dispatched++;
+        progress = true;
+    }
+
+    return progress;
+}
+
+/* Free the handlers that were deleted while the list was being walked */
+static void aio_free_deleted_handlers(AioContext *ctx)
+{
+    AioHandler *node, *tmp;
+
+    if (ctx->walking_handlers || !ctx->deleted_handlers) {
+        return;
+    }
+
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted) {
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+    ctx->deleted_handlers = false;
+}
+
+static bool aio_dispatch(AioContext *ctx, bool dispatch_handlers)
 {
     AioHandler *node;
     bool progress = false;
@@ -128,30 +352,14 @@ static bool aio_dispatch(AioContext *ctx)
      * We have to walk very carefully in case qemu_aio_set_fd_handler is
      * called while we're walking.
      */
-    node = QLIST_FIRST(&ctx->aio_handlers);
+    node = dispatch_handlers ? QLIST_FIRST(&ctx->aio_handlers) : NULL;
+    ctx->revents_pending = false;
     while (node) {
         AioHandler *tmp;
-        int revents;
 
         ctx->walking_handlers++;
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
-
-        if (!node->deleted &&
-            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
-
-            /* aio_notify() does not count as progress */
-            if (node->opaque != &ctx->notifier) {
-                progress = true;
-            }
-        }
-        if (!node->deleted &&
-            (revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
+        if (aio_dispatch_handler(ctx, node)) {
             progress = true;
         }
 
@@ -165,6 +373,7 @@ static bool aio_dispatch(AioContext *ctx)
             g_free(tmp);
         }
     }
+    aio_free_deleted_handlers(ctx);
 
     /* Run our timers */
     progress |= timerlistgroup_run_timers(&ctx->tlg);
@@ -172,13 +381,151 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
-bool aio_poll(AioContext *ctx, bool blocking)
+/* qemu_poll_ns(), accounting the time spent waiting if statistics are on */
+static int aio_wait_ns(AioContext *ctx, GPollFD *fds, guint nfds,
+                       int64_t timeout)
+{
+    int64_t start;
+    int ret;
+
+    if (!ctx->stats_enabled || timeout == 0) {
+        return qemu_poll_ns(fds, nfds, timeout);
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = qemu_poll_ns(fds, nfds, timeout);
+    ctx->stats.blocked_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    return ret;
+}
+
+#ifdef CONFIG_EPOLL_CREATE1
+/* Wait for events with epoll and dispatch the handlers that are ready */
+static bool aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+    bool progress = false;
+    int i, ret = 1;
+
+    /* epoll_wait() only takes milliseconds, so wait for the epoll file
+     * descriptor itself to become readable first
+     */
+    if (timeout != 0) {
+        ret = aio_wait_ns(ctx, &pfd, 1, timeout);
+    }
+    if (ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events), 0);
+    }
+
+    ctx->walking_handlers++;
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+
+        node->pfd.revents = pfd_events_from_epoll(events[i].events);
+        if (aio_dispatch_handler(ctx, node)) {
+            progress = true;
+        }
+    }
+    ctx->walking_handlers--;
+    aio_free_deleted_handlers(ctx);
+
+    return progress;
+}
+#endif
+
+/* Initial polling time once events are seen to come in shortly after
+ * blocking, when no shrink factor is set or the polling time dropped to 0
+ */
+#define POLL_NS_INITIAL 4000
+
+/* Call the io_poll callbacks until one of them makes progress or @max_ns
+ * have passed.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    AioHandler *node;
+    bool progress = false;
+
+    ctx->walking_handlers++;
+    do {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll &&
+                node->io_poll(node->opaque)) {
+                progress = true;
+            }
+        }
+    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+    ctx->walking_handlers--;
+    aio_free_deleted_handlers(ctx);
+
+    trace_aio_poll_run(ctx, max_ns, progress);
+    return progress;
+}
+
+/* Busy poll instead of blocking for at most ctx->poll_ns, or until the next
+ * timer expires.  Returns true if polling made progress, in which case
+ * aio_poll() must not block.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t timeout)
+{
+    if (!ctx->poll_max_ns || !ctx->nb_poll_handlers || !ctx->poll_ns) {
+        return false;
+    }
+    return run_poll_handlers(ctx, qemu_soonest_timeout(ctx->poll_ns,
+                                                       timeout));
+}
+
+/* Adapt the polling time to how long aio_poll() had to wait, polling
+ * included, for an event
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (!ctx->poll_max_ns || !ctx->nb_poll_handlers || block_ns <= old) {
+        /* Polling would not have helped, or it was not even tried */
+        return;
+    }
+
+    if (block_ns > ctx->poll_max_ns) {
+        /* Nothing came in for too long, waste less time spinning */
+        if (ctx->poll_shrink && old) {
+            ctx->poll_ns = old / ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        if (ctx->poll_ns != old) {
+            trace_aio_poll_shrink(ctx, old, ctx->poll_ns);
+        }
+    } else if (old < ctx->poll_max_ns) {
+        /* The event came in soon after polling gave up */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (old == 0) {
+            ctx->poll_ns = POLL_NS_INITIAL;
+        } else {
+            ctx->poll_ns = old * grow;
+        }
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+        trace_aio_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
+static bool aio_poll_internal(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
     bool progress;
+    bool use_epoll;
+    int64_t timeout;
+    int64_t start = 0;
 
     progress = false;
+    use_epoll = aio_epoll_check_poll(ctx);
 
     /*
      * If there are callbacks left that have been queued, we need to call them.
@@ -190,7 +537,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
-    if (aio_dispatch(ctx)) {
+    /* With epoll, handlers are dispatched as their events come in, so only
+     * events stored by the glib main loop have to be looked for here.
+     */
+    if (aio_dispatch(ctx, !use_epoll || ctx->revents_pending)) {
         progress = true;
     }
 
@@ -198,6 +548,35 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return true;
     }
 
+    timeout = blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0;
+    if (timeout && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (try_poll_mode(ctx, timeout)) {
+            /* Only pick up what is left without blocking, and run timers */
+            progress = true;
+            timeout = 0;
+            start = 0;
+        }
+    }
+
+#ifdef CONFIG_EPOLL_CREATE1
+    if (use_epoll) {
+        if (aio_epoll(ctx, timeout)) {
+            progress = true;
+        }
+        if (start) {
+            adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                  start);
+        }
+
+        /* Run timers */
+        if (aio_dispatch(ctx, false)) {
+            progress = true;
+        }
+        return progress;
+    }
+#endif
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -218,9 +597,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
     ctx->walking_handlers--;
 
     /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+    ret = aio_wait_ns(ctx, (GPollFD *)ctx->pollfds->data,
+                      ctx->pollfds->len,
+                      timeout);
+    if (start) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -234,9 +616,34 @@ bool aio_poll(AioContext *ctx, bool blocking)
     }
 
     /* Run dispatch even if there were no readable fds to run timers */
-    if (aio_dispatch(ctx)) {
+    if (aio_dispatch(ctx, true)) {
         progress = true;
     }
 
     return progress;
 }
+
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    AioContextStats *stats = &ctx->stats;
+    uint64_t dispatched;
+    int64_t start, blocked_ns;
+    bool progress;
+
+    if (!ctx->stats_enabled) {
+        return aio_poll_internal(ctx, blocking);
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    dispatched = stats->dispatched;
+    blocked_ns = stats->blocked_ns;
+
+    progress = aio_poll_internal(ctx, blocking);
+
+    stats->iterations++;
+    stats->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start -
+                      (stats->blocked_ns - blocked_ns);
+    stats->max_dispatched = MAX(stats->max_dispatched,
+                                stats->dispatched - dispatched);
+    return progress;
+}
@@ -52,6 +52,9 @@
 
 struct BdrvDirtyBitmap {
     HBitmap *bitmap;
+    char *name;         /* NULL for anonymous (job-internal) bitmaps */
+    bool persistent;    /* stored in the image by the driver on close */
+    bool frozen;        /* in use by a block job, may not be modified */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -124,13 +127,7 @@ int is_windows_drive(const char *filename)
 void bdrv_set_io_limits(BlockDriverState *bs,
                         ThrottleConfig *cfg)
 {
-    int i;
-
-    throttle_config(&bs->throttle_state, cfg);
-
-    for (i = 0; i < 2; i++) {
-        qemu_co_enter_next(&bs->throttled_reqs[i]);
-    }
+    throttle_group_config(bs, cfg);
 }
 
 /* this function drain all the throttled IOs */
@@ -159,62 +156,37 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 
     bdrv_start_throttled_reqs(bs);
 
-    throttle_destroy(&bs->throttle_state);
+    throttle_group_unregister_bs(bs);
 }
 
-static void bdrv_throttle_read_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[0]);
-}
-
-static void bdrv_throttle_write_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[1]);
-}
-
-/* should be called before bdrv_set_io_limits if a limit is set */
-void bdrv_io_limits_enable(BlockDriverState *bs)
+/* should be called before bdrv_set_io_limits if a limit is set
+ *
+ * @group: the throttling group to join; drives in the same group share
+ *         their limits
+ */
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
     assert(!bs->io_limits_enabled);
-    throttle_init(&bs->throttle_state,
-                  QEMU_CLOCK_VIRTUAL,
-                  bdrv_throttle_read_timer_cb,
-                  bdrv_throttle_write_timer_cb,
-                  bs);
+    throttle_group_register_bs(bs, group);
     bs->io_limits_enabled = true;
 }
 
-/* This function makes an IO wait if needed
- *
- * @nb_sectors: the number of sectors of the IO
- * @is_write:   is the IO a write
- */
-static void bdrv_io_limits_intercept(BlockDriverState *bs,
-                                     unsigned int bytes,
-                                     bool is_write)
+/* move a throttled drive to another throttling group */
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group)
 {
-    /* does this io must wait */
-    bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
-
-    /* if must wait or any request of this type throttled queue the IO */
-    if (must_wait ||
-        !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
-        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+    /* this bs is not part of any group */
+    if (!bs->throttle_group) {
+        return;
     }
 
-    /* the IO will be executed, do the accounting */
-    throttle_account(&bs->throttle_state, is_write, bytes);
-
-
-    /* if the next request must wait -> do nothing */
-    if (throttle_schedule_timer(&bs->throttle_state, is_write)) {
+    /* this bs is a part of the same group than the one we want */
+    if (!g_strcmp0(throttle_group_get_name(bs), group)) {
         return;
     }
 
-    /* else queue next request for execution */
-    qemu_co_queue_next(&bs->throttled_reqs[is_write]);
+    /* need to change the group this bs belong to */
+    bdrv_io_limits_disable(bs);
+    bdrv_io_limits_enable(bs, group);
 }
 
 size_t bdrv_opt_mem_align(BlockDriverState *bs)
@@ -227,6 +199,15 @@ size_t bdrv_opt_mem_align(BlockDriverState *bs)
     return bs->bl.opt_mem_alignment;
 }
 
+int bdrv_get_max_transfer_length(BlockDriverState *bs)
+{
+    if (!bs || !bs->drv) {
+        return 0;
+    }
+
+    return bs->bl.max_transfer_length;
+}
+
 /* check if the path starts with "<protocol>:" */
 static int path_has_protocol(const char *path)
 {
@@ -360,9 +341,12 @@ BlockDriverState *bdrv_new(const char *device_name, Error **errp)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_list_init(&bs->write_complete_notifiers);
+    notifier_list_init(&bs->copy_on_read_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
     bs->refcnt = 1;
+    bs->aio_context = qemu_get_aio_context();
 
     return bs;
 }
@@ -521,6 +505,7 @@ int bdrv_refresh_limits(BlockDriverState *bs)
     if (bs->file) {
         bdrv_refresh_limits(bs->file);
         bs->bl.opt_transfer_length = bs->file->bl.opt_transfer_length;
+        bs->bl.max_transfer_length = bs->file->bl.max_transfer_length;
         bs->bl.opt_mem_alignment = bs->file->bl.opt_mem_alignment;
     } else {
         bs->bl.opt_mem_alignment = 512;
@@ -531,6 +516,13 @@ int bdrv_refresh_limits(BlockDriverState *bs)
         bs->bl.opt_transfer_length =
             MAX(bs->bl.opt_transfer_length,
                 bs->backing_hd->bl.opt_transfer_length);
+        if (bs->backing_hd->bl.max_transfer_length &&
+            (!bs->bl.max_transfer_length ||
+             bs->backing_hd->bl.max_transfer_length <
+             bs->bl.max_transfer_length)) {
+            bs->bl.max_transfer_length =
+                bs->backing_hd->bl.max_transfer_length;
+        }
         bs->bl.opt_mem_alignment =
             MAX(bs->bl.opt_mem_alignment,
                 bs->backing_hd->bl.opt_mem_alignment);
@@ -874,6 +866,20 @@ static void bdrv_assign_node_name(BlockDriverState *bs,
     QTAILQ_INSERT_TAIL(&graph_bdrv_states, bs, node_list);
 }
 
+static QemuOptsList bdrv_runtime_opts = {
+    .name = "bdrv_common",
+    .head = QTAILQ_HEAD_INITIALIZER(bdrv_runtime_opts.head),
+    .desc = {
+        {
+            .name = "chain-map",
+            .type = QEMU_OPT_BOOL,
+            .help = "Read directly from the backing chain layer that has "
+                    "the data",
+        },
+        { /* end of list */ }
+    },
+};
+
 /*
  * Common part for opening disk images and files
  *
@@ -885,6 +891,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     int ret, open_flags;
     const char *filename;
     const char *node_name = NULL;
+    QemuOpts *opts;
     Error *local_err = NULL;
 
     assert(drv != NULL);
@@ -913,6 +920,16 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     }
     qdict_del(options, "node-name");
 
+    opts = qemu_opts_create(&bdrv_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    bs->chain_map_reads = qemu_opt_get_bool(opts, "chain-map", false);
+    qemu_opts_del(opts);
+
     /* bdrv_open() with directly using a protocol as drv. This layer is already
      * opened, so assign it to bs (while file becomes a closed BlockDriverState)
      * and return immediately. */
@@ -1107,6 +1124,7 @@ void bdrv_set_backing_hd(BlockDriverState *bs, BlockDriverState *backing_hd)
     }
 
     bs->backing_hd = backing_hd;
+    bdrv_chain_map_invalidate_all();
     if (!backing_hd) {
         error_free(bs->backing_blocker);
         bs->backing_blocker = NULL;
@@ -1814,6 +1832,17 @@ void bdrv_close(BlockDriverState *bs)
     bdrv_drain_all(); /* in case flush left pending I/O */
     notifier_list_notify(&bs->close_notifiers, bs);
 
+    if (bs->drv && bs->drv->bdrv_store_dirty_bitmaps && !bs->read_only) {
+        int ret = bs->drv->bdrv_store_dirty_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Could not store dirty bitmaps of '%s': %s",
+                         bdrv_get_device_name(bs), strerror(-ret));
+        }
+    }
+    bdrv_release_named_dirty_bitmaps(bs);
+    bdrv_chain_map_free(bs);
+    bdrv_chain_map_invalidate_all();
+
     if (bs->drv) {
         if (bs->backing_hd) {
             BlockDriverState *backing_hd = bs->backing_hd;
@@ -1880,17 +1909,6 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
-static bool bdrv_requests_pending_all(void)
-{
-    BlockDriverState *bs;
-    QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
-        if (bdrv_requests_pending(bs)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1910,12 +1928,20 @@ void bdrv_drain_all(void)
     BlockDriverState *bs;
 
     while (busy) {
+        busy = false;
+
         QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+            bool bs_busy;
+
+            aio_context_acquire(aio_context);
             bdrv_start_throttled_reqs(bs);
-        }
+            bs_busy = bdrv_requests_pending(bs);
+            bs_busy |= aio_poll(aio_context, bs_busy);
+            aio_context_release(aio_context);
 
-        busy = bdrv_requests_pending_all();
-        busy |= aio_poll(qemu_get_aio_context(), busy);
+            busy |= bs_busy;
+        }
     }
 }
 
@@ -1956,9 +1982,10 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
     /* i/o throttled req */
-    memcpy(&bs_dest->throttle_state,
-           &bs_src->throttle_state,
-           sizeof(ThrottleState));
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    memcpy(&bs_dest->round_robin,
+           &bs_src->round_robin,
+           sizeof(bs_dest->round_robin));
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
@@ -2021,7 +2048,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -2039,7 +2066,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->job == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     /* insert the nodes back into the graph node list if needed */
     if (bs_new->node_name[0] != '\0') {
@@ -2051,6 +2078,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
+    bdrv_chain_map_invalidate_all();
 }
 
 /*
@@ -2075,17 +2103,23 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 static void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(bdrv_op_blocker_is_empty(bs));
     assert(!bs->refcnt);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     bdrv_close(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        block_latency_cleanup(&bs->latency[i]);
+    }
+
     g_free(bs);
 }
 
@@ -2232,12 +2266,19 @@ bool bdrv_dev_is_medium_locked(BlockDriverState *bs)
  */
 int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv->bdrv_check == NULL) {
         return -ENOTSUP;
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_check(bs, res, fix);
+    ret = bs->drv->bdrv_check(bs, res, fix);
+    if (fix) {
+        /* Repairs may change the allocation of the image */
+        bdrv_chain_map_invalidate_all();
+    }
+    return ret;
 }
 
 #define COMMIT_BUF_SECTORS 2048
@@ -2320,6 +2361,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_chain_map_invalidate_all();
         if (ret < 0) {
             goto ro_cleanup;
         }
@@ -2777,7 +2819,7 @@ static int bdrv_prwv_co(BlockDriverState *bs, int64_t offset,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return rwco.ret;
@@ -3016,6 +3058,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
                                   &bounce_qiov);
     }
 
+    bdrv_chain_map_invalidate(bs, cluster_sector_num, cluster_nb_sectors);
+
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
          * is a deliberate copy-on-read then we don't want to ignore the error.
@@ -3033,6 +3077,62 @@ err:
     return ret;
 }
 
+/*
+ * Reads from an image with a backing chain, getting each part of the request
+ * directly from the layer that owns it according to the chain map instead of
+ * passing it down through all drivers of the chain.
+ */
+static int coroutine_fn bdrv_co_do_chain_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    QEMUIOVector local_qiov;
+    int64_t done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        BlockDriverState *owner;
+        int64_t status;
+        int depth, n;
+
+        status = bdrv_chain_map_get_status(bs, sector_num, nb_sectors, &n,
+                                           &owner, &depth);
+        if (status < 0) {
+            ret = status;
+            break;
+        }
+        if (n == 0) {
+            /* Beyond the end of the image */
+            owner = NULL;
+            n = nb_sectors;
+        }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, done << BDRV_SECTOR_BITS,
+                          (size_t)n << BDRV_SECTOR_BITS);
+
+        if (!owner || (status & BDRV_BLOCK_ZERO)) {
+            qemu_iovec_memset(&local_qiov, 0, 0, local_qiov.size);
+        } else if (owner == bs) {
+            ret = bs->drv->bdrv_co_readv(bs, sector_num, n, &local_qiov);
+        } else {
+            ret = bdrv_co_do_preadv(owner, sector_num << BDRV_SECTOR_BITS,
+                                    local_qiov.size, &local_qiov,
+                                    BDRV_REQ_NO_CHAIN_MAP);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        done += n;
+    }
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret;
+}
+
 /*
  * Forwards an already correctly aligned request to the BlockDriver. This
  * handles copy on read and zeroing after EOF; any other features must be
@@ -3072,9 +3172,21 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
         }
 
         if (!ret || pnum != nb_sectors) {
+            BdrvCopyOnReadMiss miss = {
+                .sector_num = sector_num,
+                .nb_sectors = nb_sectors,
+            };
+
+            notifier_list_notify(&bs->copy_on_read_notifiers, &miss);
             ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
             goto out;
         }
+    } else if (bs->chain_map_reads && bs->backing_hd &&
+               bs->backing_hd->backing_hd &&
+               !bs->growable && !(flags & BDRV_REQ_NO_CHAIN_MAP)) {
+        /* Deep backing chain, skip the layers that don't have the data */
+        ret = bdrv_co_do_chain_readv(bs, sector_num, nb_sectors, qiov);
+        goto out;
     }
 
     /* Forward the request to the BlockDriver */
@@ -3144,7 +3256,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
-        bdrv_io_limits_intercept(bs, bytes, false);
+        throttle_group_co_io_limits_intercept(bs, bytes, false);
     }
 
     /* Align read if necessary by padding qiov */
@@ -3340,6 +3452,19 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
 
     bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_chain_map_invalidate(bs, sector_num, nb_sectors);
+
+    if (!QLIST_EMPTY(&bs->write_complete_notifiers.notifiers)) {
+        BdrvWriteCompletion completion = {
+            .req        = req,
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .qiov       = qiov,
+            .flags      = flags,
+            .ret        = ret,
+        };
+        notifier_list_notify(&bs->write_complete_notifiers, &completion);
+    }
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -3379,7 +3504,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
-        bdrv_io_limits_intercept(bs, bytes, true);
+        throttle_group_co_io_limits_intercept(bs, bytes, true);
     }
 
     /*
@@ -3524,6 +3649,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EBUSY;
     }
     ret = drv->bdrv_truncate(bs, offset);
+    bdrv_chain_map_invalidate_all();
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
         bdrv_dev_resize_cb(bs);
@@ -3614,10 +3740,9 @@ BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int e
  * about the error, it does not know whether an operation comes from
  * the device or the block layer (from a job, for example).
  */
-void bdrv_error_action(BlockDriverState *bs, BlockErrorAction action,
-                       bool is_read, int error)
+static void bdrv_do_error_action(BlockDriverState *bs, BlockErrorAction action,
+                                 bool is_read, int error)
 {
-    assert(error >= 0);
     bdrv_emit_qmp_error_event(bs, QEVENT_BLOCK_IO_ERROR, action, is_read);
     if (action == BDRV_ACTION_STOP) {
         vm_stop(RUN_STATE_IO_ERROR);
@@ -3625,6 +3750,48 @@ void bdrv_error_action(BlockDriverState *bs, BlockErrorAction action,
     }
 }
 
+typedef struct BdrvErrorActionBH {
+    QEMUBH *bh;
+    BlockDriverState *bs;
+    BlockErrorAction action;
+    bool is_read;
+    int error;
+} BdrvErrorActionBH;
+
+static void bdrv_error_action_bh(void *opaque)
+{
+    BdrvErrorActionBH *eab = opaque;
+
+    qemu_bh_delete(eab->bh);
+    bdrv_do_error_action(eab->bs, eab->action, eab->is_read, eab->error);
+    g_free(eab);
+}
+
+void bdrv_error_action(BlockDriverState *bs, BlockErrorAction action,
+                       bool is_read, int error)
+{
+    BdrvErrorActionBH *eab;
+
+    assert(error >= 0);
+
+    if (bdrv_get_aio_context(bs) == qemu_get_aio_context()) {
+        bdrv_do_error_action(bs, action, is_read, error);
+        return;
+    }
+
+    /* Neither the monitor nor vm_stop() may be used from an iothread, so
+     * hand the error over to the main loop.  bs cannot go away meanwhile
+     * because the device that uses the iothread blocks drive_del.
+     */
+    eab = g_new0(BdrvErrorActionBH, 1);
+    eab->bs = bs;
+    eab->action = action;
+    eab->is_read = is_read;
+    eab->error = error;
+    eab->bh = aio_bh_new(qemu_get_aio_context(), bdrv_error_action_bh, eab);
+    qemu_bh_schedule(eab->bh);
+}
+
 int bdrv_is_read_only(BlockDriverState *bs)
 {
     return bs->read_only;
@@ -3830,7 +3997,12 @@ int bdrv_flush_all(void)
     int result = 0;
 
     QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
-        int ret = bdrv_flush(bs);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_flush(bs);
+        aio_context_release(aio_context);
         if (ret < 0 && !result) {
             result = ret;
         }
@@ -4027,7 +4199,7 @@ int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
         co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
         qemu_coroutine_enter(co, &data);
         while (!data.done) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return data.ret;
@@ -4114,6 +4286,8 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -4121,9 +4295,11 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    bdrv_chain_map_invalidate(bs, sector_num, nb_sectors);
+    return ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -4620,7 +4796,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -4665,7 +4841,7 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(blockacb->bs), true);
     }
 }
 
@@ -4702,7 +4878,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, acb->req.flags);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4738,7 +4914,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4765,7 +4941,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4953,6 +5129,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
 
+    bdrv_chain_map_invalidate_all();
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
     } else if (bs->file) {
@@ -5008,7 +5185,7 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -5094,6 +5271,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
                 ret = co.ret;
             }
         }
+        bdrv_chain_map_invalidate(bs, sector_num, num);
         if (ret && ret != -ENOTSUP) {
             return ret;
         }
@@ -5104,6 +5282,40 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Drop the data of a range from @bs so that it is read from the backing file
+ * again.  Only the clusters completely covered by the range are dropped.
+ * The caller must make sure that the backing file has the same data.
+ */
+int coroutine_fn bdrv_co_unallocate(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    } else if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    } else if (bs->read_only) {
+        return -EROFS;
+    } else if (!bs->drv->bdrv_co_unallocate || !bs->backing_hd) {
+        return -ENOTSUP;
+    }
+
+    /* Reads that are in flight may still use the dropped clusters */
+    tracked_request_begin(&req, bs, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, true);
+    mark_request_serialising(&req, bdrv_get_cluster_size(bs));
+    wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_unallocate(bs, sector_num, nb_sectors);
+    bdrv_chain_map_invalidate(bs, sector_num, nb_sectors);
+
+    tracked_request_end(&req);
+    return ret;
+}
+
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
 {
     Coroutine *co;
@@ -5121,7 +5333,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -5242,14 +5454,32 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    assert(name);
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
 BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
-                                          Error **errp)
+                                          const char *name, Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
 
     assert((granularity & (granularity - 1)) == 0);
 
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
     granularity >>= BDRV_SECTOR_BITS;
     assert(granularity);
     bitmap_size = bdrv_getlength(bs);
@@ -5261,6 +5491,7 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
     bitmap_size >>= BDRV_SECTOR_BITS;
     bitmap = g_malloc0(sizeof(BdrvDirtyBitmap));
     bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
@@ -5270,14 +5501,67 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     BdrvDirtyBitmap *bm, *next;
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
+            assert(!bitmap->frozen);
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            g_free(bitmap->name);
             g_free(bitmap);
             return;
         }
     }
 }
 
+/* Drop all user-visible bitmaps; anonymous ones belong to block jobs and
+ * are released by their owner. */
+void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name) {
+            bm->frozen = false;
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return (int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+bool bdrv_dirty_bitmap_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap,
+                                      bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->frozen;
+}
+
+void bdrv_dirty_bitmap_set_frozen(BdrvDirtyBitmap *bitmap, bool frozen)
+{
+    bitmap->frozen = frozen;
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -5288,8 +5572,12 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         BlockDirtyInfo *info = g_malloc0(sizeof(BlockDirtyInfo));
         BlockDirtyInfoList *entry = g_malloc0(sizeof(BlockDirtyInfoList));
         info->count = bdrv_get_dirty_count(bs, bm);
-        info->granularity =
-            ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->count_bytes = info->count << BDRV_SECTOR_BITS;
+        info->granularity = bdrv_dirty_bitmap_granularity(bm);
+        info->has_name = !!bm->name;
+        info->name = g_strdup(bm->name);
+        info->persistent = bm->persistent;
+        info->frozen = bm->frozen;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -5330,6 +5618,36 @@ void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
     }
 }
 
+void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                           int nr_sectors)
+{
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap, int64_t cur_sector,
+                             int nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_reset_all(bitmap->bitmap);
+}
+
+bool bdrv_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || !drv->bdrv_store_dirty_bitmaps || bdrv_is_read_only(bs)) {
+        return false;
+    }
+    if (drv->bdrv_can_store_dirty_bitmaps) {
+        return drv->bdrv_can_store_dirty_bitmaps(bs);
+    }
+    return true;
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     return hbitmap_count(bitmap->bitmap);
@@ -5476,11 +5794,24 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
+    int64_t now = get_clock();
+    int64_t latency_ns = now - cookie->start_time_ns;
+
     assert(cookie->type < BDRV_MAX_IOTYPE);
 
     bs->nr_bytes[cookie->type] += cookie->bytes;
     bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    bs->total_time_ns[cookie->type] += latency_ns;
+    block_latency_account(&bs->latency[cookie->type], latency_ns, now);
+}
+
+/* Account for @num_requests guest requests that were merged into others */
+void bdrv_acct_merge_done(BlockDriverState *bs, enum BlockAcctType type,
+                          int num_requests)
+{
+    assert(type < BDRV_MAX_IOTYPE);
+
+    bs->nr_merged[type] += num_requests;
 }
 
 void bdrv_img_create(const char *filename, const char *fmt,
@@ -5632,8 +5963,88 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+bool bdrv_can_set_aio_context(BlockDriverState *bs, Error **errp)
+{
+    if (bs->job) {
+        error_setg(errp, "Block job on device '%s' is still running",
+                   bdrv_get_device_name(bs));
+        return false;
+    }
+    if (bs->io_limits_enabled) {
+        error_setg(errp, "I/O throttling on device '%s' requires the main "
+                   "loop", bdrv_get_device_name(bs));
+        return false;
+    }
+    if (bs->drv && bs->drv->protocol_name &&
+        !bs->drv->bdrv_attach_aio_context) {
+        error_setg(errp, "Protocol '%s' does not support iothreads",
+                   bs->drv->protocol_name);
+        return false;
+    }
+
+    if (bs->file && !bdrv_can_set_aio_context(bs->file, errp)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd, errp)) {
+        return false;
+    }
+    return true;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
@@ -5642,12 +6053,28 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_write_complete_notifier(BlockDriverState *bs,
+                                      Notifier *notifier)
+{
+    notifier_list_add(&bs->write_complete_notifiers, notifier);
+}
+
+void bdrv_add_copy_on_read_notifier(BlockDriverState *bs,
+                                    Notifier *notifier)
+{
+    notifier_list_add(&bs->copy_on_read_notifiers, notifier);
+}
+
 int bdrv_amend_options(BlockDriverState *bs, QEMUOptionParameter *options)
 {
+    int ret;
+
     if (bs->drv->bdrv_amend_options == NULL) {
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, options);
+    ret = bs->drv->bdrv_amend_options(bs, options);
+    bdrv_chain_map_invalidate_all();
+    return ret;
 }
 
 /* This function will be called by the bdrv_recurse_is_first_non_filter method
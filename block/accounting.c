@@ -0,0 +1,252 @@
+/*
+ * QEMU block I/O latency accounting
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "block/accounting.h"
+#include "qemu/host-utils.h"
+
+static unsigned int latency_bin(uint64_t ns)
+{
+    unsigned int exp, sub, bin;
+
+    if (ns < BLOCK_LATENCY_SUB_BINS) {
+        return ns;
+    }
+
+    exp = 63 - clz64(ns);
+    sub = (ns >> (exp - BLOCK_LATENCY_SUB_BITS)) & (BLOCK_LATENCY_SUB_BINS - 1);
+    bin = (exp - BLOCK_LATENCY_SUB_BITS + 1) * BLOCK_LATENCY_SUB_BINS + sub;
+
+    return MIN(bin, BLOCK_LATENCY_NB_BINS - 1);
+}
+
+/* Returns the largest latency that falls into the given bin */
+static uint64_t latency_bin_limit(unsigned int bin)
+{
+    unsigned int exp, sub;
+
+    if (bin < BLOCK_LATENCY_SUB_BINS) {
+        return bin;
+    }
+
+    exp = bin / BLOCK_LATENCY_SUB_BINS - 1 + BLOCK_LATENCY_SUB_BITS;
+    sub = bin % BLOCK_LATENCY_SUB_BINS;
+
+    return (((uint64_t)BLOCK_LATENCY_SUB_BINS + sub + 1)
+            << (exp - BLOCK_LATENCY_SUB_BITS)) - 1;
+}
+
+static void latency_period_reset(BlockAcctLatencyPeriod *p, int64_t start_ns)
+{
+    memset(p, 0, sizeof(*p));
+    p->start_ns = start_ns;
+}
+
+/* Starts a new period if the current one is over */
+static void latency_rotate(BlockAcctLatency *stats, int64_t now)
+{
+    BlockAcctLatencyPeriod *cur = &stats->periods[stats->current];
+
+    if (now - cur->start_ns < BLOCK_LATENCY_PERIOD_NS) {
+        return;
+    }
+
+    if (now - cur->start_ns >= 2 * BLOCK_LATENCY_PERIOD_NS) {
+        /* Nothing happened for a whole period, forget about the past */
+        latency_period_reset(cur, now);
+    }
+
+    stats->current ^= 1;
+    latency_period_reset(&stats->periods[stats->current], now);
+}
+
+/* Records a request that took @ns nanoseconds in the period @p */
+void block_latency_period_account(BlockAcctLatencyPeriod *p, uint64_t ns)
+{
+    if (!p->nr_ops || ns < p->min_ns) {
+        p->min_ns = ns;
+    }
+    if (ns > p->max_ns) {
+        p->max_ns = ns;
+    }
+    p->nr_ops++;
+    p->total_ns += ns;
+    p->bins[latency_bin(ns)]++;
+}
+
+/*
+ * Records a request that completed at @now after @latency_ns nanoseconds.
+ * This runs for every request, so it must stay cheap.
+ */
+void block_latency_account(BlockAcctLatency *stats, int64_t latency_ns,
+                           int64_t now)
+{
+    uint64_t ns = MAX(latency_ns, 0);
+
+    latency_rotate(stats, now);
+    block_latency_period_account(&stats->periods[stats->current], ns);
+
+    if (stats->hist_bins) {
+        /* find the first boundary above ns */
+        unsigned int lo = 0, hi = stats->nb_boundaries;
+
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            if (ns < stats->boundaries[mid]) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        stats->hist_bins[lo]++;
+    }
+}
+
+static uint64_t latency_percentile(const BlockAcctLatencyPeriod **periods,
+                                   int nb_periods, uint64_t nr_ops,
+                                   uint64_t max_ns, double p)
+{
+    uint64_t target, sum = 0;
+    unsigned int i;
+    int j;
+
+    target = MAX((uint64_t)(nr_ops * p + 0.5), 1);
+    for (i = 0; i < BLOCK_LATENCY_NB_BINS; i++) {
+        for (j = 0; j < nb_periods; j++) {
+            sum += periods[j]->bins[i];
+        }
+        if (sum >= target) {
+            return MIN(latency_bin_limit(i), max_ns);
+        }
+    }
+
+    return max_ns;
+}
+
+/*
+ * Returns the latency that the fraction @p of the requests in @period did
+ * not exceed.  Periods that are not part of a sliding window, such as one
+ * that covers a whole benchmark run, can be used too.
+ */
+uint64_t block_latency_period_percentile(const BlockAcctLatencyPeriod *period,
+                                         double p)
+{
+    if (!period->nr_ops) {
+        return 0;
+    }
+    return latency_percentile(&period, 1, period->nr_ops, period->max_ns, p);
+}
+
+/*
+ * Summarises the requests of the sliding window, that is the current and
+ * the previous period, as they would be after a rotation at @now.
+ */
+void block_latency_get_window(const BlockAcctLatency *stats, int64_t now,
+                              BlockAcctLatencyWindow *win)
+{
+    const BlockAcctLatencyPeriod *cur = &stats->periods[stats->current];
+    const BlockAcctLatencyPeriod *periods[2];
+    int i, nb_periods = 0;
+    uint64_t total_ns = 0;
+
+    memset(win, 0, sizeof(*win));
+
+    if (now - cur->start_ns >= 2 * BLOCK_LATENCY_PERIOD_NS) {
+        /* everything is outdated */
+        return;
+    } else if (now - cur->start_ns >= BLOCK_LATENCY_PERIOD_NS) {
+        /* the current period will become the previous one */
+        win->interval_ns = now - cur->start_ns;
+        periods[nb_periods++] = cur;
+    } else {
+        win->interval_ns = now - stats->periods[stats->current ^ 1].start_ns;
+        periods[nb_periods++] = cur;
+        periods[nb_periods++] = &stats->periods[stats->current ^ 1];
+    }
+
+    for (i = 0; i < nb_periods; i++) {
+        const BlockAcctLatencyPeriod *p = periods[i];
+
+        if (!p->nr_ops) {
+            continue;
+        }
+        if (!win->nr_ops || p->min_ns < win->min_ns) {
+            win->min_ns = p->min_ns;
+        }
+        win->max_ns = MAX(win->max_ns, p->max_ns);
+        win->nr_ops += p->nr_ops;
+        total_ns += p->total_ns;
+    }
+
+    if (!win->nr_ops) {
+        return;
+    }
+
+    win->avg_ns = total_ns / win->nr_ops;
+    win->p50_ns = latency_percentile(periods, nb_periods, win->nr_ops,
+                                     win->max_ns, 0.5);
+    win->p99_ns = latency_percentile(periods, nb_periods, win->nr_ops,
+                                     win->max_ns, 0.99);
+    win->p999_ns = latency_percentile(periods, nb_periods, win->nr_ops,
+                                      win->max_ns, 0.999);
+}
+
+/*
+ * Sets up a latency histogram with the given bin boundaries, which must be
+ * strictly ascending, and resets its counters.  With @nb_boundaries == 0 the
+ * histogram is removed.
+ *
+ * Returns 0 on success and -EINVAL if the boundaries are not ascending.
+ */
+int block_latency_set_histogram(BlockAcctLatency *stats,
+                                const uint64_t *boundaries,
+                                unsigned int nb_boundaries)
+{
+    unsigned int i;
+
+    for (i = 1; i < nb_boundaries; i++) {
+        if (boundaries[i] <= boundaries[i - 1]) {
+            return -EINVAL;
+        }
+    }
+
+    block_latency_cleanup(stats);
+
+    if (nb_boundaries) {
+        stats->nb_boundaries = nb_boundaries;
+        stats->boundaries = g_memdup(boundaries,
+                                     nb_boundaries * sizeof(uint64_t));
+        stats->hist_bins = g_new0(uint64_t, nb_boundaries + 1);
+    }
+
+    return 0;
+}
+
+void block_latency_cleanup(BlockAcctLatency *stats)
+{
+    g_free(stats->boundaries);
+    g_free(stats->hist_bins);
+    stats->boundaries = NULL;
+    stats->hist_bins = NULL;
+    stats->nb_boundaries = 0;
+}
@@ -38,6 +38,7 @@ typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -208,6 +209,49 @@ static void backup_iostatus_reset(BlockJob *job)
     bdrv_iostatus_reset(s->target);
 }
 
+/* Take over the dirty clusters of the job's sync bitmap.  The returned
+ * HBitmap has one bit per backup cluster; the sync bitmap is cleared so that
+ * it tracks the writes for the next incremental backup from now on.
+ */
+static HBitmap *backup_take_sync_bitmap(BackupBlockJob *job, int64_t end)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t granularity;
+    HBitmap *clusters;
+    HBitmapIter hbi;
+    int64_t sector;
+
+    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap)
+                  >> BDRV_SECTOR_BITS;
+    clusters = hbitmap_alloc(end, 0);
+
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        int64_t first = sector / BACKUP_SECTORS_PER_CLUSTER;
+        int64_t last = MIN(end - 1, (sector + granularity - 1) /
+                                    BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_set(clusters, first, last - first + 1);
+    }
+
+    bdrv_clear_dirty_bitmap(job->sync_bitmap);
+    return clusters;
+}
+
+/* Give the clusters back to the sync bitmap if the backup did not complete,
+ * so that the next incremental backup copies them again. */
+static void backup_restore_sync_bitmap(BackupBlockJob *job, HBitmap *clusters)
+{
+    HBitmapIter hbi;
+    int64_t cluster;
+
+    hbitmap_iter_init(&hbi, clusters, 0);
+    while ((cluster = hbitmap_iter_next(&hbi)) != -1) {
+        bdrv_set_dirty_bitmap(job->sync_bitmap,
+                              cluster * BACKUP_SECTORS_PER_CLUSTER,
+                              BACKUP_SECTORS_PER_CLUSTER);
+    }
+}
+
 static const BlockJobDriver backup_job_driver = {
     .instance_size  = sizeof(BackupBlockJob),
     .job_type       = BLOCK_JOB_TYPE_BACKUP,
@@ -236,6 +280,7 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
+    HBitmap *sync_clusters = NULL;
     int64_t start, end;
     int ret = 0;
 
@@ -248,6 +293,20 @@ static void coroutine_fn backup_run(void *opaque)
 
     job->bitmap = hbitmap_alloc(end, 0);
 
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        HBitmapIter hbi;
+        int64_t cluster;
+
+        /* Clusters that are clean in the sync bitmap count as already
+         * copied, both for the loop below and for guest write CoW. */
+        sync_clusters = backup_take_sync_bitmap(job, end);
+        hbitmap_set(job->bitmap, 0, end);
+        hbitmap_iter_init(&hbi, sync_clusters, 0);
+        while ((cluster = hbitmap_iter_next(&hbi)) != -1) {
+            hbitmap_reset(job->bitmap, cluster, 1);
+        }
+    }
+
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
     bdrv_iostatus_enable(target);
@@ -263,7 +322,7 @@ static void coroutine_fn backup_run(void *opaque)
             job->common.busy = true;
         }
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
+        /* FULL, TOP and INCREMENTAL SYNC_MODE's require copying.. */
         for (; start < end; start++) {
             bool error_is_read;
 
@@ -271,6 +330,11 @@ static void coroutine_fn backup_run(void *opaque)
                 break;
             }
 
+            if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL &&
+                hbitmap_get(job->bitmap, start)) {
+                continue; /* clean in the sync bitmap, or already copied */
+            }
+
             /* we need to yield so that qemu_aio_flush() returns.
              * (without, VM does not reboot)
              */
@@ -343,6 +407,16 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    if (sync_clusters) {
+        if (ret < 0 || block_job_is_cancelled(&job->common)) {
+            backup_restore_sync_bitmap(job, sync_clusters);
+        }
+        hbitmap_free(sync_clusters);
+    }
+    if (job->sync_bitmap) {
+        bdrv_dirty_bitmap_set_frozen(job->sync_bitmap, false);
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -351,6 +425,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -369,6 +444,13 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == !!sync_bitmap);
+    if (sync_bitmap && bdrv_dirty_bitmap_frozen(sync_bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is already in use",
+                   bdrv_dirty_bitmap_name(sync_bitmap));
+        return;
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len, "unable to get length for '%s'",
@@ -386,6 +468,10 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_bitmap;
+    if (sync_bitmap) {
+        bdrv_dirty_bitmap_set_frozen(sync_bitmap, true);
+    }
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -0,0 +1,367 @@
+/*
+ * QEMU block backing chain allocation map
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Resolving which layer of a backing chain provides the data of a range
+ * normally takes one bdrv_get_block_status() call per layer, and reads of
+ * unallocated ranges pass through every driver of the chain.  With deep
+ * chains this gets expensive, so the result of a walk is kept in a sorted
+ * array of extents that each name the layer owning them.
+ *
+ * Writes to the top image drop the extents they cover.  Writes to any other
+ * layer that has been walked, as well as any change to the shape of a chain
+ * (commit, stream, snapshots, ...), bump a global generation number, which
+ * empties all maps on their next use.
+ */
+
+#include "block/block_int.h"
+#include "block/chain-map.h"
+
+/* Upper limit for the size of a map; a full map is simply emptied */
+#define CHAIN_MAP_MAX_EXTENTS   16384
+
+/* Unallocated ranges are remembered for this many layers of the chain */
+#define CHAIN_MAP_MAX_HOLES     16
+
+typedef struct BdrvChainExtent {
+    int64_t start;              /* first sector */
+    int64_t end;                /* first sector after the extent */
+    BlockDriverState *owner;    /* layer with the data, or NULL */
+    int depth;                  /* depth of @owner below the top */
+    int64_t status;             /* block status of @owner at @start */
+} BdrvChainExtent;
+
+typedef struct BdrvChainHole {
+    int64_t start;
+    int64_t end;
+} BdrvChainHole;
+
+struct BdrvChainMap {
+    BdrvChainExtent *extents;
+    int nb_extents;
+    int size;
+
+    /* The last range found to be unallocated in each layer */
+    BdrvChainHole holes[CHAIN_MAP_MAX_HOLES];
+
+    int64_t cluster_sectors;    /* invalidation granularity of the top */
+    uint64_t generation;        /* chain_map_generation the map is valid for */
+    uint64_t version;           /* incremented whenever extents are dropped */
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static uint64_t chain_map_generation;
+
+static void chain_extent_advance(BdrvChainExtent *e, int64_t start)
+{
+    if (e->status & BDRV_BLOCK_OFFSET_VALID) {
+        e->status += (start - e->start) * BDRV_SECTOR_SIZE;
+    }
+    e->start = start;
+}
+
+static void chain_map_clear(BdrvChainMap *map)
+{
+    map->nb_extents = 0;
+    memset(map->holes, 0, sizeof(map->holes));
+    map->generation = chain_map_generation;
+    map->version++;
+}
+
+/* Returns the index of the first extent that ends after @sector_num */
+static int chain_map_find(BdrvChainMap *map, int64_t sector_num)
+{
+    int lo = 0, hi = map->nb_extents;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (map->extents[mid].end <= sector_num) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void chain_map_insert_at(BdrvChainMap *map, int i,
+                                const BdrvChainExtent *e)
+{
+    if (map->nb_extents == map->size) {
+        if (map->size >= CHAIN_MAP_MAX_EXTENTS) {
+            chain_map_clear(map);
+            return;
+        }
+        map->size = MAX(16, map->size * 2);
+        map->extents = g_renew(BdrvChainExtent, map->extents, map->size);
+    }
+
+    memmove(&map->extents[i + 1], &map->extents[i],
+            (map->nb_extents - i) * sizeof(map->extents[0]));
+    map->extents[i] = *e;
+    map->nb_extents++;
+}
+
+/* Remove [start, end) from the map, trimming the extents at its edges */
+static void chain_map_drop(BdrvChainMap *map, int64_t start, int64_t end)
+{
+    BdrvChainExtent *ext = map->extents;
+    int i, j;
+
+    i = chain_map_find(map, start);
+    if (i < map->nb_extents && ext[i].start < start) {
+        if (ext[i].end > end) {
+            BdrvChainExtent tail = ext[i];
+
+            chain_extent_advance(&tail, end);
+            ext[i].end = start;
+            chain_map_insert_at(map, i + 1, &tail);
+            return;
+        }
+        ext[i].end = start;
+        i++;
+    }
+
+    for (j = i; j < map->nb_extents && ext[j].end <= end; j++) {
+        /* dropped completely */
+    }
+    if (j < map->nb_extents && ext[j].start < end) {
+        chain_extent_advance(&ext[j], end);
+    }
+
+    memmove(&ext[i], &ext[j], (map->nb_extents - j) * sizeof(ext[0]));
+    map->nb_extents -= j - i;
+}
+
+static bool chain_extent_can_merge(const BdrvChainExtent *prev,
+                                   const BdrvChainExtent *e)
+{
+    if (prev->end != e->start || prev->owner != e->owner ||
+        prev->depth != e->depth) {
+        return false;
+    }
+    if ((prev->status & ~BDRV_BLOCK_OFFSET_MASK) !=
+        (e->status & ~BDRV_BLOCK_OFFSET_MASK)) {
+        return false;
+    }
+    return !(e->status & BDRV_BLOCK_OFFSET_VALID) ||
+           prev->status + (prev->end - prev->start) * BDRV_SECTOR_SIZE ==
+           e->status;
+}
+
+static void chain_map_add(BdrvChainMap *map, const BdrvChainExtent *e)
+{
+    int i;
+
+    chain_map_drop(map, e->start, e->end);
+
+    i = chain_map_find(map, e->start);
+    if (i > 0 && chain_extent_can_merge(&map->extents[i - 1], e)) {
+        map->extents[i - 1].end = e->end;
+        return;
+    }
+    chain_map_insert_at(map, i, e);
+}
+
+static BdrvChainMap *chain_map_get(BlockDriverState *bs)
+{
+    BdrvChainMap *map = bs->chain_map;
+    BlockDriverInfo bdi;
+
+    if (!map) {
+        map = bs->chain_map = g_new0(BdrvChainMap, 1);
+        map->generation = chain_map_generation;
+        map->cluster_sectors = 1;
+        if (bdrv_get_info(bs, &bdi) == 0 &&
+            bdi.cluster_size >= BDRV_SECTOR_SIZE) {
+            map->cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+        }
+    } else if (map->generation != chain_map_generation) {
+        chain_map_clear(map);
+    }
+    return map;
+}
+
+/*
+ * Walk the chain like bdrv_get_block_status() callers used to: stop at the
+ * first layer that has data or reads as zeroes.  The walk may yield, so its
+ * result is only cached if nothing was invalidated in the meantime.
+ */
+static int64_t chain_map_resolve(BlockDriverState *bs, BdrvChainMap *map,
+                                 int64_t sector_num, int nb_sectors,
+                                 int *pnum, BlockDriverState **owner,
+                                 int *depth)
+{
+    uint64_t version = map->version;
+    uint64_t generation = chain_map_generation;
+    BlockDriverState *layer = bs, *prev = NULL;
+    int64_t ret;
+    int d = 0;
+    int n;
+
+    for (;;) {
+        BdrvChainHole *hole = d < CHAIN_MAP_MAX_HOLES ? &map->holes[d] : NULL;
+
+        if (hole && sector_num >= hole->start && sector_num < hole->end) {
+            n = MIN(nb_sectors, hole->end - sector_num);
+            ret = 0;
+        } else {
+            ret = bdrv_get_block_status(layer, sector_num, nb_sectors, &n);
+            if (ret < 0) {
+                return ret;
+            }
+            if (map->version != version ||
+                chain_map_generation != generation) {
+                hole = NULL;
+            }
+            if (hole && n > 0 && !(ret & (BDRV_BLOCK_ZERO | BDRV_BLOCK_DATA))) {
+                hole->start = sector_num;
+                hole->end = sector_num + n;
+            }
+        }
+
+        if (n == 0) {
+            if (d == 0) {
+                /* Beyond the end of the image */
+                nb_sectors = 0;
+                layer = NULL;
+                break;
+            }
+            /* Beyond the end of the backing file, which a cached hole of
+             * the layer above spans: that layer reads as zeroes here, as
+             * bdrv_get_block_status() would have said */
+            layer = prev;
+            d--;
+            ret = BDRV_BLOCK_ZERO;
+            break;
+        }
+        nb_sectors = n;
+
+        if (ret & (BDRV_BLOCK_ZERO | BDRV_BLOCK_DATA)) {
+            break;
+        }
+        prev = layer;
+        layer = layer->backing_hd;
+        if (layer == NULL) {
+            ret = 0;
+            break;
+        }
+        /* Drivers also write to their file directly, e.g. when they
+         * update metadata, so writes there invalidate the maps as well */
+        layer->chain_map_layer = true;
+        if (layer->file) {
+            layer->file->chain_map_layer = true;
+        }
+        d++;
+    }
+
+    *pnum = nb_sectors;
+    *owner = layer;
+    *depth = d;
+
+    if (nb_sectors > 0 &&
+        map->version == version && chain_map_generation == generation) {
+        BdrvChainExtent e = {
+            .start  = sector_num,
+            .end    = sector_num + nb_sectors,
+            .owner  = layer,
+            .depth  = d,
+            .status = ret,
+        };
+        chain_map_add(map, &e);
+    }
+    return ret;
+}
+
+int64_t bdrv_chain_map_get_status(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, int *pnum,
+                                  BlockDriverState **owner, int *depth)
+{
+    BdrvChainMap *map = chain_map_get(bs);
+    BdrvChainExtent e;
+    int i;
+
+    i = chain_map_find(map, sector_num);
+    if (i == map->nb_extents || map->extents[i].start > sector_num) {
+        map->misses++;
+        return chain_map_resolve(bs, map, sector_num, nb_sectors,
+                                 pnum, owner, depth);
+    }
+
+    map->hits++;
+    e = map->extents[i];
+    chain_extent_advance(&e, sector_num);
+    *pnum = MIN(nb_sectors, e.end - sector_num);
+    *owner = e.owner;
+    *depth = e.depth;
+    return e.status;
+}
+
+void bdrv_chain_map_invalidate(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors)
+{
+    BdrvChainMap *map = bs->chain_map;
+
+    if (bs->chain_map_layer) {
+        bdrv_chain_map_invalidate_all();
+    }
+    if (map && map->generation == chain_map_generation) {
+        /* Allocations may cover whole clusters beyond the request */
+        int64_t start = QEMU_ALIGN_DOWN(sector_num, map->cluster_sectors);
+        int64_t end = QEMU_ALIGN_UP(sector_num + nb_sectors,
+                                    map->cluster_sectors);
+
+        chain_map_drop(map, start, end);
+        memset(map->holes, 0, sizeof(map->holes));
+        map->version++;
+    }
+}
+
+void bdrv_chain_map_invalidate_all(void)
+{
+    chain_map_generation++;
+}
+
+void bdrv_chain_map_free(BlockDriverState *bs)
+{
+    if (bs->chain_map) {
+        g_free(bs->chain_map->extents);
+        g_free(bs->chain_map);
+        bs->chain_map = NULL;
+    }
+    bs->chain_map_layer = false;
+}
+
+bool bdrv_chain_map_get_stats(const BlockDriverState *bs,
+                              BdrvChainMapStats *stats)
+{
+    BdrvChainMap *map = bs->chain_map;
+
+    if (!map) {
+        return false;
+    }
+
+    stats->hits = map->hits;
+    stats->misses = map->misses;
+    stats->nb_extents = map->generation == chain_map_generation ?
+                        map->nb_extents : 0;
+    return true;
+}
@@ -27,8 +27,27 @@ enum {
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
+#define DEFAULT_MAX_IN_FLIGHT 4
 
-typedef struct CommitBlockJob {
+/* Adjacent allocated ranges are merged into requests of up to this size */
+#define COMMIT_MAX_OP_SECTORS ((4 * 1024 * 1024) >> BDRV_SECTOR_BITS)
+
+/* Committed data is dropped from top in batches of this size by default,
+ * each after a flush of base.
+ */
+#define DEFAULT_DROP_BATCH_SIZE (64 * 1024 * 1024)
+
+typedef struct CommitBlockJob CommitBlockJob;
+
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_zero;           /* the range reads as zeroes */
+    QLIST_ENTRY(CommitOp) next;
+} CommitOp;
+
+struct CommitBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *active;
@@ -37,28 +56,153 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     int orig_overlay_flags;
-} CommitBlockJob;
+    int orig_top_flags;
+
+    /* Copy operations in flight */
+    QLIST_HEAD(, CommitOp) ops;
+    int in_flight;
+    int max_in_flight;
+    bool waiting;           /* commit_run() waits for an operation */
+    int ret;                /* first error of a completed operation */
+
+    /* Ranges that are in base and can be dropped from top */
+    bool drop_committed;
+    int64_t drop_batch_sectors;
+    QLIST_HEAD(, CommitOp) committed;
+    int64_t committed_sectors;
+};
 
-static int coroutine_fn commit_populate(BlockDriverState *bs,
-                                        BlockDriverState *base,
-                                        int64_t sector_num, int nb_sectors,
-                                        void *buf)
+static int coroutine_fn commit_populate(CommitBlockJob *s, CommitOp *op)
 {
-    int ret = 0;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    void *buf = NULL;
+    int ret;
 
-    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
-    if (ret) {
-        return ret;
+    if (!op->is_zero) {
+        iov.iov_len = op->nb_sectors * BDRV_SECTOR_SIZE;
+        iov.iov_base = buf = qemu_blockalign(s->top, iov.iov_len);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->top, op->sector_num, op->nb_sectors, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
+        op->is_zero = qemu_iovec_is_zero(&qiov);
+    }
+
+    if (op->is_zero) {
+        trace_commit_write_zeroes(s, op->sector_num, op->nb_sectors);
+        ret = bdrv_co_write_zeroes(s->base, op->sector_num, op->nb_sectors, 0);
+    } else {
+        ret = bdrv_co_writev(s->base, op->sector_num, op->nb_sectors, &qiov);
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void coroutine_fn commit_populate_co(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    int ret;
+
+    ret = commit_populate(s, op);
+    trace_commit_populate_done(s, op->sector_num, op->nb_sectors, ret);
+    if (ret < 0 && s->ret == 0) {
+        s->ret = ret;
     }
 
-    ret = bdrv_write(base, sector_num, buf, nb_sectors);
-    if (ret) {
+    QLIST_REMOVE(op, next);
+    s->in_flight--;
+    if (ret >= 0 && s->drop_committed) {
+        QLIST_INSERT_HEAD(&s->committed, op, next);
+        s->committed_sectors += op->nb_sectors;
+    } else {
+        g_free(op);
+    }
+
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void commit_issue(CommitBlockJob *s, int64_t sector_num,
+                         int nb_sectors, bool is_zero)
+{
+    CommitOp *op = g_new0(CommitOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->is_zero = is_zero;
+    QLIST_INSERT_HEAD(&s->ops, op, next);
+    s->in_flight++;
+
+    qemu_coroutine_enter(qemu_coroutine_create(commit_populate_co), op);
+}
+
+/* Waits until a copy operation completes */
+static void coroutine_fn commit_wait(CommitBlockJob *s)
+{
+    assert(s->in_flight > 0);
+    s->waiting = true;
+    qemu_coroutine_yield();
+    assert(!s->waiting);
+}
+
+static void commit_forget_committed(CommitBlockJob *s)
+{
+    CommitOp *op, *next_op;
+
+    QLIST_FOREACH_SAFE(op, &s->committed, next, next_op) {
+        QLIST_REMOVE(op, next);
+        g_free(op);
+    }
+    s->committed_sectors = 0;
+}
+
+/* Drops the committed ranges from top, which reads them from base then */
+static int coroutine_fn commit_drop_committed(CommitBlockJob *s)
+{
+    CommitOp *op;
+    int ret;
+
+    /* The data must be stable in base before it disappears from top */
+    ret = bdrv_co_flush(s->base);
+    if (ret < 0) {
         return ret;
     }
 
+    while ((op = QLIST_FIRST(&s->committed)) != NULL) {
+        QLIST_REMOVE(op, next);
+        s->committed_sectors -= op->nb_sectors;
+        ret = bdrv_co_unallocate(s->top, op->sector_num, op->nb_sectors);
+        trace_commit_drop(s, op->sector_num, op->nb_sectors, ret);
+        g_free(op);
+
+        if (ret == -ENOTSUP) {
+            /* Keep the data in top, but commit anyway */
+            s->drop_committed = false;
+            commit_forget_committed(s);
+            return 0;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
     return 0;
 }
 
+static bool commit_error_is_fatal(CommitBlockJob *s, int ret)
+{
+    return s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+           s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+           (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC);
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -67,10 +211,10 @@ static void coroutine_fn commit_run(void *opaque)
     BlockDriverState *base = s->base;
     BlockDriverState *overlay_bs;
     int64_t sector_num, end;
+    uint64_t delay_ns = 0;
+    bool top_dropped = false;
     int ret = 0;
-    int n = 0;
-    void *buf;
-    int bytes_written = 0;
+    int error = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -93,60 +237,121 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
+    ret = 0;
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
+    sector_num = 0;
+    for (;;) {
+        int64_t status;
+        bool is_zero;
         bool copy;
+        int allocated;
+        int n, pnum;
 
-wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
+        delay_ns = 0;
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                      &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
+
+        if (s->ret < 0) {
+            if (commit_error_is_fatal(s, s->ret)) {
+                ret = s->ret;
+                break;
+            }
+            /* Ignored, the range stays uncommitted */
+            if (error == 0) {
+                error = s->ret;
+            }
+            s->ret = 0;
+        }
+
+        if (s->in_flight >= s->max_in_flight ||
+            (sector_num >= end && s->in_flight > 0)) {
+            commit_wait(s);
+            continue;
+        }
+        if (sector_num >= end) {
+            break;
+        }
+
+        if (s->committed_sectors >= s->drop_batch_sectors) {
+            s->ret = commit_drop_committed(s);
+            continue;
+        }
+
+        /* Copy if allocated above the base, merging adjacent ranges that
+         * are allocated in different layers into one request.
+         */
+        allocated = bdrv_is_allocated_above(top, base, sector_num,
+                                            COMMIT_MAX_OP_SECTORS, &n);
+        copy = (allocated == 1);
+        while (copy && n < COMMIT_MAX_OP_SECTORS && sector_num + n < end) {
+            int m;
+
+            if (bdrv_is_allocated_above(top, base, sector_num + n,
+                                        COMMIT_MAX_OP_SECTORS - n, &m) != 1) {
+                break;
+            }
+            n += m;
+        }
+        if (allocated < 0) {
+            /* Copy anyway, the copy reports an error if there is one */
+            n = COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+            copy = true;
+        }
+        n = MAX(1, MIN(n, end - sector_num));
+        trace_commit_one_iteration(s, sector_num, n, allocated);
+
         if (copy) {
             if (s->common.speed) {
                 delay_ns = ratelimit_calculate_delay(&s->limit, n);
                 if (delay_ns > 0) {
-                    goto wait;
+                    continue;
                 }
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
-        if (ret < 0) {
-            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
-                s->on_error == BLOCKDEV_ON_ERROR_REPORT||
-                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto exit_free_buf;
-            } else {
-                n = 0;
-                continue;
-            }
+
+            /* Data that reads as zeroes is zeroed in base without a read */
+            status = bdrv_get_block_status(top, sector_num, n, &pnum);
+            is_zero = status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum == n;
+
+            commit_issue(s, sector_num, n, is_zero);
         }
+
         /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
+        s->common.offset = sector_num * BDRV_SECTOR_SIZE;
     }
 
-    ret = 0;
+    /* Wait for the remaining operations, e.g. after cancellation */
+    while (s->in_flight > 0) {
+        commit_wait(s);
+    }
+    if (s->ret < 0 && error == 0) {
+        error = s->ret;
+    }
+
+    /* The last batch, top is not dropped from the chain if this fails */
+    if (ret == 0 && !QLIST_EMPTY(&s->committed)) {
+        ret = commit_drop_committed(s);
+    }
+    commit_forget_committed(s);
+
+    /* Do not drop the intermediate images if an error was there but
+     * ignored, they still hold the uncommitted ranges.  */
+    if (ret == 0) {
+        ret = error;
+    }
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end) {
+    if (!block_job_is_cancelled(&s->common) && sector_num >= end &&
+        ret == 0) {
         /* success */
         ret = bdrv_drop_intermediate(active, top, base);
+        top_dropped = (ret == 0);
     }
 
-exit_free_buf:
-    qemu_vfree(buf);
-
 exit_restore_reopen:
     /* restore base open flags here if appropriate (e.g., change the base back
      * to r/o). These reopens do not need to be atomic, since we won't abort
@@ -158,6 +363,9 @@ exit_restore_reopen:
     if (overlay_bs && s->orig_overlay_flags != bdrv_get_flags(overlay_bs)) {
         bdrv_reopen(overlay_bs, s->orig_overlay_flags, NULL);
     }
+    if (!top_dropped && s->orig_top_flags != bdrv_get_flags(top)) {
+        bdrv_reopen(top, s->orig_top_flags, NULL);
+    }
 
     block_job_completed(&s->common, ret);
 }
@@ -180,14 +388,16 @@ static const BlockJobDriver commit_job_driver = {
 };
 
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                  BlockDriverState *top, int64_t speed,
-                  BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
-                  void *opaque, Error **errp)
+                  BlockDriverState *top, int64_t speed, int max_in_flight,
+                  bool drop_committed, int64_t drop_batch_size,
+                  BlockdevOnError on_error,
+                  BlockDriverCompletionFunc *cb, void *opaque, Error **errp)
 {
     CommitBlockJob *s;
     BlockReopenQueue *reopen_queue = NULL;
     int orig_overlay_flags;
     int orig_base_flags;
+    int orig_top_flags;
     BlockDriverState *overlay_bs;
     Error *local_err = NULL;
 
@@ -204,6 +414,14 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    /* Dropping data from top is only safe if nothing between top and base
+     * could show through instead of what was committed */
+    if (drop_committed && top->backing_hd != base) {
+        error_setg(errp, "drop-committed requires base to be the backing "
+                   "file of top");
+        return;
+    }
+
     overlay_bs = bdrv_find_overlay(bs, top);
 
     if (overlay_bs == NULL) {
@@ -213,6 +431,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
 
     orig_base_flags    = bdrv_get_flags(base);
     orig_overlay_flags = bdrv_get_flags(overlay_bs);
+    orig_top_flags     = bdrv_get_flags(top);
 
     /* convert base & overlay_bs to r/w, if necessary */
     if (!(orig_base_flags & BDRV_O_RDWR)) {
@@ -223,6 +442,10 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
         reopen_queue = bdrv_reopen_queue(reopen_queue, overlay_bs,
                                          orig_overlay_flags | BDRV_O_RDWR);
     }
+    if (drop_committed && !(orig_top_flags & BDRV_O_RDWR)) {
+        reopen_queue = bdrv_reopen_queue(reopen_queue, top,
+                                         orig_top_flags | BDRV_O_RDWR);
+    }
     if (reopen_queue) {
         bdrv_reopen_multiple(reopen_queue, &local_err);
         if (local_err != NULL) {
@@ -243,8 +466,15 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
 
     s->base_flags          = orig_base_flags;
     s->orig_overlay_flags  = orig_overlay_flags;
+    s->orig_top_flags      = orig_top_flags;
 
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ? max_in_flight : DEFAULT_MAX_IN_FLIGHT;
+    s->drop_committed = drop_committed;
+    s->drop_batch_sectors = (drop_batch_size ? drop_batch_size :
+                             DEFAULT_DROP_BATCH_SIZE) >> BDRV_SECTOR_BITS;
+    QLIST_INIT(&s->ops);
+    QLIST_INIT(&s->committed);
     s->common.co = qemu_coroutine_create(commit_run);
 
     trace_commit_start(bs, base, top, s, s->common.co, opaque);
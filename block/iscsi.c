@@ -1458,6 +1458,11 @@ static int iscsi_refresh_limits(BlockDriverState *bs)
     }
     bs->bl.opt_transfer_length = sector_lun2qemu(iscsilun->bl.opt_xfer_len,
                                                  iscsilun);
+    if (iscsilun->bl.max_xfer_len) {
+        bs->bl.max_transfer_length =
+            MIN(sector_lun2qemu(iscsilun->bl.max_xfer_len, iscsilun),
+                INT_MAX);
+    }
     return 0;
 }
 
@@ -18,7 +18,12 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define DEFAULT_MAX_IN_FLIGHT 64
+
+/* A single operation never takes more than this fraction of the buffer, so
+ * that even sequential copies keep several operations in flight.
+ */
+#define MAX_OP_BUF_SHARE 4
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -27,12 +32,15 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+typedef struct MirrorOp MirrorOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *target;
     BlockDriverState *base;
     bool is_none_mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -46,17 +54,41 @@ typedef struct MirrorBlockJob {
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
     int buf_free_count;
 
+    /* Operations double in size, up to max_op_chunks, as long as each one
+     * starts where the previous one ended.
+     */
+    int op_chunks;
+    int max_op_chunks;
+    int64_t next_sector;
+
     unsigned long *in_flight_bitmap;
+    QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int in_flight;
+    int max_in_flight;
     int ret;
+
+    /* Guest writes are copied synchronously in write-blocking mode */
+    bool write_blocking;
+    NotifierWithReturn before_write;
+    Notifier write_complete;
 } MirrorBlockJob;
 
-typedef struct MirrorOp {
+struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
-} MirrorOp;
+
+    /* The data reads as zeroes, so the target is zeroed without a copy */
+    bool is_zero;
+
+    /* Non-NULL for guest writes in write-blocking mode */
+    BdrvTrackedRequest *req;
+
+    /* Guest writes that wait for this operation to complete */
+    CoQueue waiting_requests;
+    QTAILQ_ENTRY(MirrorOp) next;
+};
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
@@ -80,6 +112,7 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
 
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
     s->in_flight--;
     iov = op->qiov.iov;
     for (i = 0; i < op->qiov.niov; i++) {
@@ -96,6 +129,13 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
         bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
     }
 
+    /* The operation is gone from ops_in_flight, so the waiters will only
+     * look for other conflicting operations.
+     */
+    while (qemu_co_enter_next(&op->waiting_requests)) {
+        /* do nothing */
+    }
+
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
@@ -142,17 +182,150 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    if (qemu_iovec_is_zero(&op->qiov)) {
+        trace_mirror_write_zeroes(s, op->sector_num, op->nb_sectors);
+        bdrv_aio_write_zeroes(s->target, op->sector_num, op->nb_sectors, 0,
+                              mirror_write_complete, op);
+        return;
+    }
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
 
+/* Wait until no operation touches the chunks from @chunk_start to
+ * @chunk_end (exclusive).  This is for guest writes only; the job coroutine
+ * is woken up whenever an operation completes.
+ */
+static void coroutine_fn mirror_wait_on_conflicts(MirrorBlockJob *s,
+                                                  int64_t chunk_start,
+                                                  int64_t chunk_end)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    MirrorOp *op;
+
+restart:
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        int64_t op_start = op->sector_num / sectors_per_chunk;
+        int64_t op_end = DIV_ROUND_UP(op->sector_num + op->nb_sectors,
+                                      sectors_per_chunk);
+
+        if (op_start < chunk_end && chunk_start < op_end) {
+            qemu_co_queue_wait(&op->waiting_requests);
+            goto restart;
+        }
+    }
+}
+
+/* In write-blocking mode, every guest write becomes an operation before it
+ * reaches the source.  This orders it against the background copy and
+ * against other guest writes, so that the target sees the writes in the
+ * same order as the source.
+ */
+static int coroutine_fn mirror_before_write_notify(NotifierWithReturn *notifier,
+                                                   void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t chunk_start, chunk_end;
+    MirrorOp *op;
+
+    chunk_start = req->overlap_offset / s->granularity;
+    chunk_end = DIV_ROUND_UP(req->overlap_offset + req->overlap_bytes,
+                             s->granularity);
+    chunk_end = MIN(chunk_end, DIV_ROUND_UP(s->common.len, s->granularity));
+    if (chunk_start >= chunk_end) {
+        return 0;
+    }
+
+    mirror_wait_on_conflicts(s, chunk_start, chunk_end);
+
+    op = g_slice_new0(MirrorOp);
+    op->s = s;
+    op->req = req;
+    op->sector_num = chunk_start * sectors_per_chunk;
+    op->nb_sectors = (chunk_end - chunk_start) * sectors_per_chunk;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
+    s->in_flight++;
+    bitmap_set(s->in_flight_bitmap, chunk_start, chunk_end - chunk_start);
+
+    return 0;
+}
+
+/* Copy a guest write to the target once it is on the source.  Only whole
+ * chunks can be marked clean; the rest of the write stays dirty and is left
+ * to the background copy.
+ */
+static void coroutine_fn mirror_write_complete_notify(Notifier *notifier,
+                                                      void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, write_complete);
+    BdrvWriteCompletion *c = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num, end;
+    MirrorOp *op;
+    int ret;
+
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        if (op->req == c->req) {
+            break;
+        }
+    }
+    if (!op) {
+        return;
+    }
+
+    sector_num = ROUND_UP(c->sector_num, sectors_per_chunk);
+    end = QEMU_ALIGN_DOWN(c->sector_num + c->nb_sectors, sectors_per_chunk);
+    if (c->ret >= 0 && sector_num < end) {
+        int nb_sectors = end - sector_num;
+
+        if (c->flags & BDRV_REQ_ZERO_WRITE) {
+            ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                       c->flags & BDRV_REQ_MAY_UNMAP);
+        } else {
+            QEMUIOVector qiov;
+
+            qemu_iovec_init(&qiov, c->qiov->niov);
+            qemu_iovec_concat(&qiov, c->qiov,
+                              (sector_num - c->sector_num) * BDRV_SECTOR_SIZE,
+                              nb_sectors * BDRV_SECTOR_SIZE);
+            ret = bdrv_co_writev(s->target, sector_num, nb_sectors, &qiov);
+            qemu_iovec_destroy(&qiov);
+        }
+        trace_mirror_active_write(s, sector_num, nb_sectors, ret);
+
+        /* On failure the chunks stay dirty and the background copy retries
+         * them, applying on-target-error.
+         */
+        if (ret >= 0) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        }
+    }
+
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    s->in_flight--;
+    bitmap_clear(s->in_flight_bitmap, op->sector_num / sectors_per_chunk,
+                 op->nb_sectors / sectors_per_chunk);
+    qemu_co_queue_restart_all(&op->waiting_requests);
+    g_slice_free(MirrorOp, op);
+
+    /* The job may be waiting for this chunk, or draining */
+    if (s->common.busy) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t status;
     uint64_t delay_ns;
     MirrorOp *op;
+    int pnum;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
     if (s->sector_num < 0) {
@@ -186,12 +359,29 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     next_sector = sector_num;
     next_chunk = sector_num / sectors_per_chunk;
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
+    /* Wait for I/O to this cluster (from a previous iteration or from a
+     * guest write in write-blocking mode) to be done.
+     */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
         qemu_coroutine_yield();
     }
 
+    /* A guest write may have copied the chunk in the meantime */
+    if (!bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+        return 0;
+    }
+
+    /* Grow the operations while the dirty data is sequential, so that bulk
+     * copies use large requests while scattered dirty chunks are copied by
+     * many small operations in parallel.
+     */
+    if (sector_num == s->next_sector) {
+        s->op_chunks = MIN(s->op_chunks * 2, s->max_op_chunks);
+    } else {
+        s->op_chunks = 1;
+    }
+
     do {
         int added_sectors, added_chunks;
 
@@ -220,6 +410,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
+        if (nb_chunks > 0 && nb_chunks + added_chunks > s->op_chunks) {
+            break;
+        }
+
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
          */
@@ -247,10 +441,16 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     } while (delay_ns == 0 && next_sector < end);
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_slice_new(MirrorOp);
+    op = g_slice_new0(MirrorOp);
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    qemu_co_queue_init(&op->waiting_requests);
+
+    /* Data that reads as zeroes needs neither a read nor a buffer */
+    status = bdrv_get_block_status(source, sector_num, nb_sectors, &pnum);
+    op->is_zero = status >= 0 && (status & BDRV_BLOCK_ZERO) &&
+                  pnum == nb_sectors;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -258,10 +458,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     qemu_iovec_init(&op->qiov, nb_chunks);
     next_sector = sector_num;
     while (nb_chunks-- > 0) {
-        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
-        s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, s->granularity);
+        if (!op->is_zero) {
+            MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+            QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+            s->buf_free_count--;
+            qemu_iovec_add(&op->qiov, buf, s->granularity);
+        }
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
@@ -274,13 +476,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
+    bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+    s->next_sector = sector_num + nb_sectors;
 
     /* Copy the dirty cluster.  */
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
     s->in_flight++;
-    trace_mirror_one_iteration(s, sector_num, nb_sectors);
-    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                   mirror_read_complete, op);
+    if (op->is_zero) {
+        trace_mirror_write_zeroes(s, sector_num, nb_sectors);
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors, 0,
+                              mirror_write_complete, op);
+    } else {
+        trace_mirror_one_iteration(s, sector_num, nb_sectors);
+        bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                       mirror_read_complete, op);
+    }
     return delay_ns;
 }
 
@@ -308,14 +518,40 @@ static void mirror_drain(MirrorBlockJob *s)
     }
 }
 
+/* If we have no backing file yet in the destination, we cannot let
+ * the destination do COW.  Instead, we copy sectors around the
+ * dirty data if needed.  Return 1 if that is the case for @granularity,
+ * storing the target cluster size in @cluster_size, 0 if it is not, or
+ * -errno on failure.
+ */
+static int mirror_target_needs_cow(BlockDriverState *target,
+                                   int64_t granularity, int *cluster_size)
+{
+    BlockDriverInfo bdi;
+    char backing_filename[1024];
+    int ret;
+
+    bdrv_get_backing_filename(target, backing_filename,
+                              sizeof(backing_filename));
+    if (!backing_filename[0] || target->backing_hd) {
+        return 0;
+    }
+
+    ret = bdrv_get_info(target, &bdi);
+    if (ret < 0) {
+        return ret;
+    }
+    *cluster_size = bdi.cluster_size;
+    return granularity < bdi.cluster_size;
+}
+
 static void coroutine_fn mirror_run(void *opaque)
 {
     MirrorBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     int64_t sector_num, end, sectors_per_chunk, length;
     uint64_t last_pause_ns;
-    BlockDriverInfo bdi;
-    char backing_filename[1024];
+    int cluster_size;
     int ret = 0;
     int n;
 
@@ -332,27 +568,41 @@ static void coroutine_fn mirror_run(void *opaque)
     length = DIV_ROUND_UP(s->common.len, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
 
-    /* If we have no backing file yet in the destination, we cannot let
-     * the destination do COW.  Instead, we copy sectors around the
-     * dirty data if needed.  We need a bitmap to do that.
+    /* Copying around the dirty data needs a bitmap of the chunks that
+     * the target already has.
      */
-    bdrv_get_backing_filename(s->target, backing_filename,
-                              sizeof(backing_filename));
-    if (backing_filename[0] && !s->target->backing_hd) {
-        ret = bdrv_get_info(s->target, &bdi);
-        if (ret < 0) {
-            goto immediate_exit;
-        }
-        if (s->granularity < bdi.cluster_size) {
-            s->buf_size = MAX(s->buf_size, bdi.cluster_size);
-            s->cow_bitmap = bitmap_new(length);
-        }
+    ret = mirror_target_needs_cow(s->target, s->granularity, &cluster_size);
+    if (ret < 0) {
+        goto immediate_exit;
+    }
+    if (ret > 0) {
+        s->buf_size = MAX(s->buf_size, cluster_size);
+        s->cow_bitmap = bitmap_new(length);
     }
+    ret = 0;
 
     end = s->common.len >> BDRV_SECTOR_BITS;
     s->buf = qemu_blockalign(bs, s->buf_size);
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
+    s->max_op_chunks = MAX(1, s->buf_free_count / MAX_OP_BUF_SHARE);
+    s->op_chunks = 1;
+    s->next_sector = -1;
+
+    /* mirror_start_job() refuses write-blocking mode when the target needs
+     * whole clusters, because guest writes are copied on their own.
+     */
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        if (s->cow_bitmap) {
+            ret = -ENOTSUP;
+            goto immediate_exit;
+        }
+        s->before_write.notify = mirror_before_write_notify;
+        s->write_complete.notify = mirror_write_complete_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        bdrv_add_write_complete_notifier(bs, &s->write_complete);
+        s->write_blocking = true;
+    }
 
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
@@ -397,7 +647,7 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 qemu_coroutine_yield();
@@ -474,16 +724,27 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->write_blocking) {
+        /* Guest writes that start from now on are not copied */
+        notifier_with_return_remove(&s->before_write);
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
-         * the target is a copy of the source.
+         * the target is a copy of the source.  The guest writes that are
+         * being copied are waited for too.
          */
         assert(ret < 0 || (!s->synced && block_job_is_cancelled(&s->common)));
         mirror_drain(s);
     }
 
+    if (s->write_blocking) {
+        notifier_remove(&s->write_complete);
+    }
+
     assert(s->in_flight == 0);
+    assert(QTAILQ_EMPTY(&s->ops_in_flight));
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
@@ -563,7 +824,8 @@ static const BlockJobDriver commit_active_job_driver = {
 
 static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                             int64_t speed, int64_t granularity,
-                            int64_t buf_size,
+                            int64_t buf_size, int max_in_flight,
+                            MirrorCopyMode copy_mode,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             BlockDriverCompletionFunc *cb,
@@ -594,6 +856,23 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        int cluster_size;
+        int ret;
+
+        ret = mirror_target_needs_cow(target, granularity, &cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not get target image info");
+            return;
+        }
+        if (ret > 0) {
+            error_setg(errp, "Write-blocking mode needs a granularity of at "
+                       "least the target cluster size (%d bytes) while the "
+                       "target backing file is not open", cluster_size);
+            return;
+        }
+    }
+
 
     s = block_job_create(driver, bs, speed, cb, opaque, errp);
     if (!s) {
@@ -607,8 +886,11 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->base = base;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = max_in_flight ? max_in_flight : DEFAULT_MAX_IN_FLIGHT;
+    s->copy_mode = copy_mode;
+    QTAILQ_INIT(&s->ops_in_flight);
 
-    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, errp);
+    s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
         return;
     }
@@ -622,6 +904,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight, MirrorCopyMode copy_mode,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
@@ -633,6 +916,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
     mirror_start_job(bs, target, speed, granularity, buf_size,
+                     max_in_flight, copy_mode,
                      on_source_error, on_target_error, cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base);
 }
@@ -680,7 +964,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     bdrv_ref(base);
-    mirror_start_job(bs, base, speed, 0, 0,
+    mirror_start_job(bs, base, speed, 0, 0, 0, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
@@ -36,7 +36,7 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
 {
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->recv_coroutine[i]) {
             qemu_coroutine_enter(s->recv_coroutine[i], NULL);
         }
@@ -79,7 +79,7 @@ static void nbd_reply_ready(void *opaque)
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
     i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    if (i >= s->max_requests) {
         goto fail;
     }
 
@@ -132,30 +132,170 @@ static int nbd_co_send_request(NbdClientSession *s,
     return rc;
 }
 
+/* A single extent of a base:allocation block status reply */
+typedef struct NbdExtent {
+    uint32_t length;
+    uint32_t flags;
+} NbdExtent;
+
+static int nbd_co_read_payload(NbdClientSession *s, void *buf, size_t len)
+{
+    return qemu_co_recv(s->sock, buf, len) == len ? 0 : -EIO;
+}
+
+static int nbd_co_skip_payload(NbdClientSession *s, size_t len)
+{
+    uint8_t buf[512];
+
+    while (len > 0) {
+        size_t n = MIN(len, sizeof(buf));
+        if (nbd_co_read_payload(s, buf, n) < 0) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Checks that [@from, @from + @len) is within the request and returns the
+ * offset of @from into the request's buffer, or -EIO.
+ */
+static int64_t nbd_chunk_offset(struct nbd_request *request,
+                                uint64_t from, uint64_t len)
+{
+    if (from < request->from || len > request->len ||
+        from - request->from > request->len - len) {
+        return -EIO;
+    }
+    return from - request->from;
+}
+
+/* Processes the payload of a structured reply chunk for @request.  The
+ * payload is always consumed completely unless the connection fails.
+ */
+static int nbd_co_handle_chunk(NbdClientSession *s,
+    struct nbd_request *request, struct nbd_reply *chunk,
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
+{
+    uint32_t len = chunk->length;
+    uint8_t buf[12];
+    int64_t pos;
+    int ret;
+
+    if (chunk->type & NBD_REPLY_TYPE_ERROR_BIT) {
+        uint32_t error;
+
+        /* error, message length, then the message and maybe an offset */
+        if (len < 6 || nbd_co_read_payload(s, buf, 6) < 0) {
+            return -EIO;
+        }
+        error = be32_to_cpup((uint32_t*)buf);
+        ret = nbd_co_skip_payload(s, len - 6);
+        if (ret < 0) {
+            return ret;
+        }
+        return error ? -error : -EIO;
+    }
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (len) {
+            break;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || len < 8 || nbd_co_read_payload(s, buf, 8) < 0) {
+            break;
+        }
+        len -= 8;
+        pos = nbd_chunk_offset(request, be64_to_cpup((uint64_t*)buf), len);
+        if (pos < 0) {
+            break;
+        }
+        ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                            offset + pos, len);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || len != 12 || nbd_co_read_payload(s, buf, 12) < 0) {
+            break;
+        }
+        len = be32_to_cpup((uint32_t*)(buf + 8));
+        pos = nbd_chunk_offset(request, be64_to_cpup((uint64_t*)buf), len);
+        if (pos < 0) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + pos, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* context id, then (length, flags) pairs; we only need the first */
+        if (!extent || len < 12 || (len - 4) % 8 ||
+            nbd_co_read_payload(s, buf, 12) < 0) {
+            break;
+        }
+        if (be32_to_cpup((uint32_t*)buf) != s->ext.meta_context_id) {
+            break;
+        }
+        extent->length = be32_to_cpup((uint32_t*)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t*)(buf + 8));
+        return nbd_co_skip_payload(s, len - 12);
+    }
+
+    /* Unknown or malformed chunk, skip what is left of it */
+    logout("Bad chunk type %d for request %d\n", chunk->type, request->type);
+    nbd_co_skip_payload(s, chunk->length);
+    return -EIO;
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
 {
+    int error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    /* With structured replies, a request can be answered by several chunks;
+     * the last one has NBD_REPLY_FLAG_DONE set.  Simple replies consist
+     * of a single header, followed by the data of successful reads.
+     */
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (reply->magic != NBD_STRUCTURED_REPLY_MAGIC) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+        } else if (!s->ext.structured_reply) {
+            nbd_co_skip_payload(s, reply->length);
+            reply->error = EIO;
+        } else {
+            ret = nbd_co_handle_chunk(s, request, reply, qiov, offset, extent);
+            reply->error = -ret;
+        }
+
+        /* Report the first error, but consume all chunks */
+        if (!error) {
+            error = reply->error;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
-    }
+    } while (!(reply->flags & NBD_REPLY_FLAG_DONE));
+
+    reply->error = error;
 }
 
 static void nbd_coroutine_start(NbdClientSession *s,
@@ -165,20 +305,20 @@ static void nbd_coroutine_start(NbdClientSession *s,
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
+    if (s->in_flight >= s->max_requests - 1) {
         qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+        assert(s->in_flight < s->max_requests);
     }
     s->in_flight++;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->recv_coroutine[i] == NULL) {
             s->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
+    assert(i < s->max_requests);
     request->handle = INDEX_TO_HANDLE(s, i);
 }
 
@@ -187,7 +327,7 @@ static void nbd_coroutine_end(NbdClientSession *s,
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
+    if (s->in_flight-- == s->max_requests) {
         qemu_co_mutex_unlock(&s->free_sema);
     }
 }
@@ -208,7 +348,7 @@ static int nbd_co_readv_1(NbdClientSession *client, int64_t sector_num,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(client, &request, &reply, qiov, offset, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -236,7 +376,7 @@ static int nbd_co_writev_1(NbdClientSession *client, int64_t sector_num,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -304,7 +444,7 @@ int nbd_client_session_co_flush(NbdClientSession *client)
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -328,13 +468,61 @@ int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+    int64_t sector_num, int nb_sectors, int *pnum)
+{
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE
+    };
+    struct nbd_reply reply;
+    NbdExtent extent = { 0, 0 };
+    int64_t data = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+                   (sector_num * BDRV_SECTOR_SIZE);
+    ssize_t ret;
+
+    if (!client->ext.block_status) {
+        *pnum = nb_sectors;
+        return data;
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    if (*pnum == 0) {
+        /* No (or a sub-sector) extent, treat the first sector as data */
+        *pnum = 1;
+        return data;
+    }
+
+    if (extent.flags & NBD_STATE_ZERO) {
+        return (extent.flags & NBD_STATE_HOLE) ?
+               BDRV_BLOCK_ZERO : BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO;
+    }
+    /* Holes that do not read as zeroes still have to be read */
+    return data;
+}
+
 void nbd_client_session_close(NbdClientSession *client)
 {
     struct nbd_request request = {
@@ -357,7 +545,7 @@ void nbd_client_session_close(NbdClientSession *client)
 }
 
 int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
-    int sock, const char *export)
+    int sock, const char *export, int queue_depth)
 {
     int ret;
 
@@ -366,13 +554,15 @@ int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
     qemu_set_block(sock);
     ret = nbd_receive_negotiate(sock, export,
                                 &client->nbdflags, &client->size,
-                                &client->blocksize);
+                                &client->blocksize, &client->ext);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
         return ret;
     }
 
+    assert(queue_depth > 0 && queue_depth <= NBD_MAX_QUEUE_DEPTH);
+    client->max_requests = queue_depth;
     qemu_co_mutex_init(&client->send_mutex);
     qemu_co_mutex_init(&client->free_sema);
     client->bs = bs;
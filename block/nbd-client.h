@@ -14,8 +14,6 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
-
 typedef struct NbdClientSession {
     int sock;
     uint32_t nbdflags;
@@ -26,9 +24,11 @@ typedef struct NbdClientSession {
     CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    int max_requests;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine *recv_coroutine[NBD_MAX_QUEUE_DEPTH];
     struct nbd_reply reply;
+    NBDExtensions ext;
 
     bool is_unix;
 
@@ -36,7 +36,8 @@ typedef struct NbdClientSession {
 } NbdClientSession;
 
 int nbd_client_session_init(NbdClientSession *client, BlockDriverState *bs,
-                            int sock, const char *export_name);
+                            int sock, const char *export_name,
+                            int queue_depth);
 void nbd_client_session_close(NbdClientSession *client);
 
 int nbd_client_session_co_discard(NbdClientSession *client, int64_t sector_num,
@@ -46,5 +47,8 @@ int nbd_client_session_co_writev(NbdClientSession *client, int64_t sector_num,
                                  int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_session_co_readv(NbdClientSession *client, int64_t sector_num,
                                 int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_session_co_get_block_status(NbdClientSession *client,
+                                               int64_t sector_num,
+                                               int nb_sectors, int *pnum);
 
 #endif /* NBD_CLIENT_H */
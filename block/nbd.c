@@ -39,11 +39,35 @@
 
 #define EN_OPTSTR ":exportname="
 
+#define NBD_MAX_CONNECTIONS 16
+
 typedef struct BDRVNBDState {
-    NbdClientSession client;
+    /* Requests are spread over several connections if the server allows
+     * it; client[0] always exists.
+     */
+    NbdClientSession client[NBD_MAX_CONNECTIONS];
+    int nb_clients;
     QemuOpts *socket_opts;
 } BDRVNBDState;
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight per connection",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -202,7 +226,7 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
         return;
     }
 
-    s->client.is_unix = qdict_haskey(options, "path");
+    s->client[0].is_unix = qdict_haskey(options, "path");
     s->socket_opts = qemu_opts_create(&socket_optslist, NULL, 0,
                                       &error_abort);
 
@@ -227,7 +251,7 @@ static int nbd_establish_connection(BlockDriverState *bs, Error **errp)
     BDRVNBDState *s = bs->opaque;
     int sock;
 
-    if (s->client.is_unix) {
+    if (s->client[0].is_unix) {
         sock = unix_connect_opts(s->socket_opts, errp, NULL, NULL);
     } else {
         sock = inet_connect_opts(s->socket_opts, errp, NULL, NULL);
@@ -249,10 +273,35 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     BDRVNBDState *s = bs->opaque;
+    QemuOpts *opts;
     char *export = NULL;
-    int result, sock;
+    int64_t queue_depth, connections;
+    int result, sock, i;
     Error *local_err = NULL;
 
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    queue_depth = qemu_opt_get_number(opts, "queue-depth",
+                                      NBD_DEFAULT_QUEUE_DEPTH);
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    qemu_opts_del(opts);
+
+    if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   NBD_MAX_QUEUE_DEPTH);
+        return -EINVAL;
+    }
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        return -EINVAL;
+    }
+
     /* Pop the config into our state object. Exit if invalid. */
     nbd_config(s, options, &export, &local_err);
     if (local_err) {
@@ -265,21 +314,84 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
      */
     sock = nbd_establish_connection(bs, errp);
     if (sock < 0) {
-        return sock;
+        result = sock;
+        goto out;
     }
 
     /* NBD handshake */
-    result = nbd_client_session_init(&s->client, bs, sock, export);
+    result = nbd_client_session_init(&s->client[0], bs, sock, export,
+                                     queue_depth);
+    if (result < 0) {
+        goto out;
+    }
+    s->nb_clients = 1;
+
+    /* Additional connections are only safe if a flush on one of them also
+     * covers the writes completed on the others.
+     */
+    if (!(s->client[0].nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        connections = 1;
+    }
+    for (i = 1; i < connections; i++) {
+        NbdClientSession *client = &s->client[i];
+
+        client->is_unix = s->client[0].is_unix;
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            result = sock;
+            goto fail;
+        }
+        result = nbd_client_session_init(client, bs, sock, export,
+                                         queue_depth);
+        if (result < 0) {
+            error_setg_errno(errp, -result, "Could not open connection %d", i);
+            goto fail;
+        }
+        s->nb_clients++;
+        if (client->size != s->client[0].size ||
+            client->nbdflags != s->client[0].nbdflags) {
+            error_setg(errp, "Server changed the export between connections");
+            result = -EINVAL;
+            goto fail;
+        }
+    }
+    result = 0;
+    goto out;
+
+fail:
+    for (i = 0; i < s->nb_clients; i++) {
+        nbd_client_session_close(&s->client[i]);
+    }
+    s->nb_clients = 0;
+out:
+    if (result < 0) {
+        qemu_opts_del(s->socket_opts);
+        s->socket_opts = NULL;
+    }
     g_free(export);
     return result;
 }
 
+/* Returns the connection with the fewest requests in flight */
+static NbdClientSession *nbd_pick_client(BDRVNBDState *s)
+{
+    NbdClientSession *client = &s->client[0];
+    int i;
+
+    for (i = 1; i < s->nb_clients; i++) {
+        if (s->client[i].in_flight < client->in_flight) {
+            client = &s->client[i];
+        }
+    }
+    return client;
+}
+
 static int nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_readv(&s->client, sector_num,
+    return nbd_client_session_co_readv(nbd_pick_client(s), sector_num,
                                        nb_sectors, qiov);
 }
 
@@ -288,7 +400,7 @@ static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_writev(&s->client, sector_num,
+    return nbd_client_session_co_writev(nbd_pick_client(s), sector_num,
                                         nb_sectors, qiov);
 }
 
@@ -296,7 +408,10 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_flush(&s->client);
+    /* With multiple connections, the server guarantees that any of them
+     * can be used to flush the writes completed on all of them.
+     */
+    return nbd_client_session_co_flush(nbd_pick_client(s));
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -304,23 +419,37 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
 
-    return nbd_client_session_co_discard(&s->client, sector_num,
+    return nbd_client_session_co_discard(nbd_pick_client(s), sector_num,
                                          nb_sectors);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    return nbd_client_session_co_get_block_status(nbd_pick_client(s), sector_num,
+                                                  nb_sectors, pnum);
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
+    int i;
+
     qemu_opts_del(s->socket_opts);
-    nbd_client_session_close(&s->client);
+    for (i = 0; i < s->nb_clients; i++) {
+        nbd_client_session_close(&s->client[i]);
+    }
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.size;
+    return s->client[0].size;
 }
 
 static BlockDriver bdrv_nbd = {
@@ -334,6 +463,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -348,6 +478,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -362,6 +493,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_get_block_status = nbd_co_get_block_status,
     .bdrv_getlength      = nbd_getlength,
 };
 
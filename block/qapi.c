@@ -54,7 +54,7 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs)
 
     if (bs->io_limits_enabled) {
         ThrottleConfig cfg;
-        throttle_get_config(&bs->throttle_state, &cfg);
+        throttle_group_get_config(bs, &cfg);
         info->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
         info->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
         info->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -79,6 +79,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs)
 
         info->has_iops_size = cfg.op_size;
         info->iops_size = cfg.op_size;
+
+        info->has_group = true;
+        info->group = g_strdup(throttle_group_get_name(bs));
     }
 
     return info;
@@ -293,9 +296,54 @@ void bdrv_query_info(BlockDriverState *bs,
     qapi_free_BlockInfo(info);
 }
 
+static uint64List *uint64_list(const uint64_t *values, unsigned int count)
+{
+    uint64List *head = NULL, **p_next = &head;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        uint64List *entry = g_malloc0(sizeof(*entry));
+        entry->value = values[i];
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockLatencyStats *bdrv_query_latency(const BlockAcctLatency *latency,
+                                             int64_t now)
+{
+    BlockLatencyStats *info = g_malloc0(sizeof(*info));
+    BlockAcctLatencyWindow win;
+
+    block_latency_get_window(latency, now, &win);
+    info->interval_length = win.interval_ns;
+    info->operations = win.nr_ops;
+    info->min_ns = win.min_ns;
+    info->max_ns = win.max_ns;
+    info->avg_ns = win.avg_ns;
+    info->p50_ns = win.p50_ns;
+    info->p99_ns = win.p99_ns;
+    info->p999_ns = win.p999_ns;
+
+    if (latency->hist_bins) {
+        info->has_histogram = true;
+        info->histogram = g_malloc0(sizeof(*info->histogram));
+        info->histogram->boundaries = uint64_list(latency->boundaries,
+                                                  latency->nb_boundaries);
+        info->histogram->bins = uint64_list(latency->hist_bins,
+                                            latency->nb_boundaries + 1);
+    }
+
+    return info;
+}
+
 BlockStats *bdrv_query_stats(const BlockDriverState *bs)
 {
     BlockStats *s;
+    BdrvChainMapStats cms;
+    int64_t now = get_clock();
 
     s = g_malloc0(sizeof(*s));
 
@@ -309,11 +357,42 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_bytes = bs->nr_bytes[BDRV_ACCT_WRITE];
     s->stats->rd_operations = bs->nr_ops[BDRV_ACCT_READ];
     s->stats->wr_operations = bs->nr_ops[BDRV_ACCT_WRITE];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
     s->stats->wr_highest_offset = bs->wr_highest_sector * BDRV_SECTOR_SIZE;
     s->stats->flush_operations = bs->nr_ops[BDRV_ACCT_FLUSH];
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_latency = bdrv_query_latency(&bs->latency[BDRV_ACCT_READ],
+                                              now);
+    s->stats->wr_latency = bdrv_query_latency(&bs->latency[BDRV_ACCT_WRITE],
+                                              now);
+    s->stats->flush_latency =
+        bdrv_query_latency(&bs->latency[BDRV_ACCT_FLUSH], now);
+
+    if (bs->io_limits_enabled) {
+        ThrottleGroupStats tgs;
+
+        throttle_group_get_stats(bs, &tgs);
+        s->has_throttle_group = true;
+        s->throttle_group = g_malloc0(sizeof(*s->throttle_group));
+        s->throttle_group->name = g_strdup(throttle_group_get_name(bs));
+        s->throttle_group->rd_bytes = tgs.nr_bytes[false];
+        s->throttle_group->wr_bytes = tgs.nr_bytes[true];
+        s->throttle_group->rd_operations = tgs.nr_ops[false];
+        s->throttle_group->wr_operations = tgs.nr_ops[true];
+        s->throttle_group->rd_throttled = tgs.nr_throttled[false];
+        s->throttle_group->wr_throttled = tgs.nr_throttled[true];
+    }
+
+    if (bdrv_chain_map_get_stats(bs, &cms)) {
+        s->has_chain_map = true;
+        s->chain_map = g_malloc0(sizeof(*s->chain_map));
+        s->chain_map->hits = cms.hits;
+        s->chain_map->misses = cms.misses;
+        s->chain_map->extents = cms.nb_extents;
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -0,0 +1,430 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/hbitmap.h"
+
+/* Bitmaps are only written on close, so the on-disk copy is only trusted
+ * while the dirty bitmaps autoclear bit is set.  Opening the image read/write
+ * moves the bitmaps into memory and clears the bit, so that a crash or an
+ * older QEMU writing to the image invalidates them. */
+
+#define QCOW2_MIN_BITMAP_GRANULARITY_BITS   BDRV_SECTOR_BITS
+#define QCOW2_MAX_BITMAP_GRANULARITY_BITS   26
+#define QCOW2_MAX_BITMAP_NAME_SIZE          1023
+
+void qcow2_free_bitmap_table(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        g_free(s->bitmaps[i].name);
+    }
+    g_free(s->bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+/* Parse the dirty bitmaps header extension at @offset */
+int qcow2_read_bitmap_table(BlockDriverState *bs, uint64_t offset,
+                            uint32_t len, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    uint8_t *buf;
+    uint32_t pos;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    qcow2_free_bitmap_table(bs);
+
+    buf = g_malloc(len);
+    ret = bdrv_pread(bs->file, offset, buf, len);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read dirty bitmap table");
+        goto fail;
+    }
+
+    pos = 0;
+    while (len - pos >= sizeof(h)) {
+        memcpy(&h, buf + pos, sizeof(h));
+        pos += sizeof(h);
+
+        be16_to_cpus(&h.name_size);
+        if (h.name_size > len - pos) {
+            error_setg(errp, "Dirty bitmap table entry truncated");
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        s->bitmaps = g_realloc(s->bitmaps,
+                               (s->nb_bitmaps + 1) * sizeof(Qcow2Bitmap));
+        bm = &s->bitmaps[s->nb_bitmaps++];
+        bm->offset = be64_to_cpu(h.bitmap_offset);
+        bm->size = be64_to_cpu(h.bitmap_size);
+        bm->granularity_bits = be32_to_cpu(h.granularity_bits);
+        bm->name = g_strndup((char *) buf + pos, h.name_size);
+
+        pos = MIN(len, pos + align_offset(sizeof(h) + h.name_size, 8)
+                       - sizeof(h));
+
+        if (offset_into_cluster(s, bm->offset)) {
+            error_setg(errp, "Dirty bitmap '%s' is not cluster aligned",
+                       bm->name);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    g_free(buf);
+    return 0;
+
+fail:
+    g_free(buf);
+    qcow2_free_bitmap_table(bs);
+    return ret;
+}
+
+size_t qcow2_bitmap_table_size(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        size += align_offset(sizeof(Qcow2BitmapHeader) +
+                             strlen(s->bitmaps[i].name), 8);
+    }
+    return size;
+}
+
+/* Serialize the bitmap table into @buf, which must be zeroed and at least
+ * qcow2_bitmap_table_size() bytes large */
+void qcow2_write_bitmap_table(BlockDriverState *bs, uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    Qcow2Bitmap *bm;
+    size_t name_size;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        bm = &s->bitmaps[i];
+        name_size = strlen(bm->name);
+
+        memset(&h, 0, sizeof(h));
+        h.bitmap_offset = cpu_to_be64(bm->offset);
+        h.bitmap_size = cpu_to_be64(bm->size);
+        h.granularity_bits = cpu_to_be32(bm->granularity_bits);
+        h.name_size = cpu_to_be16(name_size);
+
+        memcpy(buf, &h, sizeof(h));
+        memcpy(buf + sizeof(h), bm->name, name_size);
+        buf += align_offset(sizeof(h) + name_size, 8);
+    }
+}
+
+static uint64_t bitmap_granules(BlockDriverState *bs, int granularity_bits)
+{
+    uint64_t len = bs->total_sectors * BDRV_SECTOR_SIZE;
+    return DIV_ROUND_UP(len, 1ULL << granularity_bits);
+}
+
+static int load_bitmap(BlockDriverState *bs, Qcow2Bitmap *qbm, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    uint64_t nb_granules, i;
+    int64_t granule_sectors;
+    uint8_t *buf;
+    int ret;
+
+    if (qbm->granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+        qbm->granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS) {
+        error_setg(errp, "Dirty bitmap '%s' has unsupported granularity 2^%d",
+                   qbm->name, qbm->granularity_bits);
+        return -EINVAL;
+    }
+
+    nb_granules = bitmap_granules(bs, qbm->granularity_bits);
+    if (qbm->size != DIV_ROUND_UP(nb_granules, 8)) {
+        error_setg(errp, "Dirty bitmap '%s' does not match the image size",
+                   qbm->name);
+        return -EINVAL;
+    }
+
+    if (bdrv_find_dirty_bitmap(bs, qbm->name)) {
+        /* Still in memory, e.g. after qcow2_invalidate_cache() */
+        return 0;
+    }
+
+    buf = g_malloc(qbm->size);
+    ret = bdrv_pread(bs->file, qbm->offset, buf, qbm->size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read dirty bitmap '%s'",
+                         qbm->name);
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1 << qbm->granularity_bits,
+                                      qbm->name, errp);
+    if (!bitmap) {
+        ret = -EINVAL;
+        goto out;
+    }
+    bdrv_dirty_bitmap_set_persistent(bitmap, true);
+
+    granule_sectors = 1 << (qbm->granularity_bits - BDRV_SECTOR_BITS);
+    for (i = 0; i < nb_granules; i++) {
+        if (buf[i / 8] & (1 << (i % 8))) {
+            bdrv_set_dirty_bitmap(bitmap, i * granule_sectors,
+                                  granule_sectors);
+        }
+    }
+    ret = 0;
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+/* Drop the on-disk copy of all bitmaps, freeing their clusters */
+static int discard_stored_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps = s->bitmaps;
+    unsigned int nb_bitmaps = s->nb_bitmaps;
+    int i, ret;
+
+    if (!nb_bitmaps &&
+        !(s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS)) {
+        return 0;
+    }
+
+    /* Unlink the bitmaps from the header before their clusters can be
+     * reused */
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        /* Leak the clusters rather than risk a dangling reference */
+        goto out;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        qcow2_free_clusters(bs, bitmaps[i].offset, bitmaps[i].size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+out:
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+    return ret;
+}
+
+/* Called at the end of qcow2_open() */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    bool writable = !bs->read_only && !(s->flags & BDRV_O_INCOMING);
+    int i, ret;
+
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DIRTY_BITMAPS) {
+        for (i = 0; i < s->nb_bitmaps; i++) {
+            ret = load_bitmap(bs, &s->bitmaps[i], errp);
+            if (ret < 0) {
+                bdrv_release_named_dirty_bitmaps(bs);
+                return ret;
+            }
+        }
+    }
+
+    /* Writes from now on are only recorded in memory, so the copy in the
+     * image becomes stale (or already was, if the autoclear bit was clear) */
+    if (writable) {
+        ret = discard_stored_bitmaps(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update qcow2 header");
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Called when an image becomes writable again, or stays writable after a
+ * failed reopen: like on open, the bitmaps are only kept in memory from now
+ * on, and the copy in the image must not be trusted any more */
+int qcow2_reopen_bitmaps_rw(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->flags & BDRV_O_INCOMING) {
+        return 0;
+    }
+
+    return discard_stored_bitmaps(bs);
+}
+
+bool qcow2_can_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* Needs the autoclear feature bits of version 3 images */
+    return s->qcow_version >= 3;
+}
+
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *qbm)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t nb_granules, granule;
+    HBitmapIter hbi;
+    int64_t sector, offset;
+    uint8_t *buf;
+    int ret;
+
+    qbm->granularity_bits = ctz64(bdrv_dirty_bitmap_granularity(bitmap));
+    nb_granules = bitmap_granules(bs, qbm->granularity_bits);
+    qbm->size = DIV_ROUND_UP(nb_granules, 8);
+
+    buf = g_malloc0(align_offset(qbm->size, s->cluster_size));
+    bdrv_dirty_iter_init(bs, bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+        granule = (sector << BDRV_SECTOR_BITS) >> qbm->granularity_bits;
+        buf[granule / 8] |= 1 << (granule % 8);
+    }
+
+    offset = qcow2_alloc_clusters(bs, qbm->size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    qbm->offset = offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, qbm->offset, qbm->size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, qbm->offset, buf,
+                      align_offset(qbm->size, s->cluster_size));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    qcow2_free_clusters(bs, qbm->offset, qbm->size, QCOW2_DISCARD_OTHER);
+out:
+    g_free(buf);
+    return ret;
+}
+
+/* Write all persistent bitmaps to the image and set the autoclear bit */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2Bitmap *qbm;
+    int ret;
+
+    if (s->flags & BDRV_O_INCOMING) {
+        return 0;
+    }
+
+    if (!qcow2_can_store_dirty_bitmaps(bs)) {
+        while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+            if (bdrv_dirty_bitmap_persistent(bitmap)) {
+                return -ENOTSUP;
+            }
+        }
+        return 0;
+    }
+
+    /* Bitmaps loaded while the image was read-only are still on disk */
+    ret = discard_stored_bitmaps(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!name || !bdrv_dirty_bitmap_persistent(bitmap)) {
+            continue;
+        }
+        if (strlen(name) > QCOW2_MAX_BITMAP_NAME_SIZE) {
+            ret = -ENAMETOOLONG;
+            goto fail;
+        }
+
+        s->bitmaps = g_realloc(s->bitmaps,
+                               (s->nb_bitmaps + 1) * sizeof(Qcow2Bitmap));
+        qbm = &s->bitmaps[s->nb_bitmaps];
+        qbm->name = g_strdup(name);
+
+        ret = store_bitmap(bs, bitmap, qbm);
+        if (ret < 0) {
+            g_free(qbm->name);
+            goto fail;
+        }
+        s->nb_bitmaps++;
+    }
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    /* The bitmap data and its refcounts must be stable before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DIRTY_BITMAPS;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    discard_stored_bitmaps(bs);
+    return ret;
+}
@@ -1015,6 +1015,50 @@ fail:
 
 
 
+/*
+ * Reference counts computed by the image check, one 16 bit entry per cluster
+ * of the image file like in the refcount blocks.  Images with many internal
+ * snapshots share most of their clusters, so a sparse table of clusters with
+ * more than one reference wouldn't save memory where it matters.
+ */
+typedef struct CheckRefcounts {
+    uint16_t *refcounts;
+    int64_t nb_clusters;
+} CheckRefcounts;
+
+static void check_refcounts_init(CheckRefcounts *rc, int64_t nb_clusters)
+{
+    rc->refcounts = g_malloc0(nb_clusters * sizeof(uint16_t));
+    rc->nb_clusters = nb_clusters;
+}
+
+static void check_refcounts_free(CheckRefcounts *rc)
+{
+    g_free(rc->refcounts);
+}
+
+static void check_refcounts_grow(CheckRefcounts *rc, int64_t nb_clusters)
+{
+    if (nb_clusters > rc->nb_clusters) {
+        rc->refcounts = g_realloc(rc->refcounts,
+                                  nb_clusters * sizeof(uint16_t));
+        memset(&rc->refcounts[rc->nb_clusters], 0,
+               (nb_clusters - rc->nb_clusters) * sizeof(uint16_t));
+        rc->nb_clusters = nb_clusters;
+    }
+}
+
+static uint16_t check_get_refcount(CheckRefcounts *rc, int64_t k)
+{
+    return rc->refcounts[k];
+}
+
+static void check_set_refcount(CheckRefcounts *rc, int64_t k,
+                               uint16_t refcount)
+{
+    rc->refcounts[k] = refcount;
+}
+
 /*
  * Increases the refcount for a range of clusters in a given refcount table.
  * This is used to construct a temporary refcount table out of L1 and L2 tables
@@ -1024,12 +1068,12 @@ fail:
  */
 static void inc_refcounts(BlockDriverState *bs,
                           BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+                          CheckRefcounts *refcounts,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t start, last, cluster_offset, k;
+    uint16_t refcount;
 
     if (size <= 0)
         return;
@@ -1039,13 +1083,15 @@ static void inc_refcounts(BlockDriverState *bs,
     for(cluster_offset = start; cluster_offset <= last;
         cluster_offset += s->cluster_size) {
         k = cluster_offset >> s->cluster_bits;
-        if (k >= refcount_table_size) {
+        if (k >= refcounts->nb_clusters) {
             fprintf(stderr, "Warning: cluster offset=0x%" PRIx64 " is after "
                 "the end of the image file, can't properly check refcounts.\n",
                 cluster_offset);
             res->check_errors++;
         } else {
-            if (++refcount_table[k] == 0) {
+            refcount = check_get_refcount(refcounts, k) + 1;
+            check_set_refcount(refcounts, k, refcount);
+            if (refcount == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
                 res->corruptions++;
@@ -1054,6 +1100,112 @@ static void inc_refcounts(BlockDriverState *bs,
     }
 }
 
+/*
+ * Reads the L2 tables of an L1 table ahead of their processing, with up to
+ * QCOW2_CHECK_L2_READAHEAD requests in flight.  This keeps the host storage
+ * busy while the check walks the tables, which are still processed in L1
+ * order so that the output stays deterministic.
+ */
+#define QCOW2_CHECK_L2_READAHEAD 16
+
+typedef struct L2ReadRequest {
+    BlockDriverState *bs;
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    int ret;
+    bool done;
+} L2ReadRequest;
+
+typedef struct L2Reader {
+    const uint64_t *l2_offsets;
+    int nb_tables;
+    int next;               /* next table to submit a read for */
+    L2ReadRequest reqs[QCOW2_CHECK_L2_READAHEAD];
+} L2Reader;
+
+static void coroutine_fn l2_read_entry(void *opaque)
+{
+    L2ReadRequest *req = opaque;
+    BDRVQcowState *s = req->bs->opaque;
+    int ret;
+
+    ret = bdrv_pread(req->bs->file, req->l2_offset, req->l2_table,
+                     s->l2_size * sizeof(uint64_t));
+    req->ret = ret < 0 ? ret : 0;
+    req->done = true;
+}
+
+/* @l2_offsets must stay valid until l2_reader_destroy() */
+static void l2_reader_init(BlockDriverState *bs, L2Reader *r,
+                           const uint64_t *l2_offsets, int nb_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    r->l2_offsets = l2_offsets;
+    r->nb_tables = nb_tables;
+    r->next = 0;
+    for (i = 0; i < QCOW2_CHECK_L2_READAHEAD; i++) {
+        r->reqs[i] = (L2ReadRequest) {
+            .bs         = bs,
+            .l2_table   = qemu_blockalign(bs, s->cluster_size),
+            .done       = true,
+        };
+    }
+}
+
+static void l2_reader_destroy(L2Reader *r)
+{
+    int i;
+
+    /* Tables that were read ahead but not used must complete before their
+     * buffers can be freed */
+    for (i = 0; i < QCOW2_CHECK_L2_READAHEAD; i++) {
+        while (!r->reqs[i].done) {
+            aio_poll(bdrv_get_aio_context(r->reqs[i].bs), true);
+        }
+        qemu_vfree(r->reqs[i].l2_table);
+    }
+}
+
+/*
+ * Returns the L2 table with the given index in @l2_table, or -errno if it
+ * could not be read.  The table is only valid until the next call.  Tables
+ * must be requested in increasing order, but may be skipped.
+ */
+static int l2_reader_get(L2Reader *r, int index, uint64_t **l2_table)
+{
+    L2ReadRequest *req;
+
+    while (r->next < r->nb_tables &&
+           r->next < index + QCOW2_CHECK_L2_READAHEAD) {
+        req = &r->reqs[r->next % QCOW2_CHECK_L2_READAHEAD];
+        /* A table may have been skipped by the caller, so its read can still
+         * be in flight */
+        while (!req->done) {
+            aio_poll(bdrv_get_aio_context(req->bs), true);
+        }
+        req->l2_offset = r->l2_offsets[r->next++];
+        req->done = false;
+
+        if (qemu_in_coroutine()) {
+            /* Can't wait for other coroutines here, so read synchronously */
+            l2_read_entry(req);
+        } else {
+            Coroutine *co = qemu_coroutine_create(l2_read_entry);
+            qemu_coroutine_enter(co, req);
+        }
+    }
+
+    req = &r->reqs[index % QCOW2_CHECK_L2_READAHEAD];
+    while (!req->done) {
+        aio_poll(bdrv_get_aio_context(req->bs), true);
+    }
+
+    *l2_table = req->l2_table;
+    return req->ret;
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1063,25 +1215,14 @@ enum {
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
  * entries.
- *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
  */
-static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int flags)
+static void check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
+    CheckRefcounts *refcounts, uint64_t *l2_table, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    int i, nb_csectors;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1102,7 +1243,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            inc_refcounts(bs, res, refcounts,
                 l2_entry & ~511, nb_csectors * 512);
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1138,8 +1279,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
-                offset, s->cluster_size);
+            inc_refcounts(bs, res, refcounts, offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
             if (offset_into_cluster(s, offset)) {
@@ -1157,14 +1297,6 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             abort();
         }
     }
-
-    g_free(l2_table);
-    return 0;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
-    return -EIO;
 }
 
 /*
@@ -1177,65 +1309,73 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+                              CheckRefcounts *refcounts,
                               int64_t l1_table_offset, int l1_size,
                               int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t *l1_table, *l2_table, l2_offset, l1_size2;
+    L2Reader reader;
+    int i, nb_tables, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
-        l1_table_offset, l1_size2);
+    inc_refcounts(bs, res, refcounts, l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
     if (l1_size2 == 0) {
-        l1_table = NULL;
-    } else {
-        l1_table = g_malloc(l1_size2);
-        if (bdrv_pread(bs->file, l1_table_offset,
-                       l1_table, l1_size2) != l1_size2)
-            goto fail;
-        for(i = 0;i < l1_size; i++)
-            be64_to_cpus(&l1_table[i]);
+        return 0;
     }
 
-    /* Do the actual checks */
+    l1_table = g_malloc(l1_size2);
+    if (bdrv_pread(bs->file, l1_table_offset,
+                   l1_table, l1_size2) != l1_size2) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
+        res->check_errors++;
+        g_free(l1_table);
+        return -EIO;
+    }
+
+    /* Compact the L1 table to the list of L2 tables to read */
+    nb_tables = 0;
     for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
+        l2_offset = be64_to_cpu(l1_table[i]);
         if (l2_offset) {
-            /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_offset, s->cluster_size);
+            l1_table[nb_tables++] = l2_offset & L1E_OFFSET_MASK;
+        }
+    }
 
-            /* L2 tables are cluster aligned */
-            if (offset_into_cluster(s, l2_offset)) {
-                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                    "cluster aligned; L1 entry corrupted\n", l2_offset);
-                res->corruptions++;
-            }
+    /* Do the actual checks */
+    l2_reader_init(bs, &reader, l1_table, nb_tables);
+    for(i = 0; i < nb_tables; i++) {
+        l2_offset = l1_table[i];
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
-                goto fail;
-            }
+        /* Mark L2 table as used */
+        inc_refcounts(bs, res, refcounts, l2_offset, s->cluster_size);
+
+        /* L2 tables are cluster aligned */
+        if (offset_into_cluster(s, l2_offset)) {
+            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            res->corruptions++;
         }
+
+        /* Process and check L2 entries */
+        ret = l2_reader_get(&reader, i, &l2_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
+            res->check_errors++;
+            l2_reader_destroy(&reader);
+            g_free(l1_table);
+            return -EIO;
+        }
+        check_refcounts_l2(bs, res, refcounts, l2_table, flags);
     }
+    l2_reader_destroy(&reader);
     g_free(l1_table);
     return 0;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
-    res->check_errors++;
-    g_free(l1_table);
-    return -EIO;
 }
 
 /*
@@ -1250,12 +1390,23 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                               BdrvCheckMode fix)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table = qemu_blockalign(bs, s->cluster_size);
+    uint64_t *l2_table;
+    uint64_t *l2_offsets = g_new(uint64_t, s->l1_size);
+    L2Reader reader;
     int ret;
     int refcount;
-    int i, j;
+    int i, j, nb_tables, l2_index;
 
+    nb_tables = 0;
     for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+        if (l2_offset) {
+            l2_offsets[nb_tables++] = l2_offset;
+        }
+    }
+    l2_reader_init(bs, &reader, l2_offsets, nb_tables);
+
+    for (i = 0, nb_tables = 0; i < s->l1_size; i++) {
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         bool l2_dirty = false;
@@ -1263,6 +1414,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         if (!l2_offset) {
             continue;
         }
+        l2_index = nb_tables++;
 
         refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
         if (refcount < 0) {
@@ -1290,8 +1442,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = l2_reader_get(&reader, l2_index, &l2_table);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1353,7 +1504,8 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    qemu_vfree(l2_table);
+    l2_reader_destroy(&reader);
+    g_free(l2_offsets);
     return ret;
 }
 
@@ -1485,7 +1637,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int64_t size, i, highest_cluster, nb_clusters;
     int refcount1, refcount2;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    CheckRefcounts refcounts;
     int ret;
 
     size = bdrv_getlength(bs->file);
@@ -1500,17 +1652,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return -EFBIG;
     }
 
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+    check_refcounts_init(&refcounts, nb_clusters);
 
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        0, s->cluster_size);
+    inc_refcounts(bs, res, &refcounts, 0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+    ret = check_refcounts_l1(bs, res, &refcounts,
                              s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
     if (ret < 0) {
         goto fail;
@@ -1519,17 +1670,23 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, &refcounts,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcounts,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        inc_refcounts(bs, res, &refcounts,
+            s->bitmaps[i].offset, s->bitmaps[i].size);
+    }
+
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcounts,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1554,14 +1711,14 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            inc_refcounts(bs, res, &refcounts,
                 offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            if (check_get_refcount(&refcounts, cluster) != 1) {
                 fprintf(stderr, "%s refcount block %" PRId64
                     " refcount=%d\n",
                     fix & BDRV_FIX_ERRORS ? "Repairing" :
                                             "ERROR",
-                    i, refcount_table[cluster]);
+                    i, check_get_refcount(&refcounts, cluster));
 
                 if (fix & BDRV_FIX_ERRORS) {
                     int64_t new_offset;
@@ -1575,15 +1732,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     /* update refcounts */
                     if ((new_offset >> s->cluster_bits) >= nb_clusters) {
                         /* increase refcount_table size if necessary */
-                        int old_nb_clusters = nb_clusters;
                         nb_clusters = (new_offset >> s->cluster_bits) + 1;
-                        refcount_table = g_realloc(refcount_table,
-                                nb_clusters * sizeof(uint16_t));
-                        memset(&refcount_table[old_nb_clusters], 0, (nb_clusters
-                                - old_nb_clusters) * sizeof(uint16_t));
+                        check_refcounts_grow(&refcounts, nb_clusters);
                     }
-                    refcount_table[cluster]--;
-                    inc_refcounts(bs, res, refcount_table, nb_clusters,
+                    check_set_refcount(&refcounts, cluster,
+                        check_get_refcount(&refcounts, cluster) - 1);
+                    inc_refcounts(bs, res, &refcounts,
                             new_offset, s->cluster_size);
 
                     res->corruptions_fixed++;
@@ -1604,7 +1758,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = refcount_table[i];
+        refcount2 = check_get_refcount(&refcounts, i);
 
         if (refcount1 > 0 || refcount2 > 0) {
             highest_cluster = i;
@@ -1655,7 +1809,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    check_refcounts_free(&refcounts);
 
     return ret;
 }
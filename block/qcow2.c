@@ -57,6 +57,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x64697274
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -155,6 +156,15 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            if (p_feature_table == NULL) {
+                ret = qcow2_read_bitmap_table(bs, offset, ext.len, errp);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -745,8 +755,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -827,6 +838,12 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    ret = qcow2_load_dirty_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -839,6 +856,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmap_table(bs);
     qcow2_refcount_close(bs);
     g_free(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -905,21 +923,34 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
-/* We have no actual commit/abort logic for qcow2, but we need to write out any
- * unwritten data if we reopen read-only. */
+/* Write out any unwritten data, including the persistent dirty bitmaps, if
+ * we reopen read-only.  Images that become writable drop the copy of the
+ * bitmaps on disk in commit, when bs->file has been reopened read/write. */
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BlockDriverState *bs = state->bs;
     int ret;
 
     if ((state->flags & BDRV_O_RDWR) == 0) {
-        ret = bdrv_flush(state->bs);
+        ret = bdrv_flush(bs);
         if (ret < 0) {
             return ret;
         }
 
-        ret = qcow2_mark_clean(state->bs);
+        if (!bs->read_only) {
+            ret = qcow2_store_dirty_bitmaps(bs);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not store dirty bitmaps");
+                return ret;
+            }
+        }
+
+        ret = qcow2_mark_clean(bs);
         if (ret < 0) {
+            if (!bs->read_only) {
+                qcow2_reopen_bitmaps_rw(bs);
+            }
             return ret;
         }
     }
@@ -927,6 +958,31 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
+static void qcow2_reopen_commit(BDRVReopenState *state)
+{
+    BlockDriverState *bs = state->bs;
+    int ret;
+
+    if (bs->read_only && (state->flags & BDRV_O_RDWR)) {
+        ret = qcow2_reopen_bitmaps_rw(bs);
+        if (ret < 0) {
+            error_report("Could not invalidate the dirty bitmaps stored in "
+                         "'%s': %s", bs->filename, strerror(-ret));
+        }
+    }
+}
+
+static void qcow2_reopen_abort(BDRVReopenState *state)
+{
+    BlockDriverState *bs = state->bs;
+
+    /* The image stays writable, so the bitmaps that prepare stored are stale
+     * as soon as the next write happens */
+    if (!bs->read_only && !(state->flags & BDRV_O_RDWR)) {
+        qcow2_reopen_bitmaps_rw(bs);
+    }
+}
+
 static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
@@ -1272,6 +1328,7 @@ static void qcow2_close(BlockDriverState *bs)
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmap_table(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
@@ -1463,6 +1520,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DIRTY_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1473,6 +1535,23 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmap table */
+    if (s->nb_bitmaps) {
+        size_t table_size = qcow2_bitmap_table_size(bs);
+        uint8_t *table = g_malloc0(table_size);
+
+        qcow2_write_bitmap_table(bs, table);
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             table, table_size, buflen);
+        g_free(table);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1866,7 +1945,20 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
 
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors, QCOW2_DISCARD_REQUEST);
+        nb_sectors, QCOW2_DISCARD_REQUEST, false);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static coroutine_fn int qcow2_co_unallocate(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    int ret;
+    BDRVQcowState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_discard_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+        nb_sectors, QCOW2_DISCARD_OTHER, true);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -2377,6 +2469,8 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
+    .bdrv_reopen_commit   = qcow2_reopen_commit,
+    .bdrv_reopen_abort    = qcow2_reopen_abort,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = qcow2_co_get_block_status,
@@ -2388,6 +2482,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
+    .bdrv_co_unallocate     = qcow2_co_unallocate,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
 
@@ -2407,6 +2502,9 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_can_store_dirty_bitmaps   = qcow2_can_store_dirty_bitmaps,
+    .bdrv_store_dirty_bitmaps       = qcow2_store_dirty_bitmaps,
+
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
     .bdrv_amend_options = qcow2_amend_options,
@@ -26,7 +26,7 @@ static void qed_aio_cancel(BlockDriverAIOCB *blockacb)
     /* Wait for the request to finish */
     acb->finished = &finished;
     while (!finished) {
-        qemu_aio_wait();
+        aio_poll(bdrv_get_aio_context(acb->common.bs), true);
     }
 }
 
@@ -285,6 +285,59 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 
 static void qed_aio_next_io(void *opaque, int ret);
 
+/**
+ * Check whether an allocating write must wait for others to finish
+ *
+ * Allocating writes to the same clusters must not run in parallel since both
+ * would allocate new clusters, and the same goes for writes to the range of
+ * an L2 table that is being allocated.
+ */
+static bool qed_allocating_write_must_wait(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    QEDAIOCB *other;
+    unsigned int l1_index = qed_l1_index(s, acb->alloc_start);
+
+    if (s->allocating_write_reqs_plugged || s->need_check_pending) {
+        return true;
+    }
+
+    QLIST_FOREACH(other, &s->allocating_writes, alloc_next) {
+        if (acb->alloc_start < other->alloc_end &&
+            other->alloc_start < acb->alloc_end) {
+            return true;
+        }
+        if ((acb->find_cluster_ret == QED_CLUSTER_L1 ||
+             other->find_cluster_ret == QED_CLUSTER_L1) &&
+            qed_l1_index(s, other->alloc_start) == l1_index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Restart queued allocating writes that no longer conflict
+ *
+ * Restarted requests look up their clusters again since they may have been
+ * allocated in the meantime.
+ */
+static void qed_restart_allocating_write_reqs(BDRVQEDState *s)
+{
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    QEDAIOCB *acb;
+
+    QSIMPLEQ_CONCAT(&reqs, &s->allocating_write_reqs);
+
+    while ((acb = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        if (qed_allocating_write_must_wait(s, acb)) {
+            QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+        } else {
+            qed_aio_next_io(acb, 0);
+        }
+    }
+}
+
 static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 {
     assert(!s->allocating_write_reqs_plugged);
@@ -294,16 +347,11 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
 
 static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
 {
-    QEDAIOCB *acb;
-
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
 
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_restart_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -340,6 +388,7 @@ static void qed_need_check_timer_cb(void *opaque)
 
     /* The timer should only fire when allocating writes have drained */
     assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QLIST_EMPTY(&s->allocating_writes));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -367,22 +416,73 @@ static void qed_cancel_need_check_timer(BDRVQEDState *s)
     timer_del(s->need_check_timer);
 }
 
+static void bdrv_qed_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVQEDState *s = bs->opaque;
+
+    qed_cancel_need_check_timer(s);
+    timer_free(s->need_check_timer);
+}
+
+static void bdrv_qed_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVQEDState *s = bs->opaque;
+
+    s->need_check_timer = aio_timer_new(new_context,
+                                        QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        qed_need_check_timer_cb, s);
+    if (s->header.features & QED_F_NEED_CHECK) {
+        qed_start_need_check_timer(s);
+    }
+}
+
 static void bdrv_qed_rebind(BlockDriverState *bs)
 {
     BDRVQEDState *s = bs->opaque;
     s->bs = bs;
 }
 
+static QemuOptsList qed_runtime_opts = {
+    .name = "qed",
+    .head = QTAILQ_HEAD_INITIALIZER(qed_runtime_opts.head),
+    .desc = {
+        {
+            .name = QED_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
     BDRVQEDState *s = bs->opaque;
     QEDHeader le_header;
     int64_t file_size;
+    uint64_t l2_cache_size;
+    uint64_t l2_cache_entries;
+    QemuOpts *opts;
+    Error *local_err = NULL;
     int ret;
 
     s->bs = bs;
     QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->allocating_writes);
+    QSIMPLEQ_INIT(&s->l1_update_inflight);
+    QSIMPLEQ_INIT(&s->l1_update_reqs);
+
+    opts = qemu_opts_create(&qed_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    l2_cache_size = qemu_opt_get_size(opts, QED_OPT_L2_CACHE_SIZE, 0);
+    qemu_opts_del(opts);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -471,7 +571,14 @@ static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+
+    l2_cache_entries = QED_DEFAULT_L2_CACHE_ENTRIES;
+    if (l2_cache_size) {
+        l2_cache_entries = l2_cache_size /
+            ((uint64_t)s->header.cluster_size * s->header.table_size);
+        l2_cache_entries = MIN(l2_cache_entries, s->table_nelems);
+    }
+    qed_init_l2_cache(&s->l2_cache, l2_cache_entries);
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -496,8 +603,9 @@ static int bdrv_qed_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
-    s->need_check_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                            qed_need_check_timer_cb, s);
+    s->need_check_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                        QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        qed_need_check_timer_cb, s);
 
 out:
     if (ret) {
@@ -901,6 +1009,30 @@ static void qed_aio_complete_bh(void *opaque)
     }
 }
 
+/**
+ * Finish the allocation of the current clusters of a request
+ *
+ * This lets queued allocating writes proceed, and arms the need check timer
+ * once all of them are done.
+ */
+static void qed_finish_allocating_write(BDRVQEDState *s, QEDAIOCB *acb)
+{
+    if (!acb->allocating) {
+        return;
+    }
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->allocating = false;
+
+    qed_restart_allocating_write_reqs(s);
+
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
 static void qed_aio_complete(QEDAIOCB *acb, int ret)
 {
     BDRVQEDState *s = acb_to_s(acb);
@@ -919,24 +1051,11 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
 
     /* Arrange for a bh to invoke the completion function */
     acb->bh_ret = ret;
-    acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
-     */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
+    qed_finish_allocating_write(s, acb);
 }
 
 /**
@@ -960,8 +1079,54 @@ static void qed_commit_l2_update(void *opaque, int ret)
     qed_aio_next_io(opaque, ret);
 }
 
+static void qed_write_l1_update_reqs(BDRVQEDState *s);
+
+static void qed_write_l1_update_reqs_cb(void *opaque, int ret)
+{
+    BDRVQEDState *s = opaque;
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    QEDAIOCB *acb;
+
+    QSIMPLEQ_CONCAT(&reqs, &s->l1_update_inflight);
+    if (!QSIMPLEQ_EMPTY(&s->l1_update_reqs)) {
+        qed_write_l1_update_reqs(s);
+    }
+
+    while ((acb = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, table_next);
+        qed_commit_l2_update(acb, ret);
+    }
+}
+
+/**
+ * Write out the L1 entries of all queued requests at once
+ */
+static void qed_write_l1_update_reqs(BDRVQEDState *s)
+{
+    unsigned int first = UINT_MAX, last = 0;
+    QEDAIOCB *acb;
+
+    assert(QSIMPLEQ_EMPTY(&s->l1_update_inflight));
+    QSIMPLEQ_CONCAT(&s->l1_update_inflight, &s->l1_update_reqs);
+
+    QSIMPLEQ_FOREACH(acb, &s->l1_update_inflight, table_next) {
+        unsigned int index = qed_l1_index(s, acb->cur_pos);
+
+        first = MIN(first, index);
+        last = MAX(last, index);
+    }
+
+    trace_qed_write_l1_update_reqs(s, first, last - first + 1);
+    qed_write_l1_table(s, first, last - first + 1,
+                       qed_write_l1_update_reqs_cb, s);
+}
+
 /**
  * Update L1 table with new L2 table offset and write it out
+ *
+ * Writes of the L1 table are serialized since concurrent writes could cover
+ * the same sector and complete out of order.  Updates made while a write is
+ * in flight are written out together when it completes.
  */
 static void qed_aio_write_l1_update(void *opaque, int ret)
 {
@@ -977,7 +1142,54 @@ static void qed_aio_write_l1_update(void *opaque, int ret)
     index = qed_l1_index(s, acb->cur_pos);
     s->l1_table->offsets[index] = acb->request.l2_table->offset;
 
-    qed_write_l1_table(s, index, 1, qed_commit_l2_update, acb);
+    QSIMPLEQ_INSERT_TAIL(&s->l1_update_reqs, acb, table_next);
+    if (QSIMPLEQ_EMPTY(&s->l1_update_inflight)) {
+        qed_write_l1_update_reqs(s);
+    }
+}
+
+static void qed_write_l2_update_reqs(BDRVQEDState *s, CachedL2Table *l2_table);
+
+static void qed_write_l2_update_reqs_cb(void *opaque, int ret)
+{
+    CachedL2Table *l2_table = opaque;
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
+    QEDAIOCB *acb;
+
+    QSIMPLEQ_CONCAT(&reqs, &l2_table->write_inflight);
+    if (!QSIMPLEQ_EMPTY(&l2_table->write_reqs)) {
+        /* The requests in the list hold references to the table */
+        qed_write_l2_update_reqs(acb_to_s(QSIMPLEQ_FIRST(&reqs)), l2_table);
+    }
+
+    while ((acb = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, table_next);
+        qed_aio_next_io(acb, ret);
+    }
+}
+
+/**
+ * Write out the L2 entries of all requests queued on an L2 table at once
+ */
+static void qed_write_l2_update_reqs(BDRVQEDState *s, CachedL2Table *l2_table)
+{
+    unsigned int first = UINT_MAX, end = 0;
+    QEDAIOCB *acb;
+
+    assert(QSIMPLEQ_EMPTY(&l2_table->write_inflight));
+    QSIMPLEQ_CONCAT(&l2_table->write_inflight, &l2_table->write_reqs);
+
+    QSIMPLEQ_FOREACH(acb, &l2_table->write_inflight, table_next) {
+        unsigned int index = qed_l2_index(s, acb->cur_pos);
+
+        first = MIN(first, index);
+        end = MAX(end, index + acb->cur_nclusters);
+    }
+
+    acb = QSIMPLEQ_FIRST(&l2_table->write_inflight);
+    trace_qed_write_l2_update_reqs(s, l2_table, first, end - first);
+    qed_write_l2_table(s, &acb->request, first, end - first, false,
+                       qed_write_l2_update_reqs_cb, l2_table);
 }
 
 /**
@@ -1007,9 +1219,15 @@ static void qed_aio_write_l2_update(QEDAIOCB *acb, int ret, uint64_t offset)
         qed_write_l2_table(s, &acb->request, 0, s->table_nelems, true,
                             qed_aio_write_l1_update, acb);
     } else {
-        /* Write out only the updated part of the L2 table */
-        qed_write_l2_table(s, &acb->request, index, acb->cur_nclusters, false,
-                            qed_aio_next_io, acb);
+        /* Write out only the updated part of the L2 table.  Like for the L1
+         * table, updates made while a write is in flight are batched.
+         */
+        CachedL2Table *l2_table = acb->request.l2_table;
+
+        QSIMPLEQ_INSERT_TAIL(&l2_table->write_reqs, acb, table_next);
+        if (QSIMPLEQ_EMPTY(&l2_table->write_inflight)) {
+            qed_write_l2_update_reqs(s, l2_table);
+        }
     }
     return;
 
@@ -1140,6 +1358,23 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+static void qed_aio_write_need_check_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+    BDRVQEDState *s = acb_to_s(acb);
+
+    s->need_check_pending = false;
+    qed_restart_allocating_write_reqs(s);
+
+    if (acb->flags & QED_AIOCB_ZERO) {
+        qed_aio_write_zero_cluster(acb, ret);
+    } else if (ret) {
+        qed_aio_complete(acb, ret);
+    } else {
+        qed_aio_write_prefill(acb, 0);
+    }
+}
+
 /**
  * Write new data cluster
  *
@@ -1154,18 +1389,22 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     BlockDriverCompletionFunc *cb;
 
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (QLIST_EMPTY(&s->allocating_writes) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
+    /* Freeze this request if it conflicts with allocating writes in progress */
+    acb->alloc_start = qed_start_of_cluster(s, acb->cur_pos);
+    acb->alloc_end = qed_start_of_cluster(s, acb->cur_pos + len +
+                                          s->header.cluster_size - 1);
+    if (qed_allocating_write_must_wait(s, acb)) {
+        trace_qed_aio_write_alloc_wait(s, acb, acb->cur_pos);
         QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+        return; /* wait for existing requests to finish */
     }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
-        return; /* wait for existing request to finish */
-    }
+    acb->allocating = true;
+    QLIST_INSERT_HEAD(&s->allocating_writes, acb, alloc_next);
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
             qed_offset_into_cluster(s, acb->cur_pos) + len);
@@ -1185,8 +1424,10 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     }
 
     if (qed_should_set_need_check(s)) {
+        /* Other allocating writes wait until the flag is on disk */
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, cb, acb);
+        s->need_check_pending = true;
+        qed_write_header(s, qed_aio_write_need_check_cb, acb);
     } else {
         cb(acb, 0);
     }
@@ -1326,6 +1567,8 @@ static void qed_aio_next_io(void *opaque, int ret)
         return;
     }
 
+    qed_finish_allocating_write(s, acb);
+
     acb->qiov_offset += acb->cur_qiov.size;
     acb->cur_pos += acb->cur_qiov.size;
     qemu_iovec_reset(&acb->cur_qiov);
@@ -1360,6 +1603,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->allocating = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1564,6 +1808,7 @@ static void bdrv_qed_invalidate_cache(BlockDriverState *bs, Error **errp)
 {
     BDRVQEDState *s = bs->opaque;
     Error *local_err = NULL;
+    QDict *options;
     int ret;
 
     bdrv_qed_close(bs);
@@ -1575,7 +1820,9 @@ static void bdrv_qed_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     memset(s, 0, sizeof(BDRVQEDState));
-    ret = bdrv_qed_open(bs, NULL, bs->open_flags, &local_err);
+    options = qdict_clone_shallow(bs->options);
+    ret = bdrv_qed_open(bs, options, bs->open_flags, &local_err);
+    QDECREF(options);
     if (local_err) {
         error_setg(errp, "Could not reopen qed layer: %s",
                    error_get_pretty(local_err));
@@ -1630,6 +1877,8 @@ static BlockDriver bdrv_qed = {
     .bdrv_rebind              = bdrv_qed_rebind,
     .bdrv_open                = bdrv_qed_open,
     .bdrv_close               = bdrv_qed_close,
+    .bdrv_detach_aio_context  = bdrv_qed_detach_aio_context,
+    .bdrv_attach_aio_context  = bdrv_qed_attach_aio_context,
     .bdrv_reopen_prepare      = bdrv_qed_reopen_prepare,
     .bdrv_create              = bdrv_qed_create,
     .bdrv_has_zero_init       = bdrv_has_zero_init_1,
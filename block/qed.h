@@ -81,8 +81,13 @@ enum {
 
     /* Delay to flush and clean image after last allocating write completes */
     QED_NEED_CHECK_TIMEOUT = 5,    /* in seconds */
+
+    /* Each L2 holds 2GB by default so this lets us fully cache a 100GB disk */
+    QED_DEFAULT_L2_CACHE_ENTRIES = 50,
 };
 
+#define QED_OPT_L2_CACHE_SIZE "l2-cache-size"
+
 typedef struct {
     uint32_t magic;                 /* QED\0 */
 
@@ -112,11 +117,18 @@ typedef struct CachedL2Table {
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
     int ref;
+
+    /* Requests whose L2 updates are being written out, and requests waiting
+     * for that write to finish so that their updates go out together
+     */
+    QSIMPLEQ_HEAD(, QEDAIOCB) write_inflight;
+    QSIMPLEQ_HEAD(, QEDAIOCB) write_reqs;
 } CachedL2Table;
 
 typedef struct {
     QTAILQ_HEAD(, CachedL2Table) entries;
     unsigned int n_entries;
+    unsigned int max_entries;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -148,6 +160,13 @@ typedef struct QEDAIOCB {
     unsigned int cur_nclusters;     /* number of clusters being accessed */
     int find_cluster_ret;           /* used for L1/L2 update */
 
+    /* Allocating writes */
+    bool allocating;                /* in BDRVQEDState.allocating_writes? */
+    QLIST_ENTRY(QEDAIOCB) alloc_next;
+    uint64_t alloc_start;           /* clusters being allocated, in bytes */
+    uint64_t alloc_end;
+    QSIMPLEQ_ENTRY(QEDAIOCB) table_next; /* batched L1/L2 table update */
+
     QEDRequest request;
 } QEDAIOCB;
 
@@ -163,9 +182,18 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
+    /* Allocating write request queue and requests currently allocating.
+     * Allocating writes run in parallel as long as they touch different
+     * clusters and do not allocate an L2 table that another one uses.
+     */
     QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    QLIST_HEAD(, QEDAIOCB) allocating_writes;
     bool allocating_write_reqs_plugged;
+    bool need_check_pending;        /* QED_F_NEED_CHECK header write */
+
+    /* Batched L1 table updates, see qed_aio_write_l1_update() */
+    QSIMPLEQ_HEAD(, QEDAIOCB) l1_update_inflight;
+    QSIMPLEQ_HEAD(, QEDAIOCB) l1_update_reqs;
 
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
@@ -218,7 +246,7 @@ int qed_write_header_sync(BDRVQEDState *s);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
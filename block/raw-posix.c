@@ -31,6 +31,8 @@
 #include "qemu/iov.h"
 #include "raw-aio.h"
 
+#include <sys/mman.h>
+
 #if defined(__APPLE__) && (__MACH__)
 #include <paths.h>
 #include <sys/param.h>
@@ -149,6 +151,14 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_FIEMAP
     bool skip_fiemap;
 #endif
+
+    /* With the mmap option, requests within the first mmap_size bytes of
+     * the file are served by copying from/to a shared mapping */
+    bool use_mmap;
+    bool use_mmap_write;
+    void *mmap_base;
+    uint64_t mmap_size;
+    bool mmap_writable;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -359,10 +369,81 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "mmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "Serve reads by copying from a shared mapping of the "
+                    "file (regular files only)",
+        },
+        {
+            .name = "mmap-write",
+            .type = QEMU_OPT_BOOL,
+            .help = "Serve writes through the mapping as well; the whole "
+                    "file is allocated when it is mapped",
+        },
         { /* end of list */ }
     },
 };
 
+/*
+ * A write through the mapping into a hole that cannot be allocated raises
+ * SIGBUS instead of failing with ENOSPC, so writable mappings only cover
+ * allocated blocks.
+ */
+static int raw_mmap_allocate(BDRVRawState *s, int64_t size)
+{
+#ifdef CONFIG_FALLOCATE
+    do {
+        if (fallocate(s->fd, 0, 0, size) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+    return -errno;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/*
+ * (Re-)map the first @size bytes of the file.  Without a mapping, requests
+ * simply go through the thread pool, so failing to map is not an error.
+ * If the file cannot be allocated for a writable mapping, it is mapped
+ * read-only and the error is returned.
+ */
+static int raw_mmap_update(BlockDriverState *bs, int64_t size)
+{
+    BDRVRawState *s = bs->opaque;
+    bool writable;
+    void *base;
+    int ret = 0;
+
+    if (s->mmap_base) {
+        munmap(s->mmap_base, s->mmap_size);
+        s->mmap_base = NULL;
+        s->mmap_size = 0;
+    }
+    if (!s->use_mmap || size <= 0 || (size_t)size != size) {
+        return 0;
+    }
+
+    writable = s->use_mmap_write && (s->open_flags & O_ACCMODE) == O_RDWR;
+    if (writable) {
+        ret = raw_mmap_allocate(s, size);
+        writable = (ret == 0);
+    }
+    base = mmap(NULL, size, PROT_READ | (writable ? PROT_WRITE : 0),
+                MAP_SHARED, s->fd, 0);
+    if (base == MAP_FAILED) {
+        return ret;
+    }
+
+    trace_raw_mmap_map(bs, size, writable);
+    s->mmap_base = base;
+    s->mmap_size = size;
+    s->mmap_writable = writable;
+    return ret;
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags, Error **errp)
 {
@@ -382,6 +463,18 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 
     filename = qemu_opt_get(opts, "filename");
+    s->use_mmap = qemu_opt_get_bool(opts, "mmap", false);
+    s->use_mmap_write = qemu_opt_get_bool(opts, "mmap-write", false);
+    if (s->use_mmap_write && !s->use_mmap) {
+        error_setg(errp, "mmap-write requires mmap");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->use_mmap && (bdrv_flags & BDRV_O_NOCACHE)) {
+        error_setg(errp, "mmap cannot be used with cache.direct=on");
+        ret = -EINVAL;
+        goto fail;
+    }
 
     ret = raw_normalize_devicepath(&filename);
     if (ret != 0) {
@@ -412,7 +505,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
-    s->has_discard = true;
+    /* Discarding would punch holes into the writable mapping */
+    s->has_discard = !s->use_mmap_write;
     s->has_write_zeroes = true;
 
     if (fstat(s->fd, &st) < 0) {
@@ -422,6 +516,24 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     if (S_ISREG(st.st_mode)) {
         s->discard_zeroes = true;
     }
+    if (s->use_mmap) {
+        if (!S_ISREG(st.st_mode)) {
+            error_setg(errp, "mmap is only supported for regular files");
+            qemu_close(fd);
+            s->fd = -1;
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = raw_mmap_update(bs, st.st_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not allocate the file for "
+                             "mmap-write");
+            raw_mmap_update(bs, 0);
+            qemu_close(fd);
+            s->fd = -1;
+            goto fail;
+        }
+    }
     if (S_ISBLK(st.st_mode)) {
 #ifdef BLKDISCARDZEROES
         unsigned int arg;
@@ -565,6 +677,11 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->use_aio = raw_s->use_aio;
 #endif
 
+    if (s->use_mmap) {
+        /* The mapping may have to become read-only or writable */
+        raw_mmap_update(state->bs, raw_getlength(state->bs));
+    }
+
     g_free(state->opaque);
     state->opaque = NULL;
 }
@@ -590,10 +707,22 @@ static void raw_reopen_abort(BDRVReopenState *state)
 static int raw_refresh_limits(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#if defined(__linux__) && defined(BLKSECTGET)
+    struct stat st;
+    unsigned short max_sectors = 0;
+#endif
 
     raw_probe_alignment(bs);
     bs->bl.opt_mem_alignment = s->buf_align;
 
+#if defined(__linux__) && defined(BLKSECTGET)
+    /* Larger requests are split by the kernel anyway */
+    if (fstat(s->fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+        ioctl(s->fd, BLKSECTGET, &max_sectors) == 0) {
+        bs->bl.max_transfer_length = max_sectors;
+    }
+#endif
+
     return 0;
 }
 
@@ -1045,6 +1174,79 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+typedef struct RawCoCompletion {
+    Coroutine *co;
+    int ret;
+} RawCoCompletion;
+
+static void raw_co_complete(void *opaque, int ret)
+{
+    RawCoCompletion *rc = opaque;
+
+    rc->ret = ret;
+    qemu_coroutine_enter(rc->co, NULL);
+}
+
+static int coroutine_fn raw_co_rw(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, QEMUIOVector *qiov,
+                                  int type)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    uint64_t bytes = (uint64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    RawCoCompletion rc = {
+        .co = qemu_coroutine_self(),
+        .ret = -EINPROGRESS,
+    };
+
+    /* Data that is already in the page cache is simply copied; anything
+     * outside the mapping (e.g. after the file was grown by someone else)
+     * takes the usual path */
+    if (s->mmap_base && offset + bytes <= s->mmap_size &&
+        (type == QEMU_AIO_READ || s->mmap_writable)) {
+        if (type == QEMU_AIO_READ) {
+            qemu_iovec_from_buf(qiov, 0, s->mmap_base + offset, bytes);
+        } else {
+            qemu_iovec_to_buf(qiov, 0, s->mmap_base + offset, bytes);
+        }
+        return 0;
+    }
+
+    if (!raw_aio_submit(bs, sector_num, qiov, nb_sectors,
+                        raw_co_complete, &rc, type)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return rc.ret;
+}
+
+static int coroutine_fn raw_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
+{
+    return raw_co_rw(bs, sector_num, nb_sectors, qiov, QEMU_AIO_READ);
+}
+
+static int coroutine_fn raw_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    return raw_co_rw(bs, sector_num, nb_sectors, qiov, QEMU_AIO_WRITE);
+}
+
+/*
+ * Hand the writes made through the mapping over to the file, so that the
+ * fdatasync() of the flush covers them.  This runs in the coroutine, where
+ * the mapping cannot change under our feet, and does not wait for I/O.
+ */
+static int coroutine_fn raw_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->mmap_writable && msync(s->mmap_base, s->mmap_size, MS_ASYNC)) {
+        return -errno;
+    }
+    return 0;
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -1056,9 +1258,35 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+    s->use_mmap = false;
+    raw_mmap_update(bs, 0);
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1078,6 +1306,9 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
         if (ftruncate(s->fd, offset) < 0) {
             return -errno;
         }
+        if (s->use_mmap) {
+            raw_mmap_update(bs, offset);
+        }
     } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
        if (offset > raw_getlength(bs)) {
            return -EINVAL;
@@ -1462,13 +1693,18 @@ static BlockDriver bdrv_file = {
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
     .bdrv_create = raw_create,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
 
+    .bdrv_co_readv = raw_co_readv,
+    .bdrv_co_writev = raw_co_writev,
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_co_flush_to_os = raw_co_flush_to_os,
     .bdrv_aio_discard = raw_aio_discard,
     .bdrv_refresh_limits = raw_refresh_limits,
 
@@ -1863,6 +2099,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
     .bdrv_create        = hdev_create,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
     .create_options     = raw_create_options,
     .bdrv_co_write_zeroes = hdev_co_write_zeroes,
 
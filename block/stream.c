@@ -26,14 +26,60 @@ enum {
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
+#define DEFAULT_MAX_IN_FLIGHT 4
 
-typedef struct StreamBlockJob {
+/* Prefetching after a guest copy-on-read miss starts with one buffer and
+ * doubles while the guest keeps reading where the last prefetch ended.
+ */
+#define PREFETCH_MIN_SECTORS (STREAM_BUFFER_SIZE >> BDRV_SECTOR_BITS)
+#define PREFETCH_MAX_SECTORS (16 * PREFETCH_MIN_SECTORS)
+#define MAX_PREFETCH_HINTS   16
+
+typedef struct StreamBlockJob StreamBlockJob;
+
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    QLIST_ENTRY(StreamOp) next;
+} StreamOp;
+
+/* A range that the guest is likely to read soon */
+typedef struct StreamHint {
+    int64_t sector_num;
+    int64_t end;
+} StreamHint;
+
+struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char backing_file_id[1024];
-} StreamBlockJob;
+
+    /* Copy operations in flight */
+    QLIST_HEAD(, StreamOp) ops;
+    int in_flight;
+    int max_in_flight;
+    bool waiting;           /* stream_run() waits for an operation */
+    int ret;                /* first error of a completed operation */
+    int64_t error_sector;
+
+    /* Adaptive prefetch, fed by copy-on-read misses of guest requests */
+    Notifier cor_notifier;
+    StreamHint hints[MAX_PREFETCH_HINTS];
+    int nb_hints;
+    StreamHint last_hint;
+    int prefetch_sectors;
+
+    /* Bandwidth share of guest I/O */
+    int guest_share;
+    int64_t slice_start;
+    uint64_t slice_guest_bytes;     /* guest bytes before the slice */
+    uint64_t guest_rate;            /* guest bytes per slice */
+    uint64_t stream_bytes;          /* bytes streamed in the slice */
+};
 
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
@@ -51,6 +97,207 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+/* Checks [sector_num, sector_num + *n) against the copy operations in
+ * flight.  Returns true if @sector_num is being copied already, with *n set
+ * to the number of sectors that this operation still covers.  Otherwise *n
+ * is reduced so that the range ends where the next operation starts.
+ */
+static bool stream_in_flight(StreamBlockJob *s, int64_t sector_num, int *n)
+{
+    StreamOp *op;
+
+    QLIST_FOREACH(op, &s->ops, next) {
+        int64_t op_end = op->sector_num + op->nb_sectors;
+
+        if (sector_num >= op->sector_num && sector_num < op_end) {
+            *n = op_end - sector_num;
+            return true;
+        }
+        if (op->sector_num > sector_num && op->sector_num < sector_num + *n) {
+            *n = op->sector_num - sector_num;
+        }
+    }
+    return false;
+}
+
+/* Publishes the progress of the sequential pass up to @sector_num.  Copies
+ * that are still in flight below @sector_num hold it back, so that progress
+ * only covers data that has actually been copied.
+ */
+static void stream_update_progress(StreamBlockJob *s, int64_t sector_num)
+{
+    StreamOp *op;
+
+    QLIST_FOREACH(op, &s->ops, next) {
+        sector_num = MIN(sector_num, op->sector_num);
+    }
+    s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+}
+
+static void coroutine_fn stream_populate_co(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    int ret;
+
+    ret = stream_populate(s->common.bs, op->sector_num, op->nb_sectors,
+                          op->buf);
+    trace_stream_populate_done(s, op->sector_num, op->nb_sectors, ret);
+    if (ret < 0 && (s->ret == 0 || op->sector_num < s->error_sector)) {
+        s->ret = ret;
+        s->error_sector = op->sector_num;
+    }
+
+    QLIST_REMOVE(op, next);
+    qemu_vfree(op->buf);
+    g_free(op);
+    s->in_flight--;
+
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_issue(StreamBlockJob *s, int64_t sector_num,
+                         int nb_sectors)
+{
+    StreamOp *op = g_new0(StreamOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->buf = qemu_blockalign(s->common.bs, nb_sectors * BDRV_SECTOR_SIZE);
+    QLIST_INSERT_HEAD(&s->ops, op, next);
+    s->in_flight++;
+
+    qemu_coroutine_enter(qemu_coroutine_create(stream_populate_co), op);
+}
+
+/* Waits until a copy operation completes */
+static void coroutine_fn stream_wait(StreamBlockJob *s)
+{
+    assert(s->in_flight > 0);
+    s->waiting = true;
+    qemu_coroutine_yield();
+    assert(!s->waiting);
+}
+
+static void stream_cor_notify(Notifier *notifier, void *opaque)
+{
+    StreamBlockJob *s = container_of(notifier, StreamBlockJob, cor_notifier);
+    BdrvCopyOnReadMiss *miss = opaque;
+    int64_t end = miss->sector_num + miss->nb_sectors;
+    StreamHint hint;
+    StreamOp *op;
+
+    /* Our own copy operations go through copy-on-read as well */
+    QLIST_FOREACH(op, &s->ops, next) {
+        if (op->sector_num == miss->sector_num &&
+            op->nb_sectors == miss->nb_sectors) {
+            return;
+        }
+    }
+
+    if (miss->sector_num >= s->last_hint.sector_num &&
+        miss->sector_num <= s->last_hint.end) {
+        /* The guest keeps reading into the prefetched range, read further */
+        s->prefetch_sectors = MIN(s->prefetch_sectors * 2,
+                                  PREFETCH_MAX_SECTORS);
+        hint.sector_num = MAX(end, s->last_hint.end);
+    } else {
+        s->prefetch_sectors = PREFETCH_MIN_SECTORS;
+        hint.sector_num = end;
+    }
+    hint.end = hint.sector_num + s->prefetch_sectors;
+    s->last_hint = hint;
+
+    trace_stream_prefetch_hint(s, miss->sector_num, miss->nb_sectors,
+                               hint.sector_num, hint.end);
+
+    if (s->nb_hints == MAX_PREFETCH_HINTS) {
+        /* Forget the oldest hint */
+        memmove(&s->hints[0], &s->hints[1],
+                (MAX_PREFETCH_HINTS - 1) * sizeof(s->hints[0]));
+        s->nb_hints--;
+    }
+    s->hints[s->nb_hints++] = hint;
+}
+
+/* Looks for an unallocated chunk in the most recent prefetch hint.  Chunks
+ * that are already allocated or behind @cursor are dropped from the hint,
+ * the returned chunk is only dropped by stream_prefetch_done().
+ */
+static bool coroutine_fn stream_next_prefetch(StreamBlockJob *s,
+                                              int64_t cursor, int64_t end,
+                                              int64_t *sector_num, int *n)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    while (s->nb_hints > 0) {
+        StreamHint *hint = &s->hints[s->nb_hints - 1];
+        int ret;
+
+        hint->sector_num = MAX(hint->sector_num, cursor);
+        hint->end = MIN(hint->end, end);
+        if (hint->sector_num >= hint->end) {
+            s->nb_hints--;
+            continue;
+        }
+
+        ret = bdrv_is_allocated(bs, hint->sector_num,
+                                MIN(hint->end - hint->sector_num,
+                                    STREAM_BUFFER_SIZE >> BDRV_SECTOR_BITS),
+                                n);
+        if (ret < 0 || *n == 0) {
+            s->nb_hints--;
+            continue;
+        }
+        if (ret == 0 && !stream_in_flight(s, hint->sector_num, n)) {
+            *sector_num = hint->sector_num;
+            return true;
+        }
+        /* Allocated, or being copied already */
+        hint->sector_num += *n;
+    }
+    return false;
+}
+
+static void stream_prefetch_done(StreamBlockJob *s, int n)
+{
+    s->hints[s->nb_hints - 1].sector_num += n;
+}
+
+/* Returns how long to wait before copying @n sectors so that guest I/O gets
+ * its share of the bandwidth.  Guest I/O is measured with the accounting
+ * statistics of @bs, which do not include our own requests.
+ */
+static uint64_t stream_guest_share_delay(StreamBlockJob *s, int n)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t guest_bytes = bs->nr_bytes[BDRV_ACCT_READ] +
+                           bs->nr_bytes[BDRV_ACCT_WRITE];
+    uint64_t allowed;
+
+    if (now - s->slice_start >= SLICE_TIME) {
+        s->guest_rate = (guest_bytes - s->slice_guest_bytes) * SLICE_TIME /
+                        (now - s->slice_start);
+        s->slice_guest_bytes = guest_bytes;
+        s->slice_start = now;
+        s->stream_bytes = 0;
+    }
+
+    if (s->guest_share && s->guest_rate) {
+        allowed = s->guest_rate * (100 - s->guest_share) / s->guest_share;
+        if (s->stream_bytes >= allowed) {
+            return s->slice_start + SLICE_TIME - now;
+        }
+    }
+    s->stream_bytes += n * BDRV_SECTOR_SIZE;
+    return 0;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -85,10 +332,9 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
+    uint64_t delay_ns = 0;
     int error = 0;
     int ret = 0;
-    int n = 0;
-    void *buf;
 
     if (!bs->backing_hd) {
         block_job_completed(&s->common, 0);
@@ -102,65 +348,51 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
      * backing chain since the copy-on-read operation does not take base into
-     * account.
+     * account.  The misses of guest requests tell us where to prefetch.
      */
     if (!base) {
         bdrv_enable_copy_on_read(bs);
+        s->cor_notifier.notify = stream_cor_notify;
+        bdrv_add_copy_on_read_notifier(bs, &s->cor_notifier);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        uint64_t delay_ns = 0;
+    sector_num = 0;
+    for (;;) {
+        int64_t copy_sector;
+        bool sequential;
         bool copy;
+        int n;
 
-wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
+        delay_ns = 0;
+        stream_update_progress(s, sector_num);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
-        copy = false;
-
-        ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_is_allocated_above(bs->backing_hd, base,
-                                          sector_num, n, &n);
+        if (s->ret < 0) {
+            BlockErrorAction action;
 
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
+            /* Let the other operations finish before acting on the error */
+            while (s->in_flight > 0) {
+                stream_wait(s);
             }
+            ret = s->ret;
+            s->ret = 0;
 
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
+            action = block_job_error_action(&s->common, s->common.bs,
+                                            s->on_error, true, -ret);
             if (action == BDRV_ACTION_STOP) {
-                n = 0;
+                /* Retry from the failed request on resume */
+                sector_num = MIN(sector_num, s->error_sector);
+                stream_update_progress(s, sector_num);
                 continue;
             }
             if (error == 0) {
@@ -170,20 +402,98 @@ wait:
                 break;
             }
         }
-        ret = 0;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        if (s->in_flight >= s->max_in_flight ||
+            (sector_num >= end && s->in_flight > 0)) {
+            stream_wait(s);
+            continue;
+        }
+        if (sector_num >= end) {
+            break;
+        }
+
+        /* Regions that the guest is reading come first */
+        sequential = !stream_next_prefetch(s, sector_num, end,
+                                           &copy_sector, &n);
+        if (sequential) {
+            copy_sector = sector_num;
+            copy = false;
+
+            n = STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE;
+            if (stream_in_flight(s, sector_num, &n)) {
+                /* Being copied by a prefetch, its completion is our progress */
+                ret = 1;
+            } else {
+                ret = bdrv_is_allocated(bs, sector_num, n, &n);
+            }
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+            } else if (ret >= 0) {
+                /* Copy if allocated in the intermediate images.  Limit to the
+                 * known-unallocated area [sector_num, sector_num+n).  */
+                ret = bdrv_is_allocated_above(bs->backing_hd, base,
+                                              sector_num, n, &n);
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
+                if (ret == 1) {
+                    /* Do not overlap a prefetch that starts in the range */
+                    stream_in_flight(s, sector_num, &n);
+                }
+
+                copy = (ret == 1);
+            }
+            trace_stream_one_iteration(s, sector_num, n, ret);
+            if (ret < 0) {
+                s->ret = ret;
+                s->error_sector = sector_num;
+                continue;
+            }
+        } else {
+            copy = true;
+        }
+
+        if (copy) {
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
+            if (delay_ns == 0) {
+                delay_ns = stream_guest_share_delay(s, n);
+            }
+            if (delay_ns > 0) {
+                continue;
+            }
+            stream_issue(s, copy_sector, n);
+        }
+
+        if (sequential) {
+            sector_num += n;
+            stream_update_progress(s, sector_num);
+        } else {
+            stream_prefetch_done(s, n);
+        }
+    }
+
+    /* Wait for the remaining operations, e.g. after cancellation */
+    while (s->in_flight > 0) {
+        stream_wait(s);
+    }
+    stream_update_progress(s, sector_num);
+    if (s->ret < 0 && error == 0) {
+        error = s->ret;
     }
 
     if (!base) {
+        notifier_remove(&s->cor_notifier);
         bdrv_disable_copy_on_read(bs);
     }
 
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+    if (!block_job_is_cancelled(&s->common) && sector_num >= end && ret == 0) {
         const char *base_id = NULL, *base_fmt = NULL;
         if (base) {
             base_id = s->backing_file_id;
@@ -195,7 +505,6 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
     block_job_completed(&s->common, ret);
 }
 
@@ -217,8 +526,8 @@ static const BlockJobDriver stream_job_driver = {
 };
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed,
-                  BlockdevOnError on_error,
+                  const char *base_id, int64_t speed, int max_in_flight,
+                  int guest_share, BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -242,6 +551,13 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     s->on_error = on_error;
+    s->max_in_flight = max_in_flight ? max_in_flight : DEFAULT_MAX_IN_FLIGHT;
+    s->guest_share = guest_share;
+    s->prefetch_sectors = PREFETCH_MIN_SECTORS;
+    s->slice_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->slice_guest_bytes = bs->nr_bytes[BDRV_ACCT_READ] +
+                           bs->nr_bytes[BDRV_ACCT_WRITE];
+    QLIST_INIT(&s->ops);
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
@@ -0,0 +1,349 @@
+/*
+ * QEMU block throttling group infrastructure
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block/throttle-groups.h"
+#include "block/block_int.h"
+#include "qemu/queue.h"
+
+/* Every throttled BlockDriverState is a member of exactly one group.  The
+ * members share one set of leaky buckets and one pair of timers.  When the
+ * budget is exhausted, requests queue up in the throttled_reqs of their
+ * own BlockDriverState and the members are served in round-robin order so
+ * that one busy drive cannot starve the others.
+ */
+struct ThrottleGroup {
+    char *name;                 /* constant during the lifetime */
+    ThrottleState ts;           /* shared budget and timers */
+    unsigned refcount;
+
+    /* Members of the group, and for reads and writes the one that was
+     * served last (the "token" in round-robin terms) */
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+
+    ThrottleGroupStats stats;
+
+    QTAILQ_ENTRY(ThrottleGroup) list;
+};
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write);
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+/* Increments the reference count of a ThrottleGroup given its name.
+ *
+ * If no ThrottleGroup is found with the given name a new one is created.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup
+ */
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            tg->refcount++;
+            return tg;
+        }
+    }
+
+    tg = g_new0(ThrottleGroup, 1);
+    tg->name = g_strdup(name);
+    tg->refcount = 1;
+    QLIST_INIT(&tg->head);
+    throttle_init(&tg->ts, QEMU_CLOCK_VIRTUAL,
+                  throttle_group_read_timer_cb,
+                  throttle_group_write_timer_cb,
+                  tg);
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+
+    return tg;
+}
+
+/* Decrements the reference count of a ThrottleGroup and destroys it when
+ * it reaches zero.
+ *
+ * @tg: the ThrottleGroup
+ */
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        throttle_destroy(&tg->ts);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+/* Get the name from a BlockDriverState's ThrottleGroup.  The name (and the
+ * pointer) is guaranteed to remain constant during the lifetime of the
+ * group.
+ *
+ * @bs:   a BlockDriverState that is member of a throttling group
+ * @ret:  the name of the group.
+ */
+const char *throttle_group_get_name(const BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+/* Return the next BlockDriverState in the round-robin sequence, wrapping
+ * around to the first member of the group.
+ *
+ * @bs:  the current BlockDriverState
+ * @ret: the next BlockDriverState in the sequence
+ */
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    if (!next) {
+        return QLIST_FIRST(&tg->head);
+    }
+
+    return next;
+}
+
+/* Return the first member after @bs in round-robin order that has throttled
+ * requests of the given type.  @bs itself is checked last.
+ *
+ * @bs:       the member that was served last
+ * @is_write: the type of operation (read/write)
+ * @ret:      the member whose request must go next, or NULL if there is none
+ */
+static BlockDriverState *throttle_group_next_token(BlockDriverState *bs,
+                                                   bool is_write)
+{
+    BlockDriverState *token = bs;
+
+    do {
+        token = throttle_group_next_bs(token);
+        if (!qemu_co_queue_empty(&token->throttled_reqs[is_write])) {
+            return token;
+        }
+    } while (token != bs);
+
+    return NULL;
+}
+
+/* Check if the next I/O request of a group must wait, and arm the group
+ * timer if needed.  A request also waits if the timer is already pending,
+ * because then some member is due to be served first.
+ *
+ * @bs:       the current BlockDriverState
+ * @is_write: the type of operation (read/write)
+ * @ret:      whether the I/O request needs to be throttled or not
+ */
+static bool throttle_group_schedule_timer(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    if (timer_pending(tg->ts.timers[is_write])) {
+        return true;
+    }
+
+    return throttle_schedule_timer(&tg->ts, is_write);
+}
+
+/* Look for the next throttled request of the group and either let it run
+ * right away or make sure the timer will serve it.  Must be called in
+ * coroutine context right after @bs was served.
+ *
+ * @bs:       the BlockDriverState whose request just went through
+ * @is_write: the type of operation (read/write)
+ */
+static void coroutine_fn schedule_next_request(BlockDriverState *bs,
+                                               bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *token;
+
+    tg->tokens[is_write] = bs;
+
+    token = throttle_group_next_token(bs, is_write);
+    if (!token) {
+        return;
+    }
+
+    /* if the next request must wait, the timer has been armed for it */
+    if (throttle_group_schedule_timer(bs, is_write)) {
+        return;
+    }
+
+    /* else queue it for execution once we yield */
+    qemu_co_queue_next(&token->throttled_reqs[is_write]);
+    tg->tokens[is_write] = token;
+}
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *token;
+
+    if (!tg->tokens[is_write]) {
+        return;
+    }
+
+    token = throttle_group_next_token(tg->tokens[is_write], is_write);
+    if (token) {
+        tg->tokens[is_write] = token;
+        qemu_co_enter_next(&token->throttled_reqs[is_write]);
+    }
+}
+
+/* Check if an I/O request needs to be throttled, wait and set a timer
+ * if necessary, and schedule the next request using a round robin
+ * algorithm.
+ *
+ * @bs:       the current BlockDriverState
+ * @bytes:    the number of bytes for this I/O
+ * @is_write: the type of operation (read/write)
+ */
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    bool must_wait;
+
+    /* does this io must wait */
+    must_wait = throttle_group_schedule_timer(bs, is_write);
+
+    /* if must wait or any request of this type throttled queue the IO */
+    if (must_wait ||
+        !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
+        tg->stats.nr_throttled[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+    }
+
+    /* the IO will be executed, do the accounting */
+    throttle_account(&tg->ts, is_write, bytes);
+    tg->stats.nr_bytes[is_write] += bytes;
+    tg->stats.nr_ops[is_write]++;
+
+    schedule_next_request(bs, is_write);
+}
+
+/* Update the throttle configuration for a particular group.  All members
+ * of the group are affected.
+ *
+ * @bs:  a BlockDriverState that is member of the group
+ * @cfg: the configuration to set
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    BlockDriverState *member;
+    int i;
+
+    throttle_config(&tg->ts, cfg);
+
+    /* The timers have been cancelled, so restart the queues */
+    QLIST_FOREACH(member, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            qemu_co_enter_next(&member->throttled_reqs[i]);
+        }
+    }
+}
+
+/* Get the throttle configuration from a particular group.
+ *
+ * @bs:  a BlockDriverState that is member of the group
+ * @cfg: the configuration will be written here
+ */
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
+
+/* Get the accounting data of a particular group.  The counters cover all
+ * requests of all members since the group was created.
+ *
+ * @bs:    a BlockDriverState that is member of the group
+ * @stats: the statistics will be written here
+ */
+void throttle_group_get_stats(const BlockDriverState *bs,
+                              ThrottleGroupStats *stats)
+{
+    *stats = bs->throttle_group->stats;
+}
+
+/* Register a BlockDriverState in the throttling group, creating the group
+ * if necessary.
+ *
+ * @bs:        the BlockDriverState to insert
+ * @groupname: the name of the group
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg = throttle_group_incref(groupname);
+    int i;
+
+    assert(bs->throttle_group == NULL);
+    bs->throttle_group = tg;
+
+    for (i = 0; i < 2; i++) {
+        if (!tg->tokens[i]) {
+            tg->tokens[i] = bs;
+        }
+    }
+
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+}
+
+/* Unregister a BlockDriverState from its group, removing it from the list
+ * and destroying the group if it's the last member.  The BlockDriverState
+ * must not have throttled requests.
+ *
+ * @bs: the BlockDriverState to remove
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        assert(qemu_co_queue_empty(&bs->throttled_reqs[i]));
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *token = throttle_group_next_bs(bs);
+            /* Take care of the case where this is the last bs in the group */
+            if (token == bs) {
+                token = NULL;
+            }
+            tg->tokens[i] = token;
+        }
+    }
+
+    /* remove the current bs from the list */
+    QLIST_REMOVE(bs, round_robin);
+    throttle_group_unref(tg);
+    bs->throttle_group = NULL;
+}
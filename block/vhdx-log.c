@@ -380,6 +380,33 @@ exit:
 }
 
 
+/* Data sectors that go to contiguous file offsets are collected and written
+ * to the image file with a single request.  This only reduces the number of
+ * requests during replay; what ends up on disk, and the flush before the log
+ * is marked empty, are the same as with one write per sector. */
+#define VHDX_LOG_FLUSH_RUN_SECTORS 256
+
+typedef struct VHDXLogFlushRun {
+    void *buffer;
+    uint64_t file_offset;
+    uint32_t sectors;
+} VHDXLogFlushRun;
+
+static int vhdx_log_flush_run(BlockDriverState *bs, VHDXLogFlushRun *run)
+{
+    int ret;
+
+    if (run->sectors == 0) {
+        return 0;
+    }
+
+    ret = bdrv_pwrite(bs->file, run->file_offset, run->buffer,
+                      run->sectors * VHDX_LOG_SECTOR_SIZE);
+    run->sectors = 0;
+
+    return ret < 0 ? ret : 0;
+}
+
 /* Flushes the descriptor described by desc to the VHDX image file.
  * If the descriptor is a data descriptor, than 'data' must be non-NULL,
  * and >= 4096 bytes (VHDX_LOG_SECTOR_SIZE), containing the data to be
@@ -388,26 +415,27 @@ exit:
  * Verification is performed to make sure the sequence numbers of a data
  * descriptor match the sequence number in the desc.
  *
+ * Data sectors are not written right away, but appended to 'run' if they
+ * follow the sectors already in there; vhdx_log_flush_run() writes them.
+ * Nothing is synced, the caller flushes the image file once the whole log
+ * has been replayed.
+ *
  * For a zero descriptor, it may describe multiple sectors to fill with zeroes.
  * In this case, it should be noted that zeroes are written to disk, and the
  * image file is not extended as a sparse file.  */
 static int vhdx_log_flush_desc(BlockDriverState *bs, VHDXLogDescriptor *desc,
-                               VHDXLogDataSector *data)
+                               VHDXLogDataSector *data, VHDXLogFlushRun *run)
 {
     int ret = 0;
-    uint64_t seq, file_offset;
+    uint64_t seq, file_offset, length;
     uint32_t offset = 0;
+    uint32_t chunk;
     void *buffer = NULL;
-    uint64_t count = 1;
-    int i;
-
-    buffer = qemu_blockalign(bs, VHDX_LOG_SECTOR_SIZE);
 
     if (!memcmp(&desc->signature, "desc", 4)) {
         /* data sector */
         if (data == NULL) {
-            ret = -EFAULT;
-            goto exit;
+            return -EFAULT;
         }
 
         /* The sequence number of the data sector must match that
@@ -417,10 +445,22 @@ static int vhdx_log_flush_desc(BlockDriverState *bs, VHDXLogDescriptor *desc,
         seq |= data->sequence_low & 0xffffffff;
 
         if (seq != desc->sequence_number) {
-            ret = -EINVAL;
-            goto exit;
+            return -EINVAL;
         }
 
+        if (run->sectors == VHDX_LOG_FLUSH_RUN_SECTORS ||
+            (run->sectors && desc->file_offset != run->file_offset +
+                             run->sectors * VHDX_LOG_SECTOR_SIZE)) {
+            ret = vhdx_log_flush_run(bs, run);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (run->sectors == 0) {
+            run->file_offset = desc->file_offset;
+        }
+        buffer = run->buffer + run->sectors * VHDX_LOG_SECTOR_SIZE;
+
         /* Each data sector is in total 4096 bytes, however the first
          * 8 bytes, and last 4 bytes, are located in the descriptor */
         memcpy(buffer, &desc->leading_bytes, 8);
@@ -431,27 +471,39 @@ static int vhdx_log_flush_desc(BlockDriverState *bs, VHDXLogDescriptor *desc,
 
         memcpy(buffer+offset, &desc->trailing_bytes, 4);
 
+        run->sectors++;
+
     } else if (!memcmp(&desc->signature, "zero", 4)) {
-        /* write 'count' sectors of sector */
-        memset(buffer, 0, VHDX_LOG_SECTOR_SIZE);
-        count = desc->zero_length / VHDX_LOG_SECTOR_SIZE;
-    }
+        /* earlier data must not overwrite the zeroes */
+        ret = vhdx_log_flush_run(bs, run);
+        if (ret < 0) {
+            return ret;
+        }
 
-    file_offset = desc->file_offset;
+        file_offset = desc->file_offset;
+        length = desc->zero_length;
+        if (length == 0) {
+            return 0;
+        }
 
-    /* count is only > 1 if we are writing zeroes */
-    for (i = 0; i < count; i++) {
-        ret = bdrv_pwrite_sync(bs->file, file_offset, buffer,
-                               VHDX_LOG_SECTOR_SIZE);
-        if (ret < 0) {
-            goto exit;
+        buffer = qemu_blockalign(bs, MIN(length, VHDX_LOG_FLUSH_RUN_SECTORS *
+                                                 VHDX_LOG_SECTOR_SIZE));
+        memset(buffer, 0, MIN(length, VHDX_LOG_FLUSH_RUN_SECTORS *
+                                      VHDX_LOG_SECTOR_SIZE));
+        while (length) {
+            chunk = MIN(length, VHDX_LOG_FLUSH_RUN_SECTORS *
+                                VHDX_LOG_SECTOR_SIZE);
+            ret = bdrv_pwrite(bs->file, file_offset, buffer, chunk);
+            if (ret < 0) {
+                break;
+            }
+            file_offset += chunk;
+            length -= chunk;
         }
-        file_offset += VHDX_LOG_SECTOR_SIZE;
+        qemu_vfree(buffer);
     }
 
-exit:
-    qemu_vfree(buffer);
-    return ret;
+    return ret < 0 ? ret : 0;
 }
 
 /* Flush the entire log (as described by 'logs') to the VHDX image
@@ -466,12 +518,15 @@ static int vhdx_log_flush(BlockDriverState *bs, BDRVVHDXState *s,
     uint32_t cnt, sectors_read;
     uint64_t new_file_size;
     void *data = NULL;
+    VHDXLogFlushRun run = { 0 };
     VHDXLogDescEntries *desc_entries = NULL;
     VHDXLogEntryHeader hdr_tmp = { 0 };
 
     cnt = logs->count;
 
     data = qemu_blockalign(bs, VHDX_LOG_SECTOR_SIZE);
+    run.buffer = qemu_blockalign(bs, VHDX_LOG_FLUSH_RUN_SECTORS *
+                                     VHDX_LOG_SECTOR_SIZE);
 
     ret = vhdx_user_visible_write(bs, s);
     if (ret < 0) {
@@ -512,11 +567,16 @@ static int vhdx_log_flush(BlockDriverState *bs, BDRVVHDXState *s,
                 }
             }
 
-            ret = vhdx_log_flush_desc(bs, &desc_entries->desc[i], data);
+            ret = vhdx_log_flush_desc(bs, &desc_entries->desc[i], data,
+                                      &run);
             if (ret < 0) {
                 goto exit;
             }
         }
+        ret = vhdx_log_flush_run(bs, &run);
+        if (ret < 0) {
+            goto exit;
+        }
         if (bdrv_getlength(bs->file) < desc_entries->hdr.last_file_offset) {
             new_file_size = desc_entries->hdr.last_file_offset;
             if (new_file_size % (1024*1024)) {
@@ -529,13 +589,14 @@ static int vhdx_log_flush(BlockDriverState *bs, BDRVVHDXState *s,
         desc_entries = NULL;
     }
 
-    bdrv_flush(bs);
+    bdrv_flush(bs->file);
     /* once the log is fully flushed, indicate that we have an empty log
      * now.  This also sets the log guid to 0, to indicate an empty log */
     vhdx_log_reset(bs, s);
 
 exit:
     qemu_vfree(data);
+    qemu_vfree(run.buffer);
     qemu_vfree(desc_entries);
     return ret;
 }
@@ -998,8 +1059,9 @@ int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
 
 
     /* Make sure data written (new and/or changed blocks) is stable
-     * on disk, before creating log entry */
-    bdrv_flush(bs);
+     * on disk, before creating log entry.  This flushes the image file
+     * directly, as it is called while flushing bs. */
+    bdrv_flush(bs->file);
     ret = vhdx_log_write(bs, s, data, length, offset);
     if (ret < 0) {
         goto exit;
@@ -1007,7 +1069,7 @@ int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
     logs.log = s->log;
 
     /* Make sure log is stable on disk */
-    bdrv_flush(bs);
+    bdrv_flush(bs->file);
     ret = vhdx_log_flush(bs, s, &logs);
     if (ret < 0) {
         goto exit;
@@ -894,6 +894,7 @@ static int vhdx_open(BlockDriverState *bs, QDict *options, int flags,
     s->first_visible_write = true;
 
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->allocating_writes_queue);
     QLIST_INIT(&s->regions);
 
     /* validate the file signature */
@@ -1181,6 +1182,98 @@ int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
     return ret;
 }
 
+/* Largest part of the BAT, in bytes, that is committed with a single log
+ * entry.  Every data sector of the entry also needs a descriptor, so this
+ * stays well below the size of the log. */
+static uint64_t vhdx_bat_commit_max(BDRVVHDXState *s)
+{
+    return s->log.length / 2;
+}
+
+/* Returns true if BAT entry bat_idx can be marked dirty without growing the
+ * dirty range beyond what fits into one log entry */
+static bool vhdx_bat_dirty_fits(BDRVVHDXState *s, uint32_t bat_idx)
+{
+    uint32_t start, end;
+
+    if (s->bat_dirty_start >= s->bat_dirty_end) {
+        return true;
+    }
+    start = MIN(s->bat_dirty_start, bat_idx);
+    end = MAX(s->bat_dirty_end, bat_idx + 1);
+
+    return (uint64_t) (end - start) * sizeof(VHDXBatEntry) <=
+           vhdx_bat_commit_max(s);
+}
+
+static void vhdx_bat_mark_dirty(BDRVVHDXState *s, uint32_t bat_idx)
+{
+    if (s->bat_dirty_start >= s->bat_dirty_end) {
+        s->bat_dirty_start = bat_idx;
+        s->bat_dirty_end = bat_idx + 1;
+    } else {
+        s->bat_dirty_start = MIN(s->bat_dirty_start, bat_idx);
+        s->bat_dirty_end = MAX(s->bat_dirty_end, bat_idx + 1);
+    }
+}
+
+/*
+ * Write all BAT entries changed since the last commit to the image file,
+ * with a single log entry.  Must be called with s->lock held.
+ *
+ * The log write flushes the image file before the entry is written, which
+ * makes the data of newly allocated blocks stable before the BAT points to
+ * them.  This only works once that data has been written, so wait for all
+ * allocating writes first.
+ */
+static coroutine_fn int vhdx_bat_commit(BlockDriverState *bs,
+                                        BDRVVHDXState *s)
+{
+    uint64_t *bat_le;
+    uint32_t i, count;
+    int ret;
+
+    while (s->allocating_writes > 0) {
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&s->allocating_writes_queue);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
+    if (s->bat_dirty_start >= s->bat_dirty_end) {
+        return 0;
+    }
+
+    count = s->bat_dirty_end - s->bat_dirty_start;
+    bat_le = g_new(uint64_t, count);
+    for (i = 0; i < count; i++) {
+        bat_le[i] = cpu_to_le64(s->bat[s->bat_dirty_start + i]);
+    }
+
+    ret = vhdx_log_write_and_flush(bs, s, bat_le,
+                                   count * sizeof(VHDXBatEntry),
+                                   s->bat_offset +
+                                   s->bat_dirty_start * sizeof(VHDXBatEntry));
+    g_free(bat_le);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->bat_dirty_start = s->bat_dirty_end = 0;
+    return 0;
+}
+
+static coroutine_fn int vhdx_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVVHDXState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = vhdx_bat_commit(bs, s);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
 static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                       int nb_sectors, QEMUIOVector *qiov)
 {
@@ -1218,9 +1311,20 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             vhdx_block_translate(s, sector_num, nb_sectors, &sinfo);
             sectors_to_write = sinfo.sectors_avail;
 
-            qemu_iovec_reset(&hd_qiov);
             /* check the payload block state */
             bat_state = s->bat[sinfo.bat_idx] & VHDX_BAT_STATE_BIT_MASK;
+            if (bat_state != PAYLOAD_BLOCK_FULLY_PRESENT &&
+                !vhdx_bat_dirty_fits(s, sinfo.bat_idx)) {
+                /* Committing may drop the lock, so look at the block
+                 * again afterwards */
+                ret = vhdx_bat_commit(bs, s);
+                if (ret < 0) {
+                    goto exit;
+                }
+                continue;
+            }
+
+            qemu_iovec_reset(&hd_qiov);
             switch (bat_state) {
             case PAYLOAD_BLOCK_ZERO:
                 /* in this case, we need to preserve zero writes for
@@ -1280,6 +1384,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 vhdx_update_bat_table_entry(bs, s, &sinfo, &bat_entry,
                                             &bat_entry_offset,
                                             PAYLOAD_BLOCK_FULLY_PRESENT);
+                /* the BAT is written back by vhdx_bat_commit(), on flush
+                 * or once the dirty part gets too large for the log */
+                vhdx_bat_mark_dirty(s, sinfo.bat_idx);
                 bat_update = true;
                 /* since we just allocated a block, file_offset is the
                  * beginning of the payload block. It needs to be the
@@ -1301,11 +1408,17 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                                       sinfo.bytes_avail);
                 }
                 /* block exists, so we can just overwrite it */
+                if (bat_update) {
+                    s->allocating_writes++;
+                }
                 qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_writev(bs->file,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sectors_to_write, &hd_qiov);
                 qemu_co_mutex_lock(&s->lock);
+                if (bat_update && --s->allocating_writes == 0) {
+                    qemu_co_queue_restart_all(&s->allocating_writes_queue);
+                }
                 if (ret < 0) {
                     goto error_bat_restore;
                 }
@@ -1319,17 +1432,6 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 break;
             }
 
-            if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
-                }
-            }
-
             nb_sectors -= sinfo.sectors_avail;
             sector_num += sinfo.sectors_avail;
             bytes_done += sinfo.bytes_avail;
@@ -1927,6 +2029,7 @@ static BlockDriver bdrv_vhdx = {
     .bdrv_reopen_prepare    = vhdx_reopen_prepare,
     .bdrv_co_readv          = vhdx_co_readv,
     .bdrv_co_writev         = vhdx_co_writev,
+    .bdrv_co_flush_to_os    = vhdx_co_flush_to_os,
     .bdrv_create            = vhdx_create,
     .bdrv_get_info          = vhdx_get_info,
     .bdrv_check             = vhdx_check,
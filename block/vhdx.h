@@ -384,6 +384,16 @@ typedef struct BDRVVHDXState {
     VHDXBatEntry *bat;
     uint64_t bat_offset;
 
+    /* BAT entries [bat_dirty_start, bat_dirty_end) may have been changed in
+     * memory without being written out through the log yet */
+    uint32_t bat_dirty_start;
+    uint32_t bat_dirty_end;
+
+    /* Writes to newly allocated blocks whose data is not written yet; the
+     * BAT must not be committed while there are any */
+    int allocating_writes;
+    CoQueue allocating_writes_queue;
+
     bool first_visible_write;
     MSGUID session_guid;
 
@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "migration/migration.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -81,7 +82,13 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Default size of the grain table cache of each extent, in bytes */
+#define VMDK_L2_CACHE_DEFAULT_SIZE (256 * 1024)
+
+/* Grains of a single read request that are read and inflated in parallel */
+#define VMDK_READ_MAX_IN_FLIGHT 8
+
+#define VMDK_OPT_L2_CACHE_SIZE "l2-cache-size"
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -102,8 +109,11 @@ typedef struct VmdkExtent {
 
     unsigned int l2_size;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    unsigned int l2_cache_entries;
+    uint32_t *l2_cache_offsets;
+    uint64_t *l2_cache_lru;     /* l2_cache_lru_clock at the last use */
+    uint64_t l2_cache_lru_clock;
+    unsigned int l2_cache_last_hit;
 
     int64_t cluster_sectors;
     char *type;
@@ -111,6 +121,7 @@ typedef struct VmdkExtent {
 
 typedef struct BDRVVmdkState {
     CoMutex lock;
+    uint64_t l2_cache_size;
     uint64_t desc_offset;
     bool cid_updated;
     bool cid_checked;
@@ -216,6 +227,8 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_offsets);
+        g_free(e->l2_cache_lru);
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -443,6 +456,7 @@ static int vmdk_add_extent(BlockDriverState *bs,
 static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
                             Error **errp)
 {
+    BDRVVmdkState *s = bs->opaque;
     int ret;
     int l1_size, i;
 
@@ -480,8 +494,16 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    /* No point in caching more grain tables than the extent has */
+    extent->l2_cache_entries = s->l2_cache_size /
+                               (extent->l2_size * sizeof(uint32_t));
+    extent->l2_cache_entries = MIN(extent->l2_cache_entries, extent->l1_size);
+    extent->l2_cache_entries = MAX(extent->l2_cache_entries, 1);
+
+    extent->l2_cache = g_malloc(extent->l2_size * extent->l2_cache_entries *
+                                sizeof(uint32_t));
+    extent->l2_cache_offsets = g_new0(uint32_t, extent->l2_cache_entries);
+    extent->l2_cache_lru = g_new0(uint64_t, extent->l2_cache_entries);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -884,6 +906,19 @@ exit:
     return ret;
 }
 
+static QemuOptsList vmdk_runtime_opts = {
+    .name = "vmdk",
+    .head = QTAILQ_HEAD_INITIALIZER(vmdk_runtime_opts.head),
+    .desc = {
+        {
+            .name = VMDK_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the grain table cache of each extent",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -891,6 +926,19 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
     int ret;
     BDRVVmdkState *s = bs->opaque;
     uint32_t magic;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create(&vmdk_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->l2_cache_size = qemu_opt_get_size(opts, VMDK_OPT_L2_CACHE_SIZE,
+                                         VMDK_L2_CACHE_DEFAULT_SIZE);
+    qemu_opts_del(opts);
 
     buf = vmdk_read_desc(bs->file, 0, errp);
     if (!buf) {
@@ -1034,8 +1082,9 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    unsigned int min_index, i;
+    uint64_t min_lru;
+    uint32_t *l2_table;
     bool zeroed = false;
 
     if (m_data) {
@@ -1055,28 +1104,34 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
+    /* Sequential access keeps hitting the same table, so try that first */
+    i = extent->l2_cache_last_hit;
+    if (l2_offset != extent->l2_cache_offsets[i]) {
+        for (i = 0; i < extent->l2_cache_entries; i++) {
+            if (l2_offset == extent->l2_cache_offsets[i]) {
+                break;
             }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
         }
     }
-    /* not found: load a new entry in the least used one */
+    if (i < extent->l2_cache_entries) {
+        extent->l2_cache_lru[i] = ++extent->l2_cache_lru_clock;
+        extent->l2_cache_last_hit = i;
+        l2_table = extent->l2_cache + (i * extent->l2_size);
+        goto found;
+    }
+    /* not found: load a new entry in the least recently used one */
     min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
+    min_lru = UINT64_MAX;
+    for (i = 0; i < extent->l2_cache_entries; i++) {
+        if (extent->l2_cache_lru[i] < min_lru) {
+            min_lru = extent->l2_cache_lru[i];
             min_index = i;
         }
     }
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    /* the entry is invalid until the table has been read */
+    extent->l2_cache_offsets[min_index] = 0;
+    extent->l2_cache_lru[min_index] = 0;
     if (bdrv_pread(
                 extent->file,
                 (int64_t)l2_offset * 512,
@@ -1087,7 +1142,8 @@ static int get_cluster_offset(BlockDriverState *bs,
     }
 
     extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
+    extent->l2_cache_lru[min_index] = ++extent->l2_cache_lru_clock;
+    extent->l2_cache_last_hit = min_index;
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
@@ -1242,10 +1298,28 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+typedef struct VmdkInflateData {
+    uint8_t *dest;
+    uLongf dest_len;
+    const uint8_t *src;
+    uLong src_len;
+} VmdkInflateData;
+
+static int vmdk_inflate_worker(void *opaque)
 {
+    VmdkInflateData *data = opaque;
+
+    return uncompress(data->dest, &data->dest_len, data->src, data->src_len);
+}
+
+static int coroutine_fn vmdk_read_extent(BlockDriverState *bs,
+                                         VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         uint8_t *buf, int nb_sectors)
+{
+    ThreadPool *pool;
+    VmdkInflateData inflate;
     int ret;
     int cluster_bytes, buf_bytes;
     uint8_t *cluster_buf, *compressed_data;
@@ -1288,12 +1362,21 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
+    /* Inflating is expensive, keep it out of the main loop */
+    inflate = (VmdkInflateData) {
+        .dest       = uncomp_buf,
+        .dest_len   = buf_len,
+        .src        = compressed_data,
+        .src_len    = data_len,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, vmdk_inflate_worker, &inflate);
     if (ret != Z_OK) {
         ret = -EINVAL;
         goto out;
 
     }
+    buf_len = inflate.dest_len;
     if (offset_in_cluster < 0 ||
             offset_in_cluster + nb_sectors * 512 > buf_len) {
         ret = -EINVAL;
@@ -1308,8 +1391,50 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+typedef struct VmdkReadState {
+    Coroutine *co;
+    int in_flight;
+    int ret;
+    bool waiting;
+} VmdkReadState;
+
+typedef struct VmdkGrainRead {
+    BlockDriverState *bs;
+    VmdkReadState *state;
+    VmdkExtent *extent;
+    uint64_t cluster_offset;
+    int64_t offset_in_cluster;
+    uint8_t *buf;
+    int nb_sectors;
+} VmdkGrainRead;
+
+static void coroutine_fn vmdk_grain_read_entry(void *opaque)
+{
+    VmdkGrainRead *g = opaque;
+    VmdkReadState *state = g->state;
+    int ret;
+
+    ret = vmdk_read_extent(g->bs, g->extent, g->cluster_offset,
+                           g->offset_in_cluster, g->buf, g->nb_sectors);
+    if (ret < 0 && state->ret == 0) {
+        state->ret = ret;
+    }
+    g_free(g);
+
+    state->in_flight--;
+    if (state->waiting) {
+        state->waiting = false;
+        qemu_coroutine_enter(state->co, NULL);
+    }
+}
+
+/*
+ * Only the grain table lookups need s->lock.  The grains themselves are
+ * read (and inflated, for compressed extents) without holding it, up to
+ * VMDK_READ_MAX_IN_FLIGHT of them in parallel.
+ */
+static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
+                                     uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1317,15 +1442,23 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
     uint64_t extent_begin_sector, extent_relative_sector_num;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    VmdkReadState state = {
+        .co = qemu_coroutine_self(),
+    };
+    VmdkGrainRead *g;
+    Coroutine *co;
 
-    while (nb_sectors > 0) {
+    while (nb_sectors > 0 && state.ret == 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            state.ret = -EIO;
+            break;
         }
+        qemu_co_mutex_lock(&s->lock);
         ret = get_cluster_offset(
                             bs, extent, NULL,
                             sector_num << 9, 0, &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
         extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
         index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
@@ -1337,39 +1470,46 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    state.ret = -EINVAL;
+                    break;
                 }
                 ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
                 if (ret < 0) {
-                    return ret;
+                    state.ret = ret;
+                    break;
                 }
             } else {
                 memset(buf, 0, 512 * n);
             }
         } else {
-            ret = vmdk_read_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n);
-            if (ret) {
-                return ret;
+            while (state.in_flight >= VMDK_READ_MAX_IN_FLIGHT) {
+                state.waiting = true;
+                qemu_coroutine_yield();
             }
+            g = g_new(VmdkGrainRead, 1);
+            *g = (VmdkGrainRead) {
+                .bs                 = bs,
+                .state              = &state,
+                .extent             = extent,
+                .cluster_offset     = cluster_offset,
+                .offset_in_cluster  = index_in_cluster * 512,
+                .buf                = buf,
+                .nb_sectors         = n,
+            };
+            state.in_flight++;
+            co = qemu_coroutine_create(vmdk_grain_read_entry);
+            qemu_coroutine_enter(co, g);
         }
         nb_sectors -= n;
         sector_num += n;
         buf += n * 512;
     }
-    return 0;
-}
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
+    while (state.in_flight > 0) {
+        state.waiting = true;
+        qemu_coroutine_yield();
+    }
+    return state.ret;
 }
 
 /**
@@ -99,7 +99,10 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY, NULL);
+    /* The NBD server accepts any number of clients, and they all share bs */
+    exp = nbd_export_new(bs, 0, -1,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY), NULL);
 
     nbd_export_set_name(exp, device);
 
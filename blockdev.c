@@ -335,6 +335,7 @@ static DriveInfo *blockdev_init(const char *file, QDict *bs_opts,
     int on_read_error, on_write_error;
     DriveInfo *dinfo;
     ThrottleConfig cfg;
+    const char *throttling_group;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -448,6 +449,8 @@ static DriveInfo *blockdev_init(const char *file, QDict *bs_opts,
 
     cfg.op_size = qemu_opt_get_number(opts, "throttling.iops-size", 0);
 
+    throttling_group = qemu_opt_get(opts, "throttling.group");
+
     if (!check_throttle_config(&cfg, &error)) {
         error_propagate(errp, error);
         goto early_err;
@@ -510,7 +513,10 @@ static DriveInfo *blockdev_init(const char *file, QDict *bs_opts,
 
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(dinfo->bdrv);
+        if (!throttling_group) {
+            throttling_group = dinfo->id;
+        }
+        bdrv_io_limits_enable(dinfo->bdrv, throttling_group);
         bdrv_set_io_limits(dinfo->bdrv, &cfg);
     }
 
@@ -694,6 +700,8 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     qemu_opt_rename(all_opts,
                     "iops_size", "throttling.iops-size");
 
+    qemu_opt_rename(all_opts, "group", "throttling.group");
+
     qemu_opt_rename(all_opts, "readonly", "read-only");
 
     value = qemu_opt_get(all_opts, "cache");
@@ -1424,6 +1432,7 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->sync,
                      backup->has_mode, backup->mode,
                      backup->has_speed, backup->speed,
+                     backup->has_bitmap, backup->bitmap,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
                      &local_err);
@@ -1696,7 +1705,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -1743,14 +1754,99 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
-    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
-        bdrv_io_limits_disable(bs);
+    if (throttle_enabled(&cfg) &&
+        bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+        error_setg(errp, "Device '%s' is used by an iothread, which does not "
+                   "support I/O throttling", device);
+        return;
     }
 
-    if (bs->io_limits_enabled) {
+    if (throttle_enabled(&cfg)) {
+        /* Enable I/O limits if they're not enabled yet, otherwise
+         * just update the throttling group. */
+        if (!bs->io_limits_enabled) {
+            bdrv_io_limits_enable(bs, has_group ? group : device);
+        } else if (has_group) {
+            bdrv_io_limits_update_group(bs, group);
+        }
+        /* Set the new throttling configuration */
         bdrv_set_io_limits(bs, &cfg);
+    } else if (bs->io_limits_enabled) {
+        /* If all throttling settings are set to 0, disable I/O limits */
+        bdrv_io_limits_disable(bs);
+    }
+}
+
+static void set_latency_histogram(BlockAcctLatency *latency,
+                                  uint64List *boundaries)
+{
+    uint64List *entry;
+    uint64_t *values;
+    unsigned int i, count = 0;
+    int ret;
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        count++;
+    }
+
+    values = g_new(uint64_t, MAX(count, 1));
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        values[i] = entry->value;
+    }
+
+    ret = block_latency_set_histogram(latency, values, count);
+    assert(ret == 0);
+    g_free(values);
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockDriverState *bs;
+    uint64List *lists[BDRV_MAX_IOTYPE];
+    int i;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        lists[i] = has_boundaries ? boundaries : NULL;
+    }
+    if (has_boundaries_read) {
+        lists[BDRV_ACCT_READ] = boundaries_read;
+    }
+    if (has_boundaries_write) {
+        lists[BDRV_ACCT_WRITE] = boundaries_write;
+    }
+    if (has_boundaries_flush) {
+        lists[BDRV_ACCT_FLUSH] = boundaries_flush;
+    }
+
+    /* Check all lists before touching any histogram */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        uint64List *entry;
+
+        for (entry = lists[i]; entry && entry->next; entry = entry->next) {
+            if (entry->next->value <= entry->value) {
+                error_setg(errp, "Histogram boundaries must be ascending");
+                return;
+            }
+        }
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        set_latency_histogram(&bs->latency[i], lists[i]);
     }
 }
 
@@ -1871,6 +1967,8 @@ static void block_job_cb(void *opaque, int ret)
 
 void qmp_block_stream(const char *device, bool has_base,
                       const char *base, bool has_speed, int64_t speed,
+                      bool has_max_in_flight, int64_t max_in_flight,
+                      bool has_guest_share, int64_t guest_share,
                       bool has_on_error, BlockdevOnError on_error,
                       Error **errp)
 {
@@ -1881,6 +1979,21 @@ void qmp_block_stream(const char *device, bool has_base,
     if (!has_on_error) {
         on_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
+    if (!has_guest_share) {
+        guest_share = 0;
+    }
+
+    if (has_max_in_flight && (max_in_flight < 1 || max_in_flight > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+    if (guest_share < 0 || guest_share > 100) {
+        error_set(errp, QERR_INVALID_PARAMETER, "guest-share");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1900,8 +2013,8 @@ void qmp_block_stream(const char *device, bool has_base,
         }
     }
 
-    stream_start(bs, base_bs, base, has_speed ? speed : 0,
-                 on_error, block_job_cb, bs, &local_err);
+    stream_start(bs, base_bs, base, has_speed ? speed : 0, max_in_flight,
+                 guest_share, on_error, block_job_cb, bs, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
@@ -1913,6 +2026,9 @@ void qmp_block_stream(const char *device, bool has_base,
 void qmp_block_commit(const char *device,
                       bool has_base, const char *base, const char *top,
                       bool has_speed, int64_t speed,
+                      bool has_max_in_flight, int64_t max_in_flight,
+                      bool has_drop_committed, bool drop_committed,
+                      bool has_drop_batch_size, int64_t drop_batch_size,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -1926,6 +2042,30 @@ void qmp_block_commit(const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
+    if (!has_drop_committed) {
+        drop_committed = false;
+    }
+    if (!has_drop_batch_size) {
+        drop_batch_size = 0;
+    }
+
+    if (has_max_in_flight && (max_in_flight < 1 || max_in_flight > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
+    if (has_drop_batch_size &&
+        (drop_batch_size < BDRV_SECTOR_SIZE ||
+         drop_batch_size % BDRV_SECTOR_SIZE)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "drop-batch-size");
+        return;
+    }
+    if (has_drop_batch_size && !drop_committed) {
+        error_setg(errp, "drop-batch-size requires drop-committed");
+        return;
+    }
 
     /* drain all i/o before commits */
     bdrv_drain_all();
@@ -1966,11 +2106,17 @@ void qmp_block_commit(const char *device,
     }
 
     if (top_bs == bs) {
+        if (drop_committed) {
+            error_setg(errp, "drop-committed cannot be used when committing "
+                       "the active layer");
+            return;
+        }
         commit_active_start(bs, base_bs, speed, on_error, block_job_cb,
                             bs, &local_err);
     } else {
-        commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
-                    &local_err);
+        commit_start(bs, base_bs, top_bs, speed, max_in_flight,
+                     drop_committed, drop_batch_size, on_error,
+                     block_job_cb, bs, &local_err);
     }
     if (local_err != NULL) {
         error_propagate(errp, local_err);
@@ -1983,6 +2129,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       enum MirrorSyncMode sync,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
+                      bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1990,6 +2137,7 @@ void qmp_drive_backup(const char *device, const char *target,
     BlockDriverState *bs;
     BlockDriverState *target_bs;
     BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
     int flags;
@@ -2035,6 +2183,22 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!has_bitmap) {
+            error_setg(errp, "Sync mode 'incremental' requires a bitmap");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    } else if (has_bitmap) {
+        error_setg(errp, "A bitmap can only be used with sync mode "
+                   "'incremental'");
+        return;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -2079,7 +2243,8 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -2093,6 +2258,121 @@ BlockDeviceInfoList *qmp_query_named_block_nodes(Error **errp)
     return bdrv_named_nodes_list();
 }
 
+static BdrvDirtyBitmap *block_dirty_bitmap_lookup(const char *device,
+                                                  const char *name,
+                                                  BlockDriverState **pbs,
+                                                  Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return NULL;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return NULL;
+    }
+
+    if (pbs) {
+        *pbs = bs;
+    }
+    return bitmap;
+}
+
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!*name) {
+        error_setg(errp, "Bitmap name cannot be empty");
+        return;
+    }
+
+    if (has_granularity) {
+        if (granularity < 512 || granularity > 1048576 * 64 ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+            return;
+        }
+    } else {
+        /* Default to the cluster size of the image, like drive-mirror */
+        BlockDriverInfo bdi;
+        if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size != 0) {
+            granularity = MAX(4096, bdi.cluster_size);
+            granularity = MIN(65536, granularity);
+        } else {
+            granularity = 65536;
+        }
+    }
+
+    if (has_persistent && persistent && !bdrv_can_store_dirty_bitmaps(bs)) {
+        error_setg(errp, "Device '%s' cannot store persistent dirty bitmaps",
+                   device);
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!bitmap) {
+        return;
+    }
+    bdrv_dirty_bitmap_set_persistent(bitmap, has_persistent && persistent);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(device, name, &bs, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a block job", name);
+        return;
+    }
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
+void qmp_block_dirty_bitmap_clear(const char *device, const char *name,
+                                  Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = block_dirty_bitmap_lookup(device, name, NULL, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a block job", name);
+        return;
+    }
+    bdrv_clear_dirty_bitmap(bitmap);
+}
+
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
 
 void qmp_drive_mirror(const char *device, const char *target,
@@ -2104,6 +2384,8 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_in_flight, int64_t max_in_flight,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -2132,6 +2414,17 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
+
+    if (has_max_in_flight && (max_in_flight < 1 || max_in_flight > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "max-in-flight");
+        return;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -2168,6 +2461,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_setg(errp, "Sync mode 'incremental' is not supported by "
+                   "drive-mirror");
+        return;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
     source = bs->backing_hd;
     if (!source && sync == MIRROR_SYNC_MODE_TOP) {
@@ -2222,8 +2521,8 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
-    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
-                 on_source_error, on_target_error,
+    mirror_start(bs, target_bs, speed, granularity, buf_size, max_in_flight,
+                 copy_mode, sync, on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -2496,6 +2795,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
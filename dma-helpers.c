@@ -96,7 +96,7 @@ static void continue_after_map_failure(void *opaque)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
 
-    dbs->bh = qemu_bh_new(reschedule_dma, dbs);
+    dbs->bh = aio_bh_new(bdrv_get_aio_context(dbs->bs), reschedule_dma, dbs);
     qemu_bh_schedule(dbs->bh);
 }
 
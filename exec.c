@@ -1074,12 +1074,16 @@ static void *file_ram_alloc(RAMBlock *block,
     if (ftruncate(fd, memory))
         perror("ftruncate");
 
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    area = mmap(0, memory, PROT_READ | PROT_WRITE,
+                mem_share ? MAP_SHARED : MAP_PRIVATE, fd, 0);
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         goto error;
     }
+    if (mem_share) {
+        block->flags |= RAM_SHARED;
+    }
 
     if (mem_prealloc) {
         int ret, i;
@@ -1409,11 +1413,13 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                 flags = MAP_FIXED;
                 munmap(vaddr, length);
                 if (block->fd >= 0) {
+                    flags |= (block->flags & RAM_SHARED) ?
+                             MAP_SHARED : MAP_PRIVATE;
 #ifdef MAP_POPULATE
-                    flags |= mem_prealloc ? MAP_POPULATE | MAP_SHARED :
-                        MAP_PRIVATE;
-#else
-                    flags |= MAP_PRIVATE;
+                    if (mem_prealloc) {
+                        flags = (flags & ~MAP_PRIVATE) |
+                                MAP_POPULATE | MAP_SHARED;
+                    }
 #endif
                     area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
                                 flags, block->fd, offset);
@@ -1471,6 +1477,35 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
     return block->host + (addr - block->offset);
 }
 
+/* Return the file descriptor backing the RAM block that contains @addr,
+ * or -1 if the block is not backed by a file (see -mem-path). */
+int qemu_get_ram_fd(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->fd;
+}
+
+/* Return true if the RAM block that contains @addr is mapped MAP_SHARED,
+ * so that changes made through another mapping of qemu_get_ram_fd() are
+ * visible to the guest (see -mem-share). */
+bool qemu_ram_is_shared(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->flags & RAM_SHARED;
+}
+
+/* Return the host address at which the RAM block that contains @addr
+ * starts.  Together with qemu_get_ram_fd(), this lets another process
+ * map the same memory. */
+void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_get_ram_block(addr);
+
+    return block->host;
+}
+
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
  * but takes a size argument */
 static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
@@ -397,6 +397,37 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void print_latency_stats(Monitor *mon, const char *type,
+                                BlockLatencyStats *latency)
+{
+    uint64List *boundary, *bin;
+
+    if (!latency->operations) {
+        return;
+    }
+
+    monitor_printf(mon, "    %s latency (ns): min=%" PRId64 " avg=%" PRId64
+                   " max=%" PRId64 " p50=%" PRId64 " p99=%" PRId64
+                   " p999=%" PRId64 "\n",
+                   type, latency->min_ns, latency->avg_ns, latency->max_ns,
+                   latency->p50_ns, latency->p99_ns, latency->p999_ns);
+
+    if (!latency->has_histogram) {
+        return;
+    }
+
+    monitor_printf(mon, "    %s histogram:", type);
+    boundary = latency->histogram->boundaries;
+    for (bin = latency->histogram->bins; bin; bin = bin->next) {
+        monitor_printf(mon, " %" PRIu64, bin->value);
+        if (boundary) {
+            monitor_printf(mon, " |%" PRIu64 "|", boundary->value);
+            boundary = boundary->next;
+        }
+    }
+    monitor_printf(mon, "\n");
+}
+
 void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
 {
     BlockStatsList *stats_list, *stats;
@@ -413,6 +444,8 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        " wr_bytes=%" PRId64
                        " rd_operations=%" PRId64
                        " wr_operations=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
                        " flush_operations=%" PRId64
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
@@ -422,10 +455,16 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
                        stats->value->stats->wr_operations,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged,
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        print_latency_stats(mon, "rd", stats->value->stats->rd_latency);
+        print_latency_stats(mon, "wr", stats->value->stats->wr_latency);
+        print_latency_stats(mon, "flush",
+                            stats->value->stats->flush_latency);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -932,7 +971,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -960,7 +999,8 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, 0, false, 0, &err);
+                     true, mode, false, 0, false, NULL,
+                     false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1161,7 +1201,9 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false,
                               0,
                               false, /* No default I/O size */
-                              0, &err);
+                              0,
+                              false,
+                              NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1173,7 +1215,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
     int64_t speed = qdict_get_try_int(qdict, "speed", 0);
 
     qmp_block_stream(device, base != NULL, base,
-                     qdict_haskey(qdict, "speed"), speed,
+                     qdict_haskey(qdict, "speed"), speed, false, 0, false, 0,
                      true, BLOCKDEV_ON_ERROR_REPORT, &error);
 
     hmp_handle_error(mon, &error);
@@ -12,6 +12,7 @@
  *
  */
 
+#include "qemu/atomic.h"
 #include "ioq.h"
 
 void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
@@ -94,6 +95,35 @@ int ioq_submit(IOQueue *ioq)
     return rc;
 }
 
+/* Layout of the completion ring that the kernel maps at the address of the
+ * Linux AIO context
+ */
+struct aio_ring {
+    unsigned int id;
+    unsigned int nr;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int magic;
+    unsigned int compat_features;
+    unsigned int incompat_features;
+    unsigned int header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Check for completed requests without a system call, so that completions
+ * can be busy polled.  Errs on the side of true if the ring cannot be read.
+ */
+bool ioq_has_completions(IOQueue *ioq)
+{
+    struct aio_ring *ring = (struct aio_ring *)ioq->io_ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return true;
+    }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
+}
+
 int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
                        void *opaque)
 {
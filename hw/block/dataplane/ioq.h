@@ -53,5 +53,6 @@ static inline unsigned int ioq_num_queued(IOQueue *ioq)
 typedef void IOQueueCompletion(struct iocb *iocb, ssize_t ret, void *opaque);
 int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
                        void *opaque);
+bool ioq_has_completions(IOQueue *ioq);
 
 #endif /* IOQ_H */
@@ -41,15 +41,13 @@ typedef struct {
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
 } VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool starting;
-    bool stopping;
-
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
+/* One virtqueue and the IOThread processing it */
+typedef struct {
+    VirtIOBlockDataPlane *s;
+    unsigned int index;             /* virtqueue index */
+    VirtQueue *vq;                  /* owns the pool of elements */
+    VirtIOBlockQueueStats *stats;
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
 
@@ -59,35 +57,48 @@ struct VirtIOBlockDataPlane {
      * use it).
      */
     IOThread *iothread;
-    IOThread internal_iothread_obj;
     AioContext *ctx;
     EventNotifier io_notifier;      /* Linux AIO completion */
     EventNotifier host_notifier;    /* doorbell */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       IOThread) */
+    IOQueue ioqueue;                /* Linux AIO queue */
     VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
                                              queue */
 
     unsigned int num_reqs;
+} VirtIOBlockDataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    VirtIODevice *vdev;
+    IOThread internal_iothread_obj;
+
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 
     /* Operation blocker on BDS */
     Error *blocker;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
     struct virtio_blk_inhdr hdr;
     int len;
@@ -100,7 +111,8 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->elem->index, ret);
+    trace_virtio_blk_data_plane_complete_request(q->s, q->index,
+                                                 req->elem->index, ret);
 
     if (req->read_qiov) {
         assert(req->bounce_iov);
@@ -122,12 +134,15 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->elem, len + sizeof(hdr));
+    vring_push(&q->vring, req->elem, len + sizeof(hdr));
+    virtqueue_free_element(q->vq, req->elem);
     req->elem = NULL;
-    s->num_reqs--;
+    q->num_reqs--;
+    q->stats->completed++;
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, VirtQueueElement *elem,
+static void complete_request_early(VirtIOBlockDataPlaneQueue *q,
+                                   VirtQueueElement *elem,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
     struct virtio_blk_inhdr hdr = {
@@ -138,28 +153,32 @@ static void complete_request_early(VirtIOBlockDataPlane *s, VirtQueueElement *el
     qemu_iovec_destroy(inhdr);
     g_slice_free(QEMUIOVector, inhdr);
 
-    vring_push(&s->vring, elem, sizeof(hdr));
-    notify_guest(s);
+    vring_push(&q->vring, elem, sizeof(hdr));
+    virtqueue_free_element(q->vq, elem);
+    q->stats->completed++;
+    notify_guest(q);
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockDataPlaneQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           VirtQueueElement *elem, QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->s;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when longer than buffer */
     strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_OK);
+    complete_request_early(q, elem, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockDataPlaneQueue *q, bool read,
                        struct iovec *iov, unsigned iov_cnt,
                        long long offset, VirtQueueElement *elem,
                        QEMUIOVector *inhdr)
 {
+    VirtIOBlockDataPlane *s = q->s;
     struct iocb *iocb;
     QEMUIOVector qiov;
     struct iovec *bounce_iov = NULL;
@@ -186,7 +205,15 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
         iov_cnt = 1;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    if (read) {
+        q->stats->rd_ops++;
+        q->stats->rd_bytes += qiov.size;
+    } else {
+        q->stats->wr_ops++;
+        q->stats->wr_bytes += qiov.size;
+    }
+
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt, offset);
 
     /* Fill in virtio block metadata needed for completion */
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
@@ -199,7 +226,9 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
 
 static int process_request(IOQueue *ioq, VirtQueueElement *elem)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
+    VirtIOBlockDataPlaneQueue *q = container_of(ioq, VirtIOBlockDataPlaneQueue,
+                                                ioqueue);
+    VirtIOBlockDataPlane *s = q->s;
     struct iovec *iov = elem->out_sg;
     struct iovec *in_iov = elem->in_sg;
     unsigned out_num = elem->out_num;
@@ -234,29 +263,32 @@ static int process_request(IOQueue *ioq, VirtQueueElement *elem)
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, elem, inhdr);
+        do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector * 512, elem, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, elem, inhdr);
+        do_rdwr_cmd(q, false, iov, out_num, outhdr.sector * 512, elem, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_UNSUPP);
+        q->stats->other_ops++;
+        complete_request_early(q, elem, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
+        q->stats->flush_ops++;
         if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_IOERR);
+            complete_request_early(q, elem, inhdr, VIRTIO_BLK_S_IOERR);
         } else {
-            complete_request_early(s, elem, inhdr, VIRTIO_BLK_S_OK);
+            complete_request_early(q, elem, inhdr, VIRTIO_BLK_S_OK);
         }
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, elem, inhdr);
+        q->stats->other_ops++;
+        do_get_id_cmd(q, in_iov, in_num, elem, inhdr);
         return 0;
 
     default:
@@ -269,31 +301,37 @@ static int process_request(IOQueue *ioq, VirtQueueElement *elem)
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
-
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtQueueElement *elem;
     int ret;
     unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(s->vdev, &q->vring);
 
         for (;;) {
-            ret = vring_pop(s->vdev, &s->vring, &elem);
+            elem = virtqueue_alloc_element(q->vq);
+            ret = vring_pop(s->vdev, &q->vring, elem);
             if (ret < 0) {
-                assert(elem == NULL);
+                virtqueue_free_element(q->vq, elem);
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, elem->out_num,
-                                                        elem->in_num, elem->index);
-
-            if (process_request(&s->ioqueue, elem) < 0) {
-                vring_set_broken(&s->vring);
-                vring_free_element(elem);
+            trace_virtio_blk_data_plane_process_request(s, q->index,
+                                                        elem->out_num,
+                                                        elem->in_num,
+                                                        elem->index);
+
+            q->stats->requests++;
+            if (process_request(&q->ioqueue, elem) < 0) {
+                q->stats->completed++;
+                vring_set_broken(&q->vring);
+                vring_unmap_element(elem);
+                virtqueue_free_element(q->vq, elem);
                 ret = -EFAULT;
                 break;
             }
@@ -303,7 +341,7 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(s->vdev, &q->vring)) {
                 break;
             }
         } else { /* ret == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -315,11 +353,11 @@ static void handle_notify(EventNotifier *e)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
+    num_queued = ioq_num_queued(&q->ioqueue);
     if (num_queued > 0) {
-        s->num_reqs += num_queued;
+        q->num_reqs += num_queued;
 
-        int rc = ioq_submit(&s->ioqueue);
+        int rc = ioq_submit(&q->ioqueue);
         if (unlikely(rc < 0)) {
             fprintf(stderr, "ioq_submit failed %d\n", rc);
             exit(1);
@@ -329,30 +367,63 @@ static void handle_notify(EventNotifier *e)
 
 static void handle_io(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                io_notifier);
 
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
+    event_notifier_test_and_clear(&q->io_notifier);
+    if (ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        notify_guest(q);
     }
 
     /* If there were more requests than iovecs, the vring will not be empty yet
      * so check again.  There should now be enough resources to process more
      * requests.
      */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(&q->host_notifier);
+    }
+}
+
+/* Busy polling callbacks, see aio_context_set_poll_params() */
+static bool poll_notify(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(opaque,
+                                                VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    uint16_t last_avail_idx = q->vring.last_avail_idx;
+
+    if (q->vring.broken || !vring_more_avail(&q->vring)) {
+        return false;
     }
+    handle_notify(&q->host_notifier);
+
+    /* Requests may be left in the vring until iovecs are freed */
+    return q->vring.last_avail_idx != last_avail_idx;
+}
+
+static bool poll_io(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(opaque,
+                                                VirtIOBlockDataPlaneQueue,
+                                                io_notifier);
+
+    if (q->num_reqs == 0 || !ioq_has_completions(&q->ioqueue)) {
+        return false;
+    }
+    handle_io(&q->io_notifier);
+    return true;
 }
 
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockQueueStats *stats,
                                   VirtIOBlockDataPlane **dataplane,
                                   Error **errp)
 {
     VirtIOBlockDataPlane *s;
+    IOThread *iothread = NULL;
     int fd;
+    unsigned int i;
     Error *local_err = NULL;
 
     *dataplane = NULL;
@@ -373,6 +444,17 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return;
     }
 
+    if (blk->iothread && blk->num_iothreads) {
+        error_setg(errp, "x-iothread and x-iothreads cannot be used together");
+        return;
+    }
+    for (i = 0; i < blk->num_iothreads; i++) {
+        if (!blk->iothreads[i]) {
+            error_setg(errp, "x-iothreads[%u] is not set", i);
+            return;
+        }
+    }
+
     /* If dataplane is (re-)enabled while the guest is running there could be
      * block jobs that can conflict.
      */
@@ -396,9 +478,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     s->blk = blk;
 
     if (blk->iothread) {
-        s->iothread = blk->iothread;
-        object_ref(OBJECT(s->iothread));
-    } else {
+        iothread = blk->iothread;
+    } else if (!blk->num_iothreads) {
         /* Create per-device IOThread if none specified.  This is for
          * x-data-plane option compatibility.  If x-data-plane is removed we
          * can drop this.
@@ -407,9 +488,24 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                           sizeof(s->internal_iothread_obj),
                           TYPE_IOTHREAD);
         user_creatable_complete(OBJECT(&s->internal_iothread_obj), &error_abort);
-        s->iothread = &s->internal_iothread_obj;
+        iothread = &s->internal_iothread_obj;
+    }
+
+    /* Spread the virtqueues round-robin over the IOThreads */
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->index = i;
+        q->vq = virtio_get_queue(vdev, i);
+        q->stats = &stats[i];
+        q->iothread = blk->num_iothreads ?
+                      blk->iothreads[i % blk->num_iothreads] : iothread;
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
     }
-    s->ctx = iothread_get_aio_context(s->iothread);
 
     error_setg(&s->blocker, "block device is in use by data plane");
     bdrv_op_block_all(blk->conf.bs, s->blocker);
@@ -420,6 +516,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned int i;
+
     if (!s) {
         return;
     }
@@ -427,17 +525,59 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     bdrv_op_unblock_all(s->blk->conf.bs, s->blocker);
     error_free(s->blocker);
-    object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_queues; i++) {
+        object_unref(OBJECT(s->queues[i].iothread));
+    }
+    if (s->queues[0].iothread == &s->internal_iothread_obj) {
+        /* The reference taken by object_initialize() */
+        object_unref(OBJECT(&s->internal_iothread_obj));
+    }
+    g_free(s->queues);
     g_free(s);
 }
 
+/* Returns the IOThread of a virtqueue, or NULL for the internal one */
+IOThread *virtio_blk_data_plane_get_iothread(VirtIOBlockDataPlane *s,
+                                             unsigned int index)
+{
+    assert(index < s->num_queues);
+    if (s->queues[index].iothread == &s->internal_iothread_obj) {
+        return NULL;
+    }
+    return s->queues[index].iothread;
+}
+
+static void data_plane_queue_start(VirtIOBlockDataPlaneQueue *q)
+{
+    VirtIOBlockDataPlane *s = q->s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtQueue *vq = virtio_get_queue(s->vdev, q->index);
+    int i;
+
+    q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (k->set_host_notifier(qbus->parent, q->index, true) != 0) {
+        fprintf(stderr, "virtio-blk failed to set host notifier\n");
+        exit(1);
+    }
+    q->host_notifier = *virtio_queue_get_host_notifier(vq);
+
+    /* Set up ioqueue */
+    ioq_init(&q->ioqueue, s->fd, REQ_MAX);
+    for (i = 0; i < ARRAY_SIZE(q->requests); i++) {
+        ioq_put_iocb(&q->ioqueue, &q->requests[i].iocb);
+    }
+    q->io_notifier = *ioq_get_notifier(&q->ioqueue);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
-    VirtQueue *vq;
-    int i;
+    unsigned int i;
 
     if (s->started) {
         return;
@@ -449,46 +589,45 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        s->starting = false;
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            s->starting = false;
+            return;
+        }
     }
 
     /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
-
-    /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
-    }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    for (i = 0; i < s->num_queues; i++) {
+        data_plane_queue_start(&s->queues[i]);
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
 
     s->starting = false;
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(&q->host_notifier);
 
-    /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io);
-    aio_context_release(s->ctx);
+        /* Get this show started by hooking up our callbacks */
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+        aio_set_event_notifier(q->ctx, &q->io_notifier, handle_io);
+        aio_set_event_notifier_poll(q->ctx, &q->host_notifier, poll_notify);
+        aio_set_event_notifier_poll(q->ctx, &q->io_notifier, poll_io);
+        aio_context_release(q->ctx);
+    }
 }
 
 /* Context: QEMU global mutex held */
@@ -496,37 +635,43 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned int i;
+
     if (!s->started || s->stopping) {
         return;
     }
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+        aio_context_acquire(q->ctx);
 
-    /* Complete pending requests */
-    while (s->num_reqs > 0) {
-        aio_poll(s->ctx, true);
-    }
+        /* Stop notifications for new requests from guest */
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
 
-    /* Stop ioq callbacks (there are no pending requests left) */
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL);
+        /* Complete pending requests */
+        while (q->num_reqs > 0) {
+            aio_poll(q->ctx, true);
+        }
 
-    aio_context_release(s->ctx);
+        /* Stop ioq callbacks (there are no pending requests left) */
+        aio_set_event_notifier(q->ctx, &q->io_notifier, NULL);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+        aio_context_release(q->ctx);
 
-    ioq_cleanup(&s->ioqueue);
-    k->set_host_notifier(qbus->parent, 0, false);
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&q->vring, s->vdev, i);
+
+        ioq_cleanup(&q->ioqueue);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
     /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
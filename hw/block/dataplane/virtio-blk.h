@@ -20,9 +20,12 @@
 typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
 
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockQueueStats *stats,
                                   VirtIOBlockDataPlane **dataplane,
                                   Error **errp);
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+IOThread *virtio_blk_data_plane_get_iothread(VirtIOBlockDataPlane *s,
+                                             unsigned int index);
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_drain(VirtIOBlockDataPlane *s);
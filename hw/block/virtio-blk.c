@@ -26,29 +26,73 @@
 # include <scsi/sg.h>
 #endif
 #include "hw/virtio/virtio-bus.h"
+#include "qapi-visit.h"
 
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueue *vq;
+    VirtIOBlockQueueStats *stats;
+    VirtQueueElement *elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     struct virtio_scsi_inhdr *scsi;
     QEMUIOVector qiov;
+    int64_t sector_num;
     struct VirtIOBlockReq *next;
+    struct VirtIOBlockReq *mr_next;     /* next request of a merged batch */
+    QEMUIOVector *merged_qiov;          /* set in the first request only */
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
+/* Maximum number of requests that are collected before submission */
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
+typedef struct MultiReqBuffer {
+    VirtIOBlockReq      *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int        num_reqs;
+    bool                is_write;
+} MultiReqBuffer;
+
+static void virtio_blk_free_request(VirtIOBlockReq *req)
+{
+    if (req->elem) {
+        virtqueue_free_element(req->vq, req->elem);
+    }
+    g_free(req);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(vdev, s->vq);
+    virtqueue_push_pending(req->vq, req->elem,
+                           req->qiov.size + sizeof(*req->in));
+    req->stats->completed++;
+
+    /* Completions that happen together share a used index update and
+     * an interrupt */
+    qemu_bh_schedule(s->complete_bh);
+}
+
+static void virtio_blk_flush_completions(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned int i;
+
+    for (i = 0; i < s->blk.num_queues; i++) {
+        if (virtqueue_flush_pending(s->vqs[i])) {
+            virtio_notify(vdev, s->vqs[i]);
+        }
+    }
+}
+
+static void virtio_blk_complete_bh(void *opaque)
+{
+    virtio_blk_flush_completions(opaque);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -63,7 +107,7 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     } else if (action == BDRV_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         bdrv_acct_done(s->bs, &req->acct);
-        g_free(req);
+        virtio_blk_free_request(req);
     }
 
     bdrv_error_action(s->bs, action, is_read, error);
@@ -72,19 +116,31 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
+    VirtIOBlockReq *next = opaque;
 
-    trace_virtio_blk_rw_complete(req, ret);
+    while (next) {
+        VirtIOBlockReq *req = next;
+        next = req->mr_next;
+        trace_virtio_blk_rw_complete(req, ret);
 
-    if (ret) {
-        bool is_read = !(ldl_p(&req->out->type) & VIRTIO_BLK_T_OUT);
-        if (virtio_blk_handle_rw_error(req, -ret, is_read))
-            return;
-    }
+        if (req->merged_qiov) {
+            qemu_iovec_destroy(req->merged_qiov);
+            g_free(req->merged_qiov);
+            req->merged_qiov = NULL;
+        }
+        req->mr_next = NULL;
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-    bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+        if (ret) {
+            bool is_read = !(ldl_p(&req->out->type) & VIRTIO_BLK_T_OUT);
+            if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
+                continue;
+            }
+        }
+
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        bdrv_acct_done(req->dev->bs, &req->acct);
+        virtio_blk_free_request(req);
+    }
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -99,29 +155,21 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
 
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     bdrv_acct_done(req->dev->bs, &req->acct);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s,
+                                                unsigned int queue)
 {
     VirtIOBlockReq *req = g_malloc(sizeof(*req));
     req->dev = s;
+    req->vq = s->vqs[queue];
+    req->stats = &s->queue_stats[queue];
     req->qiov.size = 0;
     req->next = NULL;
-    return req;
-}
-
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-
-    if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
-            g_free(req);
-            return NULL;
-        }
-    }
-
+    req->mr_next = NULL;
+    req->merged_qiov = NULL;
+    req->elem = NULL;
     return req;
 }
 
@@ -140,9 +188,9 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * We also at least require the virtio_blk_inhdr, the virtio_scsi_inhdr
      * and the sense buffer pointer in the input segments.
      */
-    if (req->elem.out_num < 2 || req->elem.in_num < 3) {
+    if (req->elem->out_num < 2 || req->elem->in_num < 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        g_free(req);
+        virtio_blk_free_request(req);
         return;
     }
 
@@ -150,7 +198,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * The scsi inhdr is placed in the second-to-last input segment, just
      * before the regular inhdr.
      */
-    req->scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
+    req->scsi = (void *)req->elem->in_sg[req->elem->in_num - 2].iov_base;
 
     if (!req->dev->blk.scsi) {
         status = VIRTIO_BLK_S_UNSUPP;
@@ -160,7 +208,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     /*
      * No support for bidirection commands yet.
      */
-    if (req->elem.out_num > 2 && req->elem.in_num > 3) {
+    if (req->elem->out_num > 2 && req->elem->in_num > 3) {
         status = VIRTIO_BLK_S_UNSUPP;
         goto fail;
     }
@@ -169,34 +217,34 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     struct sg_io_hdr hdr;
     memset(&hdr, 0, sizeof(struct sg_io_hdr));
     hdr.interface_id = 'S';
-    hdr.cmd_len = req->elem.out_sg[1].iov_len;
-    hdr.cmdp = req->elem.out_sg[1].iov_base;
+    hdr.cmd_len = req->elem->out_sg[1].iov_len;
+    hdr.cmdp = req->elem->out_sg[1].iov_base;
     hdr.dxfer_len = 0;
 
-    if (req->elem.out_num > 2) {
+    if (req->elem->out_num > 2) {
         /*
          * If there are more than the minimally required 2 output segments
          * there is write payload starting from the third iovec.
          */
         hdr.dxfer_direction = SG_DXFER_TO_DEV;
-        hdr.iovec_count = req->elem.out_num - 2;
+        hdr.iovec_count = req->elem->out_num - 2;
 
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.out_sg[i + 2].iov_len;
+            hdr.dxfer_len += req->elem->out_sg[i + 2].iov_len;
 
-        hdr.dxferp = req->elem.out_sg + 2;
+        hdr.dxferp = req->elem->out_sg + 2;
 
-    } else if (req->elem.in_num > 3) {
+    } else if (req->elem->in_num > 3) {
         /*
          * If we have more than 3 input segments the guest wants to actually
          * read data.
          */
         hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        hdr.iovec_count = req->elem.in_num - 3;
+        hdr.iovec_count = req->elem->in_num - 3;
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.in_sg[i].iov_len;
+            hdr.dxfer_len += req->elem->in_sg[i].iov_len;
 
-        hdr.dxferp = req->elem.in_sg;
+        hdr.dxferp = req->elem->in_sg;
     } else {
         /*
          * Some SCSI commands don't actually transfer any data.
@@ -204,8 +252,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
         hdr.dxfer_direction = SG_DXFER_NONE;
     }
 
-    hdr.sbp = req->elem.in_sg[req->elem.in_num - 3].iov_base;
-    hdr.mx_sb_len = req->elem.in_sg[req->elem.in_num - 3].iov_len;
+    hdr.sbp = req->elem->in_sg[req->elem->in_num - 3].iov_base;
+    hdr.mx_sb_len = req->elem->in_sg[req->elem->in_num - 3].iov_len;
 
     ret = bdrv_ioctl(req->dev->bs, SG_IO, &hdr);
     if (ret) {
@@ -232,7 +280,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     stl_p(&req->scsi->data_len, hdr.dxfer_len);
 
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
     return;
 #else
     abort();
@@ -242,89 +290,163 @@ fail:
     /* Just put anything nonzero so that the ioctl fails in the guest.  */
     stl_p(&req->scsi->errors, 255);
     virtio_blk_req_complete(req, status);
-    g_free(req);
+    virtio_blk_free_request(req);
 }
 
-typedef struct MultiReqBuffer {
-    BlockRequest        blkreq[32];
-    unsigned int        num_writes;
-} MultiReqBuffer;
-
-static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+static void virtio_blk_submit_requests(BlockDriverState *bs,
+                                       MultiReqBuffer *mrb,
+                                       int start, int num_reqs, int niov)
 {
-    int i, ret;
+    VirtIOBlockReq *req = mrb->reqs[start];
+    QEMUIOVector *qiov = &req->qiov;
+    int64_t sector_num = req->sector_num;
+    int nb_sectors;
+    int i;
 
-    if (!mrb->num_writes) {
-        return;
-    }
+    if (num_reqs > 1) {
+        req->merged_qiov = g_new(QEMUIOVector, 1);
+        qemu_iovec_init(req->merged_qiov, niov);
 
-    ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_writes);
-    if (ret != 0) {
-        for (i = 0; i < mrb->num_writes; i++) {
-            if (mrb->blkreq[i].error) {
-                virtio_blk_rw_complete(mrb->blkreq[i].opaque, -EIO);
+        for (i = start; i < start + num_reqs; i++) {
+            qemu_iovec_concat(req->merged_qiov, &mrb->reqs[i]->qiov, 0,
+                              mrb->reqs[i]->qiov.size);
+            if (i > start) {
+                mrb->reqs[i - 1]->mr_next = mrb->reqs[i];
             }
         }
+        qiov = req->merged_qiov;
+
+        bdrv_acct_merge_done(bs, mrb->is_write ? BDRV_ACCT_WRITE
+                                               : BDRV_ACCT_READ,
+                             num_reqs - 1);
     }
 
-    mrb->num_writes = 0;
+    nb_sectors = qiov->size / BDRV_SECTOR_SIZE;
+    trace_virtio_blk_submit_multireq(mrb, start, num_reqs, sector_num,
+                                     nb_sectors, mrb->is_write);
+
+    if (mrb->is_write) {
+        bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                        virtio_blk_rw_complete, req);
+    } else {
+        bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                       virtio_blk_rw_complete, req);
+    }
 }
 
-static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
+static int multireq_compare(const void *a, const void *b)
 {
-    bdrv_acct_start(req->dev->bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+    const VirtIOBlockReq *req1 = *(VirtIOBlockReq **)a,
+                         *req2 = *(VirtIOBlockReq **)b;
 
     /*
-     * Make sure all outstanding writes are posted to the backing device.
+     * Note that we can't simply subtract sector_num1 from sector_num2
+     * here as that could overflow the return value.
      */
-    virtio_submit_multiwrite(req->dev->bs, mrb);
-    bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
+    if (req1->sector_num > req2->sector_num) {
+        return 1;
+    } else if (req1->sector_num < req2->sector_num) {
+        return -1;
+    } else {
+        return 0;
+    }
 }
 
-static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
+/*
+ * Submit all requests in @mrb, merging those that are sequential on disk
+ * into a single block layer request.  A merged request never exceeds the
+ * maximal transfer length of the backend or IOV_MAX segments.
+ */
+static void virtio_blk_submit_multireq(BlockDriverState *bs,
+                                       MultiReqBuffer *mrb)
 {
-    BlockRequest *blkreq;
-    uint64_t sector;
-
-    sector = ldq_p(&req->out->sector);
+    int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
+    int max_xfer_len;
+    int64_t sector_num = 0;
 
-    bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
-
-    trace_virtio_blk_handle_write(req, sector, req->qiov.size / 512);
-
-    if (sector & req->dev->sector_mask) {
-        virtio_blk_rw_complete(req, -EIO);
+    if (mrb->num_reqs == 0) {
         return;
     }
-    if (req->qiov.size % req->dev->conf->logical_block_size) {
-        virtio_blk_rw_complete(req, -EIO);
+
+    if (mrb->num_reqs == 1) {
+        virtio_blk_submit_requests(bs, mrb, 0, 1, -1);
+        mrb->num_reqs = 0;
         return;
     }
 
-    if (mrb->num_writes == 32) {
-        virtio_submit_multiwrite(req->dev->bs, mrb);
+    max_xfer_len = bdrv_get_max_transfer_length(bs);
+    if (max_xfer_len == 0) {
+        max_xfer_len = INT_MAX / BDRV_SECTOR_SIZE;
+    }
+
+    qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs), &multireq_compare);
+
+    for (i = 0; i < mrb->num_reqs; i++) {
+        VirtIOBlockReq *req = mrb->reqs[i];
+        int req_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+
+        if (num_reqs > 0 &&
+            (sector_num + nb_sectors != req->sector_num ||
+             niov + req->qiov.niov > IOV_MAX ||
+             nb_sectors + req_sectors > max_xfer_len)) {
+            virtio_blk_submit_requests(bs, mrb, start, num_reqs, niov);
+            num_reqs = 0;
+        }
+
+        if (num_reqs == 0) {
+            sector_num = req->sector_num;
+            nb_sectors = niov = 0;
+            start = i;
+        }
+
+        nb_sectors += req_sectors;
+        niov += req->qiov.niov;
+        num_reqs++;
     }
 
-    blkreq = &mrb->blkreq[mrb->num_writes];
-    blkreq->sector = sector;
-    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
-    blkreq->qiov = &req->qiov;
-    blkreq->cb = virtio_blk_rw_complete;
-    blkreq->opaque = req;
-    blkreq->error = 0;
+    virtio_blk_submit_requests(bs, mrb, start, num_reqs, niov);
+    mrb->num_reqs = 0;
+}
 
-    mrb->num_writes++;
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    virtio_blk_submit_multireq(s->bs, s->mrb);
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
+{
+    req->stats->flush_ops++;
+    bdrv_acct_start(req->dev->bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+
+    /*
+     * Make sure all outstanding writes are posted to the backing device.
+     */
+    virtio_blk_submit_multireq(req->dev->bs, mrb);
+    bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
+}
+
+static void virtio_blk_handle_rw(VirtIOBlockReq *req, MultiReqBuffer *mrb,
+                                 bool is_write)
 {
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
 
-    bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
-
-    trace_virtio_blk_handle_read(req, sector, req->qiov.size / 512);
+    if (is_write) {
+        bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size,
+                        BDRV_ACCT_WRITE);
+        req->stats->wr_ops++;
+        req->stats->wr_bytes += req->qiov.size;
+        trace_virtio_blk_handle_write(req, sector, req->qiov.size / 512);
+    } else {
+        bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size,
+                        BDRV_ACCT_READ);
+        req->stats->rd_ops++;
+        req->stats->rd_bytes += req->qiov.size;
+        trace_virtio_blk_handle_read(req, sector, req->qiov.size / 512);
+    }
 
     if (sector & req->dev->sector_mask) {
         virtio_blk_rw_complete(req, -EIO);
@@ -334,9 +456,16 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
-    bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                   req->qiov.size / BDRV_SECTOR_SIZE,
-                   virtio_blk_rw_complete, req);
+
+    /* Only requests of the same direction are merged */
+    if (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+        (mrb->num_reqs > 0 && mrb->is_write != is_write)) {
+        virtio_blk_submit_multireq(req->dev->bs, mrb);
+    }
+
+    req->sector_num = sector;
+    mrb->reqs[mrb->num_reqs++] = req;
+    mrb->is_write = is_write;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -344,76 +473,98 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 {
     uint32_t type;
 
-    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+    if (req->elem->out_num < 1 || req->elem->in_num < 1) {
         error_report("virtio-blk missing headers");
         exit(1);
     }
 
-    if (req->elem.out_sg[0].iov_len < sizeof(*req->out) ||
-        req->elem.in_sg[req->elem.in_num - 1].iov_len < sizeof(*req->in)) {
+    if (req->elem->out_sg[0].iov_len < sizeof(*req->out) ||
+        req->elem->in_sg[req->elem->in_num - 1].iov_len < sizeof(*req->in)) {
         error_report("virtio-blk header not in correct element");
         exit(1);
     }
 
-    req->out = (void *)req->elem.out_sg[0].iov_base;
-    req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+    req->out = (void *)req->elem->out_sg[0].iov_base;
+    req->in = (void *)req->elem->in_sg[req->elem->in_num - 1].iov_base;
 
     type = ldl_p(&req->out->type);
 
     if (type & VIRTIO_BLK_T_FLUSH) {
         virtio_blk_handle_flush(req, mrb);
     } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        req->stats->other_ops++;
         virtio_blk_handle_scsi(req);
     } else if (type & VIRTIO_BLK_T_GET_ID) {
         VirtIOBlock *s = req->dev;
 
+        req->stats->other_ops++;
+
         /*
          * NB: per existing s/n string convention the string is
          * terminated by '\0' only when shorter than buffer.
          */
-        strncpy(req->elem.in_sg[0].iov_base,
+        strncpy(req->elem->in_sg[0].iov_base,
                 s->blk.serial ? s->blk.serial : "",
-                MIN(req->elem.in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
+                MIN(req->elem->in_sg[0].iov_len, VIRTIO_BLK_ID_BYTES));
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        g_free(req);
+        virtio_blk_free_request(req);
     } else if (type & VIRTIO_BLK_T_OUT) {
-        qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
-                                 req->elem.out_num - 1);
-        virtio_blk_handle_write(req, mrb);
+        qemu_iovec_init_external(&req->qiov, &req->elem->out_sg[1],
+                                 req->elem->out_num - 1);
+        virtio_blk_handle_rw(req, mrb, true);
     } else if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_BARRIER) {
         /* VIRTIO_BLK_T_IN is 0, so we can't just & it. */
-        qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
-                                 req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        qemu_iovec_init_external(&req->qiov, &req->elem->in_sg[0],
+                                 req->elem->in_num - 1);
+        virtio_blk_handle_rw(req, mrb, false);
     } else {
+        req->stats->other_ops++;
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
-        g_free(req);
+        virtio_blk_free_request(req);
     }
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {
-        .num_writes = 0,
-    };
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int queue = virtio_get_queue_index(vq);
+    unsigned int i, num;
 
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
      * dataplane here instead of waiting for .set_status().
      */
     if (s->dataplane) {
+        /* Dataplane takes over the used ring from here */
+        virtio_blk_flush_completions(s);
         virtio_blk_data_plane_start(s->dataplane);
         return;
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
+    while ((num = virtqueue_pop_batch(vq, elems, ARRAY_SIZE(elems)))) {
+        for (i = 0; i < num; i++) {
+            VirtIOBlockReq *req = virtio_blk_alloc_request(s, queue);
+
+            req->elem = elems[i];
+            req->stats->requests++;
+            virtio_blk_handle_request(req, s->mrb);
+        }
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    /*
+     * With a merge window, requests that arrive with the next few kicks
+     * get a chance to be merged with the ones collected so far.
+     */
+    if (s->blk.merge_window_us && s->mrb->num_reqs > 0) {
+        if (!timer_pending(s->merge_timer)) {
+            timer_mod(s->merge_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                      s->blk.merge_window_us);
+        }
+    } else {
+        virtio_blk_submit_multireq(s->bs, s->mrb);
+    }
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -427,7 +578,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -436,11 +587,12 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     s->rq = NULL;
 
     while (req) {
+        VirtIOBlockReq *next = req->next;
         virtio_blk_handle_request(req, &mrb);
-        req = req->next;
+        req = next;
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_blk_submit_multireq(s->bs, &mrb);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -449,6 +601,9 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtIOBlock *s = opaque;
 
     if (!running) {
+        /* Requests held back for merging must be drained with the rest */
+        timer_del(s->merge_timer);
+        virtio_blk_submit_multireq(s->bs, s->mrb);
         return;
     }
 
@@ -468,11 +623,16 @@ static void virtio_blk_reset(VirtIODevice *vdev)
     }
 #endif
 
+    timer_del(s->merge_timer);
+    virtio_blk_submit_multireq(s->bs, s->mrb);
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
     bdrv_drain_all();
+    qemu_bh_cancel(s->complete_bh);
+    virtio_blk_flush_completions(s);
     bdrv_set_enable_write_cache(s->bs, s->original_wce);
 }
 
@@ -514,7 +674,8 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    stw_raw(&blkcfg.num_queues, s->blk.num_queues);
+    memcpy(config, &blkcfg, vdev->config_len);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -522,7 +683,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, vdev->config_len);
     bdrv_set_enable_write_cache(s->bs, blkcfg.wce != 0);
 }
 
@@ -535,6 +696,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     features |= (1 << VIRTIO_BLK_F_TOPOLOGY);
     features |= (1 << VIRTIO_BLK_F_BLK_SIZE);
     features |= (1 << VIRTIO_BLK_F_SCSI);
+    if (s->blk.num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
 
     if (s->blk.config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
@@ -592,11 +756,15 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     VirtIOBlockReq *req = s->rq;
 
+    virtio_blk_flush_completions(s);
     virtio_save(vdev, f);
     
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        qemu_put_buffer(f, (unsigned char *)req->elem, sizeof(*req->elem));
+        if (s->blk.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -617,15 +785,29 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        VirtQueueElement *elem = g_new(VirtQueueElement, 1);
+        unsigned int queue = 0;
+        VirtIOBlockReq *req;
+
+        qemu_get_buffer(f, (unsigned char *)elem, sizeof(*elem));
+        if (s->blk.num_queues > 1) {
+            queue = qemu_get_be32(f);
+            if (queue >= s->blk.num_queues) {
+                error_report("Invalid virtio-blk queue index %u", queue);
+                g_free(elem);
+                return -EINVAL;
+            }
+        }
+        req = virtio_blk_alloc_request(s, queue);
+        req->elem = elem;
+        req->stats->requests++;
         req->next = s->rq;
         s->rq = req;
 
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
+        virtqueue_map_sg(req->elem->in_sg, req->elem->in_addr,
+            req->elem->in_num, 1);
+        virtqueue_map_sg(req->elem->out_sg, req->elem->out_addr,
+            req->elem->out_num, 0);
     }
 
     return 0;
@@ -670,9 +852,13 @@ static void virtio_blk_migration_state_changed(Notifier *notifier, void *data)
         if (s->dataplane) {
             return;
         }
-        bdrv_drain_all(); /* complete in-flight non-dataplane requests */
+        /* complete in-flight non-dataplane requests */
+        timer_del(s->merge_timer);
+        virtio_blk_submit_multireq(s->bs, s->mrb);
+        bdrv_drain_all();
+        virtio_blk_flush_completions(s);
         virtio_blk_data_plane_create(VIRTIO_DEVICE(s), &s->blk,
-                                     &s->dataplane, &err);
+                                     s->queue_stats, &s->dataplane, &err);
         if (err != NULL) {
             error_report("%s", error_get_pretty(err));
             error_free(err);
@@ -681,6 +867,48 @@ static void virtio_blk_migration_state_changed(Notifier *notifier, void *data)
 }
 #endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
 
+static void virtio_blk_get_queue_stats(Object *obj, Visitor *v, void *opaque,
+                                       const char *name, Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    VirtioBlkQueueStatsList *head = NULL, **p_next = &head;
+    unsigned int i;
+
+    for (i = 0; s->queue_stats && i < s->blk.num_queues; i++) {
+        VirtIOBlockQueueStats *qs = &s->queue_stats[i];
+        VirtioBlkQueueStatsList *entry = g_new0(VirtioBlkQueueStatsList, 1);
+        VirtioBlkQueueStats *info = g_new0(VirtioBlkQueueStats, 1);
+
+        info->queue = i;
+        info->requests = qs->requests;
+        info->in_flight = qs->requests - qs->completed;
+        info->rd_operations = qs->rd_ops;
+        info->wr_operations = qs->wr_ops;
+        info->flush_operations = qs->flush_ops;
+        info->other_operations = qs->other_ops;
+        info->rd_bytes = qs->rd_bytes;
+        info->wr_bytes = qs->wr_bytes;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        if (s->dataplane) {
+            IOThread *iothread =
+                virtio_blk_data_plane_get_iothread(s->dataplane, i);
+
+            if (iothread) {
+                info->has_iothread = true;
+                info->iothread = iothread_get_id(iothread);
+            }
+        }
+#endif
+
+        entry->value = info;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    visit_type_VirtioBlkQueueStatsList(v, &head, name, errp);
+    qapi_free_VirtioBlkQueueStatsList(head);
+}
+
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -690,6 +918,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 #endif
     static int virtio_blk_id;
+    unsigned int i;
 
     if (!blk->conf.bs) {
         error_setg(errp, "drive property not set");
@@ -707,19 +936,45 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (blk->num_queues < 1 || blk->num_queues > VIRTIO_BLK_MAX_QUEUES) {
+        error_setg(errp, "num-queues property must be between 1 and %d",
+                   VIRTIO_BLK_MAX_QUEUES);
+        return;
+    }
+
+    /* The num_queues field is only there with VIRTIO_BLK_F_MQ, so that the
+     * config space of single-queue devices stays the same for migration.
+     */
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
-                sizeof(struct virtio_blk_config));
+                blk->num_queues > 1 ? sizeof(struct virtio_blk_config) :
+                offsetof(struct virtio_blk_config, unused));
 
     s->bs = blk->conf.bs;
     s->conf = &blk->conf;
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    s->complete_bh = qemu_bh_new(virtio_blk_complete_bh, s);
+    s->mrb = g_new0(MultiReqBuffer, 1);
+    s->merge_timer = timer_new_us(QEMU_CLOCK_REALTIME,
+                                  virtio_blk_merge_timer_cb, s);
+
+    s->vqs = g_new0(VirtQueue *, blk->num_queues);
+    s->queue_stats = g_new0(VirtIOBlockQueueStats, blk->num_queues);
+    for (i = 0; i < blk->num_queues; i++) {
+        s->vqs[i] = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
-    virtio_blk_data_plane_create(vdev, blk, &s->dataplane, &err);
+    virtio_blk_data_plane_create(vdev, blk, s->queue_stats, &s->dataplane,
+                                 &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        qemu_bh_delete(s->complete_bh);
+        timer_free(s->merge_timer);
+        g_free(s->mrb);
+        g_free(s->vqs);
+        g_free(s->queue_stats);
+        s->queue_stats = NULL;
         virtio_cleanup(vdev);
         return;
     }
@@ -748,9 +1003,17 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
 #endif
+    timer_del(s->merge_timer);
+    virtio_blk_submit_multireq(s->bs, s->mrb);
+    timer_free(s->merge_timer);
+    qemu_bh_delete(s->complete_bh);
+    g_free(s->mrb);
     qemu_del_vm_change_state_handler(s->change);
     unregister_savevm(dev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
+    g_free(s->vqs);
+    g_free(s->queue_stats);
+    s->queue_stats = NULL;
     virtio_cleanup(vdev);
 }
 
@@ -775,10 +1038,17 @@ static void virtio_blk_class_init(ObjectClass *klass, void *data)
     vdc->reset = virtio_blk_reset;
 }
 
+static void virtio_blk_instance_init(Object *obj)
+{
+    object_property_add(obj, "queue-stats", "VirtioBlkQueueStatsList",
+                        virtio_blk_get_queue_stats, NULL, NULL, NULL, NULL);
+}
+
 static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_BLK,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBlock),
+    .instance_init = virtio_blk_instance_init,
     .class_init = virtio_blk_class_init,
 };
 
@@ -0,0 +1,394 @@
+/*
+ * Virtio SCSI dataplane
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/virtio-scsi.h"
+#include "hw/scsi/scsi.h"
+#include "block/scsi.h"
+#include "block/aio.h"
+#include "hw/virtio/virtio-bus.h"
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_init(VirtIOSCSI *s)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+
+    object_ref(OBJECT(vs->conf.iothread));
+    s->ctx = iothread_get_aio_context(vs->conf.iothread);
+    error_setg(&s->blocker, "block device is in use by data plane");
+
+    s->ctrl_vring = g_new0(VirtIOSCSIVring, 1);
+    s->event_vring = g_new0(VirtIOSCSIVring, 1);
+    s->cmd_vrings = g_new0(VirtIOSCSIVring, vs->conf.num_queues);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+
+    if (!s->ctx) {
+        return;
+    }
+
+    virtio_scsi_dataplane_stop(s);
+    g_free(s->ctrl_vring);
+    g_free(s->event_vring);
+    g_free(s->cmd_vrings);
+    error_free(s->blocker);
+    object_unref(OBJECT(vs->conf.iothread));
+    s->ctx = NULL;
+}
+
+VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
+                                         VirtIOSCSIVring *vring)
+{
+    VirtIOSCSIReq *req;
+
+    req = g_malloc(sizeof(*req));
+    if (vring_pop(VIRTIO_DEVICE(s), &vring->vring, &req->elem) < 0) {
+        g_free(req);
+        return NULL;
+    }
+
+    virtio_scsi_parse_req(s, vring->vq, req);
+    req->vring = vring;
+    return req;
+}
+
+void virtio_scsi_vring_notify(VirtIOSCSI *s, VirtIOSCSIVring *vring)
+{
+    if (vring_should_notify(VIRTIO_DEVICE(s), &vring->vring)) {
+        event_notifier_set(&vring->guest_notifier);
+    }
+}
+
+static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *vring = container_of(notifier,
+                                          VirtIOSCSIVring, host_notifier);
+    VirtIOSCSI *s = vring->parent;
+    VirtIOSCSIReq *req;
+
+    event_notifier_test_and_clear(notifier);
+    while ((req = virtio_scsi_pop_req_vring(s, vring))) {
+        virtio_scsi_handle_ctrl_req(s, req);
+    }
+}
+
+static void virtio_scsi_iothread_handle_event(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *vring = container_of(notifier,
+                                          VirtIOSCSIVring, host_notifier);
+    VirtIOSCSI *s = vring->parent;
+
+    event_notifier_test_and_clear(notifier);
+    virtio_scsi_handle_event_req(s);
+}
+
+static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *vring = container_of(notifier,
+                                          VirtIOSCSIVring, host_notifier);
+    VirtIOSCSI *s = vring->parent;
+    VirtIOSCSIReq *req;
+
+    event_notifier_test_and_clear(notifier);
+    while ((req = virtio_scsi_pop_req_vring(s, vring))) {
+        virtio_scsi_handle_cmd_req(s, req);
+    }
+}
+
+static bool virtio_scsi_iothread_poll_cmd(void *opaque)
+{
+    VirtIOSCSIVring *vring = container_of(opaque,
+                                          VirtIOSCSIVring, host_notifier);
+    VirtIOSCSIReq *req;
+    bool progress = false;
+
+    if (vring->vring.broken || !vring_more_avail(&vring->vring)) {
+        return false;
+    }
+    while ((req = virtio_scsi_pop_req_vring(vring->parent, vring))) {
+        virtio_scsi_handle_cmd_req(vring->parent, req);
+        progress = true;
+    }
+    return progress;
+}
+
+/* Returns false and reports why if a LUN cannot be used from the iothread */
+static bool virtio_scsi_dataplane_check_lun(VirtIOSCSI *s, SCSIDevice *d)
+{
+    Error *local_err = NULL;
+
+    if (d->type == TYPE_ROM) {
+        error_report("virtio-scsi: removable media LUN %d:%d is not "
+                     "supported with iothread", d->id, d->lun);
+        return false;
+    }
+    if (d->conf.bs && !bdrv_can_set_aio_context(d->conf.bs, &local_err)) {
+        error_report("virtio-scsi: LUN %d:%d: %s", d->id, d->lun,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+    return true;
+}
+
+/* Move the block devices of all LUNs to @ctx */
+static void virtio_scsi_set_luns_aio_context(VirtIOSCSI *s, AioContext *ctx)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        if (d->conf.bs) {
+            bdrv_set_aio_context(d->conf.bs, ctx);
+        }
+    }
+}
+
+/* Completions of requests popped by the iothread go through the virtqueue
+ * from now on.
+ */
+static void virtio_scsi_release_vring_reqs(VirtIOSCSI *s)
+{
+    BusChild *kid;
+    SCSIRequest *r;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        QTAILQ_FOREACH(r, &d->requests, next) {
+            VirtIOSCSIReq *req = r->hba_private;
+
+            if (req) {
+                req->vring = NULL;
+            }
+        }
+    }
+}
+
+static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtIOSCSIVring *r,
+                                  VirtQueue *vq, int n,
+                                  EventNotifierHandler *handler)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int rc;
+
+    /* Set up virtqueue notify */
+    rc = k->set_host_notifier(qbus->parent, n, true);
+    if (rc != 0) {
+        error_report("virtio-scsi: Failed to set host notifier (%d)", rc);
+        return rc;
+    }
+    if (!vring_setup(&r->vring, VIRTIO_DEVICE(s), n)) {
+        error_report("virtio-scsi: VRing setup failed");
+        k->set_host_notifier(qbus->parent, n, false);
+        return -ENOMEM;
+    }
+
+    r->parent = s;
+    r->vq = vq;
+    r->host_notifier = *virtio_queue_get_host_notifier(vq);
+    r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
+    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
+    return 0;
+}
+
+static void virtio_scsi_vring_teardown(VirtIOSCSI *s, VirtIOSCSIVring *r,
+                                       int n)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    /* Sync vring state back to virtqueue so that non-dataplane request
+     * processing can continue when we disable the host notifier below.
+     */
+    vring_teardown(&r->vring, VIRTIO_DEVICE(s), n);
+    k->set_host_notifier(qbus->parent, n, false);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_start(VirtIOSCSI *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    BusChild *kid;
+    int i, rc;
+
+    if (s->dataplane_started ||
+        s->dataplane_starting ||
+        s->dataplane_disabled ||
+        s->ctx == NULL) {
+        return;
+    }
+
+    /* Fall back to the main loop if any LUN cannot be moved */
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        if (!virtio_scsi_dataplane_check_lun(s, d)) {
+            s->dataplane_disabled = true;
+            return;
+        }
+    }
+
+    s->dataplane_starting = true;
+
+    /* Set up guest notifier (irq) */
+    rc = k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, true);
+    if (rc != 0) {
+        error_report("virtio-scsi: Failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", rc);
+        s->dataplane_disabled = true;
+        s->dataplane_starting = false;
+        return;
+    }
+
+    /* Complete requests submitted by the main loop, then hand the LUNs
+     * over to the iothread.
+     */
+    virtio_scsi_set_luns_aio_context(s, s->ctx);
+
+    aio_context_acquire(s->ctx);
+    rc = virtio_scsi_vring_init(s, s->ctrl_vring, vs->ctrl_vq, 0,
+                                virtio_scsi_iothread_handle_ctrl);
+    if (rc) {
+        goto fail_ctrl;
+    }
+    rc = virtio_scsi_vring_init(s, s->event_vring, vs->event_vq, 1,
+                                virtio_scsi_iothread_handle_event);
+    if (rc) {
+        goto fail_event;
+    }
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        rc = virtio_scsi_vring_init(s, &s->cmd_vrings[i], vs->cmd_vqs[i],
+                                    i + 2, virtio_scsi_iothread_handle_cmd);
+        if (rc) {
+            goto fail_cmd;
+        }
+        aio_set_event_notifier_poll(s->ctx, &s->cmd_vrings[i].host_notifier,
+                                    virtio_scsi_iothread_poll_cmd);
+    }
+
+    s->dataplane_starting = false;
+    s->dataplane_started = true;
+    trace_virtio_scsi_dataplane_start(s);
+
+    /* Kick right away to begin processing requests already in the vrings */
+    event_notifier_set(&s->ctrl_vring->host_notifier);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        event_notifier_set(&s->cmd_vrings[i].host_notifier);
+    }
+    aio_context_release(s->ctx);
+    return;
+
+fail_cmd:
+    while (--i >= 0) {
+        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i].host_notifier, NULL);
+        virtio_scsi_vring_teardown(s, &s->cmd_vrings[i], i + 2);
+    }
+    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+    virtio_scsi_vring_teardown(s, s->event_vring, 1);
+fail_event:
+    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+    virtio_scsi_vring_teardown(s, s->ctrl_vring, 0);
+fail_ctrl:
+    virtio_scsi_set_luns_aio_context(s, qemu_get_aio_context());
+    aio_context_release(s->ctx);
+    k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, false);
+    s->dataplane_disabled = true;
+    s->dataplane_starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    int i;
+
+    if (!s->dataplane_started || s->dataplane_stopping) {
+        return;
+    }
+    s->dataplane_stopping = true;
+    trace_virtio_scsi_dataplane_stop(s);
+
+    aio_context_acquire(s->ctx);
+
+    /* Stop notifications for new requests from guest */
+    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i].host_notifier, NULL);
+    }
+
+    /* Complete pending requests and give the LUNs back to the main loop.
+     * Requests that are still queued, e.g. after an I/O error stopped the
+     * VM, are completed through the virtqueue later.
+     */
+    virtio_scsi_set_luns_aio_context(s, qemu_get_aio_context());
+    virtio_scsi_release_vring_reqs(s);
+
+    aio_context_release(s->ctx);
+
+    virtio_scsi_vring_teardown(s, s->ctrl_vring, 0);
+    virtio_scsi_vring_teardown(s, s->event_vring, 1);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        virtio_scsi_vring_teardown(s, &s->cmd_vrings[i], i + 2);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, false);
+
+    s->dataplane_started = false;
+    s->dataplane_stopping = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_hotplug(VirtIOSCSI *s, SCSIDevice *d)
+{
+    if (d->conf.bs) {
+        bdrv_op_block_all(d->conf.bs, s->blocker);
+    }
+    if (!s->dataplane_started) {
+        return;
+    }
+
+    if (!virtio_scsi_dataplane_check_lun(s, d)) {
+        virtio_scsi_dataplane_stop(s);
+        s->dataplane_disabled = true;
+        return;
+    }
+    if (d->conf.bs) {
+        bdrv_set_aio_context(d->conf.bs, s->ctx);
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_hot_unplug(VirtIOSCSI *s, SCSIDevice *d)
+{
+    if (!d->conf.bs) {
+        return;
+    }
+
+    if (bdrv_get_aio_context(d->conf.bs) != qemu_get_aio_context()) {
+        aio_context_acquire(s->ctx);
+        bdrv_set_aio_context(d->conf.bs, qemu_get_aio_context());
+        aio_context_release(s->ctx);
+    }
+    bdrv_op_unblock_all(d->conf.bs, s->blocker);
+}
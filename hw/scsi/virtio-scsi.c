@@ -18,27 +18,9 @@
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
-
-typedef struct VirtIOSCSIReq {
-    VirtIOSCSI *dev;
-    VirtQueue *vq;
-    VirtQueueElement elem;
-    QEMUSGList qsgl;
-    SCSIRequest *sreq;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdReq      *cmd;
-        VirtIOSCSICtrlTMFReq  *tmf;
-        VirtIOSCSICtrlANReq   *an;
-    } req;
-    union {
-        char                  *buf;
-        VirtIOSCSICmdResp     *cmd;
-        VirtIOSCSICtrlTMFResp *tmf;
-        VirtIOSCSICtrlANResp  *an;
-        VirtIOSCSIEvent       *event;
-    } resp;
-} VirtIOSCSIReq;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "migration/migration.h"
+#endif
 
 static inline int virtio_scsi_get_lun(uint8_t *lun)
 {
@@ -61,13 +43,29 @@ static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+    uint32_t len = req->qsgl.size + req->elem.in_sg[0].iov_len;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSIVring *vring = req->vring;
+
+    if (vring) {
+        vring_push(&vring->vring, &req->elem, len);
+    } else
+#endif
+    {
+        virtqueue_push(vq, &req->elem, len);
+    }
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
     g_free(req);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (vring) {
+        virtio_scsi_vring_notify(s, vring);
+        return;
+    }
+#endif
     virtio_notify(vdev, vq);
 }
 
@@ -88,13 +86,15 @@ static void qemu_sgl_init_external(VirtIOSCSIReq *req, struct iovec *sg,
     }
 }
 
-static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
-                                  VirtIOSCSIReq *req)
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req)
 {
     assert(req->elem.in_num);
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    req->vring = NULL;
+#endif
     if (req->elem.out_num) {
         req->req.buf = req->elem.out_sg[0].iov_base;
     }
@@ -275,37 +275,66 @@ fail:
     req->resp.tmf->response = VIRTIO_SCSI_S_BAD_TARGET;
 }
 
-static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
+void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
-    VirtIOSCSIReq *req;
+    int out_size, in_size;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+        return;
+    }
+
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (req->req.tmf->type == VIRTIO_SCSI_T_TMF) {
+        if (out_size < sizeof(VirtIOSCSICtrlTMFReq) ||
+            in_size < sizeof(VirtIOSCSICtrlTMFResp)) {
             virtio_scsi_bad_req();
-            continue;
         }
+        virtio_scsi_do_tmf(s, req);
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (req->req.tmf->type == VIRTIO_SCSI_T_TMF) {
-            if (out_size < sizeof(VirtIOSCSICtrlTMFReq) ||
-                in_size < sizeof(VirtIOSCSICtrlTMFResp)) {
-                virtio_scsi_bad_req();
-            }
-            virtio_scsi_do_tmf(s, req);
+    } else if (req->req.tmf->type == VIRTIO_SCSI_T_AN_QUERY ||
+               req->req.tmf->type == VIRTIO_SCSI_T_AN_SUBSCRIBE) {
+        if (out_size < sizeof(VirtIOSCSICtrlANReq) ||
+            in_size < sizeof(VirtIOSCSICtrlANResp)) {
+            virtio_scsi_bad_req();
+        }
+        req->resp.an->event_actual = 0;
+        req->resp.an->response = VIRTIO_SCSI_S_OK;
+    }
+    virtio_scsi_complete_req(req);
+}
 
-        } else if (req->req.tmf->type == VIRTIO_SCSI_T_AN_QUERY ||
-                   req->req.tmf->type == VIRTIO_SCSI_T_AN_SUBSCRIBE) {
-            if (out_size < sizeof(VirtIOSCSICtrlANReq) ||
-                in_size < sizeof(VirtIOSCSICtrlANResp)) {
-                virtio_scsi_bad_req();
-            }
-            req->resp.an->event_actual = 0;
-            req->resp.an->response = VIRTIO_SCSI_S_OK;
+/* Returns true if requests of @vq are handled by the iothread.  Kicks that
+ * reach the main loop after dataplane has started did not go through the
+ * host notifier, e.g. because they raced with its assignment, and are
+ * forwarded to it.
+ */
+static bool virtio_scsi_dataplane_handles(VirtIOSCSI *s, VirtQueue *vq)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->ctx && !s->dataplane_disabled) {
+        if (s->dataplane_started) {
+            event_notifier_set(virtio_queue_get_host_notifier(vq));
+            return true;
         }
-        virtio_scsi_complete_req(req);
+        virtio_scsi_dataplane_start(s);
+        return s->dataplane_started;
+    }
+#endif
+    return false;
+}
+
+static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+    if (virtio_scsi_dataplane_handles(s, vq)) {
+        return;
+    }
+    while ((req = virtio_scsi_pop_req(s, vq))) {
+        virtio_scsi_handle_ctrl_req(s, req);
     }
 }
 
@@ -362,60 +391,69 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
-static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     /* use non-QOM casts in the data path */
-    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSICommon *vs = &s->parent_obj;
-
-    VirtIOSCSIReq *req;
+    SCSIDevice *d;
+    int out_size, in_size;
     int n;
 
-    while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
-            virtio_scsi_bad_req();
-        }
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + vs->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + vs->sense_size) {
+        virtio_scsi_bad_req();
+    }
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
             virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
-            }
+            return;
         }
+    }
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
-        }
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
+    }
+}
+
+static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* use non-QOM casts in the data path */
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+    if (virtio_scsi_dataplane_handles(s, vq)) {
+        return;
+    }
+    while ((req = virtio_scsi_pop_req(s, vq))) {
+        virtio_scsi_handle_cmd_req(s, req);
     }
 }
 
@@ -464,6 +502,11 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(vdev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->ctx) {
+        virtio_scsi_dataplane_stop(s);
+    }
+#endif
     s->resetting++;
     qbus_reset_all(&s->bus.qbus);
     s->resetting--;
@@ -507,7 +550,14 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
         return;
     }
 
-    req = virtio_scsi_pop_req(s, vs->event_vq);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane_started) {
+        req = virtio_scsi_pop_req_vring(s, s->event_vring);
+    } else
+#endif
+    {
+        req = virtio_scsi_pop_req(s, vs->event_vq);
+    }
     if (!req) {
         s->events_dropped = true;
         return;
@@ -546,13 +596,38 @@ static void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
     virtio_scsi_complete_req(req);
 }
 
+void virtio_scsi_handle_event_req(VirtIOSCSI *s)
+{
+    if (s->events_dropped) {
+        virtio_scsi_push_event(s, NULL, VIRTIO_SCSI_T_NO_EVENT, 0);
+    }
+}
+
 static void virtio_scsi_handle_event(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(vdev);
 
-    if (s->events_dropped) {
-        virtio_scsi_push_event(s, NULL, VIRTIO_SCSI_T_NO_EVENT, 0);
+    if (virtio_scsi_dataplane_handles(s, vq)) {
+        return;
+    }
+    virtio_scsi_handle_event_req(s);
+}
+
+/* Events are pushed from the main loop; the iothread must not be using the
+ * event vring at the same time.
+ */
+static void virtio_scsi_push_event_locked(VirtIOSCSI *s, SCSIDevice *dev,
+                                          uint32_t event, uint32_t reason)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane_started) {
+        aio_context_acquire(s->ctx);
+        virtio_scsi_push_event(s, dev, event, reason);
+        aio_context_release(s->ctx);
+        return;
     }
+#endif
+    virtio_scsi_push_event(s, dev, event, reason);
 }
 
 static void virtio_scsi_change(SCSIBus *bus, SCSIDevice *dev, SCSISense sense)
@@ -562,8 +637,8 @@ static void virtio_scsi_change(SCSIBus *bus, SCSIDevice *dev, SCSISense sense)
 
     if (((vdev->guest_features >> VIRTIO_SCSI_F_CHANGE) & 1) &&
         dev->type != TYPE_ROM) {
-        virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_PARAM_CHANGE,
-                               sense.asc | (sense.ascq << 8));
+        virtio_scsi_push_event_locked(s, dev, VIRTIO_SCSI_T_PARAM_CHANGE,
+                                      sense.asc | (sense.ascq << 8));
     }
 }
 
@@ -572,9 +647,14 @@ static void virtio_scsi_hotplug(SCSIBus *bus, SCSIDevice *dev)
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->ctx) {
+        virtio_scsi_dataplane_hotplug(s, dev);
+    }
+#endif
     if ((vdev->guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
-        virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
-                               VIRTIO_SCSI_EVT_RESET_RESCAN);
+        virtio_scsi_push_event_locked(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
+                                      VIRTIO_SCSI_EVT_RESET_RESCAN);
     }
 }
 
@@ -584,9 +664,14 @@ static void virtio_scsi_hot_unplug(SCSIBus *bus, SCSIDevice *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     if ((vdev->guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
-        virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
-                               VIRTIO_SCSI_EVT_RESET_REMOVED);
+        virtio_scsi_push_event_locked(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
+                                      VIRTIO_SCSI_EVT_RESET_REMOVED);
     }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->ctx) {
+        virtio_scsi_dataplane_hot_unplug(s, dev);
+    }
+#endif
 }
 
 static struct SCSIBusInfo virtio_scsi_scsi_info = {
@@ -628,19 +713,68 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp)
     }
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+/* Disable dataplane thread during live migration since it does not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_scsi_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIOSCSI *s = container_of(notifier, VirtIOSCSI,
+                                 migration_state_notifier);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        virtio_scsi_dataplane_stop(s);
+        s->dataplane_disabled = true;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        /* The next guest kick moves processing back into the iothread */
+        s->dataplane_disabled = false;
+    }
+}
+#endif /* CONFIG_VIRTIO_BLK_DATA_PLANE */
+
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t val)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSI *s = VIRTIO_SCSI(vdev);
+
+    if (s->ctx && !(val & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_scsi_dataplane_stop(s);
+    }
+#endif
+}
+
 static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
     static int virtio_scsi_id;
     Error *err = NULL;
 
+#ifndef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (vs->conf.iothread) {
+        error_setg(errp, "iothread is not supported by this QEMU build");
+        return;
+    }
+#endif
+
     virtio_scsi_common_realize(dev, &err);
     if (err != NULL) {
         error_propagate(errp, err);
         return;
     }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (vs->conf.iothread) {
+        virtio_scsi_dataplane_init(s);
+        s->migration_state_notifier.notify =
+            virtio_scsi_migration_state_changed;
+        add_migration_state_change_notifier(&s->migration_state_notifier);
+    }
+#endif
+
     scsi_bus_new(&s->bus, sizeof(s->bus), dev,
                  &virtio_scsi_scsi_info, vdev->bus_name);
 
@@ -669,6 +803,22 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->ctx) {
+        BusChild *kid;
+
+        remove_migration_state_change_notifier(&s->migration_state_notifier);
+        virtio_scsi_dataplane_stop(s);
+        QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+            SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+            if (d->conf.bs) {
+                bdrv_op_unblock_all(d->conf.bs, s->blocker);
+            }
+        }
+        virtio_scsi_dataplane_cleanup(s);
+    }
+#endif
     unregister_savevm(dev, "virtio-scsi", s);
 
     virtio_scsi_common_unrealize(dev, errp);
@@ -700,6 +850,7 @@ static void virtio_scsi_class_init(ObjectClass *klass, void *data)
     vdc->set_config = virtio_scsi_set_config;
     vdc->get_features = virtio_scsi_get_features;
     vdc->reset = virtio_scsi_reset;
+    vdc->set_status = virtio_scsi_set_status;
 }
 
 static const TypeInfo virtio_scsi_common_info = {
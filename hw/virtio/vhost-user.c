@@ -0,0 +1,532 @@
+/*
+ * vhost-user
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * The vhost-user backend implements the vhost ioctls by sending messages
+ * over a UNIX domain socket to a process that runs the device rings.  Guest
+ * memory and the kick/call eventfds are handed over as file descriptors, so
+ * guest RAM must come from a shared file mapping (-mem-path with
+ * -mem-share).  The protocol is described in docs/specs/vhost-user.txt.
+ */
+
+#include "hw/virtio/vhost.h"
+#include "hw/virtio/vhost-backend.h"
+#include "sysemu/char.h"
+#include "exec/ram_addr.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_MAX_CONFIG_SIZE   256
+
+/* Request codes; 17 to 23 are left unused so that the numbering stays
+ * compatible with other implementations of the protocol. */
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+/* Feature bit offered by backends that understand protocol features */
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+/* Protocol features */
+#define VHOST_USER_PROTOCOL_F_CONFIG   9
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserConfig config;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+static VhostUserMsg m __attribute__ ((unused));
+#define VHOST_USER_HDR_SIZE (sizeof(m.request) \
+                            + sizeof(m.flags) \
+                            + sizeof(m.size))
+
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(m) - VHOST_USER_HDR_SIZE)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+typedef struct VhostUserState {
+    CharDriverState *chr;
+    bool has_protocol_features;
+    uint64_t protocol_features;
+} VhostUserState;
+
+static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = VHOST_USER_NONE + 1; idx <= VHOST_USER_SET_VRING_ERR; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx > VHOST_USER_SET_VRING_ERR) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    VhostUserState *u = dev->opaque;
+    uint8_t *p = (uint8_t *) msg;
+    int r, size = VHOST_USER_HDR_SIZE;
+
+    r = qemu_chr_fe_read_all(u->chr, p, size);
+    if (r != size) {
+        error_report("Failed to read msg header. Read %d instead of %d.",
+                     r, size);
+        goto fail;
+    }
+
+    /* validate received flags */
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("Failed to read msg header."
+                     " Flags 0x%x instead of 0x%x.",
+                     msg->flags, VHOST_USER_REPLY_MASK | VHOST_USER_VERSION);
+        goto fail;
+    }
+
+    /* validate message size is sane */
+    if (msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("Failed to read msg header."
+                     " Size %d exceeds the maximum %zu.", msg->size,
+                     VHOST_USER_PAYLOAD_SIZE);
+        goto fail;
+    }
+
+    if (msg->size) {
+        p += VHOST_USER_HDR_SIZE;
+        size = msg->size;
+        r = qemu_chr_fe_read_all(u->chr, p, size);
+        if (r != size) {
+            error_report("Failed to read msg payload."
+                         " Read %d instead of %d.", r, msg->size);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    errno = EIO;
+    return -1;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    VhostUserState *u = dev->opaque;
+    int size = VHOST_USER_HDR_SIZE + msg->size;
+
+    if (fd_num && qemu_chr_fe_set_msgfds(u->chr, fds, fd_num) < 0) {
+        error_report("vhost-user requires a UNIX domain socket chardev");
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (qemu_chr_fe_write_all(u->chr, (const uint8_t *) msg, size) != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Send @msg and wait for the reply to the same request */
+static int vhost_user_transact(struct vhost_dev *dev, VhostUserMsg *msg,
+                               int *fds, int fd_num)
+{
+    VhostUserRequest request = msg->request;
+
+    trace_vhost_user_request(dev, request, msg->size);
+
+    if (vhost_user_write(dev, msg, fds, fd_num) < 0) {
+        return -1;
+    }
+    if (vhost_user_read(dev, msg) < 0) {
+        return -1;
+    }
+    if (msg->request != request) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d", request, msg->request);
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_transact(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+    if (msg.size != sizeof(msg.u64)) {
+        error_report("Received bad msg size.");
+        errno = EPROTO;
+        return -1;
+    }
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_mem_table(struct vhost_dev *dev, VhostUserMsg *msg,
+                                    int *fds, int *fd_num)
+{
+    int i;
+
+    for (i = 0; i < dev->mem->nregions; ++i) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        VhostUserMemoryRegion *r = &msg->memory.regions[*fd_num];
+        ram_addr_t ram_addr;
+        int fd;
+
+        assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
+        if (!qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                     &ram_addr)) {
+            continue;
+        }
+        fd = qemu_get_ram_fd(ram_addr);
+        if (fd < 0) {
+            continue;
+        }
+        if (!qemu_ram_is_shared(ram_addr)) {
+            /* The slave would only see a copy of the guest's memory */
+            error_report("vhost-user requires guest memory mapped shared, "
+                         "use -mem-share");
+            errno = EINVAL;
+            return -1;
+        }
+        if (*fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user supports at most %d memory regions",
+                         VHOST_MEMORY_MAX_NREGIONS);
+            errno = E2BIG;
+            return -1;
+        }
+
+        r->guest_phys_addr = reg->guest_phys_addr;
+        r->memory_size = reg->memory_size;
+        r->userspace_addr = reg->userspace_addr;
+        r->mmap_offset = reg->userspace_addr -
+            (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
+        fds[(*fd_num)++] = fd;
+    }
+
+    if (!*fd_num) {
+        error_report("Failed initializing vhost-user memory map, "
+                     "consider using -mem-path with -mem-share");
+        errno = EINVAL;
+        return -1;
+    }
+
+    msg->memory.nregions = *fd_num;
+    msg->size = sizeof(msg->memory.nregions) +
+                sizeof(msg->memory.padding) +
+                *fd_num * sizeof(VhostUserMemoryRegion);
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+        void *arg)
+{
+    VhostUserState *u = dev->opaque;
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file = NULL;
+    int need_reply = 0;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    if (msg_request == VHOST_USER_NONE) {
+        error_report("vhost-user trying to send unhandled ioctl");
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        need_reply = 1;
+        break;
+
+    case VHOST_SET_FEATURES:
+        msg.u64 = *((uint64_t *) arg);
+        if (u->has_protocol_features) {
+            msg.u64 |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        }
+        msg.size = sizeof(m.u64);
+        break;
+
+    case VHOST_SET_LOG_BASE:
+        msg.u64 = *((uint64_t *) arg);
+        msg.size = sizeof(m.u64);
+        break;
+
+    case VHOST_SET_OWNER:
+    case VHOST_RESET_OWNER:
+        break;
+
+    case VHOST_SET_MEM_TABLE:
+        if (vhost_user_set_mem_table(dev, &msg, fds, &fd_num) < 0) {
+            return -1;
+        }
+        break;
+
+    case VHOST_SET_LOG_FD:
+        fds[fd_num++] = *((int *) arg);
+        break;
+
+    case VHOST_SET_VRING_NUM:
+    case VHOST_SET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(m.state);
+        break;
+
+    case VHOST_GET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(m.state);
+        need_reply = 1;
+        break;
+
+    case VHOST_SET_VRING_ADDR:
+        memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(m.addr);
+        break;
+
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+    case VHOST_SET_VRING_ERR:
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(m.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user trying to send unhandled ioctl");
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (!need_reply) {
+        trace_vhost_user_request(dev, msg_request, msg.size);
+        return vhost_user_write(dev, &msg, fds, fd_num);
+    }
+
+    if (vhost_user_transact(dev, &msg, fds, fd_num) < 0) {
+        return -1;
+    }
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        if (msg.size != sizeof(m.u64)) {
+            error_report("Received bad msg size.");
+            errno = EPROTO;
+            return -1;
+        }
+        *((uint64_t *) arg) = msg.u64;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg.size != sizeof(m.state)) {
+            error_report("Received bad msg size.");
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static int vhost_user_get_config(struct vhost_dev *dev, uint8_t *config,
+                                 uint32_t len)
+{
+    VhostUserState *u = dev->opaque;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_CONFIG,
+        .flags = VHOST_USER_VERSION,
+    };
+    size_t hdr_size = offsetof(VhostUserConfig, region);
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (!(u->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+        return -ENOTSUP;
+    }
+    if (len > VHOST_USER_MAX_CONFIG_SIZE) {
+        return -EINVAL;
+    }
+
+    msg.config.offset = 0;
+    msg.config.size = len;
+    msg.config.flags = 0;
+    msg.size = hdr_size + len;
+
+    if (vhost_user_transact(dev, &msg, NULL, 0) < 0) {
+        return -errno;
+    }
+    if (msg.size != hdr_size + len || msg.config.size != len) {
+        error_report("Received bad msg size.");
+        return -EPROTO;
+    }
+
+    memcpy(config, msg.config.region, len);
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, void *opaque)
+{
+    VhostUserState *u;
+    uint64_t features;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_PROTOCOL_FEATURES,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.u64),
+    };
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    u = g_new0(VhostUserState, 1);
+    u->chr = opaque;
+    dev->opaque = u;
+
+    if (vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features) < 0) {
+        goto fail;
+    }
+
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        if (vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                               &u->protocol_features) < 0) {
+            goto fail;
+        }
+        u->protocol_features &= VHOST_USER_PROTOCOL_FEATURE_MASK;
+        u->has_protocol_features = true;
+
+        msg.u64 = u->protocol_features;
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    dev->opaque = NULL;
+    g_free(u);
+    return -1;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    g_free(dev->opaque);
+    dev->opaque = NULL;
+
+    return 0;
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup,
+    .vhost_backend_get_config = vhost_user_get_config,
+};
@@ -19,6 +19,8 @@
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/xen/xen.h"
+#include "qapi-visit.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -69,6 +71,8 @@ struct VirtQueue
     VRing vring;
     hwaddr pa;
     uint16_t last_avail_idx;
+    /* Shadow of the used index, which only the device writes */
+    uint16_t used_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -87,8 +91,232 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* Elements returned with virtqueue_free_element(), at most vring.num */
+    VirtQueueElement **elem_pool;
+    unsigned int elem_pool_len;
+
+    /* Host addresses of the descriptor table and available ring, valid as
+     * long as ring_generation matches the map cache of the device */
+    uint8_t *desc_host;
+    uint8_t *avail_host;
+    unsigned int ring_generation;
+
+    /* Elements filled by virtqueue_push_pending() but not flushed yet */
+    unsigned int used_pending;
+
+    /* Statistics, see VirtQueueStats */
+    uint64_t nr_completed;
+    uint64_t nr_used_updates;
+    uint64_t nr_notify;
+    uint64_t nr_notify_suppressed;
+    uint64_t nr_map_hits;
+    uint64_t nr_map_misses;
+};
+
+/*
+ * Guest memory map cache
+ *
+ * cpu_physical_memory_map() looks up the memory map for every descriptor.
+ * Instead, each device keeps a sorted copy of the RAM sections of the
+ * system address space, rebuilt by a MemoryListener whenever the memory
+ * map changes, and maps descriptors and rings with a lookup in it.  Each
+ * entry holds a reference to its MemoryRegion; like address_space_map(),
+ * a mapping takes another one, so that address_space_unmap() can be used
+ * on the result as before.
+ */
+typedef struct VirtIOMapCacheEntry {
+    hwaddr addr;
+    hwaddr size;
+    uint8_t *host;
+    MemoryRegion *mr;
+    bool readonly;
+} VirtIOMapCacheEntry;
+
+struct VirtIOMapCache {
+    MemoryListener listener;
+    VirtIOMapCacheEntry *entries;
+    int nb_entries;
+    int size;
+    int last;                   /* index of the last hit */
+    unsigned int generation;    /* incremented when the map changes */
 };
 
+static void virtio_map_cache_begin(MemoryListener *listener)
+{
+    VirtIOMapCache *cache = container_of(listener, VirtIOMapCache, listener);
+    int i;
+
+    for (i = 0; i < cache->nb_entries; i++) {
+        memory_region_unref(cache->entries[i].mr);
+    }
+    cache->nb_entries = 0;
+    cache->last = 0;
+    cache->generation++;
+}
+
+static void virtio_map_cache_region_add(MemoryListener *listener,
+                                        MemoryRegionSection *section)
+{
+    VirtIOMapCache *cache = container_of(listener, VirtIOMapCache, listener);
+    VirtIOMapCacheEntry *e;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+
+    if (cache->nb_entries == cache->size) {
+        cache->size = MAX(8, cache->size * 2);
+        cache->entries = g_renew(VirtIOMapCacheEntry, cache->entries,
+                                 cache->size);
+    }
+
+    e = &cache->entries[cache->nb_entries++];
+    e->addr = section->offset_within_address_space;
+    e->size = int128_get64(section->size);
+    e->host = memory_region_get_ram_ptr(section->mr) +
+              section->offset_within_region;
+    e->mr = section->mr;
+    e->readonly = section->readonly;
+    memory_region_ref(e->mr);
+}
+
+static int virtio_map_cache_compare(const void *a, const void *b)
+{
+    const VirtIOMapCacheEntry *e1 = a, *e2 = b;
+
+    if (e1->addr < e2->addr) {
+        return -1;
+    }
+    return e1->addr > e2->addr;
+}
+
+static void virtio_map_cache_commit(MemoryListener *listener)
+{
+    VirtIOMapCache *cache = container_of(listener, VirtIOMapCache, listener);
+
+    qsort(cache->entries, cache->nb_entries, sizeof(cache->entries[0]),
+          virtio_map_cache_compare);
+}
+
+static VirtIOMapCache *virtio_map_cache_new(void)
+{
+    VirtIOMapCache *cache = g_new0(VirtIOMapCache, 1);
+
+    cache->listener = (MemoryListener) {
+        .begin = virtio_map_cache_begin,
+        .commit = virtio_map_cache_commit,
+        .region_add = virtio_map_cache_region_add,
+        .region_nop = virtio_map_cache_region_add,
+        .priority = 10,
+    };
+
+    /* Registering replays the current map without begin and commit */
+    memory_listener_register(&cache->listener, &address_space_memory);
+    virtio_map_cache_commit(&cache->listener);
+    return cache;
+}
+
+static void virtio_map_cache_free(VirtIOMapCache *cache)
+{
+    memory_listener_unregister(&cache->listener);
+    virtio_map_cache_begin(&cache->listener);
+    g_free(cache->entries);
+    g_free(cache);
+}
+
+/* Returns the host address of [addr, addr + len), or NULL if the range is
+ * not within a single RAM section */
+static uint8_t *virtio_map_cache_lookup(VirtIOMapCache *cache, hwaddr addr,
+                                        hwaddr len, bool is_write,
+                                        MemoryRegion **mr)
+{
+    VirtIOMapCacheEntry *e;
+    int lo = 0, hi = cache->nb_entries;
+
+    if (!cache->nb_entries) {
+        return NULL;
+    }
+
+    e = &cache->entries[cache->last];
+    if (addr < e->addr || addr - e->addr >= e->size) {
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (cache->entries[mid].addr + cache->entries[mid].size <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == cache->nb_entries || cache->entries[lo].addr > addr) {
+            return NULL;
+        }
+        cache->last = lo;
+        e = &cache->entries[lo];
+    }
+
+    if (len > e->size - (addr - e->addr) || (is_write && e->readonly)) {
+        return NULL;
+    }
+    if (mr) {
+        *mr = e->mr;
+    }
+    return e->host + (addr - e->addr);
+}
+
+static void virtqueue_update_ring_cache(VirtQueue *vq)
+{
+    VirtIOMapCache *cache = vq->vdev->map_cache;
+    unsigned int num = vq->vring.num;
+
+    vq->ring_generation = cache->generation;
+    vq->desc_host = virtio_map_cache_lookup(cache, vq->vring.desc,
+                                            num * sizeof(VRingDesc),
+                                            false, NULL);
+    /* The used_event field follows the available ring */
+    vq->avail_host = virtio_map_cache_lookup(cache, vq->vring.avail,
+                                             offsetof(VRingAvail,
+                                                      ring[num + 1]),
+                                             false, NULL);
+}
+
+static void virtqueue_invalidate_ring_cache(VirtQueue *vq)
+{
+    VirtIOMapCache *cache = vq->vdev->map_cache;
+
+    vq->desc_host = vq->avail_host = NULL;
+    if (cache) {
+        vq->ring_generation = cache->generation - 1;
+    }
+}
+
+static inline void virtqueue_check_ring_cache(VirtQueue *vq)
+{
+    VirtIOMapCache *cache = vq->vdev->map_cache;
+
+    if (cache && vq->ring_generation != cache->generation) {
+        virtqueue_update_ring_cache(vq);
+    }
+}
+
+/* Host address of the descriptor table at @desc_pa with @max entries, which
+ * is either the ring of @vq or an indirect table, or NULL */
+static uint8_t *virtqueue_desc_host(VirtQueue *vq, hwaddr desc_pa,
+                                    unsigned int max)
+{
+    VirtIOMapCache *cache = vq->vdev->map_cache;
+
+    if (!cache) {
+        return NULL;
+    }
+    if (desc_pa == vq->vring.desc) {
+        virtqueue_check_ring_cache(vq);
+        return vq->desc_host;
+    }
+    return virtio_map_cache_lookup(cache, desc_pa, max * sizeof(VRingDesc),
+                                   false, NULL);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -99,55 +327,82 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  vq->vring.align);
+    virtqueue_invalidate_ring_cache(vq);
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+/* The descriptor accessors read through @desc_host if it is not NULL */
+static inline uint64_t vring_desc_addr(uint8_t *desc_host, hwaddr desc_pa,
+                                       int i)
 {
     hwaddr pa;
+    if (desc_host) {
+        return ldq_p(desc_host + sizeof(VRingDesc) * i +
+                     offsetof(VRingDesc, addr));
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(&address_space_memory, pa);
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static inline uint32_t vring_desc_len(uint8_t *desc_host, hwaddr desc_pa,
+                                      int i)
 {
     hwaddr pa;
+    if (desc_host) {
+        return ldl_p(desc_host + sizeof(VRingDesc) * i +
+                     offsetof(VRingDesc, len));
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(&address_space_memory, pa);
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_flags(uint8_t *desc_host, hwaddr desc_pa,
+                                        int i)
 {
     hwaddr pa;
+    if (desc_host) {
+        return lduw_p(desc_host + sizeof(VRingDesc) * i +
+                      offsetof(VRingDesc, flags));
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(&address_space_memory, pa);
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+static inline uint16_t vring_desc_next(uint8_t *desc_host, hwaddr desc_pa,
+                                       int i)
 {
     hwaddr pa;
+    if (desc_host) {
+        return lduw_p(desc_host + sizeof(VRingDesc) * i +
+                      offsetof(VRingDesc, next));
+    }
     pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(&address_space_memory, pa);
 }
 
+static inline uint16_t vring_avail_read(VirtQueue *vq, hwaddr offset)
+{
+    virtqueue_check_ring_cache(vq);
+    if (vq->avail_host) {
+        /* The guest updates the ring behind the compiler's back */
+        barrier();
+        return lduw_p(vq->avail_host + offset);
+    }
+    return lduw_phys(&address_space_memory, vq->vring.avail + offset);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_avail_read(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_avail_read(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return lduw_phys(&address_space_memory, pa);
+    return vring_avail_read(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -181,6 +436,7 @@ static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     stw_phys(&address_space_memory, pa, val);
+    vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
@@ -259,7 +515,8 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
+    vq->nr_completed++;
 
     /* Get a pointer to the next entry in the used ring. */
     vring_used_ring_id(vq, idx, elem->index);
@@ -272,10 +529,11 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
     vq->inuse -= count;
+    vq->nr_used_updates++;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
 }
@@ -287,6 +545,30 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * Return @elem to the guest without updating the used index.  All elements
+ * completed this way are published with a single used index update by
+ * virtqueue_flush_pending(), which the device must call before it goes
+ * back to the guest or calls virtqueue_push() for the same virtqueue.
+ */
+void virtqueue_push_pending(VirtQueue *vq, const VirtQueueElement *elem,
+                            unsigned int len)
+{
+    virtqueue_fill(vq, elem, len, vq->used_pending++);
+}
+
+/* Returns the number of elements that were flushed */
+unsigned int virtqueue_flush_pending(VirtQueue *vq)
+{
+    unsigned int count = vq->used_pending;
+
+    if (count) {
+        vq->used_pending = 0;
+        virtqueue_flush(vq, count);
+    }
+    return count;
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -323,17 +605,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
+static unsigned virtqueue_next_desc(uint8_t *desc_host, hwaddr desc_pa,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(desc_host, desc_pa, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(desc_host, desc_pa, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -357,6 +639,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
+        uint8_t *desc_host;
         hwaddr desc_pa;
         int i;
 
@@ -364,9 +647,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc_host = virtqueue_desc_host(vq, desc_pa, max);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(desc_host, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(desc_host, desc_pa, i) % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -379,8 +663,9 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(desc_pa, i);
+            max = vring_desc_len(desc_host, desc_pa, i) / sizeof(VRingDesc);
+            desc_pa = vring_desc_addr(desc_host, desc_pa, i);
+            desc_host = virtqueue_desc_host(vq, desc_pa, max);
             num_bufs = i = 0;
         }
 
@@ -391,15 +676,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (vring_desc_flags(desc_host, desc_pa, i) & VRING_DESC_F_WRITE) {
+                in_total += vring_desc_len(desc_host, desc_pa, i);
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += vring_desc_len(desc_host, desc_pa, i);
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(desc_host, desc_pa, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -424,9 +709,12 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
-    size_t num_sg, int is_write)
+/* Map @sg through the map cache of @vq, if not NULL */
+static void virtqueue_map_sg_cached(VirtQueue *vq, struct iovec *sg,
+                                    hwaddr *addr, size_t num_sg,
+                                    int is_write)
 {
+    VirtIOMapCache *cache = vq ? vq->vdev->map_cache : NULL;
     unsigned int i;
     hwaddr len;
 
@@ -437,7 +725,21 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 
     for (i = 0; i < num_sg; i++) {
+        MemoryRegion *mr;
+
         len = sg[i].iov_len;
+        if (cache) {
+            sg[i].iov_base = virtio_map_cache_lookup(cache, addr[i], len,
+                                                     is_write, &mr);
+            if (sg[i].iov_base) {
+                /* Dropped by cpu_physical_memory_unmap() */
+                memory_region_ref(mr);
+                vq->nr_map_hits++;
+                continue;
+            }
+            vq->nr_map_misses++;
+        }
+
         sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
         if (sg[i].iov_base == NULL || len != sg[i].iov_len) {
             error_report("virtio: trying to map MMIO memory");
@@ -446,33 +748,40 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
+    size_t num_sg, int is_write)
+{
+    virtqueue_map_sg_cached(NULL, sg, addr, num_sg, is_write);
+}
+
+/* Pop the next element, which the caller knows to be available */
+static int virtqueue_pop_head(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    uint8_t *desc_host;
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
 
     max = vq->vring.num;
+    desc_host = virtqueue_desc_host(vq, desc_pa, max);
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
     if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(desc_host, desc_pa, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(desc_host, desc_pa, i) % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(desc_host, desc_pa, i) / sizeof(VRingDesc);
+        desc_pa = vring_desc_addr(desc_host, desc_pa, i);
+        desc_host = virtqueue_desc_host(vq, desc_pa, max);
         i = 0;
     }
 
@@ -480,34 +789,37 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (vring_desc_flags(desc_host, desc_pa, i) & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = vring_desc_addr(desc_host,
+                                                          desc_pa, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = vring_desc_addr(desc_host,
+                                                            desc_pa, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(desc_host, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(desc_host, desc_pa, i, max)) != max);
 
     /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    virtqueue_map_sg_cached(vq, elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg_cached(vq, elem->out_sg, elem->out_addr, elem->out_num,
+                            0);
 
     elem->index = head;
 
@@ -517,6 +829,80 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     return elem->in_num + elem->out_num;
 }
 
+int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return 0;
+    }
+
+    return virtqueue_pop_head(vq, elem);
+}
+
+/*
+ * Element pool
+ *
+ * A VirtQueueElement is large enough for the longest descriptor chain, so
+ * allocating one per request is expensive.  Each virtqueue keeps the
+ * elements that were freed in a stack of up to vring.num entries and hands
+ * them out again.  The pool of a virtqueue must only be used by the thread
+ * that processes the virtqueue, so no locking is needed.
+ */
+VirtQueueElement *virtqueue_alloc_element(VirtQueue *vq)
+{
+    if (vq->elem_pool_len) {
+        return vq->elem_pool[--vq->elem_pool_len];
+    }
+    return g_new(VirtQueueElement, 1);
+}
+
+void virtqueue_free_element(VirtQueue *vq, VirtQueueElement *elem)
+{
+    if (vq->elem_pool_len >= vq->vring.num) {
+        g_free(elem);
+        return;
+    }
+
+    if (!vq->elem_pool) {
+        vq->elem_pool = g_new(VirtQueueElement *, VIRTQUEUE_MAX_SIZE);
+    }
+    vq->elem_pool[vq->elem_pool_len++] = elem;
+}
+
+static void virtqueue_free_elem_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_len) {
+        g_free(vq->elem_pool[--vq->elem_pool_len]);
+    }
+    g_free(vq->elem_pool);
+    vq->elem_pool = NULL;
+}
+
+VirtQueueElement *virtqueue_pop_elem(VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
+
+    elem = virtqueue_alloc_element(vq);
+    virtqueue_pop_head(vq, elem);
+    return elem;
+}
+
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElement **elems,
+                                 unsigned int max)
+{
+    unsigned int i, num;
+
+    num = MIN(max, virtqueue_num_heads(vq, vq->last_avail_idx));
+    for (i = 0; i < num; i++) {
+        elems[i] = virtqueue_alloc_element(vq);
+        virtqueue_pop_head(vq, elems[i]);
+    }
+    return num;
+}
+
 /* virtio device */
 static void virtio_notify_vector(VirtIODevice *vdev, uint16_t vector)
 {
@@ -568,11 +954,14 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_pending = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        virtqueue_invalidate_ring_cache(&vdev->vq[i]);
     }
 }
 
@@ -774,6 +1163,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_free_elem_pool(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -815,16 +1205,18 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!vring_notify(vdev, vq)) {
+        vq->nr_notify_suppressed++;
         return;
     }
 
+    vq->nr_notify++;
     trace_virtio_notify(vdev, vq);
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
@@ -953,6 +1345,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         if (vdev->vq[i].pa) {
             uint16_t nheads;
             virtqueue_init(&vdev->vq[i]);
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing very strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -982,6 +1375,15 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_free_elem_pool(&vdev->vq[i]);
+    }
+    if (vdev->map_cache) {
+        virtio_map_cache_free(vdev->map_cache);
+        vdev->map_cache = NULL;
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1019,6 +1421,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     vdev->config_vector = VIRTIO_NO_VECTOR;
     vdev->vq = g_malloc0(sizeof(VirtQueue) * VIRTIO_PCI_QUEUE_MAX);
     vdev->vm_running = runstate_is_running();
+    /* The Xen map cache must see every mapping, so bypass ours there */
+    vdev->map_cache = xen_enabled() ? NULL : virtio_map_cache_new();
     for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
@@ -1094,6 +1498,15 @@ void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
     vdev->vq[n].signalled_used_valid = false;
 }
 
+/* Resynchronize with the used index after another backend (vhost,
+ * dataplane) has been processing the virtqueue */
+void virtio_queue_update_used_idx(VirtIODevice *vdev, int n)
+{
+    if (vdev->vq[n].vring.desc) {
+        vdev->vq[n].used_idx = vring_used_idx(&vdev->vq[n]);
+    }
+}
+
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
 {
     return vdev->vq + n;
@@ -1212,6 +1625,49 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     }
 }
 
+static void virtio_device_get_virtqueue_stats(Object *obj, Visitor *v,
+                                              void *opaque, const char *name,
+                                              Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    VirtQueueStatsList *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; vdev->vq && i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        VirtQueueStatsList *entry;
+        VirtQueueStats *info;
+
+        if (vq->vring.num == 0) {
+            continue;
+        }
+
+        entry = g_new0(VirtQueueStatsList, 1);
+        info = g_new0(VirtQueueStats, 1);
+        info->queue = i;
+        info->completed = vq->nr_completed;
+        info->used_updates = vq->nr_used_updates;
+        info->notifications = vq->nr_notify;
+        info->suppressed_notifications = vq->nr_notify_suppressed;
+        info->map_hits = vq->nr_map_hits;
+        info->map_misses = vq->nr_map_misses;
+
+        entry->value = info;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    visit_type_VirtQueueStatsList(v, &head, name, errp);
+    qapi_free_VirtQueueStatsList(head);
+}
+
+static void virtio_device_instance_init(Object *obj)
+{
+    object_property_add(obj, "virtqueue-stats", "VirtQueueStatsList",
+                        virtio_device_get_virtqueue_stats, NULL, NULL, NULL,
+                        NULL);
+}
+
 static void virtio_device_class_init(ObjectClass *klass, void *data)
 {
     /* Set the default value here. */
@@ -1226,6 +1682,7 @@ static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_DEVICE,
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(VirtIODevice),
+    .instance_init = virtio_device_instance_init,
     .class_init = virtio_device_class_init,
     .abstract = true,
     .class_size = sizeof(VirtioDeviceClass),
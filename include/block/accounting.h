@@ -0,0 +1,92 @@
+/*
+ * QEMU block I/O latency accounting
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BLOCK_ACCOUNTING_H
+#define BLOCK_ACCOUNTING_H
+
+#include <stdint.h>
+#include "qemu-common.h"
+
+/*
+ * Latencies are sorted into log-linear bins: every power of two is split into
+ * BLOCK_LATENCY_SUB_BINS equally sized bins, which bounds the relative error
+ * of the reported percentiles by 1 / BLOCK_LATENCY_SUB_BINS.  The last bin
+ * takes everything above about 2^41 ns (~37 minutes).
+ */
+#define BLOCK_LATENCY_SUB_BITS  3
+#define BLOCK_LATENCY_SUB_BINS  (1 << BLOCK_LATENCY_SUB_BITS)
+#define BLOCK_LATENCY_NB_BINS   (40 * BLOCK_LATENCY_SUB_BINS)
+
+/* Percentiles and averages cover between one and two of these periods */
+#define BLOCK_LATENCY_PERIOD_NS (60 * 1000000000LL)
+
+typedef struct BlockAcctLatencyPeriod {
+    int64_t start_ns;
+    uint64_t nr_ops;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t bins[BLOCK_LATENCY_NB_BINS];
+} BlockAcctLatencyPeriod;
+
+typedef struct BlockAcctLatency {
+    /* sliding window: the current and the previous period */
+    BlockAcctLatencyPeriod periods[2];
+    unsigned int current;
+
+    /* optional histogram with user defined bin boundaries, counted since it
+     * was set; bins[i] counts latencies in [boundaries[i - 1], boundaries[i])
+     */
+    unsigned int nb_boundaries;
+    uint64_t *boundaries;
+    uint64_t *hist_bins;
+} BlockAcctLatency;
+
+/* Summary of the sliding window, as returned by block_latency_get_window() */
+typedef struct BlockAcctLatencyWindow {
+    int64_t interval_ns;
+    uint64_t nr_ops;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t avg_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} BlockAcctLatencyWindow;
+
+void block_latency_period_account(BlockAcctLatencyPeriod *p, uint64_t ns);
+uint64_t block_latency_period_percentile(const BlockAcctLatencyPeriod *period,
+                                         double p);
+
+void block_latency_account(BlockAcctLatency *stats, int64_t latency_ns,
+                           int64_t now);
+void block_latency_get_window(const BlockAcctLatency *stats, int64_t now,
+                              BlockAcctLatencyWindow *win);
+
+int block_latency_set_histogram(BlockAcctLatency *stats,
+                                const uint64_t *boundaries,
+                                unsigned int nb_boundaries);
+void block_latency_cleanup(BlockAcctLatency *stats);
+
+#endif
@@ -44,6 +44,16 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
+
+/* Event loop statistics, see aio_context_enable_stats() */
+typedef struct AioContextStats {
+    uint64_t iterations;        /* aio_poll() calls */
+    uint64_t dispatched;        /* fd handler callbacks invoked */
+    uint64_t max_dispatched;    /* most callbacks invoked by one aio_poll() */
+    int64_t busy_ns;            /* time in aio_poll() not spent waiting */
+    int64_t blocked_ns;         /* time spent waiting for events */
+} AioContextStats;
 
 struct AioContext {
     GSource source;
@@ -60,6 +70,28 @@ struct AioContext {
      */
     int walking_handlers;
 
+    /* Number of registered handlers, not counting deleted ones */
+    int nb_handlers;
+
+    /* Whether handlers were only marked as deleted and are still in the
+     * list because it was being walked
+     */
+    bool deleted_handlers;
+
+    /* Whether aio_pending() found events that the glib main loop stored in
+     * the handlers and that have not been dispatched yet
+     */
+    bool revents_pending;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* aio_poll() uses epoll instead of ppoll() once many handlers are
+     * registered, so that its cost does not grow with their number.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
+
     /* lock to protect between bh's adders and deleter */
     QemuMutex bh_lock;
     /* Anchor of the list of Bottom Halves belonging to the context */
@@ -81,6 +113,17 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Adaptive polling, see aio_context_set_poll_params() */
+    int nb_poll_handlers;       /* handlers with an io_poll callback */
+    int64_t poll_ns;            /* current polling time in nanoseconds */
+    int64_t poll_max_ns;        /* maximum polling time in nanoseconds */
+    int64_t poll_grow;          /* polling time growth factor */
+    int64_t poll_shrink;        /* polling time shrink factor */
+
+    /* Only updated once aio_context_enable_stats() was called */
+    bool stats_enabled;
+    AioContextStats stats;
 };
 
 /**
@@ -92,6 +135,42 @@ struct AioContext {
  */
 AioContext *aio_context_new(void);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor, 0 for the default
+ * @shrink: polling time shrink factor, 0 to reset to 0 instead
+ *
+ * Before blocking, aio_poll() can call the io_poll callbacks of its handlers
+ * for a while.  The polling time adapts itself between 0 and @max_ns: it is
+ * multiplied by @grow when events come in shortly after polling gave up, and
+ * divided by @shrink when there were none for longer than @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
+/**
+ * aio_context_enable_stats:
+ * @ctx: the aio context
+ *
+ * Make aio_poll() account its iterations, the fd handlers it dispatches (not
+ * counting aio_notify() wakeups) and the time it spends waiting for events and
+ * running.  Timing each iteration
+ * has a cost, so this is meant for contexts that run in their own thread.
+ */
+void aio_context_enable_stats(AioContext *ctx);
+
+/**
+ * aio_context_get_stats:
+ * @ctx: the aio context
+ * @stats: filled with the statistics of @ctx
+ *
+ * May be called from any thread.  The counters are not read atomically as a
+ * whole, so they can be off by an iteration relative to each other.
+ */
+void aio_context_get_stats(AioContext *ctx, AioContextStats *stats);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -202,6 +281,14 @@ void qemu_bh_delete(QEMUBH *bh);
  */
 bool aio_pending(AioContext *ctx);
 
+/* Initialize and free the host specific parts of an AioContext, like the
+ * epoll file descriptor.
+ *
+ * This is used internally by aio_context_new() and the GSource finalizer.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_cleanup(AioContext *ctx);
+
 /* Progress in completing AIO work to occur.  This can issue new pending
  * aio as a result of executing I/O completion or bh callbacks.
  *
@@ -230,6 +317,13 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_read,
                         IOHandler *io_write,
                         void *opaque);
+
+/* Set a callback that aio_poll() calls repeatedly instead of blocking, see
+ * aio_context_set_poll_params().  @io_poll is passed the opaque of the
+ * handler registered for @fd.  It must process what it finds and return
+ * true if it made progress.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
 #endif
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -243,6 +337,13 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Set a busy polling callback for an event notifier registered with
+ * aio_set_event_notifier(); @io_poll is passed the notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -36,6 +36,9 @@
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
+#include "block/throttle-groups.h"
+#include "block/accounting.h"
+#include "block/chain-map.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
@@ -72,6 +75,22 @@ typedef struct BdrvTrackedRequest {
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/* Passed to the write_complete_notifiers of a BlockDriverState */
+typedef struct BdrvWriteCompletion {
+    BdrvTrackedRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;     /* may be NULL if flags has BDRV_REQ_ZERO_WRITE */
+    int flags;
+    int ret;
+} BdrvWriteCompletion;
+
+/* Passed to the copy_on_read_notifiers of a BlockDriverState */
+typedef struct BdrvCopyOnReadMiss {
+    int64_t sector_num;
+    int nb_sectors;
+} BdrvCopyOnReadMiss;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -147,6 +166,12 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
+    /*
+     * Drop the data of a region so that it reads from the backing file
+     * again.  Unlike discard, the data must not read back as zeroes.
+     */
+    int coroutine_fn (*bdrv_co_unallocate)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
 
@@ -241,12 +266,30 @@ struct BlockDriver {
 
     int (*bdrv_refresh_limits)(BlockDriverState *bs);
 
+    /*
+     * Writes all named dirty bitmaps that are marked persistent to the image
+     * file.  Called on close, before .bdrv_close(), for writable images.
+     * Returns 0 on success, -errno otherwise.
+     */
+    bool (*bdrv_can_store_dirty_bitmaps)(BlockDriverState *bs);
+    int (*bdrv_store_dirty_bitmaps)(BlockDriverState *bs);
+
     /*
      * Returns 1 if newly created images are guaranteed to contain only
      * zeros, 0 otherwise.
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Move the fd handlers, timers and bottom halves of the driver from the
+     * current AioContext of bs to another one, see bdrv_set_aio_context().
+     * Protocol drivers that register any of them must implement both
+     * callbacks to be usable outside the main loop.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -266,6 +309,9 @@ typedef struct BlockLimits {
     /* optimal transfer length in sectors */
     int opt_transfer_length;
 
+    /* maximal transfer length in sectors, 0 if unlimited */
+    int max_transfer_length;
+
     /* memory alignment so that no bounce buffer is needed */
     size_t opt_mem_alignment;
 } BlockLimits;
@@ -305,23 +351,43 @@ struct BlockDriverState {
     BlockDriverState *backing_hd;
     BlockDriverState *file;
 
+    /* Event loop that requests are submitted and completed in */
+    AioContext *aio_context;
+
     NotifierList close_notifiers;
 
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request is processed, see BdrvWriteCompletion */
+    NotifierList write_complete_notifiers;
+
+    /* Callback when a copy-on-read request has to copy from the backing
+     * file, see BdrvCopyOnReadMiss */
+    NotifierList copy_on_read_notifiers;
+
+    /* Which layer of the backing chain owns which range, see chain-map.c */
+    BdrvChainMap *chain_map;
+    /* Whether this is a lower layer of some chain map, or its file */
+    bool chain_map_layer;
+    /* Reads of a deep backing chain bypass the layers without data */
+    bool chain_map_reads;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
     /* I/O throttling */
-    ThrottleState throttle_state;
+    ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    BlockAcctLatency latency[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
 
     /* I/O Limits */
@@ -390,11 +456,25 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
 /**
- * bdrv_get_aio_context:
+ * bdrv_add_write_complete_notifier:
  *
- * Returns: the currently bound #AioContext
+ * Register a callback that is invoked in coroutine context after write
+ * requests are processed, whether they succeeded or not, but before they
+ * are completed.  The callback gets a #BdrvWriteCompletion.
  */
-AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+void bdrv_add_write_complete_notifier(BlockDriverState *bs,
+                                      Notifier *notifier);
+
+/**
+ * bdrv_add_copy_on_read_notifier:
+ *
+ * Register a callback that is invoked in coroutine context before a
+ * copy-on-read request copies data from the backing file.  The callback
+ * gets a #BdrvCopyOnReadMiss.
+ */
+void bdrv_add_copy_on_read_notifier(BlockDriverState *bs,
+                                    Notifier *notifier);
+
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
@@ -411,6 +491,10 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of concurrent copy operations, or 0
+ * for the default.
+ * @guest_share: The percentage of the bandwidth that is left to guest I/O
+ * while the guest is active, or 0 to not restrict streaming.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -423,7 +507,8 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * @base_id in the written image and to @base in the live BlockDriverState.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
+                  const char *base_id, int64_t speed, int max_in_flight,
+                  int guest_share, BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -433,6 +518,12 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  * @top: Top block device to be committed.
  * @base: Block device that will be written into, and become the new top.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_in_flight: The maximum number of concurrent copy operations, or 0
+ * for the default.
+ * @drop_committed: Whether to drop data from @top once it is safe in @base.
+ * Requires @base to be the backing file of @top.
+ * @drop_batch_size: How much committed data, in bytes, to drop from @top
+ * at once, or 0 for the default.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -440,9 +531,10 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  *
  */
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
-                 BlockDriverState *top, int64_t speed,
-                 BlockdevOnError on_error, BlockDriverCompletionFunc *cb,
-                 void *opaque, Error **errp);
+                 BlockDriverState *top, int64_t speed, int max_in_flight,
+                 bool drop_committed, int64_t drop_batch_size,
+                 BlockdevOnError on_error,
+                 BlockDriverCompletionFunc *cb, void *opaque, Error **errp);
 /**
  * commit_active_start:
  * @bs: Active block device to be committed.
@@ -466,6 +558,9 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
+ * @max_in_flight: The maximum number of parallel copy operations, or 0 for
+ * the default.
+ * @copy_mode: Whether guest writes are copied to @target synchronously.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -480,6 +575,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight, MirrorCopyMode copy_mode,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
@@ -491,6 +587,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @sync_bitmap: The dirty bitmap describing what to copy if @sync_mode is
+ * MIRROR_SYNC_MODE_INCREMENTAL, NULL otherwise.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -501,6 +599,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
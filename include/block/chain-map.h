@@ -0,0 +1,59 @@
+/*
+ * QEMU block backing chain allocation map
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_CHAIN_MAP_H
+#define BLOCK_CHAIN_MAP_H
+
+#include "qemu-common.h"
+
+typedef struct BdrvChainMap BdrvChainMap;
+
+typedef struct BdrvChainMapStats {
+    uint64_t hits;              /* lookups answered from the map */
+    uint64_t misses;            /* lookups that walked the backing chain */
+    uint64_t nb_extents;        /* extents currently in the map */
+} BdrvChainMapStats;
+
+/*
+ * Find the layer of the backing chain of @bs that provides the data at
+ * @sector_num.  Returns the block status of that layer like
+ * bdrv_get_block_status() does, and stores the layer and its depth below
+ * @bs in @owner and @depth.  If no layer has the data, 0 is returned and
+ * @owner is set to NULL.  The result covers *@pnum sectors.
+ *
+ * This walks the chain the first time a range is looked up and remembers
+ * the result until a write or a change of the chain invalidates it.
+ */
+int64_t bdrv_chain_map_get_status(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, int *pnum,
+                                  BlockDriverState **owner, int *depth);
+
+/* Drop what is known about a range that has been written to @bs */
+void bdrv_chain_map_invalidate(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors);
+
+/* Drop all maps, to be called whenever a backing chain changes */
+void bdrv_chain_map_invalidate_all(void);
+
+void bdrv_chain_map_free(BlockDriverState *bs);
+
+bool bdrv_chain_map_get_stats(const BlockDriverState *bs,
+                              BdrvChainMapStats *stats);
+
+#endif
@@ -32,28 +32,59 @@ struct nbd_request {
     uint32_t len;
 } QEMU_PACKED;
 
+/* Header of both simple and structured replies, see nbd_receive_reply() */
 struct nbd_reply {
     uint32_t magic;
-    uint32_t error;
+    uint32_t error;             /* simple replies only */
     uint64_t handle;
+    uint16_t flags;             /* structured replies only */
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+#define NBD_REPLY_MAGIC             0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+
+/* Structured reply flags and chunk types */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR_BIT    (1 << 15)
+#define NBD_REPLY_TYPE_ERROR        (NBD_REPLY_TYPE_ERROR_BIT | 1)
+
+/* Flags of the extents in a base:allocation block status reply */
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+
+/* Extensions negotiated by nbd_receive_negotiate() */
+typedef struct NBDExtensions {
+    bool structured_reply;
+    bool block_status;          /* base:allocation meta context selected */
+    uint32_t meta_context_id;
+} NBDExtensions;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Flushes cover all connections */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
 #define NBD_DEFAULT_PORT	10809
@@ -61,9 +92,13 @@ enum {
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Number of requests that can be in flight on a single connection */
+#define NBD_DEFAULT_QUEUE_DEPTH 16
+#define NBD_MAX_QUEUE_DEPTH     256
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          off_t *size, size_t *blocksize, NBDExtensions *ext);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
@@ -84,6 +119,7 @@ BlockDriverState *nbd_export_get_blockdev(NBDExport *exp);
 
 NBDExport *nbd_export_find(const char *name);
 void nbd_export_set_name(NBDExport *exp, const char *name);
+void nbd_export_set_queue_depth(NBDExport *exp, int queue_depth);
 void nbd_export_close_all(void);
 
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
@@ -0,0 +1,49 @@
+/*
+ * QEMU block throttling group infrastructure
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THROTTLE_GROUPS_H
+#define THROTTLE_GROUPS_H
+
+#include "qemu-common.h"
+#include "qemu/throttle.h"
+#include "block/coroutine.h"
+
+typedef struct ThrottleGroup ThrottleGroup;
+
+typedef struct ThrottleGroupStats {
+    uint64_t nr_bytes[2];       /* bytes accounted, indexed by is_write */
+    uint64_t nr_ops[2];         /* requests accounted */
+    uint64_t nr_throttled[2];   /* requests that had to wait */
+} ThrottleGroupStats;
+
+const char *throttle_group_get_name(const BlockDriverState *bs);
+
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
+void throttle_group_get_stats(const BlockDriverState *bs,
+                              ThrottleGroupStats *stats);
+
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
+void throttle_group_unregister_bs(BlockDriverState *bs);
+
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * vhost-user-blk host device
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VHOST_USER_BLK_H
+#define VHOST_USER_BLK_H
+
+#include "qemu-common.h"
+#include "hw/qdev.h"
+#include "hw/virtio/virtio-blk.h"
+#include "hw/virtio/vhost.h"
+#include "sysemu/char.h"
+
+#define TYPE_VHOST_USER_BLK "vhost-user-blk"
+#define VHOST_USER_BLK(obj) \
+        OBJECT_CHECK(VHostUserBlk, (obj), TYPE_VHOST_USER_BLK)
+
+typedef struct VHostUserBlkConf {
+    CharDriverState *chardev;
+    uint16_t num_queues;
+    uint32_t queue_size;
+} VHostUserBlkConf;
+
+typedef struct VHostUserBlk {
+    VirtIODevice parent_obj;
+    VHostUserBlkConf conf;
+    struct virtio_blk_config blkcfg;
+    struct vhost_dev dev;
+} VHostUserBlk;
+
+#define DEFINE_VHOST_USER_BLK_PROPERTIES(_state, _conf_field) \
+    DEFINE_PROP_CHR("chardev", _state, _conf_field.chardev), \
+    DEFINE_PROP_UINT16("num-queues", _state, _conf_field.num_queues, 1), \
+    DEFINE_PROP_UINT32("queue-size", _state, _conf_field.queue_size, 128)
+
+#endif
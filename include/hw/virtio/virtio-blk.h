@@ -39,6 +39,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -56,6 +57,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;        /* only present with VIRTIO_BLK_F_MQ */
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -104,29 +107,53 @@ struct virtio_scsi_inhdr
     uint32_t residual;
 };
 
+/* Maximum number of request virtqueues */
+#define VIRTIO_BLK_MAX_QUEUES   64
+
 struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothreads;
+    IOThread **iothreads;       /* virtqueue n uses iothreads[n % num] */
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t num_queues;
+    uint32_t merge_window_us;
 };
 
+/* Per-virtqueue request counters */
+typedef struct VirtIOBlockQueueStats {
+    uint64_t requests;
+    uint64_t completed;
+    uint64_t rd_ops;
+    uint64_t wr_ops;
+    uint64_t flush_ops;
+    uint64_t other_ops;
+    uint64_t rd_bytes;
+    uint64_t wr_bytes;
+} VirtIOBlockQueueStats;
+
 struct VirtIOBlockDataPlane;
+struct MultiReqBuffer;
 
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockDriverState *bs;
-    VirtQueue *vq;
+    VirtQueue **vqs;
+    VirtIOBlockQueueStats *queue_stats;
     void *rq;
     QEMUBH *bh;
+    QEMUBH *complete_bh;            /* publishes completed requests */
     BlockConf *conf;
     VirtIOBlkConf blk;
     unsigned short sector_mask;
     bool original_wce;
     VMChangeStateEntry *change;
+    struct MultiReqBuffer *mrb;     /* requests not yet submitted */
+    QEMUTimer *merge_timer;
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     Notifier migration_state_notifier;
     struct VirtIOBlockDataPlane *dataplane;
@@ -143,14 +170,24 @@ typedef struct VirtIOBlock {
         DEFINE_PROP_STRING("serial", _state, _field.serial),                  \
         DEFINE_PROP_BIT("config-wce", _state, _field.config_wce, 0, true),    \
         DEFINE_PROP_BIT("scsi", _state, _field.scsi, 0, true),                \
-        DEFINE_PROP_IOTHREAD("x-iothread", _state, _field.iothread)
+        DEFINE_PROP_UINT32("num-queues", _state, _field.num_queues, 1),       \
+        DEFINE_PROP_UINT32("merge-window-us", _state, _field.merge_window_us, \
+                           0),                                                \
+        DEFINE_PROP_IOTHREAD("x-iothread", _state, _field.iothread),          \
+        DEFINE_PROP_ARRAY("x-iothreads", _state, _field.num_iothreads,        \
+                          _field.iothreads, qdev_prop_iothread, IOThread *)
 #else
 #define DEFINE_VIRTIO_BLK_PROPERTIES(_state, _field)                          \
         DEFINE_BLOCK_PROPERTIES(_state, _field.conf),                         \
         DEFINE_BLOCK_CHS_PROPERTIES(_state, _field.conf),                     \
         DEFINE_PROP_STRING("serial", _state, _field.serial),                  \
         DEFINE_PROP_BIT("config-wce", _state, _field.config_wce, 0, true),    \
-        DEFINE_PROP_IOTHREAD("x-iothread", _state, _field.iothread)
+        DEFINE_PROP_UINT32("num-queues", _state, _field.num_queues, 1),       \
+        DEFINE_PROP_UINT32("merge-window-us", _state, _field.merge_window_us, \
+                           0),                                                \
+        DEFINE_PROP_IOTHREAD("x-iothread", _state, _field.iothread),          \
+        DEFINE_PROP_ARRAY("x-iothreads", _state, _field.num_iothreads,        \
+                          _field.iothreads, qdev_prop_iothread, IOThread *)
 #endif /* __linux__ */
 
 void virtio_blk_set_conf(DeviceState *dev, VirtIOBlkConf *blk);
@@ -17,6 +17,10 @@
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
 #include "hw/scsi/scsi.h"
+#include "sysemu/iothread.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/virtio/dataplane/vring.h"
+#endif
 
 #define TYPE_VIRTIO_SCSI_COMMON "virtio-scsi-common"
 #define VIRTIO_SCSI_COMMON(obj) \
@@ -153,6 +157,7 @@ struct VirtIOSCSIConf {
     uint32_t cmd_per_lun;
     char *vhostfd;
     char *wwpn;
+    IOThread *iothread;
 };
 
 typedef struct VirtIOSCSICommon {
@@ -166,18 +171,69 @@ typedef struct VirtIOSCSICommon {
     VirtQueue **cmd_vqs;
 } VirtIOSCSICommon;
 
-typedef struct {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+/* A virtqueue processed in the iothread */
+typedef struct VirtIOSCSIVring {
+    struct VirtIOSCSI *parent;
+    VirtQueue *vq;
+    EventNotifier host_notifier;
+    EventNotifier guest_notifier;
+    Vring vring;
+} VirtIOSCSIVring;
+#endif
+
+typedef struct VirtIOSCSI {
     VirtIOSCSICommon parent_obj;
 
     SCSIBus bus;
     int resetting;
     bool events_dropped;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Fields for dataplane below */
+    AioContext *ctx;            /* the iothread's context, if one is set */
+    Error *blocker;             /* blocks operations on the LUNs */
+    Notifier migration_state_notifier;
+
+    VirtIOSCSIVring *ctrl_vring;
+    VirtIOSCSIVring *event_vring;
+    VirtIOSCSIVring *cmd_vrings;
+    bool dataplane_started;
+    bool dataplane_starting;
+    bool dataplane_stopping;
+    bool dataplane_disabled;    /* the main loop processes requests */
+#endif
 } VirtIOSCSI;
 
+typedef struct VirtIOSCSIReq {
+    VirtIOSCSI *dev;
+    VirtQueue *vq;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSIVring *vring;     /* set if popped by the iothread */
+#endif
+    VirtQueueElement elem;
+    QEMUSGList qsgl;
+    SCSIRequest *sreq;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdReq      *cmd;
+        VirtIOSCSICtrlTMFReq  *tmf;
+        VirtIOSCSICtrlANReq   *an;
+    } req;
+    union {
+        char                  *buf;
+        VirtIOSCSICmdResp     *cmd;
+        VirtIOSCSICtrlTMFResp *tmf;
+        VirtIOSCSICtrlANResp  *an;
+        VirtIOSCSIEvent       *event;
+    } resp;
+} VirtIOSCSIReq;
+
 #define DEFINE_VIRTIO_SCSI_PROPERTIES(_state, _conf_field)                     \
     DEFINE_PROP_UINT32("num_queues", _state, _conf_field.num_queues, 1),       \
     DEFINE_PROP_UINT32("max_sectors", _state, _conf_field.max_sectors, 0xFFFF),\
-    DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128)
+    DEFINE_PROP_UINT32("cmd_per_lun", _state, _conf_field.cmd_per_lun, 128),\
+    DEFINE_PROP_IOTHREAD("iothread", _state, _conf_field.iothread)
 
 #define DEFINE_VIRTIO_SCSI_FEATURES(_state, _feature_field)                    \
     DEFINE_VIRTIO_COMMON_FEATURES(_state, _feature_field),                     \
@@ -189,4 +245,22 @@ typedef struct {
 void virtio_scsi_common_realize(DeviceState *dev, Error **errp);
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 
+void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
+void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
+void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
+void virtio_scsi_handle_event_req(VirtIOSCSI *s);
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+/* virtio-scsi-dataplane.c */
+void virtio_scsi_dataplane_init(VirtIOSCSI *s);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+void virtio_scsi_dataplane_start(VirtIOSCSI *s);
+void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
+void virtio_scsi_dataplane_hotplug(VirtIOSCSI *s, SCSIDevice *d);
+void virtio_scsi_dataplane_hot_unplug(VirtIOSCSI *s, SCSIDevice *d);
+VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
+                                         VirtIOSCSIVring *vring);
+void virtio_scsi_vring_notify(VirtIOSCSI *s, VirtIOSCSIVring *vring);
+#endif
+
 #endif /* _QEMU_VIRTIO_SCSI_H */
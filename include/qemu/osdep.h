@@ -162,6 +162,7 @@ int qemu_close(int fd);
 
 int qemu_create_pidfile(const char *filename);
 int qemu_get_thread_id(void);
+int qemu_set_thread_nice(int thread_id, int nice);
 
 #ifndef CONFIG_IOVEC
 struct iovec {
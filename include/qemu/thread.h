@@ -61,4 +61,18 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/*
+ * Host scheduling of a thread.  Both return 0 or -errno; -ENOTSUP if the
+ * host does not support it.
+ *
+ * qemu_thread_set_affinity() restricts @thread to the host CPUs set in the
+ * @nbits bit long bitmap @host_cpus.  qemu_thread_set_sched() switches it to
+ * real-time FIFO scheduling at @priority if @realtime is true, and back to
+ * normal time-sharing scheduling otherwise.
+ */
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits);
+int qemu_thread_set_sched(QemuThread *thread, bool realtime, int priority);
+
 #endif
@@ -56,10 +56,12 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_sync_read)(struct CharDriverState *s, uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
+    int (*set_msgfds)(struct CharDriverState *s, int *fds, int num);
     int (*chr_add_client)(struct CharDriverState *chr, int fd);
     IOEventHandler *chr_event;
     IOCanReadHandler *chr_can_read;
@@ -188,6 +190,21 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
  */
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_read_all:
+ *
+ * Read data from a character backend, blocking until all of it has been
+ * received.  This bypasses the read handlers and is meant for front ends
+ * that talk a request/reply protocol with the back end.
+ *
+ * @buf the buffer to fill
+ * @len the number of bytes to read
+ *
+ * Returns: the number of bytes read, which is less than @len if the
+ *          connection was closed, or a negative value on error
+ */
+int qemu_chr_fe_read_all(CharDriverState *s, uint8_t *buf, int len);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
@@ -214,6 +231,19 @@ int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg);
  */
 int qemu_chr_fe_get_msgfd(CharDriverState *s);
 
+/**
+ * @qemu_chr_fe_set_msgfds:
+ *
+ * For backends capable of fd passing, set an array of file descriptors
+ * to be sent along with the next write.
+ *
+ * @fds the file descriptors; they are not closed by the backend
+ * @num the number of file descriptors, 0 to drop pending ones
+ *
+ * Returns: -ENOTSUP if fd passing isn't supported, 0 otherwise
+ */
+int qemu_chr_fe_set_msgfds(CharDriverState *s, int *fds, int num);
+
 /**
  * @qemu_chr_fe_claim:
  *
@@ -16,6 +16,7 @@
 
 #include "block/aio.h"
 #include "qemu/thread.h"
+#include "qapi-types.h"
 
 #define TYPE_IOTHREAD "iothread"
 
@@ -28,6 +29,18 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* AioContext busy polling parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Host scheduling, applied to the thread as soon as it runs */
+    char *cpus;                 /* host CPU list, NULL to inherit affinity */
+    unsigned long *host_cpus;   /* @cpus parsed into a bitmap */
+    IOThreadSchedPolicy sched_policy;
+    int64_t sched_priority;     /* SCHED_FIFO priority */
+    int64_t nice;               /* nice value with SCHED_OTHER */
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -14,12 +14,19 @@
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
+#include "qemu/bitmap.h"
+#include "qemu-common.h"
 #include "block/aio.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
 
 #define IOTHREADS_PATH "/objects"
 
+/* Highest host CPU number + 1 accepted by the "cpus" property */
+#define IOTHREAD_MAX_HOST_CPUS 1024
+
 typedef ObjectClass IOThreadClass;
 
 #define IOTHREAD_GET_CLASS(obj) \
@@ -56,21 +63,74 @@ static void iothread_instance_finalize(Object *obj)
     qemu_cond_destroy(&iothread->init_done_cond);
     qemu_mutex_destroy(&iothread->init_done_lock);
     aio_context_unref(iothread->ctx);
+    g_free(iothread->cpus);
+    g_free(iothread->host_cpus);
+}
+
+static void iothread_set_affinity(IOThread *iothread,
+                                  const unsigned long *host_cpus,
+                                  Error **errp)
+{
+    int ret;
+
+    if (!host_cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(&iothread->thread, host_cpus,
+                                   IOTHREAD_MAX_HOST_CPUS);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set host CPU affinity of "
+                         "iothread");
+    }
+}
+
+static void iothread_set_sched(IOThread *iothread, IOThreadSchedPolicy policy,
+                               int64_t priority, int64_t nice, Error **errp)
+{
+    int ret;
+
+    switch (policy) {
+    case IO_THREAD_SCHED_POLICY_INHERIT:
+        return;
+    case IO_THREAD_SCHED_POLICY_OTHER:
+        ret = qemu_thread_set_sched(&iothread->thread, false, 0);
+        if (ret == 0) {
+            ret = qemu_set_thread_nice(iothread->thread_id, nice);
+        }
+        break;
+    case IO_THREAD_SCHED_POLICY_FIFO:
+        ret = qemu_thread_set_sched(&iothread->thread, true, priority);
+        break;
+    default:
+        abort();
+    }
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot set host scheduling policy of "
+                         "iothread");
+    }
 }
 
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
 
     iothread->stopping = false;
     iothread->ctx = aio_context_new();
     iothread->thread_id = -1;
 
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink);
+    aio_context_enable_stats(iothread->ctx);
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+    /* Unless the "cpus" and "sched-policy" properties say otherwise, this
+     * assumes we are called from a thread with useful CPU affinity and
+     * scheduling for us to inherit.
      */
     qemu_thread_create(&iothread->thread, "iothread", iothread_run,
                        iothread, QEMU_THREAD_JOINABLE);
@@ -82,6 +142,271 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    iothread_set_affinity(iothread, iothread->host_cpus, &local_err);
+    if (!local_err) {
+        iothread_set_sched(iothread, iothread->sched_policy,
+                           iothread->sched_priority, iothread->nice,
+                           &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+    }
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+} PollParamInfo;
+
+static PollParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static PollParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static PollParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+
+static void iothread_get_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int(v, field, name, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (value < 0) {
+        error_setg(errp, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        return;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink);
+    }
+}
+
+/* Parse a host CPU list such as "0-3,8" */
+static unsigned long *iothread_parse_cpus(const char *str, Error **errp)
+{
+    unsigned long *host_cpus = bitmap_new(IOTHREAD_MAX_HOST_CPUS);
+    const char *p = str;
+
+    for (;;) {
+        unsigned long long first, last;
+        char *end;
+
+        if (parse_uint(p, &first, &end, 10) < 0) {
+            goto fail;
+        }
+        last = first;
+        if (*end == '-' && parse_uint(end + 1, &last, &end, 10) < 0) {
+            goto fail;
+        }
+        if (first > last || last >= IOTHREAD_MAX_HOST_CPUS) {
+            goto fail;
+        }
+        bitmap_set(host_cpus, first, last - first + 1);
+
+        if (*end == '\0') {
+            return host_cpus;
+        } else if (*end != ',') {
+            goto fail;
+        }
+        p = end + 1;
+    }
+
+fail:
+    error_setg(errp, "Invalid host CPU list '%s', expected comma separated "
+               "CPU numbers or ranges below %d", str, IOTHREAD_MAX_HOST_CPUS);
+    g_free(host_cpus);
+    return NULL;
+}
+
+static char *iothread_get_cpus(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return g_strdup(iothread->cpus ? iothread->cpus : "");
+}
+
+static void iothread_set_cpus(Object *obj, const char *value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    unsigned long *host_cpus;
+    Error *local_err = NULL;
+
+    host_cpus = iothread_parse_cpus(value, errp);
+    if (!host_cpus) {
+        return;
+    }
+
+    if (iothread->ctx) {
+        iothread_set_affinity(iothread, host_cpus, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            g_free(host_cpus);
+            return;
+        }
+    }
+
+    g_free(iothread->cpus);
+    g_free(iothread->host_cpus);
+    iothread->cpus = g_strdup(value);
+    iothread->host_cpus = host_cpus;
+}
+
+/* Apply new scheduling parameters if the thread runs, then store them */
+static void iothread_update_sched(IOThread *iothread,
+                                  IOThreadSchedPolicy policy,
+                                  int64_t priority, int64_t nice,
+                                  Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (iothread->ctx) {
+        iothread_set_sched(iothread, policy, priority, nice, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    iothread->sched_policy = policy;
+    iothread->sched_priority = priority;
+    iothread->nice = nice;
+}
+
+static void iothread_get_sched_policy(Object *obj, Visitor *v, void *opaque,
+                                      const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_IOThreadSchedPolicy(v, &iothread->sched_policy, name, errp);
+}
+
+static void iothread_set_sched_policy(Object *obj, Visitor *v, void *opaque,
+                                      const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    IOThreadSchedPolicy policy;
+
+    visit_type_IOThreadSchedPolicy(v, &policy, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    iothread_update_sched(iothread, policy, iothread->sched_priority,
+                          iothread->nice, errp);
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    int64_t min;
+    int64_t max;
+} SchedParamInfo;
+
+static SchedParamInfo sched_priority_info = {
+    "sched-priority", offsetof(IOThread, sched_priority), 1, 99,
+};
+static SchedParamInfo nice_info = {
+    "nice", offsetof(IOThread, nice), -20, 19,
+};
+
+static void iothread_get_sched_param(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    SchedParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int(v, field, name, errp);
+}
+
+static void iothread_set_sched_param(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    SchedParamInfo *info = opaque;
+    int64_t priority = iothread->sched_priority;
+    int64_t nice = iothread->nice;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (value < info->min || value > info->max) {
+        error_setg(errp, "%s value must be in range [%"PRId64", %"PRId64"]",
+                   info->name, info->min, info->max);
+        return;
+    }
+
+    if (info == &nice_info) {
+        nice = value;
+    } else {
+        priority = value;
+    }
+    iothread_update_sched(iothread, iothread->sched_policy, priority, nice,
+                          errp);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->sched_policy = IO_THREAD_SCHED_POLICY_INHERIT;
+    iothread->sched_priority = 1;
+
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_max_ns_info, NULL);
+    object_property_add(obj, "poll-grow", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_grow_info, NULL);
+    object_property_add(obj, "poll-shrink", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_shrink_info, NULL);
+    object_property_add_str(obj, "cpus", iothread_get_cpus,
+                            iothread_set_cpus, NULL);
+    object_property_add(obj, "sched-policy", "IOThreadSchedPolicy",
+                        iothread_get_sched_policy, iothread_set_sched_policy,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "sched-priority", "int",
+                        iothread_get_sched_param, iothread_set_sched_param,
+                        NULL, &sched_priority_info, NULL);
+    object_property_add(obj, "nice", "int",
+                        iothread_get_sched_param, iothread_set_sched_param,
+                        NULL, &nice_info, NULL);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
@@ -95,6 +420,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -137,6 +463,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList *elem;
     IOThreadInfo *info;
     IOThread *iothread;
+    AioContextStats stats;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -146,6 +473,17 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->has_cpus = iothread->cpus != NULL;
+    info->cpus = g_strdup(iothread->cpus);
+    info->sched_policy = iothread->sched_policy;
+
+    aio_context_get_stats(iothread->ctx, &stats);
+    info->stats = g_new0(IOThreadStats, 1);
+    info->stats->iterations = stats.iterations;
+    info->stats->dispatched = stats.dispatched;
+    info->stats->max_dispatched = stats.max_dispatched;
+    info->stats->busy_ns = stats.busy_ns;
+    info->stats->blocked_ns = stats.blocked_ns;
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -16,6 +16,8 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/ioport.h"
+#include "sysemu/kvm.h"
+#include "qemu/event_notifier.h"
 #include "qemu/bitops.h"
 #include "qom/object.h"
 #include "trace.h"
@@ -969,6 +971,33 @@ static bool memory_region_dispatch_read(MemoryRegion *mr,
     return false;
 }
 
+/* Without KVM, nobody else signals the ioeventfds of @mr, e.g. those that
+ * vhost backends wait on.  Returns true if the write matched one of them.
+ */
+static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
+                                                  hwaddr addr,
+                                                  uint64_t data,
+                                                  unsigned size)
+{
+    MemoryRegionIoeventfd ioeventfd = {
+        .addr = addrrange_make(int128_make64(addr), int128_make64(size)),
+        .data = data,
+    };
+    unsigned i;
+
+    for (i = 0; i < mr->ioeventfd_nb; i++) {
+        ioeventfd.match_data = mr->ioeventfds[i].match_data;
+        ioeventfd.e = mr->ioeventfds[i].e;
+
+        if (memory_region_ioeventfd_equal(ioeventfd, mr->ioeventfds[i])) {
+            event_notifier_set(ioeventfd.e);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static bool memory_region_dispatch_write(MemoryRegion *mr,
                                          hwaddr addr,
                                          uint64_t data,
@@ -981,6 +1010,11 @@ static bool memory_region_dispatch_write(MemoryRegion *mr,
 
     adjust_endianness(mr, &data, size);
 
+    if (!kvm_enabled() &&
+        memory_region_dispatch_write_eventfds(mr, addr, data, size)) {
+        return false;
+    }
+
     if (mr->ops->write) {
         access_with_adjusted_size(addr, &data, size,
                                   mr->ops->impl.min_access_size,
@@ -60,10 +60,11 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
-#define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -77,16 +78,48 @@
 #define NBD_SET_TIMEOUT         _IO(0xab, 9)
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
-#define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* server flags */
+#define NBD_FLAG_C_FIXED_NEWSTYLE   (1 << 0)    /* client flags */
+
+#define NBD_OPT_EXPORT_NAME         1
+#define NBD_OPT_STRUCTURED_REPLY    8
+#define NBD_OPT_SET_META_CONTEXT    10
+
+#define NBD_REP_ACK                 1
+#define NBD_REP_META_CONTEXT        4
+#define NBD_REP_ERR_UNSUP           ((1U << 31) | 1)
+#define NBD_REP_ERR_INVALID         ((1U << 31) | 3)
+
+#define NBD_MAX_OPTION_LENGTH       4096
+
+/* The only meta context we support, with a fixed id */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Maximum number of extents in a block status reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 128
+
+/* Request buffers up to this size are kept for reuse.  This covers the
+ * requests of our own client and avoids mapping and unmapping buffers
+ * above the malloc mmap threshold for every request.  Each client keeps
+ * at most one free buffer per request it may have in flight.
+ */
+#define NBD_POOL_BUFFER_SIZE    (1024 * 1024)
 
 /* Definitions for opaque data types */
 
 typedef struct NBDRequest NBDRequest;
 
+typedef struct NBDBuffer {
+    void *data;
+    uint32_t size;
+} NBDBuffer;
+
 struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    uint32_t size;  /* allocated size of data */
 };
 
 struct NBDExport {
@@ -98,6 +131,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int queue_depth;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 };
@@ -118,7 +152,16 @@ struct NBDClient {
 
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
+    int max_requests;
     bool closing;
+
+    /* Free request buffers, at most max_requests of them */
+    NBDBuffer *buffers;
+    int nb_buffers;
+
+    /* negotiated in nbd_receive_options() */
+    bool structured_reply;
+    bool block_status;
 };
 
 /* That's all folks */
@@ -215,82 +258,260 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_receive_options(NBDClient *client)
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt,
+                        const void *data, uint32_t len)
 {
-    int csock = client->sock;
-    char name[256];
-    uint32_t tmp, length;
-    uint64_t magic;
-    int rc;
+    uint8_t buf[8 + 4 + 4 + 4];
 
-    /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
+    /* Option reply:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
         [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [20 ..  xx]   data (length bytes)
      */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
 
-    rc = -EINVAL;
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (rep)");
+        return -EINVAL;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
-        goto fail;
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (rep data)");
+        return -EINVAL;
     }
+    return 0;
+}
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+static int nbd_skip_option(int csock, uint32_t length)
+{
+    char buf[256];
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
+    while (length > 0) {
+        uint32_t len = MIN(length, sizeof(buf));
+        if (read_sync(csock, buf, len) != len) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        length -= len;
     }
+    return 0;
+}
+
+static int nbd_handle_export_name(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    char name[256];
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
-    }
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
-        goto fail;
+        return -EINVAL;
     }
     if (read_sync(csock, name, length) != length) {
         LOG("read failed");
-        goto fail;
+        return -EINVAL;
     }
     name[length] = '\0';
 
     client->exp = nbd_export_find(name);
     if (!client->exp) {
         LOG("export not found");
-        goto fail;
+        return -EINVAL;
     }
 
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
+    return 0;
+}
 
-    TRACE("Option negotiation succeeded.");
-    rc = 0;
-fail:
-    return rc;
+/* Reads a 32-bit length and the string that follows it from @buf, which has
+ * @len bytes left.  Returns the number of bytes consumed, or -EINVAL.
+ */
+static int nbd_parse_string(const uint8_t *buf, uint32_t len,
+                            const char **str, uint32_t *str_len)
+{
+    if (len < 4) {
+        return -EINVAL;
+    }
+    *str_len = be32_to_cpup((uint32_t*)buf);
+    if (*str_len > len - 4) {
+        return -EINVAL;
+    }
+    *str = (const char *)buf + 4;
+    return 4 + *str_len;
+}
+
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *name, *query;
+    uint32_t name_len, query_len, nb_queries, pos, i;
+    uint8_t *buf;
+    int ret;
+
+    /* Data:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        then, for each query, its length (4 bytes) and the query string
+     */
+    if (length > NBD_MAX_OPTION_LENGTH) {
+        LOG("Bad length received");
+        return -EINVAL;
+    }
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EINVAL;
+    }
+
+    client->block_status = false;
+    if (!client->structured_reply) {
+        goto invalid;
+    }
+
+    ret = nbd_parse_string(buf, length, &name, &name_len);
+    if (ret < 0 || length - ret < 4) {
+        goto invalid;
+    }
+    pos = ret;
+    nb_queries = be32_to_cpup((uint32_t*)(buf + pos));
+    pos += 4;
+
+    for (i = 0; i < nb_queries; i++) {
+        ret = nbd_parse_string(buf + pos, length - pos, &query, &query_len);
+        if (ret < 0) {
+            goto invalid;
+        }
+        pos += ret;
+
+        /* "base:" asks for all contexts in the namespace */
+        if ((query_len == strlen(NBD_META_BASE_ALLOCATION) &&
+             !memcmp(query, NBD_META_BASE_ALLOCATION, query_len)) ||
+            (query_len == 5 && !memcmp(query, "base:", 5))) {
+            client->block_status = true;
+        }
+    }
+
+    g_free(buf);
+    if (client->block_status) {
+        uint8_t rep[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+
+        cpu_to_be32w((uint32_t*)rep, NBD_META_ID_BASE_ALLOCATION);
+        memcpy(rep + 4, NBD_META_BASE_ALLOCATION, sizeof(rep) - 4);
+        ret = nbd_send_rep(csock, NBD_REP_META_CONTEXT,
+                           NBD_OPT_SET_META_CONTEXT, rep, sizeof(rep));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT,
+                        NULL, 0);
+
+invalid:
+    g_free(buf);
+    return nbd_send_rep(csock, NBD_REP_ERR_INVALID, NBD_OPT_SET_META_CONTEXT,
+                        NULL, 0);
+}
+
+static int nbd_receive_options(NBDClient *client)
+{
+    int csock = client->sock;
+    uint32_t flags, opt, length;
+    uint64_t magic;
+    bool fixed;
+    int rc;
+
+    /* Client sends:
+        [ 0 ..   3]   client flags
+
+       followed by any number of options:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   data (length bytes)
+
+       NBD_OPT_EXPORT_NAME, whose data is the export name, must come last
+       and gets no option reply.  Other options are only accepted from
+       clients that support the fixed newstyle negotiation.
+     */
+
+    if (read_sync(csock, &flags, sizeof(flags)) != sizeof(flags)) {
+        LOG("read failed");
+        return -EINVAL;
+    }
+    TRACE("Checking client flags");
+    flags = be32_to_cpu(flags);
+    if (flags & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
+        return -EINVAL;
+    }
+    fixed = flags & NBD_FLAG_C_FIXED_NEWSTYLE;
+
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            return -EINVAL;
+        }
+
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt) ||
+            read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        opt = be32_to_cpu(opt);
+        length = be32_to_cpu(length);
+
+        TRACE("Checking option %" PRIu32, opt);
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            rc = nbd_handle_export_name(client, length);
+            if (rc == 0) {
+                TRACE("Option negotiation succeeded.");
+            }
+            return rc;
+        }
+        if (!fixed) {
+            LOG("Bad option received");
+            return -EINVAL;
+        }
+
+        switch (opt) {
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                rc = nbd_skip_option(csock, length);
+                if (rc == 0) {
+                    rc = nbd_send_rep(csock, NBD_REP_ERR_INVALID, opt,
+                                      NULL, 0);
+                }
+                break;
+            }
+            client->structured_reply = true;
+            rc = nbd_send_rep(csock, NBD_REP_ACK, opt, NULL, 0);
+            break;
+        case NBD_OPT_SET_META_CONTEXT:
+            rc = nbd_handle_set_meta_context(client, length);
+            break;
+        default:
+            rc = nbd_skip_option(csock, length);
+            if (rc == 0) {
+                rc = nbd_send_rep(csock, NBD_REP_ERR_UNSUP, opt, NULL, 0);
+            }
+            break;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+    }
 }
 
 static int nbd_send_negotiate(NBDClient *client)
@@ -298,6 +519,9 @@ static int nbd_send_negotiate(NBDClient *client)
     int csock = client->sock;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* NBD_FLAG_CAN_MULTI_CONN comes from the export flags, because only
+     * the caller knows whether more than one client may connect.
+     */
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
                          NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
 
@@ -312,7 +536,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -333,6 +557,7 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -367,8 +592,126 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, const void *data,
+                           uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        LOG("write failed (option data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Reads an option reply header for @opt; the caller must consume the
+ * @len bytes of data that follow it.
+ */
+static int nbd_receive_rep(int csock, uint32_t opt, uint32_t *type,
+                           uint32_t *len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (rep)");
+        return -EINVAL;
+    }
+    if (be64_to_cpup((uint64_t*)buf) != NBD_REP_MAGIC ||
+        be32_to_cpup((uint32_t*)(buf + 8)) != opt) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpup((uint32_t*)(buf + 12));
+    *len = be32_to_cpup((uint32_t*)(buf + 16));
+    if (*len > NBD_MAX_OPTION_LENGTH) {
+        LOG("Bad option reply length received");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t type, len, name_len, query_len;
+    uint8_t *buf;
+    size_t pos;
+    int rc;
+
+    memset(ext, 0, sizeof(*ext));
+
+    rc = nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+    if (rc == 0) {
+        rc = nbd_receive_rep(csock, NBD_OPT_STRUCTURED_REPLY, &type, &len);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+    if (len && nbd_skip_option(csock, len) < 0) {
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        /* Old server, carry on without extensions */
+        return 0;
+    }
+    ext->structured_reply = true;
+
+    /* export name, number of queries, a single query */
+    name_len = strlen(name);
+    query_len = strlen(query);
+    buf = g_malloc(4 + name_len + 4 + 4 + query_len);
+    pos = 0;
+    cpu_to_be32w((uint32_t*)(buf + pos), name_len);
+    memcpy(buf + pos + 4, name, name_len);
+    pos += 4 + name_len;
+    cpu_to_be32w((uint32_t*)(buf + pos), 1);
+    pos += 4;
+    cpu_to_be32w((uint32_t*)(buf + pos), query_len);
+    memcpy(buf + pos + 4, query, query_len);
+    pos += 4 + query_len;
+
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, buf, pos);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (;;) {
+        uint8_t data[NBD_MAX_OPTION_LENGTH];
+
+        rc = nbd_receive_rep(csock, NBD_OPT_SET_META_CONTEXT, &type, &len);
+        if (rc < 0) {
+            return rc;
+        }
+        if (read_sync(csock, data, len) != len) {
+            LOG("read failed (rep data)");
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            /* NBD_REP_ACK ends the list, errors mean no block status */
+            break;
+        }
+        if (len == 4 + query_len && !memcmp(data + 4, query, query_len)) {
+            ext->block_status = true;
+            ext->meta_context_id = be32_to_cpup((uint32_t*)data);
+        }
+    }
+    if (type != NBD_REP_ACK) {
+        ext->block_status = false;
+    }
+    return 0;
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize, NBDExtensions *ext)
 {
     char buf[256];
     uint64_t magic, s;
@@ -412,8 +755,13 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     magic = be64_to_cpu(magic);
     TRACE("Magic is 0x%" PRIx64, magic);
 
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
+
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
+        uint16_t server_flags;
         uint32_t opt;
         uint32_t namesize;
 
@@ -426,13 +774,22 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("flags read failed");
             goto fail;
         }
-        *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
+        server_flags = be16_to_cpu(tmp);
+        *flags = server_flags << 16;
+        if (server_flags & NBD_FLAG_FIXED_NEWSTYLE) {
+            client_flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("write failed (client flags)");
             goto fail;
         }
+        /* options can only be sent with the fixed newstyle negotiation */
+        if (ext && (server_flags & NBD_FLAG_FIXED_NEWSTYLE)) {
+            if (nbd_negotiate_extensions(csock, name, ext) < 0) {
+                goto fail;
+            }
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -680,16 +1037,51 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
         return -EINVAL;
     }
 
-    /* Reply
+    /* Simple reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic  = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        uint32_t length;
+
+        /* Only the first bytes of a reply can be missing */
+        do {
+            ret = read_sync(csock, &length, sizeof(length));
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(length)) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = be32_to_cpu(length);
+
+        TRACE("Got structured reply: "
+              "{ flags = 0x%x, type = %d, handle = %" PRIu64", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->flags  = NBD_REPLY_FLAG_DONE;
+    reply->type   = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
+
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
           magic, reply->error, reply->handle);
@@ -701,11 +1093,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -714,23 +1103,8 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -747,6 +1121,10 @@ void nbd_client_put(NBDClient *client)
         qemu_set_fd_handler2(client->sock, NULL, NULL, NULL, NULL);
         close(client->sock);
         client->sock = -1;
+        while (client->nb_buffers > 0) {
+            qemu_vfree(client->buffers[--client->nb_buffers].data);
+        }
+        g_free(client->buffers);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             nbd_export_put(client->exp);
@@ -778,7 +1156,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= client->max_requests - 1);
     client->nb_requests++;
 
     req = g_slice_new0(NBDRequest);
@@ -792,16 +1170,52 @@ static void nbd_request_put(NBDRequest *req)
     NBDClient *client = req->client;
 
     if (req->data) {
-        qemu_vfree(req->data);
+        if (req->size <= NBD_POOL_BUFFER_SIZE &&
+            client->nb_buffers < client->max_requests) {
+            client->buffers[client->nb_buffers].data = req->data;
+            client->buffers[client->nb_buffers].size = req->size;
+            client->nb_buffers++;
+        } else {
+            qemu_vfree(req->data);
+        }
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- == client->max_requests) {
         qemu_notify_event();
     }
     nbd_client_put(client);
 }
 
+/* Gives @req a buffer of at least @len bytes, reusing the smallest free
+ * buffer that is large enough
+ */
+static void nbd_request_alloc_data(NBDRequest *req, uint32_t len)
+{
+    NBDClient *client = req->client;
+    int best = -1;
+    int i;
+
+    if (len <= NBD_POOL_BUFFER_SIZE) {
+        for (i = 0; i < client->nb_buffers; i++) {
+            if (client->buffers[i].size >= len &&
+                (best < 0 ||
+                 client->buffers[i].size < client->buffers[best].size)) {
+                best = i;
+            }
+        }
+    }
+
+    if (best >= 0) {
+        req->data = client->buffers[best].data;
+        req->size = client->buffers[best].size;
+        client->buffers[best] = client->buffers[--client->nb_buffers];
+    } else {
+        req->data = qemu_blockalign(client->exp->bs, len);
+        req->size = len;
+    }
+}
+
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *))
@@ -812,6 +1226,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->bs = bs;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
     bdrv_ref(bs);
@@ -851,6 +1266,13 @@ void nbd_export_set_name(NBDExport *exp, const char *name)
     nbd_export_put(exp);
 }
 
+/* Only affects clients that connect afterwards */
+void nbd_export_set_queue_depth(NBDExport *exp, int queue_depth)
+{
+    assert(queue_depth > 0 && queue_depth <= NBD_MAX_QUEUE_DEPTH);
+    exp->queue_depth = queue_depth;
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -914,26 +1336,83 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
-    ssize_t rc, ret;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = req->data, .iov_len = len },
+    };
+    ssize_t rc;
+
+    nbd_encode_reply(buf, reply);
+    TRACE("Sending response to client");
 
     qemu_co_mutex_lock(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
                          nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    /* Header and data go out in a single sendmsg, straight from the buffer
+     * that the data was read into.
+     */
+    rc = qemu_co_sendv(csock, iov, len ? 2 : 1, 0, sizeof(buf) + len);
+    if (rc != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
+    }
+
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+/* Sends one chunk of a structured reply.  The payload starts with
+ * @payload_len bytes of @payload, followed by @data_len bytes of @data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, uint32_t payload_len,
+                                 void *data, uint32_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[3];
+    unsigned int niov = 0;
+    size_t len;
+    ssize_t rc;
+
+    assert(client->structured_reply);
+
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), payload_len + data_len);
+
+    iov[niov++] = (struct iovec) { .iov_base = buf, .iov_len = sizeof(buf) };
+    if (payload_len) {
+        iov[niov++] = (struct iovec) {
+            .iov_base = payload, .iov_len = payload_len
+        };
+    }
+    if (data_len) {
+        iov[niov++] = (struct iovec) { .iov_base = data, .iov_len = data_len };
     }
+    len = sizeof(buf) + payload_len + data_len;
+
+    TRACE("Sending chunk to client: { flags = 0x%x, type = %d, len = %zu }",
+          flags, type, len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    rc = qemu_co_sendv(csock, iov, niov, 0, len);
+    rc = (rc == len) ? 0 : -EIO;
 
     client->send_coroutine = NULL;
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
@@ -941,6 +1420,140 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       uint32_t error)
+{
+    uint8_t payload[4 + 2];
+
+    /* error, then the length of the (empty) message */
+    cpu_to_be32w((uint32_t*)payload, error);
+    cpu_to_be16w((uint16_t*)(payload + 4), 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Serves a READ request with structured replies: unallocated and zeroed
+ * ranges are sent as holes, without reading or transmitting their data.
+ * I/O errors are reported to the client; the return value is negative
+ * only if the connection failed.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    int done = 0;
+    ssize_t rc = 0;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    do {
+        uint8_t payload[8 + 4];
+        uint64_t offset = request->from + done * 512;
+        int64_t status;
+        uint16_t flags;
+        int pnum;
+        int ret;
+
+        status = bdrv_get_block_status(exp->bs, sector_num + done,
+                                       nb_sectors - done, &pnum);
+        if (status >= 0 && pnum == 0) {
+            status = -EIO;
+        }
+        if (status < 0) {
+            LOG("block status failed");
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+
+        flags = (done + pnum == nb_sectors) ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)payload, offset);
+
+        if (status & BDRV_BLOCK_ZERO) {
+            cpu_to_be32w((uint32_t*)(payload + 8), pnum * 512);
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   payload, sizeof(payload), NULL, 0);
+        } else {
+            uint8_t *data = req->data + done * 512;
+
+            ret = bdrv_read(exp->bs, sector_num + done, data, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   payload, 8, data, pnum * 512);
+        }
+        done += pnum;
+    } while (rc >= 0 && done < nb_sectors);
+
+    TRACE("Read %u byte(s)", request->len);
+    return rc;
+}
+
+/* Fills @buf with the context id and the base:allocation extents of the
+ * requested range and returns its length, or a negative errno value.
+ */
+static int nbd_get_block_status(NBDExport *exp, struct nbd_request *request,
+                                uint8_t *buf)
+{
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    int max_extents = (request->type & NBD_CMD_FLAG_REQ_ONE) ?
+                      1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    uint32_t *extent = NULL;
+    int nb_extents = 0;
+    int done = 0;
+
+    if (nb_sectors == 0) {
+        return -EINVAL;
+    }
+
+    cpu_to_be32w((uint32_t*)buf, NBD_META_ID_BASE_ALLOCATION);
+
+    while (done < nb_sectors) {
+        int64_t status;
+        uint32_t flags = 0;
+        int pnum;
+
+        status = bdrv_get_block_status(exp->bs, sector_num + done,
+                                       nb_sectors - done, &pnum);
+        if (status < 0) {
+            return status;
+        }
+        if (pnum == 0) {
+            return -EIO;
+        }
+
+        if (!(status & BDRV_BLOCK_DATA)) {
+            flags |= NBD_STATE_HOLE;
+        }
+        if (status & BDRV_BLOCK_ZERO) {
+            flags |= NBD_STATE_ZERO;
+        }
+
+        if (extent && be32_to_cpu(extent[1]) == flags) {
+            extent[0] = cpu_to_be32(be32_to_cpu(extent[0]) + pnum * 512);
+        } else if (nb_extents < max_extents) {
+            extent = (uint32_t *)(buf + 4 + nb_extents * 8);
+            extent[0] = cpu_to_be32(pnum * 512);
+            extent[1] = cpu_to_be32(flags);
+            nb_extents++;
+        } else {
+            break;
+        }
+        done += pnum;
+    }
+
+    return 4 + nb_extents * 8;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -957,7 +1570,12 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    TRACE("Decoding type");
+
+    command = request->type & NBD_CMD_MASK_COMMAND;
+
+    /* Block status requests do not transfer data and are not limited */
+    if (command != NBD_CMD_BLOCK_STATUS && request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -971,11 +1589,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    TRACE("Decoding type");
-
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
-        req->data = qemu_blockalign(client->exp->bs, request->len);
+        nbd_request_alloc_data(req, request->len);
     }
     if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
@@ -1046,6 +1661,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -1118,12 +1740,39 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS: {
+        uint8_t buf[4 + NBD_MAX_BLOCK_STATUS_EXTENTS * 8];
+
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->block_status) {
+            LOG("block status was not negotiated");
+            goto invalid_request;
+        }
+
+        ret = nbd_get_block_status(exp, &request, buf);
+        if (ret < 0) {
+            LOG("block status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+        if (nbd_co_send_chunk(req, request.handle, NBD_REPLY_FLAG_DONE,
+                              NBD_REPLY_TYPE_BLOCK_STATUS, buf, ret,
+                              NULL, 0) < 0) {
+            goto out;
+        }
+        break;
+    }
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_error_chunk(req, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1144,7 +1793,7 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine || client->nb_requests < client->max_requests;
 }
 
 static void nbd_read(void *opaque)
@@ -1178,6 +1827,8 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
         return NULL;
     }
     client->close = close;
+    client->max_requests = client->exp->queue_depth;
+    client->buffers = g_new(NBDBuffer, client->max_requests);
     qemu_co_mutex_init(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
 
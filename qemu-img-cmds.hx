@@ -9,6 +9,12 @@ STEXI
 @table @option
 ETEXI
 
+DEF("bench", img_bench,
+    "bench [-q] [-c count] [-d depth] [-f fmt] [-i aio] [-s buffer_size] [-t cache] [-T seconds] [-w] [--pattern=seq|rand] [--read-percent=percent] [--output=ofmt] filename")
+STEXI
+@item bench [-q] [-c @var{count}] [-d @var{depth}] [-f @var{fmt}] [-i @var{aio}] [-s @var{buffer_size}] [-t @var{cache}] [-T @var{seconds}] [-w] [--pattern=@var{pattern}] [--read-percent=@var{percent}] [--output=@var{ofmt}] @var{filename}
+ETEXI
+
 DEF("check", img_check,
     "check [-q] [-f fmt] [--output=ofmt]  [-r [leaks | all]] filename")
 STEXI
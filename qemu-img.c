@@ -28,6 +28,8 @@
 #include "qemu/option.h"
 #include "qemu/error-report.h"
 #include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "sysemu/sysemu.h"
 #include "block/block_int.h"
 #include "block/qapi.h"
@@ -45,6 +47,8 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_PATTERN = 258,
+    OPTION_READ_PERCENT = 259,
 };
 
 typedef enum OutputFormat {
@@ -155,7 +159,18 @@ static void QEMU_NORETURN help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  'aio' is the AIO mode to use, 'threads' (default) or 'native'\n"
+           "  '-c' number of requests to send (default 75000 unless '-T' is given)\n"
+           "  '-d' number of requests in flight at the same time (default 64)\n"
+           "  '-s' size of each request in bytes (default 4k)\n"
+           "  '-T' stop sending requests after this many seconds\n"
+           "  '-w' send write requests only; image data is overwritten\n"
+           "  '--pattern' selects sequential ('seq', default) or random ('rand')\n"
+           "       request offsets\n"
+           "  '--read-percent' share of read requests, the rest are writes\n";
     GSequence *seq;
 
     printf("%s\nSupported formats:", help_msg);
@@ -2017,29 +2032,15 @@ static int get_block_status(BlockDriverState *bs, int64_t sector_num,
     int64_t ret;
     int depth;
 
-    /* As an optimization, we could cache the current range of unallocated
-     * clusters in each file of the chain, and avoid querying the same
-     * range repeatedly.
+    /* The chain map remembers the unallocated ranges of each layer, so that
+     * they are not queried again for every extent found further down.
      */
-
-    depth = 0;
-    for (;;) {
-        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
-        if (ret < 0) {
-            return ret;
-        }
-        assert(nb_sectors);
-        if (ret & (BDRV_BLOCK_ZERO|BDRV_BLOCK_DATA)) {
-            break;
-        }
-        bs = bs->backing_hd;
-        if (bs == NULL) {
-            ret = 0;
-            break;
-        }
-
-        depth++;
+    ret = bdrv_chain_map_get_status(bs, sector_num, nb_sectors, &nb_sectors,
+                                    &bs, &depth);
+    if (ret < 0) {
+        return ret;
     }
+    assert(nb_sectors);
 
     e->start = sector_num * BDRV_SECTOR_SIZE;
     e->length = nb_sectors * BDRV_SECTOR_SIZE;
@@ -2799,6 +2800,395 @@ out:
     return 0;
 }
 
+#define BENCH_DEFAULT_COUNT     75000
+#define BENCH_DEFAULT_DEPTH     64
+#define BENCH_DEFAULT_SIZE      4096
+#define BENCH_MAX_DEPTH         1024
+
+typedef struct BenchState {
+    BlockDriverState *bs;
+    GRand *rand;
+    bool random;
+    int read_percent;
+    int bufsize;
+    int64_t image_size;         /* multiple of bufsize */
+    int64_t offset;             /* next offset for sequential requests */
+    int64_t count;              /* requests to send, -1 for no limit */
+    int64_t deadline;           /* no new requests after this, 0 for none */
+
+    int64_t submitted;
+    int64_t completed;
+    int64_t reads;
+    int64_t writes;
+    int in_flight;
+    int ret;
+
+    /* request latencies of the whole run, in the bins of block accounting */
+    BlockAcctLatencyPeriod lat;
+} BenchState;
+
+typedef struct BenchRequest {
+    BenchState *b;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t start;
+} BenchRequest;
+
+static bool bench_has_more(BenchState *b)
+{
+    if (b->ret < 0) {
+        return false;
+    }
+    if (b->count >= 0 && b->submitted >= b->count) {
+        return false;
+    }
+    return !b->deadline || get_clock() < b->deadline;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchState *b = req->b;
+    BlockDriverAIOCB *acb;
+    int64_t offset;
+    bool write;
+
+    if (b->random) {
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+        offset = (r % (b->image_size / b->bufsize)) * b->bufsize;
+    } else {
+        offset = b->offset;
+        b->offset += b->bufsize;
+        if (b->offset >= b->image_size) {
+            b->offset = 0;
+        }
+    }
+    write = g_rand_int_range(b->rand, 0, 100) >= b->read_percent;
+
+    b->submitted++;
+    b->in_flight++;
+    req->start = get_clock();
+    if (write) {
+        b->writes++;
+        acb = bdrv_aio_writev(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                              b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    } else {
+        b->reads++;
+        acb = bdrv_aio_readv(b->bs, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                             b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchState *b = req->b;
+    uint64_t lat = get_clock() - req->start;
+
+    b->in_flight--;
+    b->completed++;
+    block_latency_period_account(&b->lat, lat);
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        if (b->ret == 0) {
+            b->ret = ret;
+        }
+        return;
+    }
+
+    if (bench_has_more(b)) {
+        bench_submit(req);
+    }
+}
+
+static void dump_bench_result(OutputFormat output_format, BenchState *b,
+                              int depth, int64_t ns)
+{
+    static const int permille[] = { 500, 900, 990, 999 };
+    double secs = ns / 1e9;
+    uint64_t iops, bandwidth, avg;
+    int i;
+
+    iops = secs > 0 ? b->completed / secs : 0;
+    bandwidth = secs > 0 ? b->completed * b->bufsize / secs : 0;
+    avg = b->lat.nr_ops ? b->lat.total_ns / b->lat.nr_ops : 0;
+
+    switch (output_format) {
+    case OFORMAT_HUMAN:
+        printf("Run completed in %.3f seconds.\n", secs);
+        printf("Requests:    %" PRId64 " (%" PRId64 " reads, %" PRId64
+               " writes)\n", b->completed, b->reads, b->writes);
+        printf("IOPS:        %" PRIu64 "\n", iops);
+        printf("Bandwidth:   %.2f MiB/s\n", (double)bandwidth / (1 << 20));
+        printf("Latency:     min %.1f us, avg %.1f us, max %.1f us\n",
+               b->lat.min_ns / 1e3, avg / 1e3, b->lat.max_ns / 1e3);
+        printf("Percentiles:");
+        for (i = 0; i < ARRAY_SIZE(permille); i++) {
+            printf(" %g%%: %.1f us%s", permille[i] / 10.0,
+                   block_latency_period_percentile(&b->lat,
+                                                   permille[i] / 1000.0) / 1e3,
+                   i < ARRAY_SIZE(permille) - 1 ? "," : "\n");
+        }
+        break;
+    case OFORMAT_JSON:
+        printf("{\n");
+        printf("    \"pattern\": \"%s\",\n", b->random ? "rand" : "seq");
+        printf("    \"request-size\": %d,\n", b->bufsize);
+        printf("    \"queue-depth\": %d,\n", depth);
+        printf("    \"requests\": %" PRId64 ",\n", b->completed);
+        printf("    \"reads\": %" PRId64 ",\n", b->reads);
+        printf("    \"writes\": %" PRId64 ",\n", b->writes);
+        printf("    \"time-ns\": %" PRId64 ",\n", ns);
+        printf("    \"iops\": %" PRIu64 ",\n", iops);
+        printf("    \"bandwidth\": %" PRIu64 ",\n", bandwidth);
+        printf("    \"latency-ns\": {\n");
+        printf("        \"min\": %" PRIu64 ",\n", b->lat.min_ns);
+        printf("        \"avg\": %" PRIu64 ",\n", avg);
+        printf("        \"max\": %" PRIu64 ",\n", b->lat.max_ns);
+        for (i = 0; i < ARRAY_SIZE(permille); i++) {
+            printf("        \"p%g\": %" PRIu64 "%s\n", permille[i] / 10.0,
+                   block_latency_period_percentile(&b->lat,
+                                                   permille[i] / 1000.0),
+                   i < ARRAY_SIZE(permille) - 1 ? "," : "");
+        }
+        printf("    }\n");
+        printf("}\n");
+        break;
+    }
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0, i;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *filename, *fmt = NULL, *cache = BDRV_DEFAULT_CACHE;
+    const char *aio = NULL, *output = NULL, *pattern = NULL;
+    BlockDriverState *bs = NULL;
+    BenchState b = {
+        .read_percent   = 100,
+        .bufsize        = BENCH_DEFAULT_SIZE,
+        .count          = -1,
+    };
+    BenchRequest *reqs = NULL;
+    int depth = BENCH_DEFAULT_DEPTH;
+    int64_t seconds = 0;
+    int64_t start, ns;
+    bool quiet = false;
+    int flags = 0;
+    char *end;
+
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {"read-percent", required_argument, 0, OPTION_READ_PERCENT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "c:d:f:hi:qs:t:T:w",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+            b.count = strtoll(optarg, &end, 0);
+            if (b.count <= 0 || *end) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (depth <= 0 || depth > BENCH_MAX_DEPTH || *end) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'i':
+            aio = optarg;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end ||
+                sval % BDRV_SECTOR_SIZE) {
+                error_report("Invalid request size specified");
+                return 1;
+            }
+            b.bufsize = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'T':
+            seconds = strtoll(optarg, &end, 0);
+            if (seconds <= 0 || *end) {
+                error_report("Invalid time specified");
+                return 1;
+            }
+            break;
+        case 'w':
+            b.read_percent = 0;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        case OPTION_PATTERN:
+            pattern = optarg;
+            break;
+        case OPTION_READ_PERCENT:
+            b.read_percent = strtol(optarg, &end, 0);
+            if (b.read_percent < 0 || b.read_percent > 100 || *end) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[optind];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (!pattern || !strcmp(pattern, "seq")) {
+        b.random = false;
+    } else if (!strcmp(pattern, "rand")) {
+        b.random = true;
+    } else {
+        error_report("--pattern must be used with seq or rand as argument.");
+        return 1;
+    }
+
+    if (b.count < 0 && !seconds) {
+        b.count = BENCH_DEFAULT_COUNT;
+    }
+
+    if (b.read_percent < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+    if (aio && !strcmp(aio, "native")) {
+        flags |= BDRV_O_NATIVE_AIO;
+    } else if (aio && strcmp(aio, "threads")) {
+        error_report("Invalid aio option: %s", aio);
+        return 1;
+    }
+
+    bs = bdrv_new_open("image", filename, fmt, flags, true, quiet);
+    if (!bs) {
+        return 1;
+    }
+
+    b.bs = bs;
+    b.image_size = bdrv_getlength(bs);
+    if (b.image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-b.image_size));
+        ret = -1;
+        goto out;
+    }
+    b.image_size -= b.image_size % b.bufsize;
+    if (b.image_size == 0) {
+        error_report("Image is smaller than the request size");
+        ret = -1;
+        goto out;
+    }
+
+    /* A fixed seed makes runs with the same parameters comparable */
+    b.rand = g_rand_new_with_seed(0);
+
+    if (b.count >= 0) {
+        depth = MIN(depth, b.count);
+    }
+    reqs = g_new0(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].b = &b;
+        reqs[i].iov.iov_base = qemu_blockalign(bs, b.bufsize);
+        reqs[i].iov.iov_len = b.bufsize;
+        memset(reqs[i].iov.iov_base, 0xa5, b.bufsize);
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    if (output_format == OFORMAT_HUMAN) {
+        if (b.count >= 0) {
+            qprintf(quiet, "Sending %" PRId64 " requests", b.count);
+        } else {
+            qprintf(quiet, "Sending requests for %" PRId64 " seconds",
+                    seconds);
+        }
+        qprintf(quiet, ", %d bytes each, %d in parallel (%s, %d%% reads)\n",
+                b.bufsize, depth, b.random ? "random" : "sequential",
+                b.read_percent);
+    }
+
+    start = get_clock();
+    if (seconds) {
+        b.deadline = start + seconds * 1000000000LL;
+    }
+    for (i = 0; i < depth && bench_has_more(&b); i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (b.in_flight > 0) {
+        main_loop_wait(false);
+    }
+    ns = get_clock() - start;
+
+    if (b.ret < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (!quiet || output_format == OFORMAT_JSON) {
+        dump_bench_result(output_format, &b, depth, ns);
+    }
+
+out:
+    if (reqs) {
+        for (i = 0; i < depth; i++) {
+            qemu_vfree(reqs[i].iov.iov_base);
+        }
+        g_free(reqs);
+    }
+    if (b.rand) {
+        g_rand_free(b.rand);
+    }
+    bdrv_unref(bs);
+    return ret < 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
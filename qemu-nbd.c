@@ -41,6 +41,7 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_QUEUE_DEPTH 4
 
 static NBDExport *exp;
 static int verbose;
@@ -50,6 +51,7 @@ static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
 static int nb_fds;
+static const char *export_name;
 
 static void usage(const char *name)
 {
@@ -66,7 +68,13 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"      --queue-depth=NUM  number of requests a client can have in flight\n"
+"                       (default '%d')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"  -x, --export-name=NAME\n"
+"                       expose the image under NAME with the newstyle\n"
+"                       protocol, which supports sparse reads and block\n"
+"                       status queries\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
 "Exposing part of the image:\n"
@@ -98,7 +106,7 @@ static void usage(const char *name)
 #endif
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, NBD_DEFAULT_QUEUE_DEPTH, "DEVICE");
 }
 
 static void version(const char *name)
@@ -285,8 +293,8 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out_socket;
     }
@@ -369,7 +377,8 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (nbd_client_new(exp, fd, nbd_client_closed)) {
+    /* With an export name, the client picks the export while negotiating */
+    if (nbd_client_new(export_name ? NULL : exp, fd, nbd_client_closed)) {
         nb_fds++;
     } else {
         close(fd);
@@ -386,10 +395,11 @@ int main(int argc, char **argv)
     const char *bindto = "0.0.0.0";
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
+    int queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
     off_t fd_size;
     QemuOpts *sn_opts = NULL;
     const char *sn_id_or_name = NULL;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:x:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -409,9 +419,11 @@ int main(int argc, char **argv)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
+        { "queue-depth", 1, NULL, QEMU_NBD_OPT_QUEUE_DEPTH },
         { "shared", 1, NULL, 'e' },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
+        { "export-name", 1, NULL, 'x' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -482,6 +494,16 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid discard mode `%s'", optarg);
             }
             break;
+        case QEMU_NBD_OPT_QUEUE_DEPTH:
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid queue depth `%s'", optarg);
+            }
+            if (queue_depth < 1 || queue_depth > NBD_MAX_QUEUE_DEPTH) {
+                errx(EXIT_FAILURE, "Queue depth must be between 1 and %d",
+                     NBD_MAX_QUEUE_DEPTH);
+            }
+            break;
         case 'b':
             bindto = optarg;
             break;
@@ -552,6 +574,9 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case 'x':
+            export_name = optarg;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -695,7 +720,19 @@ int main(int argc, char **argv)
         }
     }
 
+    /* All connections share bs, so a flush on one of them covers the writes
+     * completed on the others; only advertise it if they can actually
+     * connect, or a client opening several connections would hang.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    nbd_export_set_queue_depth(exp, queue_depth);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -979,13 +979,15 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,max-in-flight:i?,"
+                      "guest-share:i?,on-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
     {
         .name       = "block-commit",
-        .args_type  = "device:B,base:s?,top:s,speed:o?",
+        .args_type  = "device:B,base:s?,top:s,speed:o?,max-in-flight:i?,"
+                      "drop-committed:b?,drop-batch-size:o?",
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
@@ -1018,6 +1020,15 @@ Arguments:
           yourself once the commit operation successfully completes.
           (json-string)
 - "speed":  the maximum speed, in bytes per second (json-int, optional)
+- "max-in-flight": maximum number of copy operations running in parallel,
+                   default 4; not used if top is the active layer
+                   (json-int, optional)
+- "drop-committed": drop the committed data from top as the commit proceeds;
+                    requires base to be the backing file of top and top not
+                    to be the active layer (json-bool, optional)
+- "drop-batch-size": how much committed data, in bytes, to drop from top at
+                     once, default 64 MiB; requires drop-committed
+                     (json-int, optional)
 
 
 Example:
@@ -1031,7 +1042,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -1058,11 +1069,15 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for only the sectors marked in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": the name of the dirty bitmap to copy; required if and only if
+            "sync" is "incremental".  The bitmap is cleared when the job
+            starts and restored if it fails or is cancelled.
+            (json-string, optional)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -1077,6 +1092,87 @@ Example:
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that tracks all writes to a block device.
+
+Arguments:
+
+- "device": the name of the device (json-string)
+- "name": the name of the new bitmap (json-string)
+- "granularity": the granularity of the bitmap in bytes, a power of 2
+                 between 512 and 64M (json-int, optional, default is the
+                 cluster size of the image or 64K)
+- "persistent": store the bitmap in the image file on close and load it
+                again on open; requires an image format that supports this,
+                like qcow2 version 3 (json-bool, optional, default false)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "bitmap0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap, including its copy in the image file.
+
+Arguments:
+
+- "device": the name of the device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "bitmap0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark all sectors of a named dirty bitmap as clean.
+
+Arguments:
+
+- "device": the name of the device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "drive0",
+                                                           "name": "bitmap0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1294,7 +1390,8 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,max-in-flight:i?,"
+                      "copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1329,6 +1426,12 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "max-in-flight": maximum number of parallel copy operations (json-int,
+  default 64)
+- "copy-mode": "background" to copy guest writes later, or "write-blocking"
+  to copy them to the target before they complete; "write-blocking" fails if
+  the target backing file is not open yet and the granularity is smaller
+  than the target cluster size (MirrorCopyMode, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1601,7 +1704,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1627,6 +1730,7 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name (json-string, optional)
 
 Example:
 
@@ -2032,6 +2136,8 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group name, if I/O limits are enabled
+                    (json-string, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "image": the detail of the image, it is a json-object containing
@@ -2185,16 +2291,48 @@ Each json-object contain the following:
     - "wr_bytes": bytes written (json-int)
     - "rd_operations": read operations (json-int)
     - "wr_operations": write operations (json-int)
+    - "rd_merged": read requests merged into another request (json-int)
+    - "wr_merged": write requests merged into another request (json-int)
     - "flush_operations": cache flush operations (json-int)
     - "wr_total_time_ns": total time spend on writes in nano-seconds (json-int)
     - "rd_total_time_ns": total time spend on reads in nano-seconds (json-int)
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_latency", "wr_latency", "flush_latency": Latency statistics of
+      reads, writes and cache flushes in the recent past (json-object),
+      each containing:
+        - "interval_length": length of the covered interval in nanoseconds
+                             (json-int)
+        - "operations": operations completed in the interval (json-int)
+        - "min_ns", "max_ns", "avg_ns": minimum, maximum and average
+                                        latency (json-int)
+        - "p50_ns", "p99_ns", "p999_ns": median, 99th and 99.9th percentile
+                                         of the latency (json-int)
+        - "histogram": the histogram set up with
+                       block-latency-histogram-set, with "boundaries" and
+                       "bins" (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "throttle-group": Statistics of the I/O throttling group of the device.
+                    If I/O limits are not enabled, this field is omitted
+                    (json-object, optional). It contains:
+    - "name": group name (json-string)
+    - "rd_bytes": bytes read by all members of the group (json-int)
+    - "wr_bytes": bytes written by all members of the group (json-int)
+    - "rd_operations": read operations of the group (json-int)
+    - "wr_operations": write operations of the group (json-int)
+    - "rd_throttled": read operations that had to wait (json-int)
+    - "wr_throttled": write operations that had to wait (json-int)
+- "chain-map": Statistics of the map of the backing chain that tells which
+               layer holds the data of each range.  If the map has not been
+               used, this field is omitted (json-object, optional).
+               It contains:
+    - "hits": lookups answered by the map (json-int)
+    - "misses": lookups that queried the layers of the chain (json-int)
+    - "extents": extents currently in the map (json-int)
 
 Example:
 
@@ -2273,6 +2411,42 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up latency histograms for a block device. The histograms start empty and
+are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": bin boundaries in nanoseconds for all types of operations, in
+                ascending order (json-array, optional)
+- "boundaries-read": bin boundaries for read operations (json-array, optional)
+- "boundaries-write": bin boundaries for write operations
+                      (json-array, optional)
+- "boundaries-flush": bin boundaries for cache flushes (json-array, optional)
+
+The histogram of a type of operations for which no boundaries are given is
+removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2343,6 +2517,17 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "cpus": host CPUs the iothread is restricted to, only present if set
+          (json-str, optional)
+- "sched-policy": host scheduling policy, one of "inherit", "other" or "fifo"
+                  (json-str)
+- "stats": event loop statistics (json-object)
+    - "iterations": number of event loop iterations (json-int)
+    - "dispatched": number of event handlers dispatched (json-int)
+    - "max-dispatched": most handlers dispatched by one iteration (json-int)
+    - "busy-ns": time spent processing events and busy polling, in
+                 nanoseconds (json-int)
+    - "blocked-ns": time spent waiting for events, in nanoseconds (json-int)
 
 Example:
 
@@ -2351,11 +2536,28 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "cpus":"2-3",
+            "sched-policy":"fifo",
+            "stats":{
+               "iterations":182734,
+               "dispatched":201957,
+               "max-dispatched":4,
+               "busy-ns":1932748211,
+               "blocked-ns":40218734466
+            }
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "sched-policy":"inherit",
+            "stats":{
+               "iterations":0,
+               "dispatched":0,
+               "max-dispatched":0,
+               "busy-ns":0,
+               "blocked-ns":0
+            }
          }
       ]
    }
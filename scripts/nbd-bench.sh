@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# Measure the read throughput of qemu-nbd over a local UNIX socket
+#
+# Usage: nbd-bench.sh IMAGE [CONNECTIONS [QUEUE_DEPTH [REQUEST_SIZE]]]
+#
+# The whole image is read with qemu-io, keeping CONNECTIONS * QUEUE_DEPTH
+# requests of REQUEST_SIZE bytes in flight.  Run it from the build
+# directory, or set QEMU_NBD, QEMU_IO and QEMU_IMG.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+image="$1"
+connections="${2:-1}"
+queue_depth="${3:-16}"
+request_size="${4:-1048576}"
+
+QEMU_NBD="${QEMU_NBD:-./qemu-nbd}"
+QEMU_IO="${QEMU_IO:-./qemu-io}"
+QEMU_IMG="${QEMU_IMG:-./qemu-img}"
+
+if [ -z "$image" ]; then
+    echo "Usage: $0 IMAGE [CONNECTIONS [QUEUE_DEPTH [REQUEST_SIZE]]]" >&2
+    exit 1
+fi
+
+tmpdir=$(mktemp -d) || exit 1
+sock="$tmpdir/nbd.sock"
+nbd_pid=
+
+cleanup()
+{
+    [ -n "$nbd_pid" ] && kill "$nbd_pid" 2>/dev/null
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT INT TERM
+
+"$QEMU_NBD" -r -t -x bench -k "$sock" -e "$connections" \
+    --queue-depth="$queue_depth" "$image" &
+nbd_pid=$!
+
+while [ ! -S "$sock" ]; do
+    if ! kill -0 "$nbd_pid" 2>/dev/null; then
+        echo "qemu-nbd failed to start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+size=$("$QEMU_IMG" info --output=json "$image" | \
+       sed -n 's/.*"virtual-size": \([0-9]*\).*/\1/p')
+if [ -z "$size" ]; then
+    echo "could not get the size of $image" >&2
+    exit 1
+fi
+
+image_opts="json:{\"driver\": \"nbd\", \"path\": \"$sock\", \
+\"export\": \"bench\", \"connections\": \"$connections\", \
+\"queue-depth\": \"$queue_depth\"}"
+
+# Keep at most $batch requests in flight
+batch=$((connections * queue_depth))
+commands()
+{
+    offset=0
+    n=0
+    while [ $offset -lt $size ]; do
+        len=$request_size
+        if [ $((size - offset)) -lt $len ]; then
+            len=$((size - offset))
+        fi
+        echo "aio_read -q $offset $len"
+        offset=$((offset + len))
+        n=$((n + 1))
+        if [ $((n % batch)) -eq 0 ]; then
+            echo "aio_flush"
+        fi
+    done
+    echo "aio_flush"
+}
+
+start=$(date +%s.%N)
+commands | "$QEMU_IO" -r "$image_opts" >/dev/null
+end=$(date +%s.%N)
+
+echo "$image: $size bytes, $connections connection(s)," \
+     "queue depth $queue_depth, $request_size byte requests"
+echo "$size $start $end" | \
+    awk '{ printf "%.1f MiB/s\n", $1 / 1048576 / ($3 - $2) }'
@@ -0,0 +1,118 @@
+/*
+ * libqos virtio-blk requests
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "libqtest.h"
+#include "libqos/virtio-blk.h"
+
+/* Adds a request for @len bytes at @sector to @vq without making it
+ * available.  Returns the guest address of its header; the status byte
+ * follows the 16 byte header.
+ */
+uint64_t qvirtio_blk_add(QVirtioPC *v, QVirtQueue *vq, uint32_t type,
+                         uint64_t sector, uint64_t data, uint32_t len,
+                         uint32_t *head)
+{
+    uint64_t req = guest_alloc(v->alloc, 16 + 1);
+
+    writel(req, type);
+    writel(req + 4, 0);
+    writeq(req + 8, sector);
+    writeb(req + 16, 0xff);
+
+    *head = qvirtqueue_add(vq, req, 16, false, true);
+    qvirtqueue_add(vq, data, len, type == QVIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req + 16, 1, true, false);
+
+    return req;
+}
+
+/* Queues a request and notifies the device */
+uint64_t qvirtio_blk_submit(QVirtioPC *v, QVirtQueue *vq, uint32_t type,
+                            uint64_t sector, uint64_t data, uint32_t len)
+{
+    uint32_t head;
+    uint64_t req;
+
+    req = qvirtio_blk_add(v, vq, type, sector, data, len, &head);
+    qvirtqueue_kick(&qvirtio_pci, &v->dev->vdev, vq, head);
+
+    return req;
+}
+
+/* Waits for one more used element and returns the status of @req */
+uint8_t qvirtio_blk_complete(QVirtQueue *vq, uint64_t req)
+{
+    qvirtqueue_wait_used(vq, QVIRTIO_BLK_TIMEOUT_US);
+    return readb(req + 16);
+}
+
+/* Returns the guest address of a sector filled with @pattern */
+uint64_t qvirtio_blk_pattern_buf(QVirtioPC *v, char pattern)
+{
+    char buf[512];
+    uint64_t data;
+
+    memset(buf, pattern, sizeof(buf));
+    data = guest_alloc(v->alloc, sizeof(buf));
+    memwrite(data, buf, sizeof(buf));
+    return data;
+}
+
+void qvirtio_blk_verify_pattern(uint64_t addr, char pattern)
+{
+    char buf[512], expected[512];
+
+    memset(expected, pattern, sizeof(expected));
+    memread(addr, buf, sizeof(buf));
+    g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+}
+
+void qvirtio_blk_write_pattern(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                               char pattern)
+{
+    uint64_t data = qvirtio_blk_pattern_buf(v, pattern);
+    uint64_t req;
+
+    req = qvirtio_blk_submit(v, vq, QVIRTIO_BLK_T_OUT, sector, data, 512);
+    g_assert_cmpint(qvirtio_blk_complete(vq, req), ==, QVIRTIO_BLK_S_OK);
+}
+
+/* Reads @sector into guest memory at @data */
+void qvirtio_blk_read(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                      uint64_t data)
+{
+    uint64_t req;
+
+    req = qvirtio_blk_submit(v, vq, QVIRTIO_BLK_T_IN, sector, data, 512);
+    g_assert_cmpint(qvirtio_blk_complete(vq, req), ==, QVIRTIO_BLK_S_OK);
+}
+
+void qvirtio_blk_read_pattern(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                              char pattern)
+{
+    uint64_t data = guest_alloc(v->alloc, 512);
+
+    qvirtio_blk_read(v, vq, sector, data);
+    qvirtio_blk_verify_pattern(data, pattern);
+}
+
+/* Writes and reads back @n sectors, one request at a time */
+void qvirtio_blk_test_rw(QVirtioPC *v, QVirtQueue *vq, int n, char first)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        qvirtio_blk_write_pattern(v, vq, i, first + i % 26);
+    }
+    for (i = 0; i < n; i++) {
+        qvirtio_blk_read_pattern(v, vq, i, first + i % 26);
+    }
+}
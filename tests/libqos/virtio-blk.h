@@ -0,0 +1,41 @@
+/*
+ * libqos virtio-blk requests
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_BLK_H
+#define LIBQOS_VIRTIO_BLK_H
+
+#include "libqos/virtio-pc.h"
+
+#define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+
+#define QVIRTIO_BLK_F_MQ        12
+
+#define QVIRTIO_BLK_T_IN        0
+#define QVIRTIO_BLK_T_OUT       1
+
+#define QVIRTIO_BLK_S_OK        0
+
+uint64_t qvirtio_blk_add(QVirtioPC *v, QVirtQueue *vq, uint32_t type,
+                         uint64_t sector, uint64_t data, uint32_t len,
+                         uint32_t *head);
+uint64_t qvirtio_blk_submit(QVirtioPC *v, QVirtQueue *vq, uint32_t type,
+                            uint64_t sector, uint64_t data, uint32_t len);
+uint8_t qvirtio_blk_complete(QVirtQueue *vq, uint64_t req);
+
+uint64_t qvirtio_blk_pattern_buf(QVirtioPC *v, char pattern);
+void qvirtio_blk_verify_pattern(uint64_t addr, char pattern);
+void qvirtio_blk_write_pattern(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                               char pattern);
+void qvirtio_blk_read(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                      uint64_t data);
+void qvirtio_blk_read_pattern(QVirtioPC *v, QVirtQueue *vq, uint64_t sector,
+                              char pattern);
+void qvirtio_blk_test_rw(QVirtioPC *v, QVirtQueue *vq, int n, char first);
+
+#endif
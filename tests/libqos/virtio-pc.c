@@ -0,0 +1,75 @@
+/*
+ * libqos virtio PCI devices on PC
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/virtio-pc.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+
+/* Starts a PC machine with @extra_args, which must create a virtio PCI device
+ * of type @device_type, and brings the device up with @num_queues queues
+ */
+QVirtioPC *qvirtio_pc_start(const char *extra_args, uint16_t device_type,
+                            unsigned int num_queues, uint32_t features)
+{
+    QVirtioPC *v = g_new0(QVirtioPC, 1);
+
+    qtest_start(extra_args);
+
+    v->bus = qpci_init_pc();
+    v->alloc = pc_alloc_init();
+    v->dev = qvirtio_pci_device_find(v->bus, device_type);
+    g_assert(v->dev != NULL);
+    qvirtio_pci_device_enable(v->dev);
+
+    v->features = features;
+    v->num_queues = num_queues;
+    v->vq = g_new0(QVirtQueue *, num_queues);
+    qvirtio_pc_setup(v);
+
+    return v;
+}
+
+/* Resets the device, negotiates the features and sets up all queues again */
+void qvirtio_pc_setup(QVirtioPC *v)
+{
+    QVirtioDevice *d = &v->dev->vdev;
+    unsigned int i;
+
+    qvirtio_reset(&qvirtio_pci, d);
+    qvirtio_set_acknowledge(&qvirtio_pci, d);
+    qvirtio_set_driver(&qvirtio_pci, d);
+
+    g_assert_cmphex(qvirtio_get_features(&qvirtio_pci, d) & v->features, ==,
+                    v->features);
+    qvirtio_set_features(&qvirtio_pci, d, v->features);
+
+    for (i = 0; i < v->num_queues; i++) {
+        g_free(v->vq[i]);
+        v->vq[i] = qvirtqueue_setup(&qvirtio_pci, d, v->alloc, i);
+    }
+    qvirtio_set_driver_ok(&qvirtio_pci, d);
+}
+
+void qvirtio_pc_stop(QVirtioPC *v)
+{
+    unsigned int i;
+
+    for (i = 0; i < v->num_queues; i++) {
+        g_free(v->vq[i]);
+    }
+    g_free(v->vq);
+    g_free(v->dev->pdev);
+    g_free(v->dev);
+    g_free(v->alloc);
+    g_free(v->bus);
+    g_free(v);
+    qtest_end();
+}
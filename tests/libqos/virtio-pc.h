@@ -0,0 +1,34 @@
+/*
+ * libqos virtio PCI devices on PC
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_PC_H
+#define LIBQOS_VIRTIO_PC_H
+
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/malloc.h"
+
+/* A virtio PCI device of a PC machine started by qtest_start(), driven with
+ * the same features and queues until the machine is stopped
+ */
+typedef struct QVirtioPC {
+    QPCIBus *bus;
+    QGuestAllocator *alloc;
+    QVirtioPCIDevice *dev;
+    uint32_t features;
+    unsigned int num_queues;
+    QVirtQueue **vq;
+} QVirtioPC;
+
+QVirtioPC *qvirtio_pc_start(const char *extra_args, uint16_t device_type,
+                            unsigned int num_queues, uint32_t features);
+void qvirtio_pc_setup(QVirtioPC *v);
+void qvirtio_pc_stop(QVirtioPC *v);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * libqos virtio PCI driver
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_PCI_H
+#define LIBQOS_VIRTIO_PCI_H
+
+#include "libqos/virtio.h"
+#include "libqos/pci.h"
+
+#define QVIRTIO_PCI_DEVICE_FEATURES     0x00
+#define QVIRTIO_PCI_GUEST_FEATURES      0x04
+#define QVIRTIO_PCI_QUEUE_ADDRESS       0x08
+#define QVIRTIO_PCI_QUEUE_SIZE          0x0C
+#define QVIRTIO_PCI_QUEUE_SELECT        0x0E
+#define QVIRTIO_PCI_QUEUE_NOTIFY        0x10
+#define QVIRTIO_PCI_DEVICE_STATUS       0x12
+#define QVIRTIO_PCI_ISR_STATUS          0x13
+
+/* Device specific configuration, with MSI-X disabled */
+#define QVIRTIO_PCI_DEVICE_SPECIFIC     0x14
+
+typedef struct QVirtioPCIDevice {
+    QVirtioDevice vdev;
+    QPCIDevice *pdev;
+    void *addr;
+} QVirtioPCIDevice;
+
+extern const QVirtioBus qvirtio_pci;
+
+QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, uint16_t device_type);
+void qvirtio_pci_device_enable(QVirtioPCIDevice *d);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/virtio.h"
+
+uint8_t qvirtio_config_readb(const QVirtioBus *bus, QVirtioDevice *d,
+                             uint64_t addr)
+{
+    return bus->config_readb(d, addr);
+}
+
+uint16_t qvirtio_config_readw(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr)
+{
+    return bus->config_readw(d, addr);
+}
+
+uint32_t qvirtio_config_readl(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr)
+{
+    return bus->config_readl(d, addr);
+}
+
+uint64_t qvirtio_config_readq(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr)
+{
+    return bus->config_readq(d, addr);
+}
+
+uint32_t qvirtio_get_features(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    return bus->get_features(d);
+}
+
+void qvirtio_set_features(const QVirtioBus *bus, QVirtioDevice *d,
+                          uint32_t features)
+{
+    bus->set_features(d, features);
+}
+
+void qvirtio_reset(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, QVIRTIO_RESET);
+    g_assert_cmphex(bus->get_status(d), ==, QVIRTIO_RESET);
+}
+
+void qvirtio_set_acknowledge(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_ACKNOWLEDGE);
+    g_assert_cmphex(bus->get_status(d), ==, QVIRTIO_ACKNOWLEDGE);
+}
+
+void qvirtio_set_driver(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_DRIVER);
+    g_assert_cmphex(bus->get_status(d), ==,
+                    QVIRTIO_DRIVER | QVIRTIO_ACKNOWLEDGE);
+}
+
+void qvirtio_set_driver_ok(const QVirtioBus *bus, QVirtioDevice *d)
+{
+    bus->set_status(d, bus->get_status(d) | QVIRTIO_DRIVER_OK);
+    g_assert_cmphex(bus->get_status(d), ==,
+                    QVIRTIO_DRIVER_OK | QVIRTIO_DRIVER | QVIRTIO_ACKNOWLEDGE);
+}
+
+static void qvring_init(QVirtQueue *vq, uint64_t addr, uint32_t align)
+{
+    uint8_t *zero = g_malloc0(qvring_size(vq->size, align));
+    uint32_t i;
+
+    /* Start from clean rings, e.g. when a queue is set up again after
+     * a reset
+     */
+    memwrite(addr, zero, qvring_size(vq->size, align));
+    g_free(zero);
+
+    vq->desc = addr;
+    vq->avail = vq->desc + vq->size * 16;
+    vq->used = (vq->avail + sizeof(uint16_t) * (3 + vq->size) + align - 1) &
+               ~(uint64_t)(align - 1);
+    vq->free_head = 0;
+    vq->last_used_idx = 0;
+
+    for (i = 0; i < vq->size; i++) {
+        writew(vq->desc + 16 * i + 14, (i + 1) % vq->size);
+    }
+}
+
+QVirtQueue *qvirtqueue_setup(const QVirtioBus *bus, QVirtioDevice *d,
+                             QGuestAllocator *alloc, uint16_t index)
+{
+    QVirtQueue *vq = g_new0(QVirtQueue, 1);
+    uint64_t addr;
+
+    bus->queue_select(d, index);
+    vq->index = index;
+    vq->size = bus->get_queue_size(d);
+    g_assert_cmpint(vq->size, >, 0);
+
+    /* guest_alloc() returns page aligned addresses */
+    addr = guest_alloc(alloc, qvring_size(vq->size, QVIRTIO_PCI_ALIGN));
+    qvring_init(vq, addr, QVIRTIO_PCI_ALIGN);
+    bus->set_queue_address(d, addr / QVIRTIO_PCI_ALIGN);
+
+    return vq;
+}
+
+/* Returns the index of the new descriptor.  If @next is set, it is chained
+ * to the descriptor added next.
+ */
+uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len,
+                        bool write, bool next)
+{
+    uint64_t desc = vq->desc + 16 * vq->free_head;
+    uint16_t flags = 0;
+    uint32_t head = vq->free_head;
+
+    if (write) {
+        flags |= QVRING_DESC_F_WRITE;
+    }
+    if (next) {
+        flags |= QVRING_DESC_F_NEXT;
+    }
+
+    writeq(desc, data);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+
+    vq->free_head = (vq->free_head + 1) % vq->size;
+    return head;
+}
+
+/* Make the chain starting at @head available without notifying the device */
+void qvirtqueue_make_available(QVirtQueue *vq, uint32_t head)
+{
+    uint16_t idx = readw(vq->avail + 2);
+
+    writew(vq->avail + 4 + 2 * (idx % vq->size), head);
+    writew(vq->avail + 2, idx + 1);
+}
+
+void qvirtqueue_notify(const QVirtioBus *bus, QVirtioDevice *d,
+                       QVirtQueue *vq)
+{
+    bus->virtqueue_kick(d, vq);
+}
+
+/* Make the chain starting at @head available and notify the device */
+void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d,
+                     QVirtQueue *vq, uint32_t head)
+{
+    qvirtqueue_make_available(vq, head);
+    qvirtqueue_notify(bus, d, vq);
+}
+
+/* Wait until the device has returned one more chain to the used ring */
+void qvirtqueue_wait_used(QVirtQueue *vq, gint64 timeout_us)
+{
+    gint64 start = g_get_monotonic_time();
+
+    while (readw(vq->used + 2) == vq->last_used_idx) {
+        g_assert(g_get_monotonic_time() - start <= timeout_us);
+        clock_step(100);
+    }
+    vq->last_used_idx++;
+}
@@ -0,0 +1,117 @@
+/*
+ * libqos virtio driver
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQOS_VIRTIO_H
+#define LIBQOS_VIRTIO_H
+
+#include <stdbool.h>
+#include <glib.h>
+#include "libqos/malloc.h"
+
+#define QVIRTIO_VENDOR_ID       0x1AF4
+
+#define QVIRTIO_RESET           0x0
+#define QVIRTIO_ACKNOWLEDGE     0x1
+#define QVIRTIO_DRIVER          0x2
+#define QVIRTIO_DRIVER_OK       0x4
+
+#define QVIRTIO_NET_DEVICE_ID   0x1
+#define QVIRTIO_BLK_DEVICE_ID   0x2
+#define QVIRTIO_SCSI_DEVICE_ID  0x8
+
+#define QVRING_DESC_F_NEXT      0x1
+#define QVRING_DESC_F_WRITE     0x2
+
+#define QVIRTIO_PCI_ALIGN       4096
+
+typedef struct QVirtioDevice {
+    /* Device type */
+    uint16_t device_type;
+} QVirtioDevice;
+
+/* A split virtqueue in guest memory.  Descriptors are handed out round
+ * robin, so no more than @size of them may be in flight.
+ */
+typedef struct QVirtQueue {
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t index;
+    uint32_t size;
+    uint32_t free_head;
+    uint16_t last_used_idx;
+} QVirtQueue;
+
+typedef struct QVirtioBus {
+    uint8_t (*config_readb)(QVirtioDevice *d, uint64_t addr);
+    uint16_t (*config_readw)(QVirtioDevice *d, uint64_t addr);
+    uint32_t (*config_readl)(QVirtioDevice *d, uint64_t addr);
+    uint64_t (*config_readq)(QVirtioDevice *d, uint64_t addr);
+
+    /* Get features of the device */
+    uint32_t (*get_features)(QVirtioDevice *d);
+
+    /* Set features acknowledged by the driver */
+    void (*set_features)(QVirtioDevice *d, uint32_t features);
+
+    /* Get status of the device */
+    uint8_t (*get_status)(QVirtioDevice *d);
+
+    /* Set status of the device */
+    void (*set_status)(QVirtioDevice *d, uint8_t status);
+
+    /* Select a queue to work on */
+    void (*queue_select)(QVirtioDevice *d, uint16_t index);
+
+    /* Get the size of the selected queue */
+    uint16_t (*get_queue_size)(QVirtioDevice *d);
+
+    /* Set the page frame number of the selected queue */
+    void (*set_queue_address)(QVirtioDevice *d, uint32_t pfn);
+
+    /* Notify the device of new buffers in a queue */
+    void (*virtqueue_kick)(QVirtioDevice *d, QVirtQueue *vq);
+} QVirtioBus;
+
+static inline uint32_t qvring_size(uint32_t num, uint32_t align)
+{
+    return ((sizeof(uint64_t) * 2 * num + sizeof(uint16_t) * (3 + num)
+        + align - 1) & ~(align - 1))
+        + sizeof(uint16_t) * 3 + sizeof(uint64_t) * num;
+}
+
+uint8_t qvirtio_config_readb(const QVirtioBus *bus, QVirtioDevice *d,
+                             uint64_t addr);
+uint16_t qvirtio_config_readw(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr);
+uint32_t qvirtio_config_readl(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr);
+uint64_t qvirtio_config_readq(const QVirtioBus *bus, QVirtioDevice *d,
+                              uint64_t addr);
+uint32_t qvirtio_get_features(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_features(const QVirtioBus *bus, QVirtioDevice *d,
+                          uint32_t features);
+
+void qvirtio_reset(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_acknowledge(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_driver(const QVirtioBus *bus, QVirtioDevice *d);
+void qvirtio_set_driver_ok(const QVirtioBus *bus, QVirtioDevice *d);
+
+QVirtQueue *qvirtqueue_setup(const QVirtioBus *bus, QVirtioDevice *d,
+                             QGuestAllocator *alloc, uint16_t index);
+uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len,
+                        bool write, bool next);
+void qvirtqueue_make_available(QVirtQueue *vq, uint32_t head);
+void qvirtqueue_notify(const QVirtioBus *bus, QVirtioDevice *d,
+                       QVirtQueue *vq);
+void qvirtqueue_kick(const QVirtioBus *bus, QVirtioDevice *d,
+                     QVirtQueue *vq, uint32_t head);
+void qvirtqueue_wait_used(QVirtQueue *vq, gint64 timeout_us);
+
+#endif
@@ -429,6 +429,162 @@ static void test_wait_event_notifier_noflush(void)
 
 #if !defined(_WIN32)
 
+/* Enough handlers to make aio_poll() switch to epoll where available */
+#define MANY_EVENT_NOTIFIERS 100
+
+static void event_ready_remove_cb(EventNotifier *e)
+{
+    event_ready_cb(e);
+    aio_set_event_notifier(ctx, e, NULL);
+}
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData data[MANY_EVENT_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Only the notifiers that are set are dispatched */
+    event_notifier_set(&data[0].e);
+    event_notifier_set(&data[MANY_EVENT_NOTIFIERS - 1].e);
+    wait_until_inactive(&data[0]);
+    wait_until_inactive(&data[MANY_EVENT_NOTIFIERS - 1]);
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        bool set = i == 0 || i == MANY_EVENT_NOTIFIERS - 1;
+        g_assert_cmpint(data[i].n, ==, set ? 1 : 0);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Handlers may remove themselves and others while being dispatched */
+    for (i = 1; i < MANY_EVENT_NOTIFIERS - 1; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_remove_cb);
+        event_notifier_set(&data[i].e);
+    }
+    for (i = 1; i < MANY_EVENT_NOTIFIERS - 1; i++) {
+        wait_until_inactive(&data[i]);
+        g_assert_cmpint(data[i].n, ==, 1);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Back to a few handlers */
+    event_notifier_set(&data[0].e);
+    data[0].active = 1;
+    wait_until_inactive(&data[0]);
+    g_assert_cmpint(data[0].n, ==, 2);
+    g_assert(!aio_poll(ctx, false));
+
+    aio_set_event_notifier(ctx, &data[0].e, NULL);
+    aio_set_event_notifier(ctx, &data[MANY_EVENT_NOTIFIERS - 1].e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        event_notifier_cleanup(&data[i].e);
+    }
+}
+
+/* Picks up work that was queued without setting the notifier */
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (!data->auto_set) {
+        return false;
+    }
+    data->auto_set = false;
+    data->n++;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0);
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* An event that comes in quickly enables polling */
+    event_notifier_set(&data.e);
+    wait_until_inactive(&data);
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Now aio_poll() finds the work before it would block */
+    data.auto_set = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert(!data.auto_set);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert_cmpint(ctx->nb_poll_handlers, ==, 0);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+    aio_context_set_poll_params(ctx, 0, 0, 0);
+}
+
+static void stats_timer_cb(void *opaque)
+{
+    bool *fired = opaque;
+
+    *fired = true;
+}
+
+static void test_stats(void)
+{
+    AioContext *c = aio_context_new();
+    EventNotifierTestData a = { .n = 0, .active = 1 };
+    EventNotifierTestData b = { .n = 0, .active = 1 };
+    AioContextStats stats;
+    QEMUTimer timer;
+    bool fired = false;
+
+    aio_context_enable_stats(c);
+    event_notifier_init(&a.e, false);
+    event_notifier_init(&b.e, false);
+    aio_set_event_notifier(c, &a.e, event_ready_cb);
+    aio_set_event_notifier(c, &b.e, event_ready_cb);
+
+    event_notifier_set(&a.e);
+    event_notifier_set(&b.e);
+    g_assert(aio_poll(c, false));
+    event_notifier_set(&a.e);
+    g_assert(aio_poll(c, false));
+    g_assert(!aio_poll(c, false));
+
+    aio_context_get_stats(c, &stats);
+    g_assert_cmpint(stats.iterations, ==, 3);
+    g_assert_cmpint(stats.dispatched, ==, 3);
+    g_assert_cmpint(stats.max_dispatched, ==, 2);
+    g_assert_cmpint(stats.blocked_ns, ==, 0);
+    g_assert_cmpint(stats.busy_ns, >=, 0);
+
+    /* Waiting for a timer counts as blocked */
+    aio_timer_init(c, &timer, QEMU_CLOCK_REALTIME, SCALE_MS,
+                   stats_timer_cb, &fired);
+    timer_mod(&timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 10);
+    while (!fired) {
+        aio_poll(c, true);
+    }
+    aio_context_get_stats(c, &stats);
+    g_assert_cmpint(stats.blocked_ns, >, 0);
+    g_assert_cmpint(stats.dispatched, ==, 3);
+
+    timer_del(&timer);
+    aio_set_event_notifier(c, &a.e, NULL);
+    aio_set_event_notifier(c, &b.e, NULL);
+    event_notifier_cleanup(&a.e);
+    event_notifier_cleanup(&b.e);
+    aio_context_unref(c);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -858,6 +1014,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
 #if !defined(_WIN32)
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/stats",                   test_stats);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 #endif
 
@@ -0,0 +1,151 @@
+/*
+ * Block latency accounting tests
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "block/accounting.h"
+
+#define MS (1000 * 1000LL)
+
+static void test_window_empty(void)
+{
+    BlockAcctLatency stats = {};
+    BlockAcctLatencyWindow win;
+
+    block_latency_get_window(&stats, 3 * BLOCK_LATENCY_PERIOD_NS, &win);
+    g_assert_cmpint(win.nr_ops, ==, 0);
+    g_assert_cmpint(win.p99_ns, ==, 0);
+}
+
+static void test_window_stats(void)
+{
+    BlockAcctLatency stats = {};
+    BlockAcctLatencyWindow win;
+    int64_t now = 10 * BLOCK_LATENCY_PERIOD_NS;
+    int i;
+
+    /* 1000 requests: 990 take 1 ms, 9 take 10 ms and one takes 100 ms */
+    for (i = 0; i < 990; i++) {
+        block_latency_account(&stats, 1 * MS, now);
+    }
+    for (i = 0; i < 9; i++) {
+        block_latency_account(&stats, 10 * MS, now);
+    }
+    block_latency_account(&stats, 100 * MS, now);
+
+    block_latency_get_window(&stats, now, &win);
+    g_assert_cmpint(win.nr_ops, ==, 1000);
+    g_assert_cmpint(win.min_ns, ==, 1 * MS);
+    g_assert_cmpint(win.max_ns, ==, 100 * MS);
+    g_assert_cmpint(win.avg_ns, ==, (990 * 1 + 9 * 10 + 100) * MS / 1000);
+
+    /* percentiles are exact up to 1/8 */
+    g_assert_cmpint(win.p50_ns, >=, 1 * MS);
+    g_assert_cmpint(win.p50_ns, <=, 1 * MS + MS / 8);
+    g_assert_cmpint(win.p99_ns, >=, 1 * MS);
+    g_assert_cmpint(win.p99_ns, <=, 1 * MS + MS / 8);
+    g_assert_cmpint(win.p999_ns, >=, 10 * MS);
+    g_assert_cmpint(win.p999_ns, <=, 10 * MS + 10 * MS / 8);
+}
+
+static void test_window_slide(void)
+{
+    BlockAcctLatency stats = {};
+    BlockAcctLatencyWindow win;
+    int64_t now = 10 * BLOCK_LATENCY_PERIOD_NS;
+
+    block_latency_account(&stats, 50 * MS, now);
+
+    /* still in the window after one period */
+    now += BLOCK_LATENCY_PERIOD_NS;
+    block_latency_account(&stats, 2 * MS, now);
+    block_latency_get_window(&stats, now, &win);
+    g_assert_cmpint(win.nr_ops, ==, 2);
+    g_assert_cmpint(win.max_ns, ==, 50 * MS);
+
+    /* the first request drops out after the next period */
+    now += BLOCK_LATENCY_PERIOD_NS;
+    block_latency_get_window(&stats, now, &win);
+    g_assert_cmpint(win.nr_ops, ==, 1);
+    g_assert_cmpint(win.max_ns, ==, 2 * MS);
+
+    /* and everything is gone after two idle periods */
+    now += 2 * BLOCK_LATENCY_PERIOD_NS;
+    block_latency_get_window(&stats, now, &win);
+    g_assert_cmpint(win.nr_ops, ==, 0);
+}
+
+static void test_histogram(void)
+{
+    BlockAcctLatency stats = {};
+    const uint64_t boundaries[] = { 1 * MS, 10 * MS };
+    const uint64_t bad_boundaries[] = { 10 * MS, 10 * MS };
+    int64_t now = 10 * BLOCK_LATENCY_PERIOD_NS;
+
+    g_assert_cmpint(block_latency_set_histogram(&stats, bad_boundaries, 2),
+                    ==, -EINVAL);
+    g_assert(stats.hist_bins == NULL);
+
+    g_assert_cmpint(block_latency_set_histogram(&stats, boundaries, 2),
+                    ==, 0);
+
+    block_latency_account(&stats, MS / 2, now);
+    block_latency_account(&stats, 1 * MS, now);
+    block_latency_account(&stats, 5 * MS, now);
+    block_latency_account(&stats, 10 * MS, now);
+    block_latency_account(&stats, 20 * MS, now);
+
+    g_assert_cmpint(stats.hist_bins[0], ==, 1);
+    g_assert_cmpint(stats.hist_bins[1], ==, 2);
+    g_assert_cmpint(stats.hist_bins[2], ==, 2);
+
+    /* setting the histogram again resets it */
+    g_assert_cmpint(block_latency_set_histogram(&stats, boundaries, 2),
+                    ==, 0);
+    g_assert_cmpint(stats.hist_bins[1], ==, 0);
+
+    block_latency_set_histogram(&stats, NULL, 0);
+    g_assert(stats.hist_bins == NULL);
+    block_latency_cleanup(&stats);
+}
+
+static void test_period(void)
+{
+    BlockAcctLatencyPeriod period = {};
+    int i;
+
+    g_assert_cmpint(block_latency_period_percentile(&period, 0.5), ==, 0);
+
+    /* a single period keeps everything, however long it runs */
+    for (i = 0; i < 90; i++) {
+        block_latency_period_account(&period, 1 * MS);
+    }
+    for (i = 0; i < 10; i++) {
+        block_latency_period_account(&period, 10 * MS);
+    }
+
+    g_assert_cmpint(period.nr_ops, ==, 100);
+    g_assert_cmpint(period.min_ns, ==, 1 * MS);
+    g_assert_cmpint(period.max_ns, ==, 10 * MS);
+    g_assert_cmpint(block_latency_period_percentile(&period, 0.5), >=, 1 * MS);
+    g_assert_cmpint(block_latency_period_percentile(&period, 0.5), <=,
+                    1 * MS + MS / 8);
+    g_assert_cmpint(block_latency_period_percentile(&period, 0.99), ==,
+                    10 * MS);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/block-accounting/window/empty", test_window_empty);
+    g_test_add_func("/block-accounting/window/stats", test_window_stats);
+    g_test_add_func("/block-accounting/window/slide", test_window_slide);
+    g_test_add_func("/block-accounting/histogram", test_histogram);
+    g_test_add_func("/block-accounting/period", test_period);
+    return g_test_run();
+}
@@ -0,0 +1,876 @@
+/*
+ * Reference vhost-user backend
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A minimal, single threaded implementation of the slave side of the
+ * vhost-user protocol (docs/specs/vhost-user.txt).  It is meant as an
+ * example and for manual testing, not for production use.
+ *
+ *   vhost-user-backend net SOCKET
+ *       loopback network device: every frame the guest transmits is
+ *       received back on the same interface
+ *
+ *   vhost-user-backend blk SOCKET FILE
+ *       block device backed by FILE
+ *
+ * The backend listens on SOCKET and serves one connection, e.g.
+ *
+ *   qemu -m 512 -mem-path /dev/hugepages -mem-share \
+ *        -chardev socket,id=vu0,path=SOCKET \
+ *        -netdev vhost-user,id=net0,chardev=vu0 \
+ *        -device virtio-net-pci,netdev=net0
+ *
+ *   qemu -m 512 -mem-path /dev/hugepages -mem-share \
+ *        -chardev socket,id=vu1,path=SOCKET \
+ *        -device vhost-user-blk-pci,chardev=vu1
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/* Protocol definitions, see hw/virtio/vhost-user.c */
+
+#define VHOST_USER_GET_FEATURES             1
+#define VHOST_USER_SET_FEATURES             2
+#define VHOST_USER_SET_OWNER                3
+#define VHOST_USER_RESET_OWNER              4
+#define VHOST_USER_SET_MEM_TABLE            5
+#define VHOST_USER_SET_LOG_BASE             6
+#define VHOST_USER_SET_LOG_FD               7
+#define VHOST_USER_SET_VRING_NUM            8
+#define VHOST_USER_SET_VRING_ADDR           9
+#define VHOST_USER_SET_VRING_BASE           10
+#define VHOST_USER_GET_VRING_BASE           11
+#define VHOST_USER_SET_VRING_KICK           12
+#define VHOST_USER_SET_VRING_CALL           13
+#define VHOST_USER_SET_VRING_ERR            14
+#define VHOST_USER_GET_PROTOCOL_FEATURES    15
+#define VHOST_USER_SET_PROTOCOL_FEATURES    16
+#define VHOST_USER_GET_CONFIG               24
+
+#define VHOST_USER_VERSION                  0x1
+#define VHOST_USER_REPLY_MASK               (0x1 << 2)
+#define VHOST_USER_VRING_IDX_MASK           0xff
+#define VHOST_USER_VRING_NOFD_MASK          (0x1 << 8)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES      30
+#define VHOST_USER_PROTOCOL_F_CONFIG        9
+
+#define VHOST_MEMORY_MAX_NREGIONS           8
+#define VHOST_USER_MAX_CONFIG_SIZE          256
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        struct {
+            uint32_t index;
+            uint32_t num;
+        } state;
+        struct {
+            uint32_t index;
+            uint32_t flags;
+            uint64_t desc_user_addr;
+            uint64_t used_user_addr;
+            uint64_t avail_user_addr;
+            uint64_t log_guest_addr;
+        } addr;
+        struct {
+            uint32_t nregions;
+            uint32_t padding;
+            VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+        } memory;
+        struct {
+            uint32_t offset;
+            uint32_t size;
+            uint32_t flags;
+            uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+        } config;
+    };
+} __attribute__((packed)) VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, u64)
+
+/* Split virtqueue layout */
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+/* Device definitions */
+
+#define VIRTIO_BLK_F_SEG_MAX    2
+#define VIRTIO_BLK_F_BLK_SIZE   6
+#define VIRTIO_BLK_F_WCE        9
+#define VIRTIO_BLK_F_MQ         12
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_GET_ID     8
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_BLK_ID_BYTES     20
+
+struct virtio_blk_config {
+    uint64_t capacity;
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t blk_size;
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+    uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
+} __attribute__((packed));
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+/* Backend state */
+
+#define MAX_QUEUES      8
+#define MAX_SEGS        1024
+
+typedef struct MemRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+    void *mmap_addr;
+    uint64_t mmap_size;
+} MemRegion;
+
+typedef struct VirtQueue {
+    unsigned int num;
+    uint16_t last_avail_idx;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    int kick_fd;
+    int call_fd;
+    bool started;
+} VirtQueue;
+
+typedef struct Backend {
+    bool is_blk;
+    int conn_fd;
+    uint64_t features;
+    uint64_t protocol_features;
+    MemRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    unsigned int nregions;
+    VirtQueue vqs[MAX_QUEUES];
+    int disk_fd;
+    uint64_t disk_sectors;
+} Backend;
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* Translate an address of the master's address space */
+static void *qva_to_va(Backend *b, uint64_t qva)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        MemRegion *r = &b->regions[i];
+
+        if (qva >= r->userspace_addr &&
+            qva < r->userspace_addr + r->memory_size) {
+            return (uint8_t *)r->mmap_addr + r->mmap_offset +
+                   (qva - r->userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+/* Translate a guest physical address; @len must fit in one region */
+static void *gpa_to_va(Backend *b, uint64_t gpa, uint64_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        MemRegion *r = &b->regions[i];
+
+        if (gpa >= r->guest_phys_addr &&
+            gpa + len <= r->guest_phys_addr + r->memory_size) {
+            return (uint8_t *)r->mmap_addr + r->mmap_offset +
+                   (gpa - r->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+static void unmap_regions(Backend *b)
+{
+    unsigned int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        munmap(b->regions[i].mmap_addr, b->regions[i].mmap_size);
+    }
+    b->nregions = 0;
+}
+
+/*
+ * Virtqueue processing
+ */
+
+typedef struct Request {
+    unsigned int head;
+    struct iovec out[MAX_SEGS];
+    unsigned int out_num;
+    struct iovec in[MAX_SEGS];
+    unsigned int in_num;
+} Request;
+
+/* Returns false if the ring is empty or malformed */
+static bool vq_pop(Backend *b, VirtQueue *vq, Request *req)
+{
+    uint16_t avail_idx = vq->avail->idx;
+    unsigned int i, n = 0;
+
+    if (vq->last_avail_idx == avail_idx) {
+        return false;
+    }
+    __sync_synchronize();
+
+    req->head = i = vq->avail->ring[vq->last_avail_idx % vq->num];
+    req->out_num = req->in_num = 0;
+    vq->last_avail_idx++;
+
+    for (;;) {
+        struct vring_desc *d;
+        struct iovec *iov;
+
+        if (i >= vq->num || n++ >= vq->num) {
+            fprintf(stderr, "malformed descriptor chain\n");
+            return false;
+        }
+        d = &vq->desc[i];
+        if (d->flags & VRING_DESC_F_WRITE) {
+            if (req->in_num == MAX_SEGS) {
+                return false;
+            }
+            iov = &req->in[req->in_num++];
+        } else {
+            if (req->out_num == MAX_SEGS) {
+                return false;
+            }
+            iov = &req->out[req->out_num++];
+        }
+        iov->iov_base = gpa_to_va(b, d->addr, d->len);
+        iov->iov_len = d->len;
+        if (!iov->iov_base) {
+            fprintf(stderr, "descriptor outside of guest memory\n");
+            return false;
+        }
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d->next;
+    }
+    return true;
+}
+
+static void vq_push(VirtQueue *vq, unsigned int head, uint32_t len)
+{
+    uint16_t idx = vq->used->idx;
+
+    vq->used->ring[idx % vq->num].id = head;
+    vq->used->ring[idx % vq->num].len = len;
+    __sync_synchronize();
+    vq->used->idx = idx + 1;
+}
+
+static void vq_notify(VirtQueue *vq)
+{
+    uint64_t one = 1;
+
+    __sync_synchronize();
+    if (vq->call_fd >= 0 &&
+        !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        if (write(vq->call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write call fd");
+        }
+    }
+}
+
+static size_t iov_copy(const struct iovec *dst, unsigned int dst_num,
+                       const struct iovec *src, unsigned int src_num)
+{
+    size_t done = 0, doff = 0, soff = 0;
+    unsigned int d = 0, s = 0;
+
+    while (d < dst_num && s < src_num) {
+        size_t n = dst[d].iov_len - doff;
+
+        if (src[s].iov_len - soff < n) {
+            n = src[s].iov_len - soff;
+        }
+        memcpy((uint8_t *)dst[d].iov_base + doff,
+               (uint8_t *)src[s].iov_base + soff, n);
+        done += n;
+        doff += n;
+        soff += n;
+        if (doff == dst[d].iov_len) {
+            d++;
+            doff = 0;
+        }
+        if (soff == src[s].iov_len) {
+            s++;
+            soff = 0;
+        }
+    }
+    return done;
+}
+
+/* Loopback net: queue 0 is RX, queue 1 is TX */
+static void net_process(Backend *b)
+{
+    VirtQueue *rx = &b->vqs[0], *tx = &b->vqs[1];
+    static Request txreq, rxreq;
+    bool notify_rx = false, notify_tx = false;
+
+    if (!rx->started || !tx->started) {
+        return;
+    }
+
+    while (vq_pop(b, tx, &txreq)) {
+        /* The virtio-net header is copied along with the frame */
+        if (vq_pop(b, rx, &rxreq)) {
+            size_t len = iov_copy(rxreq.in, rxreq.in_num,
+                                  txreq.out, txreq.out_num);
+            vq_push(rx, rxreq.head, len);
+            notify_rx = true;
+        }
+        vq_push(tx, txreq.head, 0);
+        notify_tx = true;
+    }
+
+    if (notify_rx) {
+        vq_notify(rx);
+    }
+    if (notify_tx) {
+        vq_notify(tx);
+    }
+}
+
+static uint8_t blk_handle_request(Backend *b, Request *req, uint32_t *in_len)
+{
+    struct virtio_blk_outhdr hdr;
+    struct iovec *data;
+    unsigned int data_num;
+    ssize_t ret;
+    off_t offset;
+
+    *in_len = 1;
+    if (req->out_num < 1 || req->in_num < 1 ||
+        req->out[0].iov_len < sizeof(hdr) ||
+        req->in[req->in_num - 1].iov_len < 1) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+    memcpy(&hdr, req->out[0].iov_base, sizeof(hdr));
+    offset = (off_t)hdr.sector * 512;
+
+    switch (hdr.type & ~0x80000000u) {
+    case VIRTIO_BLK_T_IN:
+        data = req->in;
+        data_num = req->in_num - 1;
+        ret = preadv(b->disk_fd, data, data_num, offset);
+        if (ret < 0) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        *in_len += ret;
+        return VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_OUT:
+        data = req->out + 1;
+        data_num = req->out_num - 1;
+        ret = pwritev(b->disk_fd, data, data_num, offset);
+        return ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_FLUSH:
+        return fdatasync(b->disk_fd) < 0 ? VIRTIO_BLK_S_IOERR :
+                                           VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_GET_ID: {
+        static const char id[VIRTIO_BLK_ID_BYTES] = "vhost-user-blk";
+        struct iovec src = { .iov_base = (void *)id, .iov_len = sizeof(id) };
+
+        *in_len += iov_copy(req->in, req->in_num - 1, &src, 1);
+        return VIRTIO_BLK_S_OK;
+    }
+    default:
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+}
+
+static void blk_process(Backend *b, VirtQueue *vq)
+{
+    static Request req;
+    bool notify = false;
+
+    if (!vq->started) {
+        return;
+    }
+
+    while (vq_pop(b, vq, &req)) {
+        uint32_t in_len;
+        uint8_t s = blk_handle_request(b, &req, &in_len);
+
+        if (req.in_num) {
+            struct iovec *status = &req.in[req.in_num - 1];
+            ((uint8_t *)status->iov_base)[status->iov_len - 1] = s;
+        }
+        vq_push(vq, req.head, in_len);
+        notify = true;
+    }
+
+    if (notify) {
+        vq_notify(vq);
+    }
+}
+
+static void vq_kick(Backend *b, unsigned int index)
+{
+    VirtQueue *vq = &b->vqs[index];
+    uint64_t count;
+
+    if (read(vq->kick_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read kick fd");
+    }
+
+    if (b->is_blk) {
+        blk_process(b, vq);
+    } else {
+        net_process(b);
+    }
+}
+
+/*
+ * Message handling
+ */
+
+static int read_msg(int fd, VhostUserMsg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = { .iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    *fd_num = 0;
+    ret = recvmsg(fd, &mh, 0);
+    if (ret <= 0) {
+        return -1;
+    }
+    if (ret != VHOST_USER_HDR_SIZE) {
+        fprintf(stderr, "short message header\n");
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (msg->size > sizeof(*msg) - VHOST_USER_HDR_SIZE) {
+        fprintf(stderr, "message too big\n");
+        return -1;
+    }
+    if (msg->size &&
+        recv(fd, (uint8_t *)msg + VHOST_USER_HDR_SIZE, msg->size,
+             MSG_WAITALL) != msg->size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void send_reply(Backend *b, VhostUserMsg *msg)
+{
+    size_t len = VHOST_USER_HDR_SIZE + msg->size;
+
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    if (write(b->conn_fd, msg, len) != (ssize_t)len) {
+        die("write reply");
+    }
+}
+
+static uint64_t backend_features(Backend *b)
+{
+    if (b->is_blk) {
+        return (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+               (1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+               (1ULL << VIRTIO_BLK_F_WCE) |
+               (1ULL << VIRTIO_BLK_F_MQ) |
+               (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+    }
+    return 0;
+}
+
+static void set_mem_table(Backend *b, VhostUserMsg *msg, int *fds, int fd_num)
+{
+    unsigned int i;
+
+    unmap_regions(b);
+    if (msg->memory.nregions != (unsigned int)fd_num) {
+        fprintf(stderr, "SET_MEM_TABLE: %u regions but %d fds\n",
+                msg->memory.nregions, fd_num);
+        exit(1);
+    }
+
+    for (i = 0; i < msg->memory.nregions; i++) {
+        VhostUserMemoryRegion m = msg->memory.regions[i];
+        MemRegion *r = &b->regions[i];
+
+        r->guest_phys_addr = m.guest_phys_addr;
+        r->memory_size = m.memory_size;
+        r->userspace_addr = m.userspace_addr;
+        r->mmap_offset = m.mmap_offset;
+        r->mmap_size = m.memory_size + m.mmap_offset;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[i], 0);
+        if (r->mmap_addr == MAP_FAILED) {
+            die("mmap guest memory");
+        }
+        close(fds[i]);
+        b->nregions++;
+    }
+}
+
+static void set_vring_fd(Backend *b, VhostUserMsg *msg, int *fds, int fd_num,
+                         bool kick)
+{
+    unsigned int index = msg->u64 & VHOST_USER_VRING_IDX_MASK;
+    VirtQueue *vq;
+    int fd = -1;
+
+    if (index >= MAX_QUEUES) {
+        fprintf(stderr, "virtqueue index %u out of range\n", index);
+        exit(1);
+    }
+    vq = &b->vqs[index];
+
+    if (!(msg->u64 & VHOST_USER_VRING_NOFD_MASK) && fd_num > 0) {
+        fd = fds[0];
+    }
+
+    if (kick) {
+        if (vq->kick_fd >= 0) {
+            close(vq->kick_fd);
+        }
+        vq->kick_fd = fd;
+        /* The ring is started by its first kick fd */
+        vq->started = fd >= 0 && vq->desc;
+        if (vq->started) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    } else {
+        if (vq->call_fd >= 0) {
+            close(vq->call_fd);
+        }
+        vq->call_fd = fd;
+    }
+}
+
+static void handle_msg(Backend *b, VhostUserMsg *msg, int *fds, int fd_num)
+{
+    VirtQueue *vq;
+
+    switch (msg->request) {
+    case VHOST_USER_GET_FEATURES:
+        msg->u64 = backend_features(b);
+        msg->size = sizeof(msg->u64);
+        send_reply(b, msg);
+        break;
+    case VHOST_USER_SET_FEATURES:
+        b->features = msg->u64;
+        break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg->u64 = b->is_blk ? 1ULL << VHOST_USER_PROTOCOL_F_CONFIG : 0;
+        msg->size = sizeof(msg->u64);
+        send_reply(b, msg);
+        break;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        b->protocol_features = msg->u64;
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        set_mem_table(b, msg, fds, fd_num);
+        break;
+    case VHOST_USER_SET_LOG_BASE:
+    case VHOST_USER_SET_LOG_FD:
+        fprintf(stderr, "dirty logging is not supported\n");
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+        if (msg->state.index >= MAX_QUEUES) {
+            fprintf(stderr, "virtqueue index out of range\n");
+            exit(1);
+        }
+        b->vqs[msg->state.index].num = msg->state.num;
+        break;
+    case VHOST_USER_SET_VRING_BASE:
+        if (msg->state.index >= MAX_QUEUES) {
+            fprintf(stderr, "virtqueue index out of range\n");
+            exit(1);
+        }
+        b->vqs[msg->state.index].last_avail_idx = msg->state.num;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        if (msg->state.index >= MAX_QUEUES) {
+            fprintf(stderr, "virtqueue index out of range\n");
+            exit(1);
+        }
+        /* Getting the base stops the ring */
+        vq = &b->vqs[msg->state.index];
+        vq->started = false;
+        msg->state.num = vq->last_avail_idx;
+        msg->size = sizeof(msg->state);
+        send_reply(b, msg);
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        if (msg->addr.index >= MAX_QUEUES) {
+            fprintf(stderr, "virtqueue index out of range\n");
+            exit(1);
+        }
+        vq = &b->vqs[msg->addr.index];
+        vq->desc = qva_to_va(b, msg->addr.desc_user_addr);
+        vq->avail = qva_to_va(b, msg->addr.avail_user_addr);
+        vq->used = qva_to_va(b, msg->addr.used_user_addr);
+        if (!vq->desc || !vq->avail || !vq->used) {
+            fprintf(stderr, "ring addresses outside of guest memory\n");
+            exit(1);
+        }
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+        set_vring_fd(b, msg, fds, fd_num, true);
+        break;
+    case VHOST_USER_SET_VRING_CALL:
+        set_vring_fd(b, msg, fds, fd_num, false);
+        break;
+    case VHOST_USER_SET_VRING_ERR:
+        if (fd_num > 0) {
+            close(fds[0]);
+        }
+        break;
+    case VHOST_USER_GET_CONFIG: {
+        struct virtio_blk_config cfg;
+        uint32_t len = msg->config.size;
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.capacity = b->disk_sectors;
+        cfg.seg_max = MAX_SEGS - 2;
+        cfg.blk_size = 512;
+        cfg.wce = 1;
+        cfg.num_queues = 1;
+        if (len > sizeof(cfg)) {
+            len = sizeof(cfg);
+        }
+        memset(msg->config.region, 0, msg->config.size);
+        memcpy(msg->config.region, &cfg, len);
+        send_reply(b, msg);
+        break;
+    }
+    default:
+        fprintf(stderr, "unhandled request %u\n", msg->request);
+        break;
+    }
+}
+
+/*
+ * The socket is bound under a temporary name and only renamed to @path once
+ * it listens, so that a client which waits for @path to appear never finds
+ * it refusing connections.
+ */
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un un;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket");
+    }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if (snprintf(un.sun_path, sizeof(un.sun_path), "%s.tmp", path) >=
+        (int)sizeof(un.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        exit(1);
+    }
+    unlink(un.sun_path);
+
+    if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        die("bind");
+    }
+    if (listen(fd, 1) < 0) {
+        die("listen");
+    }
+    if (rename(un.sun_path, path) < 0) {
+        die("rename");
+    }
+    return fd;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s net SOCKET\n"
+                    "       %s blk SOCKET FILE\n", name, name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    Backend b;
+    int listen_fd;
+    unsigned int i;
+
+    memset(&b, 0, sizeof(b));
+    b.disk_fd = -1;
+    for (i = 0; i < MAX_QUEUES; i++) {
+        b.vqs[i].kick_fd = -1;
+        b.vqs[i].call_fd = -1;
+    }
+
+    if (argc == 3 && !strcmp(argv[1], "net")) {
+        b.is_blk = false;
+    } else if (argc == 4 && !strcmp(argv[1], "blk")) {
+        struct stat st;
+
+        b.is_blk = true;
+        b.disk_fd = open(argv[3], O_RDWR);
+        if (b.disk_fd < 0 || fstat(b.disk_fd, &st) < 0) {
+            die(argv[3]);
+        }
+        b.disk_sectors = st.st_size / 512;
+    } else {
+        usage(argv[0]);
+    }
+
+    listen_fd = listen_unix(argv[2]);
+    b.conn_fd = accept(listen_fd, NULL, NULL);
+    if (b.conn_fd < 0) {
+        die("accept");
+    }
+    close(listen_fd);
+
+    for (;;) {
+        struct pollfd pfd[MAX_QUEUES + 1];
+        unsigned int index[MAX_QUEUES + 1];
+        unsigned int n = 0;
+
+        pfd[n].fd = b.conn_fd;
+        pfd[n].events = POLLIN;
+        n++;
+        for (i = 0; i < MAX_QUEUES; i++) {
+            if (b.vqs[i].started) {
+                pfd[n].fd = b.vqs[i].kick_fd;
+                pfd[n].events = POLLIN;
+                index[n] = i;
+                n++;
+            }
+        }
+
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
+
+        for (i = 1; i < n; i++) {
+            if (pfd[i].revents & POLLIN) {
+                vq_kick(&b, index[i]);
+            }
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            VhostUserMsg msg;
+            int fds[VHOST_MEMORY_MAX_NREGIONS];
+            int fd_num;
+
+            if (read_msg(b.conn_fd, &msg, fds, &fd_num) < 0) {
+                fprintf(stderr, "connection closed\n");
+                break;
+            }
+            handle_msg(&b, &msg, fds, fd_num);
+        }
+    }
+
+    unmap_regions(&b);
+    return 0;
+}
@@ -0,0 +1,632 @@
+/*
+ * QTest testcase for the vhost-user master
+ *
+ * Copyright (c) 2014 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * For the protocol checks, the slave side runs in a thread of the test.  It
+ * records what QEMU sends, so that the test can check the memory table, the
+ * ring setup and the file descriptors, and use them like a real slave would.
+ *
+ * The I/O tests run the reference backend, tests/vhost-user-backend, as the
+ * slave and push network frames and block requests through it.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "libqtest.h"
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/virtio-pc.h"
+#include "libqos/virtio-blk.h"
+
+#define QVHOST_USER_TIMEOUT_US  (30 * 1000 * 1000)
+
+/* Protocol definitions, see docs/specs/vhost-user.txt */
+
+#define VHOST_USER_GET_FEATURES     1
+#define VHOST_USER_SET_FEATURES     2
+#define VHOST_USER_SET_MEM_TABLE    5
+#define VHOST_USER_SET_VRING_NUM    8
+#define VHOST_USER_SET_VRING_ADDR   9
+#define VHOST_USER_SET_VRING_BASE   10
+#define VHOST_USER_GET_VRING_BASE   11
+#define VHOST_USER_SET_VRING_KICK   12
+#define VHOST_USER_SET_VRING_CALL   13
+
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+#define VHOST_USER_VRING_IDX_MASK   0xff
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+
+#define VHOST_MEMORY_MAX_NREGIONS   8
+
+/* virtio-net uses a receive and a transmit queue */
+#define NUM_QUEUES                  2
+
+/* struct virtio_net_hdr without VIRTIO_NET_F_MRG_RXBUF */
+#define VIRTIO_NET_HDR_SIZE         10
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        struct {
+            uint32_t index;
+            uint32_t num;
+        } state;
+        struct {
+            uint32_t index;
+            uint32_t flags;
+            uint64_t desc_user_addr;
+            uint64_t used_user_addr;
+            uint64_t avail_user_addr;
+            uint64_t log_guest_addr;
+        } addr;
+        struct {
+            uint32_t nregions;
+            uint32_t padding;
+            VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+        } memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, u64)
+
+typedef struct TestVring {
+    uint32_t num;
+    uint32_t base;
+    uint64_t desc, avail, used;     /* QEMU virtual addresses */
+    int kick_fd;
+    int call_fd;
+} TestVring;
+
+typedef struct TestServer {
+    int listen_fd;
+    QemuThread thread;
+    QemuMutex lock;
+
+    /* Protected by lock */
+    int features_count;
+    int mem_table_count;
+    int mem_fds_missing;            /* regions received without an fd */
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    void *region_maps[VHOST_MEMORY_MAX_NREGIONS];
+    int nregions;
+    TestVring vrings[NUM_QUEUES];
+    int call_count;
+} TestServer;
+
+static char tmp_dir[] = "/tmp/qtest-vhost-user.XXXXXX";
+static char *socket_path;
+
+static int read_msg(int fd, VhostUserMsg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = { .iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+
+    *fd_num = 0;
+    if (recvmsg(fd, &mh, MSG_WAITALL) != VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+        }
+    }
+
+    g_assert_cmpint(msg->size, <=, sizeof(*msg) - VHOST_USER_HDR_SIZE);
+    if (msg->size &&
+        recv(fd, (char *)msg + VHOST_USER_HDR_SIZE, msg->size,
+             MSG_WAITALL) != msg->size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void send_reply(int fd, VhostUserMsg *msg, uint32_t size)
+{
+    size_t len = VHOST_USER_HDR_SIZE + size;
+
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    msg->size = size;
+    g_assert_cmpint(write(fd, msg, len), ==, len);
+}
+
+static void set_mem_table(TestServer *s, VhostUserMsg *msg, int *fds,
+                          int fd_num)
+{
+    int i;
+
+    g_assert_cmpint(msg->memory.nregions, <=, VHOST_MEMORY_MAX_NREGIONS);
+    s->mem_table_count++;
+    s->mem_fds_missing += msg->memory.nregions - fd_num;
+    s->nregions = MIN(msg->memory.nregions, fd_num);
+
+    for (i = 0; i < s->nregions; i++) {
+        VhostUserMemoryRegion *r = &s->regions[i];
+
+        *r = msg->memory.regions[i];
+        s->region_maps[i] = mmap(NULL, r->memory_size + r->mmap_offset,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 fds[i], 0);
+        g_assert(s->region_maps[i] != MAP_FAILED);
+        close(fds[i]);
+    }
+}
+
+static int vring_fd(VhostUserMsg *msg, int *fds, int fd_num)
+{
+    if (msg->u64 & VHOST_USER_VRING_NOFD_MASK) {
+        return -1;
+    }
+    g_assert_cmpint(fd_num, ==, 1);
+    return fds[0];
+}
+
+static void *server_thread(void *opaque)
+{
+    TestServer *s = opaque;
+    int fd;
+
+    fd = accept(s->listen_fd, NULL, NULL);
+    g_assert_cmpint(fd, >=, 0);
+
+    for (;;) {
+        VhostUserMsg msg;
+        int fds[VHOST_MEMORY_MAX_NREGIONS];
+        int fd_num;
+        TestVring *vring;
+
+        memset(&msg, 0, sizeof(msg));
+        if (read_msg(fd, &msg, fds, &fd_num) < 0) {
+            break;
+        }
+
+        qemu_mutex_lock(&s->lock);
+        switch (msg.request) {
+        case VHOST_USER_GET_FEATURES:
+            msg.u64 = 0;
+            send_reply(fd, &msg, sizeof(msg.u64));
+            break;
+        case VHOST_USER_SET_FEATURES:
+            s->features_count++;
+            break;
+        case VHOST_USER_SET_MEM_TABLE:
+            set_mem_table(s, &msg, fds, fd_num);
+            break;
+        case VHOST_USER_SET_VRING_NUM:
+            g_assert_cmpint(msg.state.index, <, NUM_QUEUES);
+            s->vrings[msg.state.index].num = msg.state.num;
+            break;
+        case VHOST_USER_SET_VRING_BASE:
+            g_assert_cmpint(msg.state.index, <, NUM_QUEUES);
+            s->vrings[msg.state.index].base = msg.state.num;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            g_assert_cmpint(msg.state.index, <, NUM_QUEUES);
+            msg.state.num = s->vrings[msg.state.index].base;
+            send_reply(fd, &msg, sizeof(msg.state));
+            break;
+        case VHOST_USER_SET_VRING_ADDR:
+            g_assert_cmpint(msg.addr.index, <, NUM_QUEUES);
+            vring = &s->vrings[msg.addr.index];
+            vring->desc = msg.addr.desc_user_addr;
+            vring->avail = msg.addr.avail_user_addr;
+            vring->used = msg.addr.used_user_addr;
+            break;
+        case VHOST_USER_SET_VRING_KICK:
+            vring = &s->vrings[msg.u64 & VHOST_USER_VRING_IDX_MASK];
+            g_assert_cmpint(msg.u64 & VHOST_USER_VRING_IDX_MASK, <,
+                            NUM_QUEUES);
+            vring->kick_fd = vring_fd(&msg, fds, fd_num);
+            break;
+        case VHOST_USER_SET_VRING_CALL:
+            vring = &s->vrings[msg.u64 & VHOST_USER_VRING_IDX_MASK];
+            g_assert_cmpint(msg.u64 & VHOST_USER_VRING_IDX_MASK, <,
+                            NUM_QUEUES);
+            vring->call_fd = vring_fd(&msg, fds, fd_num);
+            s->call_count++;
+            break;
+        default:
+            /* Other requests need neither a reply nor checking */
+            while (fd_num > 0) {
+                close(fds[--fd_num]);
+            }
+            break;
+        }
+        qemu_mutex_unlock(&s->lock);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void server_start(TestServer *s)
+{
+    struct sockaddr_un un;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < NUM_QUEUES; i++) {
+        s->vrings[i].kick_fd = -1;
+        s->vrings[i].call_fd = -1;
+    }
+    qemu_mutex_init(&s->lock);
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(s->listen_fd, >=, 0);
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", socket_path);
+    unlink(socket_path);
+    g_assert_cmpint(bind(s->listen_fd, (struct sockaddr *)&un,
+                         sizeof(un)), ==, 0);
+    g_assert_cmpint(listen(s->listen_fd, 1), ==, 0);
+
+    qemu_thread_create(&s->thread, "vhost-user-slave", server_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* Waits until QEMU has closed the connection */
+static void server_stop(TestServer *s)
+{
+    int i;
+
+    qemu_thread_join(&s->thread);
+    close(s->listen_fd);
+    unlink(socket_path);
+
+    for (i = 0; i < s->nregions; i++) {
+        munmap(s->region_maps[i],
+               s->regions[i].memory_size + s->regions[i].mmap_offset);
+    }
+    for (i = 0; i < NUM_QUEUES; i++) {
+        if (s->vrings[i].kick_fd >= 0) {
+            close(s->vrings[i].kick_fd);
+        }
+        if (s->vrings[i].call_fd >= 0) {
+            close(s->vrings[i].call_fd);
+        }
+    }
+    qemu_mutex_destroy(&s->lock);
+}
+
+/* Returns the slave's mapping of guest physical address @gpa */
+static void *server_gpa_to_va(TestServer *s, uint64_t gpa, uint64_t len)
+{
+    int i;
+
+    for (i = 0; i < s->nregions; i++) {
+        VhostUserMemoryRegion *r = &s->regions[i];
+
+        if (gpa >= r->guest_phys_addr &&
+            gpa + len <= r->guest_phys_addr + r->memory_size) {
+            return (uint8_t *)s->region_maps[i] + r->mmap_offset +
+                   (gpa - r->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+/* Returns the guest physical address of QEMU virtual address @qva */
+static uint64_t server_qva_to_gpa(TestServer *s, uint64_t qva)
+{
+    int i;
+
+    for (i = 0; i < s->nregions; i++) {
+        VhostUserMemoryRegion *r = &s->regions[i];
+
+        if (qva >= r->userspace_addr &&
+            qva < r->userspace_addr + r->memory_size) {
+            return qva - r->userspace_addr + r->guest_phys_addr;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* Waits until the message counter @counter of the slave reaches @count */
+static void server_wait(TestServer *s, int *counter, int count)
+{
+    gint64 start = g_get_monotonic_time();
+
+    for (;;) {
+        bool done;
+
+        qemu_mutex_lock(&s->lock);
+        done = *counter >= count;
+        qemu_mutex_unlock(&s->lock);
+        if (done) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start <= QVHOST_USER_TIMEOUT_US);
+        g_usleep(1000);
+    }
+}
+
+static QVirtioPC *virtio_net_start(const char *mem_args)
+{
+    QVirtioPC *v;
+    char *cmdline;
+
+    /* Setting DRIVER_OK starts vhost */
+    cmdline = g_strdup_printf("-mem-path %s %s "
+                              "-chardev socket,id=chr0,path=%s "
+                              "-netdev vhost-user,id=net0,chardev=chr0 "
+                              "-device virtio-net-pci,netdev=net0",
+                              tmp_dir, mem_args, socket_path);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_NET_DEVICE_ID, NUM_QUEUES, 0);
+    g_free(cmdline);
+
+    return v;
+}
+
+static void test_shared_memory(void)
+{
+    TestServer s;
+    QVirtioPC *n;
+    uint64_t addr;
+    uint32_t *va;
+    gint64 start;
+    uint64_t one = 1;
+    int i;
+
+    server_start(&s);
+    n = virtio_net_start("-mem-share");
+
+    /* Both queues are started, and the interrupt fds are set last.  vhost
+     * only starts once the chardev is connected, which may happen after
+     * DRIVER_OK.
+     */
+    server_wait(&s, &s.call_count, NUM_QUEUES);
+
+    /* QEMU sends nothing more, so the slave state is stable from here on */
+    qemu_mutex_lock(&s.lock);
+    g_assert_cmpint(s.features_count, ==, 1);
+    g_assert_cmpint(s.mem_table_count, ==, 1);
+    g_assert_cmpint(s.mem_fds_missing, ==, 0);
+    g_assert_cmpint(s.nregions, >, 0);
+
+    for (i = 0; i < NUM_QUEUES; i++) {
+        TestVring *vring = &s.vrings[i];
+        struct stat st;
+
+        g_assert_cmpint(vring->num, ==, n->vq[i]->size);
+        g_assert_cmpint(vring->base, ==, 0);
+        g_assert_cmphex(server_qva_to_gpa(&s, vring->desc), ==,
+                        n->vq[i]->desc);
+        g_assert_cmphex(server_qva_to_gpa(&s, vring->avail), ==,
+                        n->vq[i]->avail);
+        g_assert_cmphex(server_qva_to_gpa(&s, vring->used), ==,
+                        n->vq[i]->used);
+        g_assert_cmpint(fstat(vring->kick_fd, &st), ==, 0);
+        g_assert_cmpint(fstat(vring->call_fd, &st), ==, 0);
+    }
+    qemu_mutex_unlock(&s.lock);
+
+    /* Guest memory is shared in both directions */
+    addr = guest_alloc(n->alloc, sizeof(*va));
+    va = server_gpa_to_va(&s, addr, sizeof(*va));
+    g_assert(va != NULL);
+    writel(addr, 0x12345678);
+    g_assert_cmphex(*va, ==, 0x12345678);
+    *va = 0x9abcdef0;
+    g_assert_cmphex(readl(addr), ==, 0x9abcdef0);
+
+    /* Signalling the call fd of the receive queue interrupts the guest */
+    qpci_io_readb(n->dev->pdev, n->dev->addr + QVIRTIO_PCI_ISR_STATUS);
+    g_assert_cmpint(write(s.vrings[0].call_fd, &one, sizeof(one)), ==,
+                    sizeof(one));
+
+    start = g_get_monotonic_time();
+    while (!(qpci_io_readb(n->dev->pdev,
+                           n->dev->addr + QVIRTIO_PCI_ISR_STATUS) & 1)) {
+        g_assert(g_get_monotonic_time() - start <= QVHOST_USER_TIMEOUT_US);
+        clock_step(100);
+    }
+
+    qvirtio_pc_stop(n);
+    server_stop(&s);
+}
+
+/* Without -mem-share, the slave would map a private copy of guest memory,
+ * so QEMU must not send the memory table
+ */
+static void test_private_memory(void)
+{
+    TestServer s;
+    QVirtioPC *n;
+
+    server_start(&s);
+    n = virtio_net_start("");
+    server_wait(&s, &s.features_count, 1);
+    qvirtio_pc_stop(n);
+    server_stop(&s);
+
+    g_assert_cmpint(s.mem_table_count, ==, 0);
+    g_assert_cmpint(s.call_count, ==, 0);
+}
+
+/*
+ * I/O through the reference backend
+ */
+
+/* Starts the reference backend for device @type, see vhost-user-backend.c,
+ * and waits until it accepts connections on socket_path
+ */
+static GPid backend_start(const char *type, const char *file)
+{
+    const char *binary = getenv("QTEST_VHOST_USER_BACKEND");
+    char *argv[] = {
+        (char *)(binary ? binary : "tests/vhost-user-backend"),
+        (char *)type, socket_path, (char *)file, NULL
+    };
+    GError *err = NULL;
+    gint64 start;
+    GPid pid;
+
+    unlink(socket_path);
+    g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                  &pid, &err);
+    g_assert_no_error(err);
+
+    start = g_get_monotonic_time();
+    while (!g_file_test(socket_path, G_FILE_TEST_EXISTS)) {
+        g_assert(g_get_monotonic_time() - start <= QVHOST_USER_TIMEOUT_US);
+        g_usleep(1000);
+    }
+
+    return pid;
+}
+
+/* The backend exits cleanly once QEMU has closed the connection */
+static void backend_stop(GPid pid)
+{
+    int status;
+
+    g_assert_cmpint(waitpid(pid, &status, 0), ==, pid);
+    g_assert(WIFEXITED(status));
+    g_assert_cmpint(WEXITSTATUS(status), ==, 0);
+    g_spawn_close_pid(pid);
+    unlink(socket_path);
+}
+
+/* Every frame that the guest transmits is received back */
+static void test_net_loopback(void)
+{
+    QVirtioPC *v;
+    QVirtQueue *rx, *tx;
+    uint8_t frame[64], buf[sizeof(frame)];
+    uint64_t rx_buf, tx_buf;
+    uint32_t head, len = VIRTIO_NET_HDR_SIZE + sizeof(frame);
+    GPid pid;
+    int i;
+
+    pid = backend_start("net", NULL);
+    v = virtio_net_start("-mem-share");
+    rx = v->vq[0];
+    tx = v->vq[1];
+
+    rx_buf = guest_alloc(v->alloc, 2048);
+    head = qvirtqueue_add(rx, rx_buf, 2048, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &v->dev->vdev, rx, head);
+
+    for (i = 0; i < sizeof(frame); i++) {
+        frame[i] = i;
+    }
+    tx_buf = guest_alloc(v->alloc, len);
+    memset(buf, 0, VIRTIO_NET_HDR_SIZE);
+    memwrite(tx_buf, buf, VIRTIO_NET_HDR_SIZE);
+    memwrite(tx_buf + VIRTIO_NET_HDR_SIZE, frame, sizeof(frame));
+    head = qvirtqueue_add(tx, tx_buf, len, false, false);
+    qvirtqueue_kick(&qvirtio_pci, &v->dev->vdev, tx, head);
+
+    qvirtqueue_wait_used(tx, QVHOST_USER_TIMEOUT_US);
+    qvirtqueue_wait_used(rx, QVHOST_USER_TIMEOUT_US);
+
+    /* The first used element holds the length of the received frame */
+    g_assert_cmpint(readl(rx->used + 8), ==, len);
+    memread(rx_buf + VIRTIO_NET_HDR_SIZE, buf, sizeof(frame));
+    g_assert(memcmp(buf, frame, sizeof(frame)) == 0);
+
+    qvirtio_pc_stop(v);
+    backend_stop(pid);
+}
+
+/* Requests to vhost-user-blk are served from the backend's image file */
+static void test_blk_io(void)
+{
+    char disk_path[] = "/tmp/qtest-vhost-user-blk.XXXXXX";
+    const int sectors = 16;
+    QVirtioPC *v;
+    char *cmdline;
+    char buf[512];
+    GPid pid;
+    int fd, i, j;
+
+    fd = mkstemp(disk_path);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ftruncate(fd, 1024 * 1024), ==, 0);
+
+    pid = backend_start("blk", disk_path);
+
+    /* The device connects to the backend when it is realized */
+    cmdline = g_strdup_printf("-mem-path %s -mem-share "
+                              "-chardev socket,id=chr0,path=%s "
+                              "-device vhost-user-blk-pci,chardev=chr0",
+                              tmp_dir, socket_path);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_BLK_DEVICE_ID, 1, 0);
+    g_free(cmdline);
+
+    /* The configuration comes from the backend */
+    g_assert_cmpint(qvirtio_config_readq(&qvirtio_pci, &v->dev->vdev, 0), ==,
+                    (1024 * 1024) / 512);
+
+    qvirtio_blk_test_rw(v, v->vq[0], sectors, 'a');
+
+    qvirtio_pc_stop(v);
+    backend_stop(pid);
+
+    /* The writes reached the image file */
+    for (i = 0; i < sectors; i++) {
+        g_assert_cmpint(pread(fd, buf, sizeof(buf), i * 512), ==,
+                        sizeof(buf));
+        for (j = 0; j < sizeof(buf); j++) {
+            g_assert_cmpint(buf[j], ==, 'a' + i);
+        }
+    }
+
+    close(fd);
+    unlink(disk_path);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_assert(mkdtemp(tmp_dir) != NULL);
+    socket_path = g_strdup_printf("%s/vhost.sock", tmp_dir);
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/vhost-user/shared-memory", test_shared_memory);
+    qtest_add_func("/vhost-user/private-memory", test_private_memory);
+    qtest_add_func("/vhost-user/net-loopback", test_net_loopback);
+    qtest_add_func("/vhost-user/blk-io", test_blk_io);
+
+    ret = g_test_run();
+
+    rmdir(tmp_dir);
+    g_free(socket_path);
+
+    return ret;
+}
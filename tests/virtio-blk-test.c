@@ -9,26 +9,631 @@
 
 #include <glib.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "libqos/virtio-blk.h"
+#include "libqos/pci-pc.h"
+
+#define TEST_IMAGE_SIZE         (1024 * 1024)
+
+/* i440FX PAM register for 0xd0000-0xd7fff and its settings */
+#define I440FX_PAM3             0x5c
+#define PAM_PCI                 0x00
+#define PAM_RAM                 0x33
+
+#define REMAP_ADDR              0xd0000
+
+/* The stream job copies STREAM_BUFFER_SIZE bytes at a time and measures
+ * guest I/O over slices of STREAM_SLICE_US
+ */
+#define STREAM_IMAGE_SIZE       (32 * 1024 * 1024)
+#define STREAM_BUFFER_SIZE      (512 * 1024)
+#define STREAM_SLICE_US         (100 * 1000)
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+static char blkdebug_path[] = "/tmp/qtest-blkdebug.XXXXXX";
+static char migrate_path[] = "/tmp/qtest-migrate.XXXXXX";
+static char stream_path[] = "/tmp/qtest-stream.XXXXXX";
+
+static QVirtioPC *virtio_blk_start(const char *drive_args)
+{
+    QVirtioPC *v;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,%s "
+                              "-device virtio-blk-pci,id=blk0,drive=drv0",
+                              drive_args);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_BLK_DEVICE_ID, 1, 0);
+    g_free(cmdline);
+
+    return v;
+}
+
+/* Skips the asynchronous events that arrive before the response */
+static QDict *qmp_until_return(const char *command)
+{
+    QDict *response = qmp(command);
+
+    while (qdict_haskey(response, "event")) {
+        QDECREF(response);
+        response = qmp_receive();
+    }
+    g_assert(qdict_haskey(response, "return"));
+    return response;
+}
+
+/* Waits until the "status" member of the reply to @command is @status */
+static void qmp_wait_status(const char *command, const char *status)
+{
+    gint64 start = g_get_monotonic_time();
+
+    for (;;) {
+        QDict *response = qmp_until_return(command);
+        QDict *ret = qdict_get_qdict(response, "return");
+        const char *s = qdict_get_try_str(ret, "status");
+
+        if (s && !strcmp(s, status)) {
+            QDECREF(response);
+            break;
+        }
+        g_assert(!s || strcmp(s, "failed"));
+        QDECREF(response);
+
+        g_assert(g_get_monotonic_time() - start <= QVIRTIO_BLK_TIMEOUT_US);
+        g_usleep(10 * 1000);
+    }
+}
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=/dev/null "
+                "-device virtio-blk-pci,drive=drv0");
+    qtest_end();
+}
+
+/* Every queue of a multiqueue device serves requests, and the data is the
+ * same whichever queue accesses it
+ */
+static void pci_multiqueue(void)
+{
+    QVirtioPC *v;
+    QDict *response;
+    QList *stats;
+    const QListEntry *entry;
+    char *cmdline;
+    int i;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device virtio-blk-pci,id=blk0,drive=drv0,"
+                              "num-queues=4", tmp_path);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_BLK_DEVICE_ID, 4,
+                         1u << QVIRTIO_BLK_F_MQ);
+    g_free(cmdline);
+
+    g_assert(qvirtio_get_features(&qvirtio_pci, &v->dev->vdev) &
+             (1u << QVIRTIO_BLK_F_MQ));
+    g_assert_cmpint(qvirtio_config_readw(&qvirtio_pci, &v->dev->vdev, 34),
+                    ==, 4);
+
+    for (i = 0; i < 4; i++) {
+        qvirtio_blk_write_pattern(v, v->vq[i], i, 'a' + i);
+    }
+    for (i = 0; i < 4; i++) {
+        qvirtio_blk_read_pattern(v, v->vq[(i + 1) % 4], i, 'a' + i);
+    }
+
+    response = qmp("{ 'execute': 'qom-get', 'arguments': {"
+                   " 'path': '/machine/peripheral/blk0/virtio-backend',"
+                   " 'property': 'queue-stats' } }");
+    g_assert(response);
+    stats = qdict_get_qlist(response, "return");
+    g_assert(stats);
+    g_assert_cmpint(qlist_size(stats), ==, 4);
+    i = 0;
+    QLIST_FOREACH_ENTRY(stats, entry) {
+        QDict *queue = qobject_to_qdict(qlist_entry_obj(entry));
+
+        g_assert_cmpint(qdict_get_int(queue, "queue"), ==, i);
+        g_assert_cmpint(qdict_get_int(queue, "requests"), ==, 2);
+        g_assert_cmpint(qdict_get_int(queue, "in_flight"), ==, 0);
+        g_assert_cmpint(qdict_get_int(queue, "rd_operations"), ==, 1);
+        g_assert_cmpint(qdict_get_int(queue, "wr_operations"), ==, 1);
+        i++;
+    }
+    QDECREF(response);
+
+    response = qmp("{ 'execute': 'qom-get', 'arguments': {"
+                   " 'path': '/machine/peripheral/blk0/virtio-backend',"
+                   " 'property': 'virtqueue-stats' } }");
+    g_assert(response);
+    stats = qdict_get_qlist(response, "return");
+    g_assert(stats);
+    g_assert_cmpint(qlist_size(stats), ==, 4);
+    QDECREF(response);
+
+    qvirtio_pc_stop(v);
+}
+
+static void pci_rw(void)
+{
+    QVirtioPC *v;
+    char *drive_args = g_strdup_printf("file=%s,format=raw", tmp_path);
+
+    v = virtio_blk_start(drive_args);
+    g_free(drive_args);
+
+    g_assert_cmpint(qvirtio_config_readq(&qvirtio_pci, &v->dev->vdev, 0), ==,
+                    TEST_IMAGE_SIZE / 512);
+    g_assert(!(qvirtio_get_features(&qvirtio_pci, &v->dev->vdev) &
+               (1u << QVIRTIO_BLK_F_MQ)));
+
+    /* Pooled elements are reused once there were more requests than the
+     * queue has entries
+     */
+    qvirtio_blk_test_rw(v, v->vq[0], v->vq[0]->size, 'a');
+
+    qvirtio_pc_stop(v);
+}
+
+/* Elements that are in the pool or in flight when the device is reset must
+ * be usable by the rings that are set up afterwards
+ */
+static void pci_reset(void)
+{
+    QVirtioPC *v;
+    char *drive_args = g_strdup_printf("file=%s,format=raw", tmp_path);
+    uint64_t data;
+
+    v = virtio_blk_start(drive_args);
+    g_free(drive_args);
+
+    qvirtio_blk_test_rw(v, v->vq[0], 8, 'a');
+
+    /* Reset with a request in flight; reset completes it */
+    data = guest_alloc(v->alloc, 512);
+    qvirtio_blk_submit(v, v->vq[0], QVIRTIO_BLK_T_IN, 0, data, 512);
+    qvirtio_pc_setup(v);
+
+    qvirtio_blk_test_rw(v, v->vq[0], v->vq[0]->size, 'A');
+
+    /* Once more with the queue set up at the same size */
+    qvirtio_pc_setup(v);
+    qvirtio_blk_test_rw(v, v->vq[0], 8, 'k');
+
+    qvirtio_pc_stop(v);
+}
+
+/* A request that failed with werror=stop is migrated in the device state
+ * and restarted on the destination.  Its element, which was loaded from the
+ * stream, is then recycled by the pool like any other.
+ */
+static void pci_migrate(void)
+{
+    QVirtioPC *v;
+    char *drive_args, *command, *cmdline;
+    QDict *response;
+    uint64_t data, req;
+    FILE *f;
+
+    f = fopen(blkdebug_path, "w");
+    g_assert(f != NULL);
+    fprintf(f, "[inject-error]\n"
+               "event = \"write_aio\"\n"
+               "errno = \"5\"\n"
+               "once = \"on\"\n");
+    fclose(f);
+
+    drive_args = g_strdup_printf("file=blkdebug:%s:%s,format=raw,"
+                                 "werror=stop", blkdebug_path, tmp_path);
+    v = virtio_blk_start(drive_args);
+    g_free(drive_args);
+
+    data = qvirtio_blk_pattern_buf(v, 'm');
+    req = qvirtio_blk_submit(v, v->vq[0], QVIRTIO_BLK_T_OUT, 2, data, 512);
+
+    qmp_wait_status("{ 'execute': 'query-status' }", "io-error");
+
+    command = g_strdup_printf("{ 'execute': 'migrate', 'arguments': {"
+                              " 'uri': 'exec:cat > %s' } }", migrate_path);
+    response = qmp_until_return(command);
+    g_free(command);
+    QDECREF(response);
+    qmp_wait_status("{ 'execute': 'query-migrate' }", "completed");
+    qtest_end();
+
+    /* The destination starts running once the state is loaded.  The rings
+     * and the allocator state in @v are still those of the guest.
+     */
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw,"
+                              "werror=stop "
+                              "-device virtio-blk-pci,id=blk0,drive=drv0 "
+                              "-incoming 'exec:cat %s'",
+                              tmp_path, migrate_path);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    g_assert_cmpint(qvirtio_blk_complete(v->vq[0], req), ==,
+                    QVIRTIO_BLK_S_OK);
+    qvirtio_blk_read_pattern(v, v->vq[0], 2, 'm');
+
+    qvirtio_blk_test_rw(v, v->vq[0], v->vq[0]->size, 'a');
+
+    qvirtio_pc_stop(v);
+    unlink(migrate_path);
+}
+
+/* Returns the statistic @name of drv0 from query-blockstats */
+static int64_t blockstats_get(const char *name)
+{
+    QDict *response;
+    QList *list;
+    const QListEntry *entry;
+    int64_t value = -1;
+
+    response = qmp_until_return("{ 'execute': 'query-blockstats' }");
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *dev = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(dev, "device"), "drv0")) {
+            value = qdict_get_int(qdict_get_qdict(dev, "stats"), name);
+        }
+    }
+    g_assert_cmpint(value, >=, 0);
+    QDECREF(response);
+
+    return value;
+}
+
+/* Issues @n requests for the sectors from @sector on, in descending order.
+ * With @batch, the device is notified once after all of them are
+ * available, else once for each.  Waits for all of them to complete.
+ */
+static void virtio_blk_rw_batch(QVirtioPC *v, uint32_t type, uint64_t sector,
+                                const uint64_t *data, int n, bool batch)
+{
+    QVirtQueue *vq = v->vq[0];
+    uint64_t req[n];
+    uint32_t head;
+    int i;
+
+    for (i = n - 1; i >= 0; i--) {
+        req[i] = qvirtio_blk_add(v, vq, type, sector + i, data[i], 512,
+                                 &head);
+        qvirtqueue_make_available(vq, head);
+        if (!batch) {
+            qvirtqueue_notify(&qvirtio_pci, &v->dev->vdev, vq);
+        }
+    }
+    if (batch) {
+        qvirtqueue_notify(&qvirtio_pci, &v->dev->vdev, vq);
+    }
+
+    for (i = 0; i < n; i++) {
+        qvirtqueue_wait_used(vq, QVIRTIO_BLK_TIMEOUT_US);
+    }
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(readb(req[i] + 16), ==, QVIRTIO_BLK_S_OK);
+    }
+}
+
+/* Writes @n sequential sectors from @sector on and reads them back the same
+ * way.  Stores how many writes and reads were merged in @wr_merged and
+ * @rd_merged.
+ */
+static void virtio_blk_test_merge(QVirtioPC *v, uint64_t sector, int n,
+                                  bool batch, char first,
+                                  int64_t *wr_merged, int64_t *rd_merged)
+{
+    uint64_t data[n];
+    int64_t wr, rd;
+    int i;
+
+    wr = blockstats_get("wr_merged");
+    rd = blockstats_get("rd_merged");
+
+    for (i = 0; i < n; i++) {
+        data[i] = qvirtio_blk_pattern_buf(v, first + i);
+    }
+    virtio_blk_rw_batch(v, QVIRTIO_BLK_T_OUT, sector, data, n, batch);
+
+    for (i = 0; i < n; i++) {
+        data[i] = guest_alloc(v->alloc, 512);
+    }
+    virtio_blk_rw_batch(v, QVIRTIO_BLK_T_IN, sector, data, n, batch);
+    for (i = 0; i < n; i++) {
+        qvirtio_blk_verify_pattern(data[i], first + i);
+    }
+
+    *wr_merged = blockstats_get("wr_merged") - wr;
+    *rd_merged = blockstats_get("rd_merged") - rd;
+}
+
+/* Without a merge window, sequential requests are merged if they are made
+ * available with the same kick
+ */
+static void pci_merge(void)
+{
+    QVirtioPC *v;
+    char *drive_args = g_strdup_printf("file=%s,format=raw", tmp_path);
+    int64_t wr_merged, rd_merged;
+
+    v = virtio_blk_start(drive_args);
+    g_free(drive_args);
+
+    virtio_blk_test_merge(v, 8, 4, true, 'a', &wr_merged, &rd_merged);
+    g_assert_cmpint(wr_merged, ==, 3);
+    g_assert_cmpint(rd_merged, ==, 3);
+
+    virtio_blk_test_merge(v, 16, 4, false, 'A', &wr_merged, &rd_merged);
+    g_assert_cmpint(wr_merged, ==, 0);
+    g_assert_cmpint(rd_merged, ==, 0);
+
+    /* The merged writes were not overwritten by anything else */
+    qvirtio_blk_read_pattern(v, v->vq[0], 8, 'a');
+    qvirtio_blk_read_pattern(v, v->vq[0], 11, 'd');
+
+    qvirtio_pc_stop(v);
+}
+
+/* With a merge window, requests from separate kicks are merged too */
+static void pci_merge_window(void)
+{
+    QVirtioPC *v;
+    char *cmdline;
+    int64_t wr_merged, rd_merged;
+
+    /* Long enough for the kicks of the test to fall into one window */
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device virtio-blk-pci,id=blk0,drive=drv0,"
+                              "merge-window-us=1000000", tmp_path);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_BLK_DEVICE_ID, 1, 0);
+    g_free(cmdline);
+
+    virtio_blk_test_merge(v, 24, 4, false, 'k', &wr_merged, &rd_merged);
+    g_assert_cmpint(wr_merged, ==, 3);
+    g_assert_cmpint(rd_merged, ==, 3);
+
+    virtio_blk_test_merge(v, 32, 4, true, 'K', &wr_merged, &rd_merged);
+    g_assert_cmpint(wr_merged, ==, 3);
+    g_assert_cmpint(rd_merged, ==, 3);
+
+    qvirtio_pc_stop(v);
+}
+
+/* Mappings must follow changes of the memory map.  With PAM set to PCI,
+ * 0xd0000 shows the option ROM area instead of the RAM below it.
+ */
+static void pci_remap(void)
+{
+    QVirtioPC *v;
+    QVirtQueue *vq;
+    QPCIDevice *host;
+    char *drive_args = g_strdup_printf("file=%s,format=raw", tmp_path);
+
+    v = virtio_blk_start(drive_args);
+    vq = v->vq[0];
+    g_free(drive_args);
+
+    qvirtio_blk_write_pattern(v, vq, 0, 'a');
+    qvirtio_blk_write_pattern(v, vq, 1, 'b');
+
+    host = qpci_device_find(v->bus, 0);
+    g_assert(host != NULL);
+
+    qpci_config_writeb(host, I440FX_PAM3, PAM_RAM);
+    qvirtio_blk_read(v, vq, 0, REMAP_ADDR);
+    qvirtio_blk_verify_pattern(REMAP_ADDR, 'a');
+
+    /* The request must land in the option ROM area, not in the RAM */
+    qpci_config_writeb(host, I440FX_PAM3, PAM_PCI);
+    qvirtio_blk_read(v, vq, 1, REMAP_ADDR);
+    qvirtio_blk_verify_pattern(REMAP_ADDR, 'b');
+
+    qpci_config_writeb(host, I440FX_PAM3, PAM_RAM);
+    qvirtio_blk_verify_pattern(REMAP_ADDR, 'a');
+
+    /* And in the RAM again once it is mapped back */
+    qvirtio_blk_read(v, vq, 1, REMAP_ADDR);
+    qvirtio_blk_verify_pattern(REMAP_ADDR, 'b');
+
+    /* Rings and descriptors are still found after all these changes */
+    qvirtio_blk_test_rw(v, vq, 8, 'k');
+
+    g_free(host);
+    qvirtio_pc_stop(v);
+}
+
+/* Returns the offset of the block job of drv0, or -1 if there is none */
+static int64_t block_job_offset(void)
+{
+    QDict *response;
+    QList *list;
+    int64_t offset = -1;
+
+    response = qmp_until_return("{ 'execute': 'query-block-jobs' }");
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    if (!qlist_empty(list)) {
+        offset = qdict_get_int(qobject_to_qdict(qlist_peek(list)), "offset");
+    }
+    QDECREF(response);
+
+    return offset;
+}
+
+/* Reads sector 0 into @data over and over for @us microseconds.  The request
+ * header is reused so that guest memory does not run out.
+ */
+static void virtio_blk_read_for(QVirtioPC *v, uint64_t data, gint64 us)
+{
+    QVirtQueue *vq = v->vq[0];
+    gint64 start = g_get_monotonic_time();
+    uint64_t req = guest_alloc(v->alloc, 16 + 1);
+    uint32_t head;
+
+    writel(req, QVIRTIO_BLK_T_IN);
+    writel(req + 4, 0);
+    writeq(req + 8, 0);
+    while (g_get_monotonic_time() - start < us) {
+        writeb(req + 16, 0xff);
+        head = qvirtqueue_add(vq, req, 16, false, true);
+        qvirtqueue_add(vq, data, 512, true, true);
+        qvirtqueue_add(vq, req + 16, 1, true, false);
+        qvirtqueue_kick(&qvirtio_pci, &v->dev->vdev, vq, head);
+        g_assert_cmpint(qvirtio_blk_complete(vq, req), ==, QVIRTIO_BLK_S_OK);
+    }
+    qvirtio_blk_verify_pattern(data, 's');
+}
+
+/* While the guest reads through the device, a stream job with guest-share
+ * set copies at most as much as the guest reads, plus one buffer per slice.
+ * The job runs at full speed again once the guest stops.
+ */
+static void pci_stream_guest_share(void)
+{
+    QVirtioPC *v;
+    QDict *response, *inserted;
+    QList *list;
+    const QListEntry *entry;
+    char *drive_args, *command, *overlay_path;
+    char buf[64 * 1024];
+    int64_t offset, rd_bytes, elapsed, limit, progress;
+    uint64_t data;
+    gint64 start;
+    FILE *f;
+    int i;
+
+    f = fopen(stream_path, "w");
+    g_assert(f != NULL);
+    memset(buf, 's', sizeof(buf));
+    for (i = 0; i < STREAM_IMAGE_SIZE / sizeof(buf); i++) {
+        g_assert_cmpint(fwrite(buf, sizeof(buf), 1, f), ==, 1);
+    }
+    fclose(f);
+
+    drive_args = g_strdup_printf("file=%s,format=raw", stream_path);
+    v = virtio_blk_start(drive_args);
+    g_free(drive_args);
+    data = guest_alloc(v->alloc, 512);
+
+    overlay_path = g_strdup_printf("%s.qcow2", stream_path);
+    command = g_strdup_printf("{ 'execute': 'blockdev-snapshot-sync',"
+                              " 'arguments': { 'device': 'drv0',"
+                              " 'snapshot-file': '%s', 'format': 'qcow2' } }",
+                              overlay_path);
+    response = qmp_until_return(command);
+    g_free(command);
+    QDECREF(response);
+
+    /* Slow at first, so that the job measures the guest rate before it
+     * could have copied everything
+     */
+    response = qmp_until_return("{ 'execute': 'block-stream', 'arguments': {"
+                                " 'device': 'drv0', 'speed': 524288,"
+                                " 'guest-share': 50 } }");
+    QDECREF(response);
+    virtio_blk_read_for(v, data, 3 * STREAM_SLICE_US);
+
+    response = qmp_until_return("{ 'execute': 'block-job-set-speed',"
+                                " 'arguments': { 'device': 'drv0',"
+                                " 'speed': 0 } }");
+    QDECREF(response);
+
+    offset = block_job_offset();
+    rd_bytes = blockstats_get("rd_bytes");
+    start = g_get_monotonic_time();
+    virtio_blk_read_for(v, data, 5 * STREAM_SLICE_US);
+    elapsed = g_get_monotonic_time() - start;
+
+    /* Besides the share, allow for the copies in flight and the prefetch
+     * after the first read
+     */
+    limit = blockstats_get("rd_bytes") - rd_bytes +
+            (elapsed / STREAM_SLICE_US + 8) * STREAM_BUFFER_SIZE;
+    progress = block_job_offset();
+    g_assert_cmpint(offset, >=, 0);
+    g_assert_cmpint(progress, >=, 0);
+    g_assert_cmpint(progress - offset, <=, limit);
+
+    start = g_get_monotonic_time();
+    while (block_job_offset() >= 0) {
+        g_assert(g_get_monotonic_time() - start <= QVIRTIO_BLK_TIMEOUT_US);
+        g_usleep(10 * 1000);
+    }
+
+    /* The job completed and dropped the backing file */
+    response = qmp_until_return("{ 'execute': 'query-block' }");
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    inserted = NULL;
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *dev = qobject_to_qdict(qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(dev, "device"), "drv0")) {
+            inserted = qdict_get_qdict(dev, "inserted");
+        }
+    }
+    g_assert(inserted);
+    g_assert(!qdict_haskey(inserted, "backing_file"));
+    QDECREF(response);
+
+    qvirtio_blk_read_pattern(v, v->vq[0], STREAM_IMAGE_SIZE / 512 - 1, 's');
+
+    qvirtio_pc_stop(v);
+    unlink(overlay_path);
+    g_free(overlay_path);
 }
 
 int main(int argc, char **argv)
 {
+    int fd;
     int ret;
 
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    fd = mkstemp(blkdebug_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    fd = mkstemp(migrate_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    fd = mkstemp(stream_path);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/blk/pci/nop", pci_nop);
+    qtest_add_func("/virtio/blk/pci/multiqueue", pci_multiqueue);
+    qtest_add_func("/virtio/blk/pci/rw", pci_rw);
+    qtest_add_func("/virtio/blk/pci/reset", pci_reset);
+    qtest_add_func("/virtio/blk/pci/migrate", pci_migrate);
+    qtest_add_func("/virtio/blk/pci/remap", pci_remap);
+    qtest_add_func("/virtio/blk/pci/merge", pci_merge);
+    qtest_add_func("/virtio/blk/pci/merge-window", pci_merge_window);
+    qtest_add_func("/virtio/blk/pci/stream-guest-share",
+                   pci_stream_guest_share);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null "
-                "-device virtio-blk-pci,drive=drv0");
     ret = g_test_run();
 
-    qtest_end();
+    unlink(tmp_path);
+    unlink(blkdebug_path);
+    unlink(migrate_path);
+    unlink(stream_path);
 
     return ret;
 }
@@ -9,27 +9,213 @@
 
 #include <glib.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "libqos/virtio-pc.h"
+
+#define TEST_IMAGE_SIZE         (1024 * 1024)
+#define QVIRTIO_SCSI_TIMEOUT_US (30 * 1000 * 1000)
+
+#define QVIRTIO_SCSI_CDB_SIZE   32
+#define QVIRTIO_SCSI_SENSE_SIZE 96
+
+/* Sizes of the request and response headers with the default CDB and
+ * sense sizes
+ */
+#define QVIRTIO_SCSI_REQ_SIZE   (19 + QVIRTIO_SCSI_CDB_SIZE)
+#define QVIRTIO_SCSI_RESP_SIZE  (12 + QVIRTIO_SCSI_SENSE_SIZE)
+
+#define QVIRTIO_SCSI_S_OK       0
+
+/* Control, event and one request queue */
+#define QVIRTIO_SCSI_NUM_QUEUES 3
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+static QVirtioPC *virtio_scsi_start(const char *extra_args)
+{
+    QVirtioPC *v;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "%s "
+                              "-device scsi-hd,bus=vscsi0.0,drive=drv0",
+                              tmp_path, extra_args);
+    v = qvirtio_pc_start(cmdline, QVIRTIO_SCSI_DEVICE_ID,
+                         QVIRTIO_SCSI_NUM_QUEUES, 0);
+    g_free(cmdline);
+
+    return v;
+}
+
+/* Sends @cdb to LUN 0 with @len bytes of data-out from @data_out or data-in
+ * into @data_in, and returns the SCSI status.  The virtio-scsi response
+ * code must be VIRTIO_SCSI_S_OK.
+ */
+static uint8_t virtio_scsi_do_command(QVirtioPC *vs, const uint8_t *cdb,
+                                      size_t cdb_len, uint64_t data_out,
+                                      uint64_t data_in, uint32_t len)
+{
+    QVirtQueue *vq = vs->vq[2];
+    uint8_t req[QVIRTIO_SCSI_REQ_SIZE] = {
+        [0] = 1,                    /* LUN 0 of target 0 */
+    };
+    uint64_t req_addr, resp_addr;
+    uint32_t head;
+
+    g_assert_cmpint(cdb_len, <=, QVIRTIO_SCSI_CDB_SIZE);
+    memcpy(req + 19, cdb, cdb_len);
+
+    req_addr = guest_alloc(vs->alloc, sizeof(req));
+    memwrite(req_addr, req, sizeof(req));
+    resp_addr = guest_alloc(vs->alloc, QVIRTIO_SCSI_RESP_SIZE);
+    writeb(resp_addr + 11, 0xff);
+
+    head = qvirtqueue_add(vq, req_addr, sizeof(req), false, true);
+    if (data_out) {
+        qvirtqueue_add(vq, data_out, len, false, true);
+    }
+    qvirtqueue_add(vq, resp_addr, QVIRTIO_SCSI_RESP_SIZE, true, !!data_in);
+    if (data_in) {
+        qvirtqueue_add(vq, data_in, len, true, false);
+    }
+    qvirtqueue_kick(&qvirtio_pci, &vs->dev->vdev, vq, head);
+    qvirtqueue_wait_used(vq, QVIRTIO_SCSI_TIMEOUT_US);
+
+    g_assert_cmpint(readb(resp_addr + 11), ==, QVIRTIO_SCSI_S_OK);
+    return readb(resp_addr + 10);
+}
+
+static void virtio_scsi_rw(QVirtioPC *vs, uint32_t lba, char pattern)
+{
+    const uint8_t write10[10] = {
+        0x2a, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, 0, 1, 0
+    };
+    const uint8_t read10[10] = {
+        0x28, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, 0, 1, 0
+    };
+    char buf[512], expected[512];
+    uint64_t data;
+
+    memset(expected, pattern, sizeof(expected));
+    data = guest_alloc(vs->alloc, sizeof(buf));
+    memwrite(data, expected, sizeof(expected));
+    g_assert_cmpint(virtio_scsi_do_command(vs, write10, sizeof(write10),
+                                           data, 0, sizeof(buf)), ==, 0);
+
+    data = guest_alloc(vs->alloc, sizeof(buf));
+    g_assert_cmpint(virtio_scsi_do_command(vs, read10, sizeof(read10),
+                                           0, data, sizeof(buf)), ==, 0);
+    memread(data, buf, sizeof(buf));
+    g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+}
+
+static void virtio_scsi_test_rw(QVirtioPC *vs)
+{
+    const uint8_t test_unit_ready[6] = { 0x00 };
+    int i;
+
+    /* The first command reports the power on unit attention */
+    for (i = 0; i < 2; i++) {
+        if (virtio_scsi_do_command(vs, test_unit_ready,
+                                   sizeof(test_unit_ready), 0, 0, 0) == 0) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, 2);
+
+    /* More requests than the queue has entries, so that requests are also
+     * submitted after dataplane has started
+     */
+    for (i = 0; i < vs->vq[2]->size / 3 + 8; i++) {
+        virtio_scsi_rw(vs, i, 'a' + i % 26);
+    }
+}
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=/dev/null "
+                "-device virtio-scsi-pci,id=vscsi0 "
+                "-device scsi-hd,bus=vscsi0.0,drive=drv0");
+    qtest_end();
+}
+
+static void pci_rw(void)
+{
+    QVirtioPC *vs;
+
+    vs = virtio_scsi_start("-device virtio-scsi-pci,id=vscsi0");
+    virtio_scsi_test_rw(vs);
+    qvirtio_pc_stop(vs);
+}
+
+/* Returns the number of event handlers that iothread0 has dispatched */
+static int64_t iothread_dispatched(void)
+{
+    QDict *response, *info;
+    QList *list;
+    int64_t dispatched;
+
+    response = qmp("{ 'execute': 'query-iothreads' }");
+    g_assert(response);
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    info = qobject_to_qdict(qlist_peek(list));
+    g_assert_cmpstr(qdict_get_str(info, "id"), ==, "iothread0");
+    dispatched = qdict_get_int(qdict_get_qdict(info, "stats"), "dispatched");
+    QDECREF(response);
+
+    return dispatched;
+}
+
+static void pci_iothread(void)
+{
+    QVirtioPC *vs;
+    int64_t dispatched;
+    int kicks;
+
+    vs = virtio_scsi_start("-object iothread,id=iothread0 "
+                           "-device virtio-scsi-pci,id=vscsi0,"
+                           "iothread=iothread0");
+    dispatched = iothread_dispatched();
+    virtio_scsi_test_rw(vs);
+
+    /* Dataplane falls back to the main loop if it fails to start, and then
+     * iothread0 has nothing to do.  With dataplane, it handles at least the
+     * kick of every WRITE(10) and READ(10).
+     */
+    kicks = 2 * (vs->vq[2]->size / 3 + 8);
+    g_assert_cmpint(iothread_dispatched() - dispatched, >=, kicks);
+
+    qvirtio_pc_stop(vs);
 }
 
 int main(int argc, char **argv)
 {
+    int fd;
     int ret;
 
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/scsi/pci/nop", pci_nop);
+    qtest_add_func("/virtio/scsi/pci/rw", pci_rw);
+    qtest_add_func("/virtio/scsi/pci/iothread", pci_iothread);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null "
-                "-device virtio-scsi-pci,id=vscsi0 "
-                "-device scsi-hd,bus=vscsi0.0,drive=drv0");
     ret = g_test_run();
 
-    qtest_end();
+    unlink(tmp_path);
 
     return ret;
 }
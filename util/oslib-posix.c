@@ -59,6 +59,8 @@ extern int daemon(int, int);
 #include <sys/mman.h>
 #include <libgen.h>
 
+#include <sys/resource.h>
+
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
 #endif
@@ -76,6 +78,22 @@ int qemu_get_thread_id(void)
 #endif
 }
 
+/* Set the nice value of the thread with ID @thread_id, as returned by
+ * qemu_get_thread_id().  Returns 0 or -errno.
+ */
+int qemu_set_thread_nice(int thread_id, int nice)
+{
+#if defined(__linux__)
+    /* On Linux, PRIO_PROCESS applied to a thread ID changes only that thread */
+    if (setpriority(PRIO_PROCESS, thread_id, nice) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 int qemu_daemon(int nochdir, int noclose)
 {
     return daemon(nochdir, noclose);
@@ -173,6 +173,11 @@ int qemu_get_thread_id(void)
     return GetCurrentThreadId();
 }
 
+int qemu_set_thread_nice(int thread_id, int nice)
+{
+    return -ENOTSUP;
+}
+
 char *
 qemu_get_local_state_pathname(const char *relative_pathname)
 {
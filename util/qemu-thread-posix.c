@@ -24,8 +24,10 @@
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #endif
+#include <sched.h>
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/bitops.h"
 
 static bool name_threads;
 
@@ -472,3 +474,43 @@ void *qemu_thread_join(QemuThread *thread)
     }
     return ret;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef __linux__
+    cpu_set_t *set;
+    size_t size;
+    unsigned long cpu;
+    int err;
+
+    set = CPU_ALLOC(nbits);
+    if (!set) {
+        return -ENOMEM;
+    }
+    size = CPU_ALLOC_SIZE(nbits);
+    CPU_ZERO_S(size, set);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        CPU_SET_S(cpu, size, set);
+    }
+
+    err = pthread_setaffinity_np(thread->thread, size, set);
+    CPU_FREE(set);
+    return -err;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int qemu_thread_set_sched(QemuThread *thread, bool realtime, int priority)
+{
+    struct sched_param param = {
+        .sched_priority = realtime ? priority : 0,
+    };
+
+    return -pthread_setschedparam(thread->thread,
+                                  realtime ? SCHED_FIFO : SCHED_OTHER,
+                                  &param);
+}
@@ -393,3 +393,15 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+    return -ENOTSUP;
+}
+
+int qemu_thread_set_sched(QemuThread *thread, bool realtime, int priority)
+{
+    return -ENOTSUP;
+}